@@ -0,0 +1,128 @@
+#!/bin/sh
+# Benchmark omxtx on synthetic inputs: make bench
+#
+# Each input is transcoded in each mode, and the frame rate, host CPU time per frame
+# and peak RSS are written to bench/results.txt. If bench/baseline.txt exists, results
+# more than BENCH_TOLERANCE percent worse than it are reported as regressions and the
+# script exits with status 1. make bench-baseline stores the last results as the baseline.
+#
+# Environment:
+#   OMXTX            omxtx binary (default: ./omxtx)
+#   BENCH_OPTS       Extra options for every run, e.g. "-E sw"
+#   BENCH_SECONDS    Length of the generated inputs (default: 20)
+#   BENCH_TOLERANCE  Percentage a result may be worse than the baseline (default: 10)
+#   FFMPEG           ffmpeg binary used to make the inputs (default: ffmpeg)
+
+OMXTX=${OMXTX:-./omxtx}
+FFMPEG=${FFMPEG:-ffmpeg}
+SECONDS_=${BENCH_SECONDS:-20}
+TOLERANCE=${BENCH_TOLERANCE:-10}
+DIR=$(dirname "$0")
+INPUTS=$DIR/inputs
+RESULTS=$DIR/results.txt
+BASELINE=$DIR/baseline.txt
+OUT=${TMPDIR:-/tmp}/omxtx-bench.$$
+
+# name codec size bitrate container: the inputs are made once and kept in bench/inputs
+INPUTLIST="mpeg2-576i mpeg2video 720x576 6M ts
+mpeg2-1080i mpeg2video 1920x1080 15M ts
+h264-720p libx264 1280x720 4M mkv
+h264-1080p libx264 1920x1080 8M mkv"
+
+# mode options output-extension: '@' in the options is a space, CROP is the centre
+# quarter of the input picture and OUTDIR the directory of the output. renditions
+# are OMX only, so they're skipped with -E sw in BENCH_OPTS
+MODELIST="plain - mkv
+deinterlace -d mkv
+crop -c@CROP mkv
+resize -r@640x360 mkv
+aspect -a mkv
+monitor -m mkv
+raw - 264
+renditions -l@640x360:1M:OUTDIR/out-360.mkv mkv
+thumbnails -k@2 mkv
+ivtc -I mkv
+decimate -D@0 mkv"
+
+if [ ! -x "$OMXTX" ]; then
+   echo "ERROR: $OMXTX not found: run make first" >&2
+   exit 2
+fi
+mkdir -p "$INPUTS" "$OUT" || exit 2
+trap 'rm -rf "$OUT"' EXIT INT TERM
+
+now() {
+   date +%s.%N
+}
+
+makeInput() {   # name codec size bitrate container
+   f=$INPUTS/$1-${SECONDS_}s.$5
+   if [ ! -f "$f" ]; then
+      echo "Making $f" >&2
+      case $2 in
+         mpeg2video) vopts="-c:v mpeg2video -flags +ilme+ildct -top 1 -c:a mp2" ;;
+         *)          vopts="-c:v $2 -pix_fmt yuv420p -g 50 -c:a aac" ;;
+      esac
+      $FFMPEG -nostdin -loglevel error -y -f lavfi -i "testsrc2=size=$3:rate=25:duration=$SECONDS_" \
+         -f lavfi -i "sine=frequency=440:duration=$SECONDS_" $vopts -b:v $4 -maxrate $4 -bufsize $4 "$f" >&2 || {
+         rm -f "$f"
+         return 1
+      }
+   fi
+   echo "$f"
+}
+
+echo "# omxtx benchmark: $(date '+%Y-%m-%d %H:%M'), $(uname -n), BENCH_OPTS='$BENCH_OPTS'" > "$RESULTS"
+echo "# input mode fps cpu_ms_per_frame peak_rss_kb" >> "$RESULTS"
+
+while read name codec size rate container; do
+   f=$(makeInput $name $codec $size $rate $container) || { echo "ERROR: Can't make the $name input" >&2; exit 2; }
+   w=${size%x*}
+   h=${size#*x}
+   crop=$((w/2)):$((h/2)):$((w/4)):$((h/4))
+   while read mode opts ext; do
+      case "$mode $BENCH_OPTS" in
+         renditions*"-E sw"*|renditions*"-Esw"*) continue ;;
+      esac
+      opts=$(echo "$opts" | sed -e "s/CROP/$crop/" -e "s|OUTDIR|$OUT|" -e 's/@/ /g')
+      [ "$opts" = "-" ] && opts=
+      o=$OUT/out.$ext
+      log=$OUT/log
+      t0=$(now)
+      $OMXTX "$f" $BENCH_OPTS $opts -o "$o" > "$log" 2>&1 < /dev/null
+      status=$?
+      t1=$(now)
+      rm -f "$OUT"/out*   # The output and any made alongside it
+      if [ $status -ne 0 ]; then
+         echo "ERROR: $name $mode failed:" >&2
+         tail -5 "$log" >&2
+         continue
+      fi
+      # Whole seconds on omxtx's own summary line aren't enough: time the run here
+      frames=$(sed -n 's/^Processed \([0-9]*\) frames.*/\1/p' "$log" | tail -1)
+      cpu=$(sed -n 's/^Host CPU time: .*; \([0-9.]*\)ms per frame/\1/p' "$log" | tail -1)
+      rss=$(sed -n 's/^Peak RSS: \([0-9]*\)kB/\1/p' "$log" | tail -1)
+      fps=$(echo "$frames $t0 $t1" | awk '{ printf "%.1f", $2 < $3 ? $1/($3-$2) : 0 }')
+      printf "%s %s %s %s %s\n" $name $mode $fps ${cpu:-0} ${rss:-0} | tee -a "$RESULTS"
+   done <<EOF
+$MODELIST
+EOF
+done <<EOF
+$INPUTLIST
+EOF
+
+[ -f "$BASELINE" ] || { echo "No baseline: make bench-baseline stores these results as one"; exit 0; }
+
+# Compare with the baseline: fps must not fall, CPU time and RSS must not rise, by more than TOLERANCE%
+awk -v tol=$TOLERANCE '
+   /^#/ { next }
+   FNR == NR { fps[$1" "$2] = $3; cpu[$1" "$2] = $4; rss[$1" "$2] = $5; next }
+   !(($1" "$2) in fps) { next }
+   {
+      k = $1" "$2
+      if ($3 < fps[k] * (1 - tol/100)) { printf "REGRESSION: %s: %.1f fps, baseline %.1f\n", k, $3, fps[k]; bad = 1 }
+      if ($4 > cpu[k] * (1 + tol/100)) { printf "REGRESSION: %s: %.3fms CPU per frame, baseline %.3f\n", k, $4, cpu[k]; bad = 1 }
+      if ($5 > rss[k] * (1 + tol/100)) { printf "REGRESSION: %s: %dkB peak RSS, baseline %d\n", k, $5, rss[k]; bad = 1 }
+   }
+   END { if (!bad) print "No regressions against the baseline"; exit bad }
+' "$BASELINE" "$RESULTS"
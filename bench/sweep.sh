@@ -0,0 +1,103 @@
+#!/bin/sh
+# Encoder parameter sweep: make sweep
+#
+# A reference clip is transcoded once for each line of the matrix of encoder knobs (-X),
+# and the frame rate, output size, video bitrate and objective quality (PSNR and SSIM of
+# the output against the reference, measured with ffmpeg) are written to bench/sweep.txt.
+# 'omxtx -X help' lists the knobs.
+#
+# Environment:
+#   OMXTX          omxtx binary (default: ./omxtx)
+#   SWEEP_INPUT    Reference clip (default: a 1080p H.264 test input, made in bench/inputs)
+#   SWEEP_OPTS     Options for every run (default: "-b 4M")
+#   SWEEP_MATRIX   File with the -X settings to try, one per line; '-' for the defaults
+#                  (default: the matrix below)
+#   FFMPEG         ffmpeg binary used to make the input and measure quality (default: ffmpeg)
+#   FFPROBE        ffprobe binary (default: ffprobe)
+
+OMXTX=${OMXTX:-./omxtx}
+FFMPEG=${FFMPEG:-ffmpeg}
+FFPROBE=${FFPROBE:-ffprobe}
+OPTS=${SWEEP_OPTS:--b 4M}
+DIR=$(dirname "$0")
+INPUTS=$DIR/inputs
+RESULTS=$DIR/sweep.txt
+OUT=${TMPDIR:-/tmp}/omxtx-sweep.$$
+
+# One encode per line: the argument to -X, or '-' for the firmware defaults
+MATRIX="-
+deblock=0
+deblock=1
+deblock=2
+intramb=0
+intramb=3
+intramb=7
+hadamard=1
+loopfilter=0
+intrarefresh=16
+intrarefresh=64
+initq=20
+initq=30
+peakrate=6M
+framelimit=800k
+deblock=2,hadamard=1"
+
+if [ -n "$SWEEP_MATRIX" ]; then
+   MATRIX=$(grep -v '^#' "$SWEEP_MATRIX") || { echo "ERROR: Can't read $SWEEP_MATRIX" >&2; exit 2; }
+fi
+if [ ! -x "$OMXTX" ]; then
+   echo "ERROR: $OMXTX not found: run make first" >&2
+   exit 2
+fi
+mkdir -p "$OUT" || exit 2
+trap 'rm -rf "$OUT"' EXIT INT TERM
+
+now() {
+   date +%s.%N
+}
+
+REF=$SWEEP_INPUT
+if [ -z "$REF" ]; then
+   mkdir -p "$INPUTS" || exit 2
+   REF=$INPUTS/sweep-1080p-10s.mkv
+   if [ ! -f "$REF" ]; then
+      echo "Making $REF" >&2
+      $FFMPEG -nostdin -loglevel error -y -f lavfi -i "testsrc2=size=1920x1080:rate=25:duration=10" \
+         -c:v libx264 -pix_fmt yuv420p -g 50 -crf 12 "$REF" || { rm -f "$REF"; exit 2; }
+   fi
+fi
+
+echo "# omxtx encoder sweep: $(date '+%Y-%m-%d %H:%M'), $(uname -n), $REF, SWEEP_OPTS='$OPTS'" > "$RESULTS"
+echo "# knobs fps size_kb video_kbps psnr_db ssim" >> "$RESULTS"
+
+while read knobs; do
+   [ -z "$knobs" ] && continue
+   xopt=
+   [ "$knobs" != "-" ] && xopt="-X $knobs"
+   o=$OUT/out.mkv
+   log=$OUT/log
+   t0=$(now)
+   $OMXTX "$REF" $OPTS $xopt -o "$o" > "$log" 2>&1 < /dev/null
+   status=$?
+   t1=$(now)
+   if [ $status -ne 0 ]; then
+      echo "ERROR: $knobs failed:" >&2
+      tail -5 "$log" >&2
+      rm -f "$o"
+      continue
+   fi
+   frames=$(sed -n 's/^Processed \([0-9]*\) frames.*/\1/p' "$log" | tail -1)
+   fps=$(echo "$frames $t0 $t1" | awk '{ printf "%.1f", $2 < $3 ? $1/($3-$2) : 0 }')
+   size=$(($(wc -c < "$o") / 1024))
+   # Video stream bitrate from the container, and quality of the output against the reference
+   kb=$($FFMPEG -nostdin -i "$o" -map 0:v -c copy -f null - 2>&1 | sed -n 's/.*video:\([0-9]*\)[kK]i*B.*/\1/p' | tail -1)
+   secs=$($FFPROBE -v error -show_entries format=duration -of default=nw=1:nk=1 "$o")
+   kbps=$(echo "${kb:-0} ${secs:-0}" | awk '{ printf "%.0f", ($2 > 0 ? $1*8*1.024/$2 : 0) }')
+   $FFMPEG -nostdin -i "$o" -i "$REF" -lavfi "[0:v]split[a][b];[1:v]split[c][d];[a][c]psnr;[b][d]ssim" -f null - > "$log" 2>&1
+   psnr=$(sed -n 's/.*PSNR .* average:\([0-9.inf]*\).*/\1/p' "$log" | tail -1)
+   ssim=$(sed -n 's/.*SSIM .* All:\([0-9.]*\).*/\1/p' "$log" | tail -1)
+   rm -f "$o"
+   printf "%s %s %s %s %s %s\n" "$knobs" $fps $size $kbps ${psnr:-0} ${ssim:-0} | tee -a "$RESULTS"
+done <<EOF
+$MATRIX
+EOF
@@ -0,0 +1,1527 @@
+/* Mock OpenMAX IL core for omxtx
+ * omxmock.c
+ *
+ * A stand-in for libopenmaxil.so that runs on any Linux box, so that the host side
+ * of omxtx (demux, buffer handling, events, NAL assembly and muxing) can be timed and
+ * regression tested without a VideoCore.
+ *
+ * Usage: make libomxmock.so
+ *        OMXTX_IL_CORE=./libomxmock.so ./omxtx -E hw <infile> [opts] -o <outfile>
+ *
+ * The six Broadcom components used by omxtx are provided, with the same port numbers.
+ * Nothing is decoded or encoded: a frame is a token carrying the timestamp of the
+ * decoder input buffer that ended it through the tunnels. The encoder writes a real
+ * SPS / PPS for the encoder input size, then one filler slice NAL per frame, so that
+ * the output file can be opened and muxed but not played. An output port that isn't
+ * tunnelled, such as the thumbnailer's resizer (-k), fills the buffers given to it with
+ * OMX_FillThisBuffer() with a YUV 4:2:0 picture: horizontal bars that move down a line
+ * each frame. An input port that isn't tunnelled, other than the decoder's, takes a frame
+ * from each buffer with data given to it with OMX_EmptyThisBuffer().
+ *
+ * Commands complete asynchronously from a thread per component, following the rules
+ * of the IL spec. that omxtx relies on: a port enable completes when the port is
+ * populated (or both ends of its tunnel are enabled), Loaded -> Idle waits for the
+ * buffers, Executing -> Idle returns them, and OMX_SetParameter() on an enabled port
+ * outside Loaded is refused. The decoder sends OMX_EventPortSettingsChanged after a
+ * few frames, and holds decoded frames until its output port is enabled.
+ * The encoder only produces output into buffers given to it with OMX_FillThisBuffer(),
+ * so a client that is slow to return them starves it, as on the Pi.
+ *
+ * Behaviour is set from the environment when OMX_Init() is called:
+ *    OMXMOCK_DEC_US      Decoder time per frame, us (0)
+ *    OMXMOCK_FX_US       image_fx, resize and splitter time per frame, us (0)
+ *    OMXMOCK_ENC_US      Encoder time per frame, us (0)
+ *    OMXMOCK_LATENCY_US  Least time from a frame leaving the decoder to encoder output, us (0)
+ *    OMXMOCK_CMD_US      Time taken by every command, us (0)
+ *    OMXMOCK_DETECT      Decoder frames before the port settings change (2)
+ *    OMXMOCK_FPS         Frame rate reported by the decoder output port (25)
+ *    OMXMOCK_INTERLACE   OMX_INTERLACETYPE reported by the decoder (0: progressive)
+ *    OMXMOCK_NAL_BYTES   Encoder output per frame, bytes (4096)
+ *    OMXMOCK_ENC_BUFSIZE Encoder output buffer size, bytes (65536); smaller than
+ *                        OMXMOCK_NAL_BYTES splits NALs across buffers
+ *    OMXMOCK_GOP         Frames from one IDR to the next (25); OMX_IndexConfigBrcmVideoRequestIFrame
+ *                        makes the next frame an IDR and starts the count again
+ *    OMXMOCK_RC_GAIN     If set, percent of the target bitrate (OMX_IndexParamVideoBitrate, or
+ *                        OMX_IndexConfigVideoBitrate while running) the encoder produces, in
+ *                        place of OMXMOCK_NAL_BYTES per frame; IDRs are four times the size
+ *    OMXMOCK_VERBOSE     1: frame and stall counts when a component is freed;
+ *                        2: trace every command and event as well (0)
+ *
+ * Parameters and configs other than the port definitions are stored and read back,
+ * so that omxtx's OMX_GetParameter() / OMX_SetParameter() pairs work, but have no effect
+ * apart from the I-frame request and, with OMXMOCK_RC_GAIN, the bitrate.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* NOTES: Lock order is downstream before upstream: a component may wake the component
+ *        feeding its input with its own lock held, but never locks the component it
+ *        feeds without first dropping its own. Callbacks are made without the lock,
+ *        since the client calls back into the component from them.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "OMX_Video.h"
+#include "OMX_Types.h"
+#include "OMX_Component.h"
+#include "OMX_Core.h"
+#include "OMX_Broadcom.h"
+
+#define MOCK_MAXPORTS 5    /* The splitter has the most: 250 - 254 */
+#define MOCK_MAXBUFS 64    /* Buffers allocated on a port */
+#define MOCK_QUEUE 16      /* Frames queued on a tunnelled port */
+#define MOCK_REORDER 4     /* Frames held by the decoder to put them in presentation order */
+
+#define ALIGN(x, a)   (((x) + (a) - 1) / (a) * (a))
+
+#define MOCKLOG(c, ...)   do { \
+            if (mock.verbose > 1) { \
+               fprintf(stderr, "omxmock %s: ", (c)->type->tag); \
+               fprintf(stderr, __VA_ARGS__); \
+            } \
+         } while (0)
+
+static OMX_VERSIONTYPE SpecificationVersion = {
+   .s.nVersionMajor = 1,
+   .s.nVersionMinor = 1,
+   .s.nRevision     = 2,
+   .s.nStep         = 0
+};
+
+enum mockKind { MOCK_DEC, MOCK_ENC, MOCK_FX, MOCK_SPL, MOCK_SINK };
+
+typedef struct {
+   const char *name;
+   const char *tag;            /* Short name for messages, as used by omxtx */
+   enum mockKind kind;
+   OMX_U32 base;               /* Input port; outputs follow it */
+   int nPorts;
+   OMX_PORTDOMAINTYPE domain;
+} MOCK_TYPE;
+
+static const MOCK_TYPE mockTypes[] = {
+   { "OMX.broadcom.video_decode",   "dec", MOCK_DEC,  130, 2, OMX_PortDomainVideo },
+   { "OMX.broadcom.video_encode",   "enc", MOCK_ENC,  200, 2, OMX_PortDomainVideo },
+   { "OMX.broadcom.resize",         "rsz", MOCK_FX,    60, 2, OMX_PortDomainImage },
+   { "OMX.broadcom.image_fx",       "dei", MOCK_FX,   190, 2, OMX_PortDomainImage },
+   { "OMX.broadcom.video_splitter", "spl", MOCK_SPL,  250, 5, OMX_PortDomainVideo },
+   { "OMX.broadcom.video_render",   "vid", MOCK_SINK,  90, 1, OMX_PortDomainVideo },
+};
+
+typedef struct {
+   int64_t ts;       /* nTimeStamp of the decoder input */
+   OMX_U32 flags;    /* OMX_BUFFERFLAG_EOS marks the end of the stream */
+   int64_t due;      /* Encoder output for the frame isn't ready before this time (us) */
+} MOCK_FRAME;
+
+typedef struct {
+   MOCK_FRAME frames[MOCK_QUEUE];
+   int head, len;
+} MOCK_FRAMEQ;
+
+struct mockComponent;
+
+typedef struct {
+   OMX_PARAM_PORTDEFINITIONTYPE def;
+   struct mockComponent *peer;                  /* Tunnelled component, or NULL */
+   OMX_U32 peerPort;
+   OMX_BUFFERHEADERTYPE *held[MOCK_MAXBUFS];   /* From OMX_EmptyThisBuffer() / OMX_FillThisBuffer(), in order */
+   int heldHead, heldLen;
+   int nBufs;                                   /* Buffers allocated on the port */
+   MOCK_FRAMEQ q;                               /* Input: frames from the tunnel; output: frames for it */
+   int cmd;                                     /* Port command waiting to complete, or -1 */
+} MOCK_PORT;
+
+/* Parameters and configs set by the client, keyed by index and, for the structures
+ * that start with one, the port: a word after nVersion that isn't one of the
+ * component's ports (e.g. OMX_CONFIG_BOOLEANTYPE.bEnabled) is taken to be data.
+ */
+typedef struct mockParam {
+   struct mockParam *next;
+   OMX_INDEXTYPE index;
+   OMX_U32 port;
+   OMX_U32 size;
+   OMX_U8 data[];
+} MOCK_PARAM;
+
+typedef struct mockComponent {
+   OMX_COMPONENTTYPE omx;      /* The handle: must be first */
+   const MOCK_TYPE *type;
+   OMX_CALLBACKTYPE cb;
+   OMX_PTR appData;
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+   pthread_t thread;
+   int quit;
+   unsigned int kicks;         /* Counts wake ups, so that none is lost while the lock is dropped */
+   OMX_STATETYPE state;
+   OMX_STATETYPE target;       /* Same as state unless a state change is pending */
+   int64_t cmdDue;             /* Commands don't complete before this time (us) */
+   MOCK_PORT port[MOCK_MAXPORTS];
+   MOCK_PARAM *params;
+
+   /* Decoder: */
+   int frames;                 /* Since the last Executing -> Idle */
+   int detected;               /* Port settings changed has been sent */
+   MOCK_FRAME reorder[MOCK_REORDER];
+   int nReorder;
+
+   /* Encoder: */
+   int headers;                /* SPS / PPS have been sent */
+   int64_t gopPos;             /* Frames since the last IDR */
+   int idrRequest;             /* OMX_IndexConfigBrcmVideoRequestIFrame: the next frame is an IDR */
+   OMX_U32 bitrate;            /* Target bitrate: OMX_IndexParamVideoBitrate, OMX_IndexConfigVideoBitrate */
+   OMX_U32 nalPos, nalSize;    /* Progress through the current frame's NAL */
+   int nalIdr;
+   int64_t nalTs;
+
+   /* Statistics: */
+   int64_t framesIn, framesOut;
+   int64_t stalls, stallUs, stallStart;
+} MOCK_COMPONENT;
+
+static struct {
+   int refs;
+   int64_t decUs, fxUs, encUs, latencyUs, cmdUs;
+   int detect, fps, interlace, gop, rcGain, verbose;
+   OMX_U32 nalBytes, encBufSize;
+} mock;
+
+static int64_t nowUs(void) {
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static int64_t envInt(const char *name, int64_t def) {
+   const char *s = getenv(name);
+
+   return (s != NULL && *s != '\0') ? strtoll(s, NULL, 0) : def;
+}
+
+/* Frame queues */
+static int queueFull(const MOCK_FRAMEQ *q) {
+   return q->len == MOCK_QUEUE;
+}
+
+static void queuePush(MOCK_FRAMEQ *q, const MOCK_FRAME *f) {
+   q->frames[(q->head + q->len++) % MOCK_QUEUE] = *f;
+}
+
+static MOCK_FRAME *queuePeek(MOCK_FRAMEQ *q) {
+   return q->len > 0 ? &q->frames[q->head] : NULL;
+}
+
+static void queuePop(MOCK_FRAMEQ *q) {
+   q->head = (q->head + 1) % MOCK_QUEUE;
+   q->len--;
+}
+
+static MOCK_PORT *findPort(MOCK_COMPONENT *c, OMX_U32 index) {
+   if (index < c->type->base || index >= c->type->base + c->type->nPorts)
+      return NULL;
+   return &c->port[index - c->type->base];
+}
+
+static OMX_BUFFERHEADERTYPE *heldPop(MOCK_PORT *p) {
+   OMX_BUFFERHEADERTYPE *buf;
+
+   if (p->heldLen == 0)
+      return NULL;
+   buf = p->held[p->heldHead];
+   p->heldHead = (p->heldHead + 1) % MOCK_MAXBUFS;
+   p->heldLen--;
+   return buf;
+}
+
+/* Called with the lock held: the component re-checks its work */
+static void kick(MOCK_COMPONENT *c) {
+   c->kicks++;
+   pthread_cond_broadcast(&c->cond);
+}
+
+static void wake(MOCK_COMPONENT *c) {
+   if (c == NULL)
+      return;
+   pthread_mutex_lock(&c->lock);
+   kick(c);
+   pthread_mutex_unlock(&c->lock);
+}
+
+/* Read a tunnelled port's enable state without taking its component's lock,
+ * which the lock order doesn't allow for a component downstream.
+ */
+static int peerEnabled(MOCK_PORT *p) {
+   MOCK_PORT *pp;
+
+   if (p->peer == NULL)
+      return 0;
+   pp = findPort(p->peer, p->peerPort);
+   return pp != NULL && __atomic_load_n(&pp->def.bEnabled, __ATOMIC_ACQUIRE);
+}
+
+/* Callbacks: the lock is dropped round each one */
+static void sendEvent(MOCK_COMPONENT *c, OMX_EVENTTYPE event, OMX_U32 data1, OMX_U32 data2) {
+   MOCKLOG(c, "event %d (%x, %x)\n", event, data1, data2);
+   pthread_mutex_unlock(&c->lock);
+   if (c->cb.EventHandler != NULL)
+      c->cb.EventHandler(&c->omx, c->appData, event, data1, data2, NULL);
+   pthread_mutex_lock(&c->lock);
+}
+
+static void returnBuffer(MOCK_COMPONENT *c, MOCK_PORT *p, OMX_BUFFERHEADERTYPE *buf) {
+   pthread_mutex_unlock(&c->lock);
+   if (p->def.eDir == OMX_DirInput) {
+      if (c->cb.EmptyBufferDone != NULL)
+         c->cb.EmptyBufferDone(&c->omx, c->appData, buf);
+   }
+   else if (c->cb.FillBufferDone != NULL)
+      c->cb.FillBufferDone(&c->omx, c->appData, buf);
+   pthread_mutex_lock(&c->lock);
+}
+
+/* Give back every buffer held on the port, and drop any frames queued on it */
+static int flushPort(MOCK_COMPONENT *c, MOCK_PORT *p) {
+   OMX_BUFFERHEADERTYPE *buf;
+   int n = 0;
+
+   p->q.len = 0;
+   while ((buf = heldPop(p)) != NULL) {
+      if (p->def.eDir == OMX_DirOutput)
+         buf->nFilledLen = 0;
+      returnBuffer(c, p, buf);
+      n++;
+   }
+   if (p->peer != NULL && p->def.eDir == OMX_DirInput)
+      wake(p->peer);   /* Room in the queue */
+   return n;
+}
+
+/* Time spent working on a frame, without the lock so that buffers can be queued meanwhile */
+static void busy(MOCK_COMPONENT *c, int64_t us) {
+   struct timespec t;
+
+   if (us <= 0)
+      return;
+   t.tv_sec = us / 1000000;
+   t.tv_nsec = us % 1000000 * 1000;
+   pthread_mutex_unlock(&c->lock);
+   nanosleep(&t, NULL);
+   pthread_mutex_lock(&c->lock);
+}
+
+/* Count the times, and the time, that a component has work it can't do for lack of
+ * a buffer or of room downstream.
+ */
+static void stalled(MOCK_COMPONENT *c, int blocked) {
+   if (blocked && c->stallStart == 0) {
+      c->stallStart = nowUs();
+      c->stalls++;
+   }
+   else if (!blocked && c->stallStart != 0) {
+      c->stallUs += nowUs() - c->stallStart;
+      c->stallStart = 0;
+   }
+}
+
+/* Port formats: the video and image layouts hold the same fields at different offsets */
+typedef struct {
+   OMX_U32 width, height;
+   OMX_S32 stride;
+   OMX_U32 slice;
+   OMX_U32 xFramerate;
+   OMX_COLOR_FORMATTYPE colour;
+   OMX_U32 coding;
+} MOCK_FORMAT;
+
+static void getFormat(const OMX_PARAM_PORTDEFINITIONTYPE *def, MOCK_FORMAT *f) {
+   memset(f, 0, sizeof(*f));
+   if (def->eDomain == OMX_PortDomainImage) {
+      f->width = def->format.image.nFrameWidth;
+      f->height = def->format.image.nFrameHeight;
+      f->stride = def->format.image.nStride;
+      f->slice = def->format.image.nSliceHeight;
+      f->colour = def->format.image.eColorFormat;
+      f->coding = def->format.image.eCompressionFormat;
+   }
+   else {
+      f->width = def->format.video.nFrameWidth;
+      f->height = def->format.video.nFrameHeight;
+      f->stride = def->format.video.nStride;
+      f->slice = def->format.video.nSliceHeight;
+      f->xFramerate = def->format.video.xFramerate;
+      f->colour = def->format.video.eColorFormat;
+      f->coding = def->format.video.eCompressionFormat;
+   }
+}
+
+/* Raw ports get the stride, slice height and buffer size of the Pi: 32 and 16 aligned YUV 4:2:0 */
+static void setFormat(OMX_PARAM_PORTDEFINITIONTYPE *def, MOCK_FORMAT *f) {
+   if (f->colour != OMX_COLOR_FormatUnused) {
+      if (f->stride < (OMX_S32)f->width)
+         f->stride = ALIGN(f->width, 32);
+      if (f->slice < f->height)
+         f->slice = ALIGN(f->height, 16);
+      def->nBufferSize = f->stride * f->slice * 3 / 2;
+   }
+   if (def->eDomain == OMX_PortDomainImage) {
+      def->format.image.nFrameWidth = f->width;
+      def->format.image.nFrameHeight = f->height;
+      def->format.image.nStride = f->stride;
+      def->format.image.nSliceHeight = f->slice;
+      def->format.image.eColorFormat = f->colour;
+      def->format.image.eCompressionFormat = OMX_IMAGE_CodingUnused;
+   }
+   else {
+      def->format.video.nFrameWidth = f->width;
+      def->format.video.nFrameHeight = f->height;
+      def->format.video.nStride = f->stride;
+      def->format.video.nSliceHeight = f->slice;
+      def->format.video.xFramerate = f->xFramerate;
+      def->format.video.eColorFormat = f->colour;
+      def->format.video.eCompressionFormat = f->coding;
+   }
+}
+
+static void initPorts(MOCK_COMPONENT *c) {
+   MOCK_FORMAT f = { .width = 1280, .height = 720, .colour = OMX_COLOR_FormatYUV420PackedPlanar };
+   MOCK_PORT *p;
+   int i;
+
+   f.xFramerate = mock.fps << 16;
+   for (i = 0; i < c->type->nPorts; i++) {
+      p = &c->port[i];
+      p->def.nSize = sizeof(p->def);
+      p->def.nVersion = SpecificationVersion;
+      p->def.nPortIndex = c->type->base + i;
+      p->def.eDir = (i == 0) ? OMX_DirInput : OMX_DirOutput;
+      p->def.nBufferCountActual = p->def.nBufferCountMin = 1;
+      p->def.bEnabled = OMX_TRUE;
+      p->def.eDomain = c->type->domain;
+      p->def.nBufferAlignment = 16;
+      p->cmd = -1;
+      setFormat(&p->def, &f);
+   }
+   if (c->type->kind == MOCK_DEC) {
+      p = &c->port[0];
+      p->def.nBufferCountActual = 20;
+      p->def.nBufferCountMin = 2;
+      p->def.nBufferSize = 80 * 1024;
+      p->def.format.video.eColorFormat = OMX_COLOR_FormatUnused;
+      p->def.format.video.eCompressionFormat = OMX_VIDEO_CodingAVC;
+   }
+   if (c->type->kind == MOCK_ENC) {
+      p = &c->port[1];
+      p->def.nBufferSize = mock.encBufSize;
+      p->def.format.video.eColorFormat = OMX_COLOR_FormatUnused;
+      p->def.format.video.eCompressionFormat = OMX_VIDEO_CodingAVC;
+   }
+}
+
+/* H.264 headers */
+typedef struct {
+   OMX_U8 rbsp[64];
+   int bits;
+} MOCK_BITS;
+
+static void putBits(MOCK_BITS *b, uint32_t v, int n) {
+   while (n-- > 0) {
+      if ((v >> n) & 1)
+         b->rbsp[b->bits >> 3] |= 0x80 >> (b->bits & 7);
+      b->bits++;
+   }
+}
+
+static void putUe(MOCK_BITS *b, uint32_t v) {
+   int n = 32 - __builtin_clz(v + 1);
+
+   putBits(b, 0, n - 1);
+   putBits(b, v + 1, n);
+}
+
+static void putSe(MOCK_BITS *b, int32_t v) {
+   putUe(b, v <= 0 ? -2 * v : 2 * v - 1);
+}
+
+/* Append a NAL with start code, rbsp trailing bits and emulation prevention */
+static OMX_U32 putNal(OMX_U8 *out, OMX_U8 header, MOCK_BITS *b) {
+   OMX_U32 n = 0;
+   int i, zeros = 0;
+
+   putBits(b, 1, 1);
+   while (b->bits & 7)
+      putBits(b, 0, 1);
+   out[n++] = 0; out[n++] = 0; out[n++] = 0; out[n++] = 1;
+   out[n++] = header;
+   for (i = 0; i < b->bits / 8; i++) {
+      if (zeros == 2 && b->rbsp[i] <= 3) {
+         out[n++] = 3;
+         zeros = 0;
+      }
+      out[n++] = b->rbsp[i];
+      zeros = (b->rbsp[i] == 0) ? zeros + 1 : 0;
+   }
+   return n;
+}
+
+/* High profile, level 4 SPS and a CAVLC PPS for the frame size: enough for the muxers
+ * to build their extradata from.
+ */
+static OMX_U32 writeHeaders(OMX_U8 *out, OMX_U32 width, OMX_U32 height) {
+   MOCK_BITS b;
+   OMX_U32 n, mbWidth = (width + 15) / 16, mbHeight = (height + 15) / 16;
+
+   memset(&b, 0, sizeof(b));
+   putBits(&b, 100, 8);   /* profile_idc: High */
+   putBits(&b, 0, 8);     /* constraint flags */
+   putBits(&b, 40, 8);    /* level_idc */
+   putUe(&b, 0);          /* seq_parameter_set_id */
+   putUe(&b, 1);          /* chroma_format_idc: 4:2:0 */
+   putUe(&b, 0);          /* bit_depth_luma_minus8 */
+   putUe(&b, 0);          /* bit_depth_chroma_minus8 */
+   putBits(&b, 0, 1);     /* qpprime_y_zero_transform_bypass_flag */
+   putBits(&b, 0, 1);     /* seq_scaling_matrix_present_flag */
+   putUe(&b, 0);          /* log2_max_frame_num_minus4 */
+   putUe(&b, 2);          /* pic_order_cnt_type */
+   putUe(&b, 1);          /* max_num_ref_frames */
+   putBits(&b, 0, 1);     /* gaps_in_frame_num_value_allowed_flag */
+   putUe(&b, mbWidth - 1);
+   putUe(&b, mbHeight - 1);
+   putBits(&b, 1, 1);     /* frame_mbs_only_flag */
+   putBits(&b, 1, 1);     /* direct_8x8_inference_flag */
+   if (mbWidth * 16 != width || mbHeight * 16 != height) {
+      putBits(&b, 1, 1);  /* frame_cropping_flag: in 2 pixel units for 4:2:0 */
+      putUe(&b, 0);
+      putUe(&b, (mbWidth * 16 - width) / 2);
+      putUe(&b, 0);
+      putUe(&b, (mbHeight * 16 - height) / 2);
+   }
+   else
+      putBits(&b, 0, 1);
+   putBits(&b, 0, 1);     /* vui_parameters_present_flag */
+   n = putNal(out, 0x67, &b);
+
+   memset(&b, 0, sizeof(b));
+   putUe(&b, 0);          /* pic_parameter_set_id */
+   putUe(&b, 0);          /* seq_parameter_set_id */
+   putBits(&b, 0, 1);     /* entropy_coding_mode_flag: CAVLC */
+   putBits(&b, 0, 1);     /* bottom_field_pic_order_in_frame_present_flag */
+   putUe(&b, 0);          /* num_slice_groups_minus1 */
+   putUe(&b, 0);          /* num_ref_idx_l0_default_active_minus1 */
+   putUe(&b, 0);          /* num_ref_idx_l1_default_active_minus1 */
+   putBits(&b, 0, 1);     /* weighted_pred_flag */
+   putBits(&b, 0, 2);     /* weighted_bipred_idc */
+   putSe(&b, 0);          /* pic_init_qp_minus26 */
+   putSe(&b, 0);          /* pic_init_qs_minus26 */
+   putSe(&b, 0);          /* chroma_qp_index_offset */
+   putBits(&b, 1, 1);     /* deblocking_filter_control_present_flag */
+   putBits(&b, 0, 1);     /* constrained_intra_pred_flag */
+   putBits(&b, 0, 1);     /* redundant_pic_cnt_present_flag */
+   return n + putNal(out + n, 0x68, &b);
+}
+
+/* Commands */
+static int stateReady(MOCK_COMPONENT *c) {
+   MOCK_PORT *p;
+   int i;
+
+   for (i = 0; i < c->type->nPorts; i++) {
+      p = &c->port[i];
+      if (p->peer != NULL)
+         continue;   /* Tunnel buffers belong to the components */
+      if (c->target == OMX_StateIdle && c->state == OMX_StateLoaded
+       && p->def.bEnabled && p->nBufs < p->def.nBufferCountActual)
+         return 0;
+      if (c->target == OMX_StateLoaded && p->nBufs > 0)
+         return 0;
+   }
+   return 1;
+}
+
+static int portReady(MOCK_COMPONENT *c, MOCK_PORT *p) {
+   if (p->heldLen > 0)
+      return 0;
+   switch (p->cmd) {
+      case OMX_CommandPortEnable:
+         if (c->state == OMX_StateLoaded)
+            return 1;
+         if (p->peer != NULL)
+            return peerEnabled(p);
+         return p->nBufs == p->def.nBufferCountActual;
+      case OMX_CommandPortDisable:
+         if (p->peer != NULL)
+            return !peerEnabled(p);
+         return p->nBufs == 0;
+      default:
+         return 1;
+   }
+}
+
+/* Complete whichever pending command is ready; returns 1 if one was */
+static int completeCommands(MOCK_COMPONENT *c, int64_t *wakeAt) {
+   MOCK_PORT *p;
+   int i, cmd, busyPorts = 0;
+
+   for (i = 0; i < c->type->nPorts; i++)
+      busyPorts |= (c->port[i].cmd != -1);
+   if (c->target == c->state && !busyPorts)
+      return 0;
+   if (nowUs() < c->cmdDue) {
+      if (c->cmdDue < *wakeAt)
+         *wakeAt = c->cmdDue;
+      return 0;
+   }
+
+   if (c->target != c->state) {
+      if (c->target == OMX_StateIdle && c->state == OMX_StateExecuting) {
+         for (i = 0; i < c->type->nPorts; i++)
+            if (flushPort(c, &c->port[i]) > 0)
+               return 1;
+         c->frames = c->detected = c->nReorder = 0;
+         c->nalSize = 0;
+         c->headers = 0;
+      }
+      if (stateReady(c)) {
+         MOCKLOG(c, "state %d -> %d\n", c->state, c->target);
+         c->state = c->target;
+         if (c->state == OMX_StateExecuting)
+            for (i = 0; i < c->type->nPorts; i++)
+               if (c->port[i].def.eDir == OMX_DirInput)
+                  wake(c->port[i].peer);   /* Frames can flow in now */
+         sendEvent(c, OMX_EventCmdComplete, OMX_CommandStateSet, c->state);
+         return 1;
+      }
+   }
+
+   for (i = 0; i < c->type->nPorts; i++) {
+      p = &c->port[i];
+      if (p->cmd == -1)
+         continue;
+      if (p->cmd != OMX_CommandPortEnable && flushPort(c, p) > 0)
+         return 1;
+      if (portReady(c, p)) {
+         cmd = p->cmd;
+         p->cmd = -1;
+         if (cmd == OMX_CommandPortEnable)
+            p->def.bPopulated = OMX_TRUE;
+         sendEvent(c, OMX_EventCmdComplete, cmd, p->def.nPortIndex);
+         return 1;
+      }
+   }
+   return 0;
+}
+
+/* Frame processing, in state Executing */
+
+/* Pass the frame at the head of an output port's queue down the tunnel, if there's room */
+static int forward(MOCK_COMPONENT *c, MOCK_PORT *p) {
+   MOCK_COMPONENT *peer = p->peer;
+   MOCK_FRAME frame, *f = queuePeek(&p->q);
+   MOCK_PORT *pp;
+   int sent = 0;
+
+   if (f == NULL || peer == NULL || !p->def.bEnabled)
+      return 0;
+   frame = *f;
+   pthread_mutex_unlock(&c->lock);
+   pthread_mutex_lock(&peer->lock);
+   pp = findPort(peer, p->peerPort);
+   if (peer->state == OMX_StateExecuting && pp->def.bEnabled && !queueFull(&pp->q)) {
+      queuePush(&pp->q, &frame);
+      kick(peer);
+      sent = 1;
+   }
+   pthread_mutex_unlock(&peer->lock);
+   pthread_mutex_lock(&c->lock);
+   if (sent && queuePeek(&p->q) != NULL) {   /* Unless the port was flushed meanwhile */
+      queuePop(&p->q);
+      c->framesOut += !(frame.flags & OMX_BUFFERFLAG_EOS);
+   }
+   return sent;
+}
+
+/* The picture for frame n of an untunnelled output, in the port's layout; returns its size */
+static OMX_U32 drawPicture(MOCK_PORT *p, OMX_BUFFERHEADERTYPE *buf, int64_t n) {
+   MOCK_FORMAT f;
+   OMX_U32 y, luma, size;
+
+   getFormat(&p->def, &f);
+   luma = f.stride * f.slice;
+   size = luma * 3 / 2;
+   if (f.colour == OMX_COLOR_FormatUnused || size > buf->nAllocLen)
+      return 0;
+   for (y = 0; y < f.height; y++)
+      memset(buf->pBuffer + y * f.stride, 16 + (y + n) % 220, f.width);
+   memset(buf->pBuffer + luma, 128, size - luma);
+   return size;
+}
+
+/* Pass the frame at the head of an untunnelled output port's queue to the client, in
+ * the next buffer given to the port with OMX_FillThisBuffer()
+ */
+static int deliver(MOCK_COMPONENT *c, MOCK_PORT *p) {
+   MOCK_FRAME frame, *f = queuePeek(&p->q);
+   OMX_BUFFERHEADERTYPE *buf;
+
+   if (f == NULL || p->peer != NULL || !p->def.bEnabled || p->heldLen == 0)
+      return 0;
+   frame = *f;
+   queuePop(&p->q);
+   buf = heldPop(p);
+   buf->nOffset = 0;
+   buf->nFilledLen = 0;
+   buf->nFlags = frame.flags | OMX_BUFFERFLAG_ENDOFFRAME;
+   buf->nTimeStamp.nLowPart = (OMX_U32)frame.ts;
+   buf->nTimeStamp.nHighPart = (OMX_U32)(frame.ts >> 32);
+   if (!(frame.flags & OMX_BUFFERFLAG_EOS))
+      buf->nFilledLen = drawPicture(p, buf, c->framesOut++);
+   returnBuffer(c, p, buf);
+   if (frame.flags & OMX_BUFFERFLAG_EOS)
+      sendEvent(c, OMX_EventBufferFlag, p->def.nPortIndex, OMX_BUFFERFLAG_EOS);
+   return 1;
+}
+
+/* Take the next buffer given to an untunnelled input port with OMX_EmptyThisBuffer(), such
+ * as the encoder's behind omxtx's filter stage (-I, -D), as a frame on the port's queue
+ */
+static int takeInput(MOCK_COMPONENT *c, MOCK_PORT *p) {
+   OMX_BUFFERHEADERTYPE *buf;
+   MOCK_FRAME f;
+
+   if (p->peer != NULL || p->heldLen == 0 || queueFull(&p->q))
+      return 0;
+   buf = heldPop(p);
+   f.ts = ((int64_t)buf->nTimeStamp.nHighPart << 32) | buf->nTimeStamp.nLowPart;
+   f.flags = buf->nFlags & OMX_BUFFERFLAG_EOS;
+   f.due = 0;
+   if (f.flags || ((buf->nFlags & OMX_BUFFERFLAG_ENDOFFRAME) && buf->nFilledLen > 0))
+      queuePush(&p->q, &f);
+   buf->nFilledLen = 0;
+   returnBuffer(c, p, buf);
+   return 1;
+}
+
+static void emitFrame(MOCK_COMPONENT *c, const MOCK_FRAME *f) {
+   MOCK_PORT *out = &c->port[1];
+
+   queuePush(&out->q, f);
+   if (!c->detected && ++c->frames >= mock.detect) {
+      MOCK_FORMAT fmt;
+
+      getFormat(&c->port[0].def, &fmt);
+      if (fmt.width == 0 || fmt.height == 0) {
+         fmt.width = 1280;
+         fmt.height = 720;
+      }
+      fmt.stride = fmt.slice = 0;
+      fmt.xFramerate = mock.fps << 16;
+      fmt.colour = OMX_COLOR_FormatYUV420PackedPlanar;
+      fmt.coding = OMX_VIDEO_CodingUnused;
+      setFormat(&out->def, &fmt);
+      c->detected = 1;
+      sendEvent(c, OMX_EventPortSettingsChanged, out->def.nPortIndex, OMX_IndexParamPortDefinition);
+   }
+}
+
+/* Emit the held frame with the earliest timestamp, as a decoder does for B frames */
+static void emitEarliest(MOCK_COMPONENT *c) {
+   MOCK_FRAME f;
+   int i, min = 0;
+
+   for (i = 1; i < c->nReorder; i++)
+      if (c->reorder[i].ts < c->reorder[min].ts)
+         min = i;
+   f = c->reorder[min];
+   c->reorder[min] = c->reorder[--c->nReorder];
+   emitFrame(c, &f);
+}
+
+static int decode(MOCK_COMPONENT *c) {
+   MOCK_PORT *in = &c->port[0], *out = &c->port[1];
+   OMX_BUFFERHEADERTYPE *buf;
+   MOCK_FRAME f;
+
+   if (in->heldLen == 0)
+      return 0;
+   if (out->q.len + MOCK_REORDER >= MOCK_QUEUE) {
+      stalled(c, 1);   /* Frames are waiting for the output port, or for room downstream */
+      return 0;
+   }
+   stalled(c, 0);
+   buf = heldPop(in);
+   f.ts = ((int64_t)buf->nTimeStamp.nHighPart << 32) | buf->nTimeStamp.nLowPart;
+   f.flags = 0;
+   f.due = 0;
+   if (buf->nFlags & OMX_BUFFERFLAG_EOS) {
+      while (c->nReorder > 0)
+         emitEarliest(c);
+      f.flags = OMX_BUFFERFLAG_EOS;
+      emitFrame(c, &f);
+   }
+   else if ((buf->nFlags & OMX_BUFFERFLAG_ENDOFFRAME) && !(buf->nFlags & OMX_BUFFERFLAG_CODECCONFIG)) {
+      busy(c, mock.decUs);
+      c->framesIn++;
+      f.due = nowUs() + mock.latencyUs;
+      c->reorder[c->nReorder++] = f;
+      if (c->nReorder == MOCK_REORDER)
+         emitEarliest(c);
+   }
+   buf->nFilledLen = 0;
+   returnBuffer(c, in, buf);
+   return 1;
+}
+
+/* An output that frames go to: enabled, and tunnelled or with the client's buffers */
+static int outputUsed(MOCK_PORT *p) {
+   return p->def.bEnabled && (p->peer != NULL || p->nBufs > 0);
+}
+
+/* Image fx, resize, splitter and render: one frame from the input queue to every
+ * output in use.
+ */
+static int filter(MOCK_COMPONENT *c) {
+   MOCK_PORT *in = &c->port[0];
+   MOCK_FRAME f, *head = queuePeek(&in->q);
+   int i;
+
+   if (head == NULL)
+      return 0;
+   for (i = 1; i < c->type->nPorts; i++)
+      if (outputUsed(&c->port[i]) && queueFull(&c->port[i].q)) {
+         stalled(c, 1);
+         return 0;
+      }
+   stalled(c, 0);
+   f = *head;
+   queuePop(&in->q);
+   wake(in->peer);   /* Room for the next frame */
+   if (!(f.flags & OMX_BUFFERFLAG_EOS)) {
+      c->framesIn++;
+      if (c->type->kind != MOCK_SINK)
+         busy(c, mock.fxUs);
+   }
+   for (i = 1; i < c->type->nPorts; i++)
+      if (outputUsed(&c->port[i]))
+         queuePush(&c->port[i].q, &f);
+   if (c->type->kind == MOCK_SINK)
+      c->framesOut += !(f.flags & OMX_BUFFERFLAG_EOS);
+   return 1;
+}
+
+/* Fill the next output buffer with the next part of the current NAL: a start code,
+ * the NAL header and filler bytes that never form a start code.
+ */
+static void fillNal(MOCK_COMPONENT *c, OMX_BUFFERHEADERTYPE *buf) {
+   OMX_U32 n = 0, len = c->nalSize - c->nalPos;
+   OMX_U8 *d = buf->pBuffer;
+
+   if (len > buf->nAllocLen)
+      len = buf->nAllocLen;
+   for (n = 0; n < len; n++, c->nalPos++) {
+      if (c->nalPos < 3)
+         d[n] = 0;
+      else if (c->nalPos == 3)
+         d[n] = 1;
+      else if (c->nalPos == 4)
+         d[n] = c->nalIdr ? 0x65 : 0x41;
+      else
+         d[n] = 0x80 | (c->nalPos & 0x7f);
+   }
+   buf->nOffset = 0;
+   buf->nFilledLen = len;
+   buf->nTimeStamp.nLowPart = (OMX_U32)c->nalTs;
+   buf->nTimeStamp.nHighPart = (OMX_U32)(c->nalTs >> 32);
+   buf->nFlags = 0;
+   if (c->nalPos == c->nalSize) {
+      buf->nFlags = OMX_BUFFERFLAG_ENDOFNAL | OMX_BUFFERFLAG_ENDOFFRAME;
+      if (c->nalIdr)
+         buf->nFlags |= OMX_BUFFERFLAG_SYNCFRAME;
+      c->nalSize = 0;
+      c->framesOut++;
+   }
+}
+
+static int encode(MOCK_COMPONENT *c, int64_t *wakeAt) {
+   MOCK_PORT *in = &c->port[0], *out = &c->port[1];
+   OMX_BUFFERHEADERTYPE *buf;
+   MOCK_FRAME *f = queuePeek(&in->q);
+   MOCK_FORMAT fmt;
+   int64_t now;
+
+   if (c->nalSize == 0) {   /* Between frames: is the next one ready? */
+      if (f == NULL)
+         return 0;
+      now = nowUs();
+      if (!(f->flags & OMX_BUFFERFLAG_EOS) && now < f->due) {
+         if (f->due < *wakeAt)
+            *wakeAt = f->due;
+         return 0;
+      }
+   }
+   if (out->heldLen == 0) {
+      stalled(c, 1);   /* Starved of output buffers */
+      return 0;
+   }
+   stalled(c, 0);
+   buf = heldPop(out);
+
+   if (!c->headers) {
+      getFormat(&in->def, &fmt);
+      buf->nFilledLen = (buf->nAllocLen >= 128) ? writeHeaders(buf->pBuffer, fmt.width, fmt.height) : 0;
+      buf->nOffset = 0;
+      buf->nFlags = OMX_BUFFERFLAG_CODECCONFIG | OMX_BUFFERFLAG_ENDOFNAL;
+      c->headers = 1;
+   }
+   else if (c->nalSize != 0)
+      fillNal(c, buf);
+   else if (f->flags & OMX_BUFFERFLAG_EOS) {
+      buf->nOffset = 0;
+      buf->nFilledLen = 0;
+      buf->nFlags = OMX_BUFFERFLAG_EOS | OMX_BUFFERFLAG_ENDOFFRAME;
+      buf->nTimeStamp.nLowPart = (OMX_U32)f->ts;
+      buf->nTimeStamp.nHighPart = (OMX_U32)(f->ts >> 32);
+      queuePop(&in->q);
+      wake(in->peer);
+      returnBuffer(c, out, buf);
+      sendEvent(c, OMX_EventBufferFlag, out->def.nPortIndex, OMX_BUFFERFLAG_EOS);
+      return 1;
+   }
+   else {
+      c->nalTs = f->ts;
+      c->nalIdr = c->idrRequest || c->gopPos % mock.gop == 0;
+      if (c->nalIdr) {
+         c->idrRequest = 0;
+         c->gopPos = 0;
+      }
+      c->gopPos++;
+      c->nalSize = mock.nalBytes;
+      if (mock.rcGain > 0 && c->bitrate > 0) {   /* (gop - 1) P frames and an IDR of 4 make the rate */
+         c->nalSize = (int64_t)c->bitrate * mock.rcGain / 100 / 8 * mock.gop / mock.fps / (mock.gop + 3);
+         if (c->nalIdr)
+            c->nalSize *= 4;
+         if (c->nalSize < 8)
+            c->nalSize = 8;
+      }
+      c->nalPos = 0;
+      c->framesIn++;
+      queuePop(&in->q);
+      wake(in->peer);
+      busy(c, mock.encUs);
+      fillNal(c, buf);
+   }
+   returnBuffer(c, out, buf);
+   return 1;
+}
+
+static int process(MOCK_COMPONENT *c, int64_t *wakeAt) {
+   int i;
+
+   for (i = 1; i < c->type->nPorts; i++)
+      if (forward(c, &c->port[i]) || deliver(c, &c->port[i]))
+         return 1;
+   if (c->type->kind != MOCK_DEC && takeInput(c, &c->port[0]))
+      return 1;
+   switch (c->type->kind) {
+      case MOCK_DEC:
+         return decode(c);
+      case MOCK_ENC:
+         return encode(c, wakeAt);
+      default:
+         return filter(c);
+   }
+}
+
+static void *componentThread(void *arg) {
+   MOCK_COMPONENT *c = arg;
+   struct timespec t;
+   unsigned int kicks;
+   int64_t wakeAt;
+
+   pthread_mutex_lock(&c->lock);
+   while (!c->quit) {
+      kicks = c->kicks;
+      wakeAt = INT64_MAX;
+      if (completeCommands(c, &wakeAt))
+         continue;
+      if (c->state == OMX_StateExecuting && process(c, &wakeAt))
+         continue;
+      if (c->kicks != kicks || c->quit)
+         continue;
+      if (wakeAt == INT64_MAX)
+         pthread_cond_wait(&c->cond, &c->lock);
+      else {
+         t.tv_sec = wakeAt / 1000000;
+         t.tv_nsec = wakeAt % 1000000 * 1000;
+         pthread_cond_timedwait(&c->cond, &c->lock, &t);
+      }
+   }
+   pthread_mutex_unlock(&c->lock);
+   return NULL;
+}
+
+/* Component entry points */
+static OMX_ERRORTYPE mockGetComponentVersion(OMX_HANDLETYPE h, OMX_STRING name, OMX_VERSIONTYPE *compVersion, OMX_VERSIONTYPE *specVersion, OMX_UUIDTYPE *uuid) {
+   MOCK_COMPONENT *c = h;
+
+   if (name != NULL)
+      strcpy(name, c->type->name);
+   if (compVersion != NULL)
+      *compVersion = SpecificationVersion;
+   if (specVersion != NULL)
+      *specVersion = SpecificationVersion;
+   if (uuid != NULL)
+      memset(uuid, 0, sizeof(*uuid));
+   return OMX_ErrorNone;
+}
+
+static int validTransition(OMX_STATETYPE from, OMX_STATETYPE to) {
+   switch (to) {
+      case OMX_StateIdle:
+         return from == OMX_StateLoaded || from == OMX_StateExecuting || from == OMX_StatePause;
+      case OMX_StateLoaded:
+         return from == OMX_StateIdle;
+      case OMX_StateExecuting:
+      case OMX_StatePause:
+         return from == OMX_StateIdle || from == OMX_StateExecuting || from == OMX_StatePause;
+      default:
+         return 0;
+   }
+}
+
+static OMX_ERRORTYPE mockSendCommand(OMX_HANDLETYPE h, OMX_COMMANDTYPE cmd, OMX_U32 param, OMX_PTR data) {
+   MOCK_COMPONENT *c = h, *peer = NULL;
+   OMX_ERRORTYPE err = OMX_ErrorNone;
+   MOCK_PORT *p;
+
+   pthread_mutex_lock(&c->lock);
+   MOCKLOG(c, "command %d (%x)\n", cmd, param);
+   switch (cmd) {
+      case OMX_CommandStateSet:
+         if (c->target != c->state)
+            err = OMX_ErrorIncorrectStateOperation;   /* Still busy with the last one */
+         else if (param == c->state)
+            err = OMX_ErrorSameState;
+         else if (!validTransition(c->state, param))
+            err = OMX_ErrorIncorrectStateTransition;
+         else
+            c->target = param;
+      break;
+      case OMX_CommandPortEnable:
+      case OMX_CommandPortDisable:
+      case OMX_CommandFlush:
+         if ((p = findPort(c, param)) == NULL)
+            err = OMX_ErrorBadPortIndex;
+         else if (p->cmd != -1)
+            err = OMX_ErrorIncorrectStateOperation;
+         else {
+            if (cmd == OMX_CommandPortEnable)
+               __atomic_store_n(&p->def.bEnabled, OMX_TRUE, __ATOMIC_RELEASE);
+            else if (cmd == OMX_CommandPortDisable) {
+               __atomic_store_n(&p->def.bEnabled, OMX_FALSE, __ATOMIC_RELEASE);
+               p->def.bPopulated = OMX_FALSE;
+            }
+            p->cmd = cmd;
+            peer = p->peer;
+         }
+      break;
+      default:
+         err = OMX_ErrorNotImplemented;
+   }
+   if (err == OMX_ErrorNone) {
+      c->cmdDue = nowUs() + mock.cmdUs;
+      kick(c);
+   }
+   pthread_mutex_unlock(&c->lock);
+   wake(peer);   /* It may be waiting for this end of the tunnel */
+   return err;
+}
+
+static int paramPort(MOCK_COMPONENT *c, OMX_PTR param) {
+   OMX_U32 port = ((OMX_PARAM_U32TYPE *)param)->nPortIndex;
+
+   return (((OMX_PARAM_U32TYPE *)param)->nSize >= 3 * sizeof(OMX_U32) && findPort(c, port) != NULL) ? (int)port : -1;
+}
+
+static MOCK_PARAM *findParam(MOCK_COMPONENT *c, OMX_INDEXTYPE index, int port) {
+   MOCK_PARAM *p;
+
+   for (p = c->params; p != NULL; p = p->next)
+      if (p->index == index && p->port == (OMX_U32)port)
+         return p;
+   return NULL;
+}
+
+static OMX_ERRORTYPE storeParam(MOCK_COMPONENT *c, OMX_INDEXTYPE index, OMX_PTR param) {
+   OMX_U32 size = *(OMX_U32 *)param;
+   int port = paramPort(c, param);
+   MOCK_PARAM *p = findParam(c, index, port);
+
+   if (size < 2 * sizeof(OMX_U32))
+      return OMX_ErrorBadParameter;
+   if (p != NULL && p->size < size) {
+      MOCK_PARAM **pp;
+
+      for (pp = &c->params; *pp != p; pp = &(*pp)->next);
+      *pp = p->next;
+      free(p);
+      p = NULL;
+   }
+   if (p == NULL) {
+      if ((p = malloc(sizeof(MOCK_PARAM) + size)) == NULL)
+         return OMX_ErrorInsufficientResources;
+      p->index = index;
+      p->port = port;
+      p->next = c->params;
+      c->params = p;
+   }
+   p->size = size;
+   memcpy(p->data, param, size);
+   return OMX_ErrorNone;
+}
+
+/* Copy a stored parameter over the caller's structure, leaving its size and version alone */
+static int loadParam(MOCK_COMPONENT *c, OMX_INDEXTYPE index, OMX_PTR param) {
+   OMX_U32 size = *(OMX_U32 *)param, skip = sizeof(OMX_U32) + sizeof(OMX_VERSIONTYPE);
+   MOCK_PARAM *p = findParam(c, index, paramPort(c, param));
+
+   if (p == NULL)
+      return 0;
+   if (p->size < size)
+      size = p->size;
+   if (size > skip)
+      memcpy((OMX_U8 *)param + skip, p->data + skip, size - skip);
+   return 1;
+}
+
+static OMX_ERRORTYPE mockGetParameter(OMX_HANDLETYPE h, OMX_INDEXTYPE index, OMX_PTR param) {
+   MOCK_COMPONENT *c = h;
+   OMX_PARAM_PORTDEFINITIONTYPE *def = param;
+   OMX_ERRORTYPE err = OMX_ErrorNone;
+   MOCK_PORT *p;
+
+   if (param == NULL)
+      return OMX_ErrorBadParameter;
+   pthread_mutex_lock(&c->lock);
+   if (index == OMX_IndexParamPortDefinition) {
+      if (def->nSize < sizeof(*def))
+         err = OMX_ErrorBadParameter;
+      else if ((p = findPort(c, def->nPortIndex)) == NULL)
+         err = OMX_ErrorBadPortIndex;
+      else
+         *def = p->def;
+   }
+   else if (!loadParam(c, index, param) && index == OMX_IndexParamVideoProfileLevelCurrent) {
+      ((OMX_VIDEO_PARAM_PROFILELEVELTYPE *)param)->eProfile = OMX_VIDEO_AVCProfileHigh;
+      ((OMX_VIDEO_PARAM_PROFILELEVELTYPE *)param)->eLevel = OMX_VIDEO_AVCLevel4;
+   }
+   pthread_mutex_unlock(&c->lock);
+   return err;
+}
+
+static OMX_ERRORTYPE setPortDefinition(MOCK_COMPONENT *c, OMX_PARAM_PORTDEFINITIONTYPE *def) {
+   MOCK_FORMAT f;
+   MOCK_PORT *p;
+   OMX_U32 size;
+
+   if (def->nSize < sizeof(*def))
+      return OMX_ErrorBadParameter;
+   if ((p = findPort(c, def->nPortIndex)) == NULL)
+      return OMX_ErrorBadPortIndex;
+   if (c->state != OMX_StateLoaded && p->def.bEnabled)
+      return OMX_ErrorIncorrectStateOperation;
+   if (def->nBufferCountActual < p->def.nBufferCountMin || def->nBufferCountActual > MOCK_MAXBUFS)
+      return OMX_ErrorBadParameter;
+
+   p->def.nBufferCountActual = def->nBufferCountActual;
+   size = p->def.nBufferSize;
+   getFormat(def, &f);   /* In the caller's domain */
+   if (c->type->kind == MOCK_ENC && p->def.eDir == OMX_DirOutput) {
+      f.colour = OMX_COLOR_FormatUnused;
+      f.coding = OMX_VIDEO_CodingAVC;
+   }
+   setFormat(&p->def, &f);   /* In the port's own */
+   if (f.colour == OMX_COLOR_FormatUnused && p->def.eDir == OMX_DirInput)   /* Compressed input: the client may want bigger buffers */
+      p->def.nBufferSize = (def->nBufferSize > size) ? def->nBufferSize : size;
+
+   if (c->type->kind == MOCK_ENC && p->def.eDir == OMX_DirInput) {   /* The output takes the input size */
+      c->port[1].def.format.video.nFrameWidth = p->def.format.video.nFrameWidth;
+      c->port[1].def.format.video.nFrameHeight = p->def.format.video.nFrameHeight;
+   }
+   return OMX_ErrorNone;
+}
+
+static OMX_ERRORTYPE mockSetParameter(OMX_HANDLETYPE h, OMX_INDEXTYPE index, OMX_PTR param) {
+   MOCK_COMPONENT *c = h;
+   OMX_ERRORTYPE err;
+
+   if (param == NULL)
+      return OMX_ErrorBadParameter;
+   pthread_mutex_lock(&c->lock);
+   if (index == OMX_IndexParamPortDefinition)
+      err = setPortDefinition(c, param);
+   else
+      err = storeParam(c, index, param);
+   if (err == OMX_ErrorNone && index == OMX_IndexParamVideoBitrate)
+      c->bitrate = ((OMX_VIDEO_PARAM_BITRATETYPE *)param)->nTargetBitrate;
+   pthread_mutex_unlock(&c->lock);
+   return err;
+}
+
+static OMX_ERRORTYPE mockGetConfig(OMX_HANDLETYPE h, OMX_INDEXTYPE index, OMX_PTR config) {
+   MOCK_COMPONENT *c = h;
+
+   if (config == NULL)
+      return OMX_ErrorBadParameter;
+   pthread_mutex_lock(&c->lock);
+   if (!loadParam(c, index, config) && index == OMX_IndexConfigCommonInterlace) {
+      ((OMX_CONFIG_INTERLACETYPE *)config)->eMode = mock.interlace;
+      ((OMX_CONFIG_INTERLACETYPE *)config)->bRepeatFirstField = OMX_FALSE;
+   }
+   pthread_mutex_unlock(&c->lock);
+   return OMX_ErrorNone;
+}
+
+static OMX_ERRORTYPE mockSetConfig(OMX_HANDLETYPE h, OMX_INDEXTYPE index, OMX_PTR config) {
+   MOCK_COMPONENT *c = h;
+   OMX_ERRORTYPE err;
+
+   if (config == NULL)
+      return OMX_ErrorBadParameter;
+   pthread_mutex_lock(&c->lock);
+   err = storeParam(c, index, config);
+   if (err == OMX_ErrorNone && index == OMX_IndexConfigBrcmVideoRequestIFrame)
+      c->idrRequest = ((OMX_CONFIG_PORTBOOLEANTYPE *)config)->bEnabled;
+   if (err == OMX_ErrorNone && index == OMX_IndexConfigVideoBitrate)
+      c->bitrate = ((OMX_VIDEO_CONFIG_BITRATETYPE *)config)->nEncodeBitrate;
+   pthread_mutex_unlock(&c->lock);
+   return err;
+}
+
+static OMX_ERRORTYPE mockGetExtensionIndex(OMX_HANDLETYPE h, OMX_STRING name, OMX_INDEXTYPE *index) {
+   return OMX_ErrorUnsupportedIndex;
+}
+
+static OMX_ERRORTYPE mockGetState(OMX_HANDLETYPE h, OMX_STATETYPE *state) {
+   MOCK_COMPONENT *c = h;
+
+   pthread_mutex_lock(&c->lock);
+   *state = c->state;
+   pthread_mutex_unlock(&c->lock);
+   return OMX_ErrorNone;
+}
+
+/* A NULL peer tears the tunnel down */
+static OMX_ERRORTYPE mockComponentTunnelRequest(OMX_HANDLETYPE h, OMX_U32 port, OMX_HANDLETYPE peer, OMX_U32 peerPort, OMX_TUNNELSETUPTYPE *setup) {
+   MOCK_COMPONENT *c = h;
+   OMX_ERRORTYPE err = OMX_ErrorNone;
+   MOCK_PORT *p, *pp = NULL;
+
+   if (peer != NULL && (pp = findPort(peer, peerPort)) == NULL)
+      return OMX_ErrorBadPortIndex;
+   pthread_mutex_lock(&c->lock);
+   if ((p = findPort(c, port)) == NULL)
+      err = OMX_ErrorBadPortIndex;
+   else if (c->state != OMX_StateLoaded && p->def.bEnabled)
+      err = OMX_ErrorIncorrectStateOperation;
+   else if (pp != NULL && pp->def.eDir == p->def.eDir)
+      err = OMX_ErrorPortsNotCompatible;
+   else {
+      p->peer = peer;
+      p->peerPort = peerPort;
+      if (setup != NULL) {
+         setup->nTunnelFlags = 0;
+         setup->eSupplier = 0;
+      }
+   }
+   pthread_mutex_unlock(&c->lock);
+   return err;
+}
+
+static OMX_ERRORTYPE newBuffer(MOCK_COMPONENT *c, OMX_BUFFERHEADERTYPE **bufp, OMX_U32 port, OMX_PTR appPrivate, OMX_U32 size, OMX_U8 *mem) {
+   OMX_BUFFERHEADERTYPE *buf;
+   OMX_ERRORTYPE err = OMX_ErrorNone;
+   MOCK_PORT *p;
+
+   pthread_mutex_lock(&c->lock);
+   if ((p = findPort(c, port)) == NULL)
+      err = OMX_ErrorBadPortIndex;
+   else if (p->peer != NULL)
+      err = OMX_ErrorIncorrectStateOperation;
+   else if (!(c->state == OMX_StateLoaded && c->target == OMX_StateIdle) && p->cmd != OMX_CommandPortEnable)
+      err = OMX_ErrorIncorrectStateOperation;   /* Only while the port is being populated */
+   else if (p->nBufs == p->def.nBufferCountActual || size < p->def.nBufferSize)
+      err = OMX_ErrorBadParameter;
+   else if ((buf = calloc(1, sizeof(*buf) + (mem == NULL ? size : 0))) == NULL)
+      err = OMX_ErrorInsufficientResources;
+   else {
+      buf->nSize = sizeof(*buf);
+      buf->nVersion = SpecificationVersion;
+      buf->pBuffer = (mem != NULL) ? mem : (OMX_U8 *)(buf + 1);
+      buf->nAllocLen = size;
+      buf->pAppPrivate = appPrivate;
+      buf->pPlatformPrivate = c;
+      if (p->def.eDir == OMX_DirInput)
+         buf->nInputPortIndex = port;
+      else
+         buf->nOutputPortIndex = port;
+      p->nBufs++;
+      kick(c);
+      *bufp = buf;
+   }
+   pthread_mutex_unlock(&c->lock);
+   return err;
+}
+
+static OMX_ERRORTYPE mockUseBuffer(OMX_HANDLETYPE h, OMX_BUFFERHEADERTYPE **buf, OMX_U32 port, OMX_PTR appPrivate, OMX_U32 size, OMX_U8 *mem) {
+   if (buf == NULL || mem == NULL)
+      return OMX_ErrorBadParameter;
+   return newBuffer(h, buf, port, appPrivate, size, mem);
+}
+
+static OMX_ERRORTYPE mockAllocateBuffer(OMX_HANDLETYPE h, OMX_BUFFERHEADERTYPE **buf, OMX_U32 port, OMX_PTR appPrivate, OMX_U32 size) {
+   if (buf == NULL)
+      return OMX_ErrorBadParameter;
+   return newBuffer(h, buf, port, appPrivate, size, NULL);
+}
+
+static OMX_ERRORTYPE mockFreeBuffer(OMX_HANDLETYPE h, OMX_U32 port, OMX_BUFFERHEADERTYPE *buf) {
+   MOCK_COMPONENT *c = h;
+   MOCK_PORT *p;
+
+   if (buf == NULL || buf->pPlatformPrivate != c)
+      return OMX_ErrorBadParameter;
+   pthread_mutex_lock(&c->lock);
+   if ((p = findPort(c, port)) == NULL || p->nBufs == 0) {
+      pthread_mutex_unlock(&c->lock);
+      return OMX_ErrorBadPortIndex;
+   }
+   p->nBufs--;
+   p->def.bPopulated = OMX_FALSE;
+   kick(c);
+   pthread_mutex_unlock(&c->lock);
+   free(buf);
+   return OMX_ErrorNone;
+}
+
+/* Queue a buffer on the port it was allocated on */
+static OMX_ERRORTYPE queueBuffer(MOCK_COMPONENT *c, OMX_BUFFERHEADERTYPE *buf, OMX_U32 port, OMX_DIRTYPE dir) {
+   OMX_ERRORTYPE err = OMX_ErrorNone;
+   MOCK_PORT *p;
+
+   if (buf == NULL || buf->pPlatformPrivate != c)
+      return OMX_ErrorBadParameter;
+   pthread_mutex_lock(&c->lock);
+   if ((p = findPort(c, port)) == NULL || p->def.eDir != dir)
+      err = OMX_ErrorBadPortIndex;
+   else if ((c->state != OMX_StateIdle && c->state != OMX_StateExecuting && c->state != OMX_StatePause)
+    || !p->def.bEnabled || p->heldLen == MOCK_MAXBUFS)
+      err = OMX_ErrorIncorrectStateOperation;
+   else {
+      p->held[(p->heldHead + p->heldLen++) % MOCK_MAXBUFS] = buf;
+      kick(c);
+   }
+   pthread_mutex_unlock(&c->lock);
+   return err;
+}
+
+static OMX_ERRORTYPE mockEmptyThisBuffer(OMX_HANDLETYPE h, OMX_BUFFERHEADERTYPE *buf) {
+   return queueBuffer(h, buf, buf != NULL ? buf->nInputPortIndex : 0, OMX_DirInput);
+}
+
+static OMX_ERRORTYPE mockFillThisBuffer(OMX_HANDLETYPE h, OMX_BUFFERHEADERTYPE *buf) {
+   return queueBuffer(h, buf, buf != NULL ? buf->nOutputPortIndex : 0, OMX_DirOutput);
+}
+
+static OMX_ERRORTYPE mockSetCallbacks(OMX_HANDLETYPE h, OMX_CALLBACKTYPE *callbacks, OMX_PTR appData) {
+   MOCK_COMPONENT *c = h;
+
+   if (callbacks == NULL)
+      return OMX_ErrorBadParameter;
+   pthread_mutex_lock(&c->lock);
+   c->cb = *callbacks;
+   c->appData = appData;
+   pthread_mutex_unlock(&c->lock);
+   return OMX_ErrorNone;
+}
+
+static OMX_ERRORTYPE mockComponentDeInit(OMX_HANDLETYPE h) {
+   MOCK_COMPONENT *c = h;
+   MOCK_PARAM *p;
+
+   pthread_mutex_lock(&c->lock);
+   c->quit = 1;
+   kick(c);
+   pthread_mutex_unlock(&c->lock);
+   pthread_join(c->thread, NULL);
+
+   stalled(c, 0);
+   if (mock.verbose > 0)
+      fprintf(stderr, "INFO: omxmock %s: %lld frames in, %lld out; stalled %lld times for %lld ms\n", c->type->tag,
+         (long long)c->framesIn, (long long)c->framesOut, (long long)c->stalls, (long long)c->stallUs / 1000);
+
+   while ((p = c->params) != NULL) {
+      c->params = p->next;
+      free(p);
+   }
+   pthread_cond_destroy(&c->cond);
+   pthread_mutex_destroy(&c->lock);
+   return OMX_ErrorNone;
+}
+
+static OMX_ERRORTYPE mockUseEGLImage(OMX_HANDLETYPE h, OMX_BUFFERHEADERTYPE **buf, OMX_U32 port, OMX_PTR appPrivate, void *image) {
+   return OMX_ErrorNotImplemented;
+}
+
+static OMX_ERRORTYPE mockComponentRoleEnum(OMX_HANDLETYPE h, OMX_U8 *role, OMX_U32 index) {
+   return OMX_ErrorNoMore;
+}
+
+/* Core entry points: the ones omxtx looks up with dlsym() */
+OMX_ERRORTYPE OMX_Init(void) {
+   if (mock.refs++ > 0)
+      return OMX_ErrorNone;
+   mock.decUs = envInt("OMXMOCK_DEC_US", 0);
+   mock.fxUs = envInt("OMXMOCK_FX_US", 0);
+   mock.encUs = envInt("OMXMOCK_ENC_US", 0);
+   mock.latencyUs = envInt("OMXMOCK_LATENCY_US", 0);
+   mock.cmdUs = envInt("OMXMOCK_CMD_US", 0);
+   mock.detect = envInt("OMXMOCK_DETECT", 2);
+   mock.fps = envInt("OMXMOCK_FPS", 25);
+   mock.interlace = envInt("OMXMOCK_INTERLACE", OMX_InterlaceProgressive);
+   mock.nalBytes = envInt("OMXMOCK_NAL_BYTES", 4096);
+   mock.encBufSize = envInt("OMXMOCK_ENC_BUFSIZE", 65536);
+   mock.gop = envInt("OMXMOCK_GOP", 25);
+   mock.rcGain = envInt("OMXMOCK_RC_GAIN", 0);
+   mock.verbose = envInt("OMXMOCK_VERBOSE", 0);
+
+   if (mock.detect < 1)
+      mock.detect = 1;
+   if (mock.fps < 1)
+      mock.fps = 25;
+   if (mock.gop < 1)
+      mock.gop = 1;
+   if (mock.nalBytes < 8)
+      mock.nalBytes = 8;
+   if (mock.encBufSize < 128)
+      mock.encBufSize = 128;   /* Room for the SPS and PPS */
+   if (mock.verbose > 0)
+      fprintf(stderr, "INFO: omxmock: decode %lld us, fx %lld us, encode %lld us, latency %lld us, commands %lld us\n",
+         (long long)mock.decUs, (long long)mock.fxUs, (long long)mock.encUs, (long long)mock.latencyUs, (long long)mock.cmdUs);
+   return OMX_ErrorNone;
+}
+
+OMX_ERRORTYPE OMX_Deinit(void) {
+   if (mock.refs > 0)
+      mock.refs--;
+   return OMX_ErrorNone;
+}
+
+OMX_ERRORTYPE OMX_GetHandle(OMX_HANDLETYPE *handle, OMX_STRING name, OMX_PTR appData, OMX_CALLBACKTYPE *callbacks) {
+   const MOCK_TYPE *type = NULL;
+   pthread_condattr_t attr;
+   MOCK_COMPONENT *c;
+   int i;
+
+   if (handle == NULL || name == NULL || callbacks == NULL)
+      return OMX_ErrorBadParameter;
+   if (mock.refs == 0)
+      return OMX_ErrorUndefined;   /* OMX_Init() not called */
+   for (i = 0; i < sizeof(mockTypes) / sizeof(mockTypes[0]); i++)
+      if (strcmp(name, mockTypes[i].name) == 0)
+         type = &mockTypes[i];
+   if (type == NULL)
+      return OMX_ErrorComponentNotFound;
+   if ((c = calloc(1, sizeof(*c))) == NULL)
+      return OMX_ErrorInsufficientResources;
+
+   c->type = type;
+   c->cb = *callbacks;
+   c->appData = appData;
+   c->state = c->target = OMX_StateLoaded;
+   initPorts(c);
+
+   c->omx.nSize = sizeof(c->omx);
+   c->omx.nVersion = SpecificationVersion;
+   c->omx.pComponentPrivate = c;
+   c->omx.pApplicationPrivate = appData;
+   c->omx.GetComponentVersion = mockGetComponentVersion;
+   c->omx.SendCommand = mockSendCommand;
+   c->omx.GetParameter = mockGetParameter;
+   c->omx.SetParameter = mockSetParameter;
+   c->omx.GetConfig = mockGetConfig;
+   c->omx.SetConfig = mockSetConfig;
+   c->omx.GetExtensionIndex = mockGetExtensionIndex;
+   c->omx.GetState = mockGetState;
+   c->omx.ComponentTunnelRequest = mockComponentTunnelRequest;
+   c->omx.UseBuffer = mockUseBuffer;
+   c->omx.AllocateBuffer = mockAllocateBuffer;
+   c->omx.FreeBuffer = mockFreeBuffer;
+   c->omx.EmptyThisBuffer = mockEmptyThisBuffer;
+   c->omx.FillThisBuffer = mockFillThisBuffer;
+   c->omx.SetCallbacks = mockSetCallbacks;
+   c->omx.ComponentDeInit = mockComponentDeInit;
+   c->omx.UseEGLImage = mockUseEGLImage;
+   c->omx.ComponentRoleEnum = mockComponentRoleEnum;
+
+   pthread_mutex_init(&c->lock, NULL);
+   pthread_condattr_init(&attr);
+   pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);   /* For the timed waits on nowUs() */
+   pthread_cond_init(&c->cond, &attr);
+   pthread_condattr_destroy(&attr);
+   if (pthread_create(&c->thread, NULL, componentThread, c) != 0) {
+      pthread_cond_destroy(&c->cond);
+      pthread_mutex_destroy(&c->lock);
+      free(c);
+      return OMX_ErrorInsufficientResources;
+   }
+   *handle = &c->omx;
+   return OMX_ErrorNone;
+}
+
+OMX_ERRORTYPE OMX_FreeHandle(OMX_HANDLETYPE handle) {
+   if (handle == NULL)
+      return OMX_ErrorBadParameter;
+   ((OMX_COMPONENTTYPE *)handle)->ComponentDeInit(handle);
+   free(handle);
+   return OMX_ErrorNone;
+}
+
+/* A NULL component on either side just tears down the other's end: omxtx does this
+ * in place of OMX_TeardownTunnel(), which the Pi doesn't have.
+ */
+OMX_ERRORTYPE OMX_SetupTunnel(OMX_HANDLETYPE out, OMX_U32 outPort, OMX_HANDLETYPE in, OMX_U32 inPort) {
+   OMX_TUNNELSETUPTYPE setup;
+   OMX_ERRORTYPE err;
+
+   if (out == NULL && in == NULL)
+      return OMX_ErrorBadParameter;
+   if (out != NULL && (err = ((OMX_COMPONENTTYPE *)out)->ComponentTunnelRequest(out, outPort, in, inPort, &setup)) != OMX_ErrorNone)
+      return err;
+   if (in != NULL && (err = ((OMX_COMPONENTTYPE *)in)->ComponentTunnelRequest(in, inPort, out, outPort, &setup)) != OMX_ErrorNone) {
+      if (out != NULL)
+         ((OMX_COMPONENTTYPE *)out)->ComponentTunnelRequest(out, outPort, NULL, 0, &setup);
+      return err;
+   }
+   return OMX_ErrorNone;
+}
@@ -52,12 +52,17 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 #include <string.h>
-#include "bcm_host.h"
+#include <math.h>
+#include <limits.h>
 #include "libavformat/avformat.h"
 #include "libavutil/avutil.h"
 #include "libavutil/mathematics.h"
+#include "libavutil/pixdesc.h"
+#include "libavutil/opt.h"
 #include "libavformat/avio.h"
+#include "libswscale/swscale.h"
 #include <error.h>
 
 #include "OMX_Video.h"
@@ -75,9 +80,17 @@
 
 #include <time.h>
 #include <errno.h>
+#include <sys/resource.h>
 
 #include <unistd.h>
 #include <signal.h>
+#include <dlfcn.h>
+#include <sys/syscall.h>
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 /* Defined in OMX_Types.h */
 static OMX_VERSIONTYPE SpecificationVersion = {
@@ -90,18 +103,35 @@ static OMX_VERSIONTYPE SpecificationVersion = {
 /* Hateful things: */
 #define MAKEME(y, x)   do { \
             y = calloc(1, sizeof(x)); \
-            y->nSize = sizeof(x); \
-            y->nVersion = SpecificationVersion; \
+            if (y != NULL) { \
+               y->nSize = sizeof(x); \
+               y->nVersion = SpecificationVersion; \
+            } \
+         } while (0)
+
+/* As MAKEME, for a struct on the stack: nothing to free on an early OERR return */
+#define INITME(x)   do { \
+            memset(&(x), 0, sizeof(x)); \
+            (x).nSize = sizeof(x); \
+            (x).nVersion = SpecificationVersion; \
          } while (0)
 
 
+/* Report an OMX error and pass it back to the caller */
 #define OERR(cmd)   do { \
             OMX_ERRORTYPE oerr = cmd; \
             if (oerr != OMX_ErrorNone) { \
                fprintf(stderr, #cmd " failed on line %d: %x\n", __LINE__, oerr); \
-               exit(1); \
+               return oerr; \
             } \
          } while (0)
+
+/* As OERR, but carry on: for teardown, where there is nothing better to do */
+#define OLOG(cmd)   do { \
+            OMX_ERRORTYPE oerr = cmd; \
+            if (oerr != OMX_ErrorNone) \
+               fprintf(stderr, #cmd " failed on line %d: %x\n", __LINE__, oerr); \
+         } while (0)
 /* ... but damn useful.*/
 
 /* Hardware component names: */
@@ -124,6 +154,120 @@ static OMX_VERSIONTYPE SpecificationVersion = {
 #define PORT_ENC 200   /* Video encode */
 #define PORT_SPL 250   /* Video splitter: output on ports 251 - 254 */
 
+/* Metrics (-M): histogram buckets are powers of two from 1us to 2^(METRIC_BUCKETS-2)us
+ * (16.8s), then +Inf. Decoder input times are kept for FRAME_TIMES frames, by tick.
+ */
+#define METRIC_BUCKETS 26
+#define FRAME_TIMES 251
+
+/* Adaptive bitrate (-A): the achieved bitrate is measured over each GOP, but over no less
+ * than ABR_MIN_WINDOW and no more than ABR_MAX_WINDOW seconds of video, and the encoder's
+ * target set to make up any difference from the goal over the next ABR_HORIZON seconds.
+ */
+#define ABR_MIN_WINDOW 1.0
+#define ABR_MAX_WINDOW 10.0
+#define ABR_HORIZON 10.0
+
+/* Target file size (-F): the input is sampled for SCAN_SECONDS at the middle of each of
+ * PLAN_SLOTS equal parts, and a bitrate planned for each part from its complexity. A
+ * TRIAL_SECONDS encode of a typical part measures the encoder's gain first.
+ */
+#define PLAN_SLOTS 32
+#define SCAN_SECONDS 2.0
+#define TRIAL_SECONDS 10.0
+#define MUX_OVERHEAD 0.01     /* Container overhead, as a fraction of the file size */
+
+/* Quality (-Q): GOPs of the output per GOP measured by default, and output frames matched
+ * with the input to find the timestamp offset between them
+ */
+#define QUALITY_GOPS 10
+#define QUALITY_ALIGN_FRAMES 5
+
+/* Renditions (-l): extra outputs from the splitter ports after the encoder's and the monitor's */
+#define MAX_RENDITIONS 3
+
+/* Thumbnails (-k): default width and sprite sheet layout, JPEG quantiser (2 - 31: lower is
+ * better), and resizer output buffers for the OMX backend
+ */
+#define THUMB_WIDTH 160
+#define THUMB_COLUMNS 10
+#define THUMB_ROWS 10
+#define THUMB_QUALITY 4
+#define THUMB_BUFFERS 3
+
+/* Inverse telecine and decimation on OMX (-I, -D): buffers on each end of the link the host filter stage
+ * takes the place of, so that the components carry on while it works on one
+ */
+#define FILTER_BUFFERS 3
+
+/* Auto crop (-c auto): frames sampled across the input, and the mean luma of a row or
+ * column at or below which it is part of a black border
+ */
+#define CROP_SAMPLES 24
+#define CROP_BLACK 24
+
+/* Inverse telecine (-I): frames in a cycle of 3:2 pulldown; how much a field from the
+ * previous or next frame may comb, as a percentage of the frame's own, to be matched in
+ * its place; and the mean luma difference from the frame before, in 1/16ths of a level,
+ * at or below which a frame is the repeat in its cycle
+ */
+#define IVTC_CYCLE 5
+#define IVTC_MATCH 80
+#define IVTC_REPEAT 32
+
+/* Decimation (-D): default threshold, the mean difference of the luma 8x8 block means in
+ * levels at or below which a frame is a repeat of the last one encoded; how many times
+ * that any one block may differ; and the longest time in seconds between frames kept
+ */
+#define DECIMATE_THRESHOLD 1.0
+#define DECIMATE_PEAK 8
+#define DECIMATE_MAX_GAP 5
+
+/* Trace (-T): events kept per thread; the oldest are lost if a thread records more */
+#define TRACE_EVENTS 16384
+
+/* Minimum number of encoder output buffers: around 500k each for dvd, 3.5M for 1080p */
+#define ENC_BUFFERS 3
+
+/* Default timeout in ms waiting for OMX state changes and commands */
+#define OMX_TIMEOUT 5000
+
+/* Demux read ahead defaults */
+#define PREFETCH_PACKETS 256
+#define PREFETCH_BYTES (32*1024*1024)
+#define PREFETCH_MAX_PACKETS 4096   /* Queue slots when the read ahead is limited by size */
+
+/* Segments (-s, -S): seek this far (us) ahead of the segment start, so that an inexact
+ * seek doesn't miss its keyframe; audio is read for up to this long after its video ends */
+#define SEGMENT_MARGIN (2*(int64_t)AV_TIME_BASE)
+
+/* Initial size of the NAL assembly buffers; the pool grows if a NAL doesn't fit */
+#define NAL_BUF_SIZE (1024*1024)
+
+/* Component index, used for the command completion objects */
+enum components {
+   COMP_RSZ,
+   COMP_VID,
+   COMP_DEC,
+   COMP_DEI,
+   COMP_ENC,
+   COMP_SPL,
+   NCOMPONENTS
+};
+
+/* Encoder tuning knobs (-X), see encoderOpts[]: set in context struct field encOpt, -1 if unset */
+enum encoderOpts {
+   XOPT_DEBLOCK,
+   XOPT_INTRAMB,
+   XOPT_HADAMARD,
+   XOPT_LOOPFILTER,
+   XOPT_INTRAREFRESH,
+   XOPT_INITQ,
+   XOPT_PEAKRATE,
+   XOPT_FRAMELIMIT,
+   NXOPTS
+};
+
 /* Process states, set in context struct field state */
 enum states {
    DECINIT,       /* Decoder: initialising */
@@ -134,6 +278,15 @@ enum states {
    DECEOF,        /* End of input file */
    ENCEOS,        /* Encoder: end of stream */
    QUIT,          /* User terminated the process with SIGINT (ctrl-c) */
+   FAILED,        /* OMX error, or the output can't be written: ctx->error is set */
+};
+
+/* Segment encoding: where the input packets are relative to the segment */
+enum segStates {
+   SEG_BEFORE,    /* Waiting for the first video keyframe at or after segStart */
+   SEG_IN,        /* Video of the segment */
+   SEG_AFTER,     /* Video done: reading the audio up to segEnd */
+   SEG_END,       /* Nothing more to read */
 };
 
 /* Double linked list of non-video packets saved during decoder initialisation
@@ -144,11 +297,73 @@ struct packetentry {
    AVPacket *packet;
 };
 TAILQ_HEAD(packetqueue, packetentry);
-static struct packetqueue packetq;
 
+/* Single producer / single consumer ring of OMX buffer headers.
+ * The producer is an OMX buffer callback, the consumer is the thread that
+ * (re)submits the buffers to the component. head is only written by the
+ * producer and tail only by the consumer, so no lock is required.
+ */
 typedef struct {
-   uint8_t *nalBuf;
-   uint32_t nalBufSize; /* 32 bit: maximum buffer size 4GB! */
+   OMX_BUFFERHEADERTYPE **bufs;
+   unsigned int size;                     /* Number of slots: one more than the number of buffers */
+   volatile _Atomic unsigned int head;    /* Next slot to write */
+   volatile _Atomic unsigned int tail;    /* Next slot to read */
+   int64_t *pushed;                       /* Metrics: time (us) each slot was written */
+   int64_t popped;                        /* Metrics: pushed time of the buffer last popped */
+} OMXTX_BUF_RING;
+
+/* Per buffer data for the decoder input buffers, stored in pAppPrivate */
+typedef struct {
+   int64_t sent;         /* Metrics: time (us) of OMX_EmptyThisBuffer() */
+} OMXTX_DEC_BUF;
+
+/* Bounded read ahead queue of demuxed packets.
+ * Filled by demuxThread(), emptied by getNextVideoPacket(). The packets are
+ * preallocated; av_read_frame() reads straight into the slot at head.
+ * readPacket() hands out the packet in the slot at tail and puts a spare in its
+ * place; the feeder gives packets back to the spares with recyclePacket().
+ * The lock and cond are only used to sleep when the queue is full or empty.
+ */
+typedef struct {
+   AVPacket **pkts;
+   AVPacket **spares;                     /* Feeder only: empty packets for the slots, size of them */
+   unsigned int nSpares;
+   int64_t *readTime;                     /* Metrics: time (us) each slot was read */
+   unsigned int size;                     /* Number of slots: one more than the maximum queue depth */
+   volatile _Atomic unsigned int head;    /* Next slot to write */
+   volatile _Atomic unsigned int tail;    /* Next slot to read */
+   int64_t maxBytes;                      /* Read ahead limit in bytes; 0 for no limit */
+   volatile _Atomic int64_t bytes;        /* Bytes currently queued */
+   volatile _Atomic int eof;              /* Set when av_read_frame() fails: end of file or error */
+   volatile _Atomic int stop;             /* Set to ask demuxThread() to finish */
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+   uint64_t reads;                        /* Statistics: packets read by the consumer */
+   uint64_t depthSum;                     /* Sum of queue depth seen at each read */
+   unsigned int maxDepth;
+   uint64_t underruns;                    /* Consumer had to wait for the demuxer */
+   uint64_t stalls;                       /* Demuxer had to wait for space */
+} OMXTX_PKT_QUEUE;
+
+/* Command completion: the component event handler records any error and wakes up
+ * the thread waiting in waitForEvents() or requestStateChange().
+ * events is incremented on every event so that a waiter can tell if it missed one.
+ */
+typedef struct {
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+   volatile _Atomic OMX_ERRORTYPE error;  /* Error reported since the last command was sent */
+   volatile _Atomic unsigned int events;
+} OMXTX_COMPLETION;
+
+/* NAL units are assembled in refcounted buffers from nalPool. A complete NAL
+ * is handed to the muxer with its buffer, which returns to the pool when the
+ * muxer releases the packet, so the data is not copied again.
+ */
+typedef struct {
+   AVBufferPool *nalPool;
+   AVBufferRef *nalBuf; /* Buffer for the NAL being assembled; NULL until data arrives */
+   uint32_t nalBufSize; /* Size of the pool buffers, including padding. 32 bit: maximum buffer size 4GB! */
    off_t nalBufOffset;
    int64_t tick;
    int64_t pts;
@@ -156,7 +371,124 @@ typedef struct {
    AVRational fps;
 } OMXTX_NAL_ENTRY;
 
-static struct context {
+/* Inverse telecine (-I): decoded frames waiting to be field matched, and matched frames
+ * waiting for their cycle to be decimated
+ */
+typedef struct {
+   int enabled;          /* -I, and the frames are 8 bit planar (always on OMX) */
+   AVFrame *in[3];       /* Decoded frames: previous, current and next */
+   int64_t inPts[3];
+   AVFrame *cycle[IVTC_CYCLE];   /* Matched frames */
+   int64_t pts[IVTC_CYCLE];
+   uint64_t diff[IVTC_CYCLE];    /* frameDiff() of each from the matched frame before it */
+   int n;                /* Frames in cycle[] */
+   AVFrame *last;        /* The last matched frame */
+   int64_t lastPts;      /* pts of the last decoded frame: the encoder's lags by a cycle */
+   int64_t frames, fromPrev, fromNext;   /* Decoded frames, and those matched from a field of the previous / next */
+   int64_t cycles, decimated;
+} OMXTX_IVTC;
+
+/* Decimation (-D): the last frame encoded, to find repeats of it */
+typedef struct {
+   int enabled;
+   double threshold;     /* -D: as given, or 0 if repeats aren't dropped */
+   uint8_t *sig[2];      /* Luma 8x8 block means of the last frame encoded, and of this frame */
+   int bw, bh;           /* Size of sig[] in blocks */
+   int have;             /* sig[0] is set */
+   int64_t next;         /* pts the next frame is due at the -D frame rate */
+   int64_t lastPts;      /* pts of the last frame encoded */
+   int64_t seenPts;      /* pts of the last frame, dropped or not: the encoder's may be well behind */
+   AVFrame *held;        /* The last frame dropped since the last encoded: the end of the input if it's the last */
+   int64_t heldPts;
+   int heldRepeat;       /* It was dropped as a repeat, not for the frame rate */
+   int64_t frames, kept, rate, repeats;   /* Frames, those encoded, and those dropped for the frame rate and as repeats */
+} OMXTX_DECIMATE;
+
+/* Inverse telecine and decimation: the host filter stage. The software backend runs it on
+ * the decoded frames ahead of the scaler. On OMX one link of the pipeline isn't tunnelled
+ * (see linkStages()): filterThread() takes the frames from the output buffers of src and
+ * passes those it keeps on in the input buffers of dst.
+ */
+typedef struct {
+   OMXTX_IVTC ivtc;
+   OMXTX_DECIMATE decimate;
+   double frameTime;          /* Duration of a frame into the stage, in the OMX timebase */
+   AVRational fps;            /* OMX: the frame rate out of it, for nalEntry.fps; 0 if it's the same */
+   OMX_HANDLETYPE src, dst;   /* OMX: the ends of the link; NULL if every link is tunnelled */
+   int srcPort, dstPort;
+   uint8_t srcFlag, dstFlag;
+   OMX_BUFFERHEADERTYPE **srcbufs;   /* OMX: NULL terminated arrays of the buffers on each end */
+   OMX_BUFFERHEADERTYPE **dstbufs;
+   OMXTX_BUF_RING filled;     /* srcbufs passed back by frameFilled() */
+   OMXTX_BUF_RING free;       /* dstbufs passed back by frameEmptied() */
+   int width, height;         /* OMX: the frame size, and the layout of the buffers on each end */
+   int srcStride, srcSlice, dstStride, dstSlice;
+} OMXTX_FILTER;
+
+/* Software backend: libavcodec decoder and encoder, both frame threaded, with
+ * swscale for crop, resize and the conversion to 4:2:0. The frames and the scaler
+ * are kept between batch jobs; the codecs are opened for each job.
+ */
+typedef struct {
+   AVCodecContext *dec;
+   AVCodecContext *enc;
+   struct SwsContext *sws;
+   AVFrame *frame;       /* Decoded frame */
+   AVFrame *dei;         /* Deinterlaced frame */
+   AVFrame *scaled;      /* Cropped / resized frame, passed to the encoder */
+   AVPacket *pkt;        /* Encoder output */
+   int scale;            /* Set if frames go through sws */
+   int srcWidth, srcHeight;   /* Size of the input to sws: the crop rectangle, or the frame */
+   int cropLeft, cropTop;
+   int step[4];          /* Bytes per pixel in each plane of the decoded frames, for the crop offset */
+   int64_t frames;       /* Frames passed to the encoder */
+} OMXTX_SW;
+
+/* Rendition (-l): an extra output made from the same decode, at its own size and bitrate */
+typedef struct {
+   int width, height;
+   int bitrate;
+   char *oname;
+} OMXTX_RENDITION;
+
+/* Thumbnails (-k): the options, then the state of the job's thumbnails and sprite sheets */
+typedef struct {
+   int enabled;
+   double interval;      /* Seconds between thumbnails; 0 for one at each input keyframe */
+   int width, height;    /* Thumbnail size; height 0 until set from the picture's aspect */
+   int columns, rows;    /* Thumbnails per sprite sheet */
+   int stride, sliceHeight;   /* OMX: layout of the resizer output buffers */
+   char *prefix;         /* Output name without its extension: NULL if thumbnails aren't being made */
+   char *name;           /* Room for the prefix and a suffix */
+   FILE *vtt;            /* WebVTT index of the sprite sheets */
+   struct SwsContext *sws;
+   AVFrame *frame;       /* Thumbnail, for the JPEG encoder */
+   AVFrame *sheet;       /* Sprite sheet being filled */
+   int count, sheets;    /* Thumbnails and sprite sheets written */
+   int failed;           /* A file couldn't be written: no more are made */
+   int64_t origin;       /* pts (us) of the first frame: the VTT times are from it */
+   int64_t next;         /* pts (us) the next thumbnail is due at */
+   int64_t cueStart;     /* pts (us) of the last thumbnail: its cue ends at the next */
+   int64_t lastPts, frameGap;
+   int64_t lastKey;      /* tick of the keyframe the last thumbnail was taken for */
+   volatile _Atomic int64_t keyTick;   /* tick of the last input keyframe; set by the feeder */
+} OMXTX_THUMBS;
+
+struct context;
+
+/* A transcode backend: the OMX components on the VideoCore, or libavcodec on the host */
+typedef struct {
+   const char *name;
+   int (*transcode)(struct context *ctx);   /* Input to output, once runJob() has opened them: returns as runJob() */
+   OMX_ERRORTYPE (*park)(struct context *ctx);  /* Batch mode: ready the pipeline for the next job; may be NULL */
+   void (*release)(struct context *ctx);    /* Free everything the backend holds for the pipeline */
+} OMXTX_BACKEND;
+
+/* A transcode pipeline: the OMX components with their buffers, threads and
+ * state. Several pipelines can run at once, sharing the OMX core; nothing in
+ * here is global, and OMX errors are returned rather than ending the process.
+ */
+struct context {
    AVFormatContext *ic;    /* Input context for demuxer */
    AVFormatContext *oc;    /* Output context for muxer */
    OMXTX_NAL_ENTRY nalEntry;  /* Store for NAL header info */
@@ -166,19 +498,102 @@ static struct context {
    volatile _Atomic uint64_t curSize;
    volatile _Atomic uint64_t framesOut;
    volatile _Atomic uint64_t ptsDelta; /* Time difference in ms between output pts and omx tick */
+   int64_t firstOutPts;                /* Least and greatest pts of the frames written: see outputTime() */
+   volatile _Atomic int64_t lastOutPts;
    volatile _Atomic uint8_t componentFlags;
-   volatile _Atomic int encBufferFilled;
+   OMXTX_COMPLETION completion[NCOMPONENTS];
+   int   omxTimeout;             /* Timeout in ms for OMX state changes and commands */
+   int64_t startTime;            /* Time (us) pipeline set up started */
+   int64_t firstFrameTime;       /* Time (us) first encoded frame was written */
+   int64_t initTime;             /* Time (us) to get the component handles */
+   int64_t setupTime;            /* Time (us) this job spent setting up and parking the components */
+   time_t runStart;              /* Time the encoder started, for the frame rate in the job summary */
+   const OMXTX_BACKEND *backend; /* Set in main(): NULL on the command line for the default */
+   OMXTX_SW sw;                  /* Software backend state */
+   const char *jobFile;          /* Batch mode: file with one job per line; NULL for a single file */
+   int   workers;                /* Batch mode: number of pipelines running jobs at once */
+   int   jobs;                   /* Number of jobs started on this pipeline */
+   int64_t segStart;             /* Segment to encode (-s): us from the start of the input, */
+   int64_t segEnd;               /*   AV_NOPTS_VALUE for the start / end of the file */
+   int   segState;               /* Where the input is relative to the segment: see segmentFilter() */
+   int   segments;               /* -S: number of segments to split the input into; 0 for none */
+   int   join;                   /* -C: iname is a list of segments to join into oname */
+   double segmentTime;           /* Segmented output (-H): seconds per segment; 0 for one output file */
+   int   playlistSize;           /* -H: segments kept in the playlist; 0 for all */
+   int64_t nextIdr;              /* -H: pts (us) at which the next segment starts: see segmentIdrDue() */
+   int   liveLatency;            /* Live mode (-L): target end to end latency in ms; 0 if not live */
+   int   livePaced;              /* Live: the input is a regular file, read at the rate it would be captured */
+   int64_t paceStart;            /* Live: wall clock time (us) of input video time 0 for a paced input */
+   volatile _Atomic int64_t clockOffset;  /* Live: least wall clock (us) - input video time seen; see liveInput() */
+   volatile _Atomic int64_t latencyLast;  /* Live: glass to output latency (us) of the last frame written */
+   int64_t latencySum, latencyMax;
+   uint64_t latencyFrames;
+   uint64_t liveDropped;         /* Live: video packets dropped to get back within liveLatency */
+   int   liveCatchUp;            /* Live: dropping video up to a keyframe that is in time */
+   int   adaptive;               /* -A: retune the encoder during the job so the output meets bitrate */
+   int   abrRate;                /* -A: bitrate the encoder is set to now */
+   double abrGain;               /* -A: achieved / set bitrate of the encoder, smoothed over the windows */
+   uint64_t abrBytes;            /* -A: curSize and outputTime() at the start of the window */
+   double abrTime;
+   int   abrChanges, abrMin, abrMax;
+   int64_t targetSize;           /* -F: output file size in bytes; 0 for none */
+   int64_t planSlot;             /* -F: us of input per planRate[] entry; 0 if there is no plan */
+   int   planRate[PLAN_SLOTS];   /* -F: video bitrate planned for each part of the input */
+   double trialGain;             /* -F: achieved / set bitrate in the trial encode; 0 if none */
+   int   ivtc;                   /* -I: inverse telecine */
+   int   decimate;               /* -D: drop frames over a frame rate, and repeated frames */
+   double decimateFps;           /* -D: the frame rate; 0 for no limit */
+   double decimateThreshold;     /* -D: see decimateDrop(); 0 to keep repeated frames */
+   OMXTX_FILTER filter;          /* -I, -D: the state of the job's filter stage */
+   int   qualityGops;            /* -Q: measure the quality of one output GOP in this many; 0 for none */
+   int   nRenditions;            /* -l: number of extra outputs; 0 for none */
+   OMXTX_RENDITION renditionOpts[MAX_RENDITIONS];   /* -l: as given on the command line */
+   struct context *renditions[MAX_RENDITIONS];      /* -l: a pipeline for each, with its own resizer and encoder */
+   struct context *parent;       /* Rendition: the pipeline that decodes the input for it; NULL otherwise */
+   int   splPort;                /* Rendition, thumbnailer: the splitter output port it is fed from */
+   OMXTX_THUMBS thumbs;          /* -k: made by the thumbnailer's thread on OMX, by the feeder on sw */
+   struct context *thumbnailer;  /* -k, OMX: a pipeline for the resizer on a splitter output that makes the
+                                  * thumbnails. Its encbufs and encFilled hold the resizer output buffers */
+   int   autoCrop;               /* -c auto: cropRect is found for each job by detectCrop(), and owned by the pipeline */
+   struct context *nextPipeline; /* Metrics: list of pipelines, for the queue depths */
+   int64_t nalStart;             /* Metrics: time (us) the first buffer of the NAL being assembled arrived */
+   int64_t lastFilled;           /* Metrics: time (us) of the last filled() callback */
+   struct {
+      volatile _Atomic int64_t tick;
+      int64_t time;
+   } frameTimes[FRAME_TIMES];    /* Metrics: time (us) each frame was passed to the decoder, by OMX tick */
+   uint16_t baseFlags;           /* userFlags from the command line: each job starts with these */
+   volatile _Atomic OMX_ERRORTYPE error;   /* First error that stopped the job; see pipelineFailed() */
+   volatile _Atomic int outputOpen;  /* Set once the output file header has been written */
    volatile _Atomic enum states state;
-   OMX_BUFFERHEADERTYPE *encbufs;
-   OMX_BUFFERHEADERTYPE *decbufs;
-   volatile uint64_t encWaitTime;
+   OMX_BUFFERHEADERTYPE **encbufs;  /* NULL terminated arrays of allocated buffers */
+   OMX_BUFFERHEADERTYPE **decbufs;
+   OMXTX_DEC_BUF *decBufInfo;    /* Per buffer data for decbufs */
+   OMX_VIDEO_PORTDEFINITIONTYPE decFormat;   /* Format decbufs were allocated for: kept between batch jobs if unchanged */
+   OMX_VIDEO_PORTDEFINITIONTYPE encFormat;   /* Format encbufs were allocated for: kept between batch jobs if unchanged */
+   int decNaluFormat;            /* naluInputFormat the decoder was set up with */
+   OMXTX_BUF_RING decFree;  /* Decoder input buffers returned by emptied() */
+   volatile _Atomic int decWaiting;   /* The feeder is asleep in getSpareDecBuffer(): emptied() must wake it */
+   OMXTX_BUF_RING encFilled;   /* Encoder output buffers passed back by filled() */
+   OMXTX_PKT_QUEUE readq;      /* Packets read ahead by the demux thread */
+   pthread_t demuxThread;
+   int   prefetchPackets;      /* Read ahead limit: packets */
+   int64_t prefetchBytes;      /* Read ahead limit: bytes; 0 for no limit */
+   volatile uint64_t encWaitTime;   /* Time in us the drain thread spent waiting for the encoder */
    int      inVidStreamIdx;
    int      inAudioStreamIdx; /* <0 if there is no audio stream */
    int      userAudioStreamIdx;
    int64_t  audioPTS;      /* Input PTS */
    int64_t  videoPTS;      /* Input PTS */
    OMX_HANDLETYPE   dec, enc, rsz, dei, spl, vid;
-   pthread_mutex_t decBufLock;
+   pthread_mutex_t bufLock; /* Used with bufCond to wait for buffer callbacks */
+   pthread_cond_t bufCond;  /* Signalled when a decoder buffer is emptied */
+   pthread_mutex_t encLock; /* Used with encCond to wait for encoder output */
+   pthread_cond_t encCond;  /* Signalled when an encoder buffer is filled */
+   pthread_mutex_t muxLock; /* Serialises writes to the output context from the feeder and drain threads */
+   pthread_mutex_t filterLock; /* Used with filterCond by filterThread() (-I, -D on OMX) */
+   pthread_cond_t filterCond;  /* Signalled when a frame comes to the host, or an input buffer of the next stage is free */
+   struct packetqueue packetq; /* Audio packets saved until the output file is opened */
    AVBitStreamFilterContext *bsfc;
    int   bitrate;
    double omxFPS;          /* Output frame rate */
@@ -197,7 +612,8 @@ static struct context {
    int controlRateType;    /* Set OMX_VIDEO_CONTROLRATETYPE: only constant quantizer (CQ - OMX_Video_ControlRateDisable) and VBR (OMX_Video_ControlRateVariable - default) supported */
    int qI;                 /* Set quantisation for CQ mode I frames */
    int qP;                 /* Set quantisation for CQ mode P frames */
-} ctx;
+   int encOpt[NXOPTS];     /* -X: encoder tuning knobs; -1 for the firmware default */
+};
 
 /* Command line option flags */
 #define UFLAGS_VERBOSE       (uint16_t)(1U<<0)
@@ -211,34 +627,302 @@ static struct context {
 #define UFLAGS_AUTO_SCALE_Y  (uint16_t)(1U<<8)
 #define UFLAGS_MAKE_UP_PTS  (uint16_t)(1U<<9)
 
-/* Component flags */
-#define CFLAGS_RSZ       (uint8_t)(1U<<0)
-#define CFLAGS_VID       (uint8_t)(1U<<1)
-#define CFLAGS_DEC       (uint8_t)(1U<<2)
-#define CFLAGS_DEI       (uint8_t)(1U<<3)
-#define CFLAGS_ENC       (uint8_t)(1U<<4)
-#define CFLAGS_SPL       (uint8_t)(1U<<5)
+/* Component flags: bit number is the component index */
+#define CFLAGS_RSZ       (uint8_t)(1U<<COMP_RSZ)
+#define CFLAGS_VID       (uint8_t)(1U<<COMP_VID)
+#define CFLAGS_DEC       (uint8_t)(1U<<COMP_DEC)
+#define CFLAGS_DEI       (uint8_t)(1U<<COMP_DEI)
+#define CFLAGS_ENC       (uint8_t)(1U<<COMP_ENC)
+#define CFLAGS_SPL       (uint8_t)(1U<<COMP_SPL)
 
-static OMX_BUFFERHEADERTYPE *allocbufs(OMX_HANDLETYPE h, int port);
-static void requestStateChange(OMX_HANDLETYPE handle, enum OMX_STATETYPE rState, int wait);
+/* Encoder tuning knobs for -X name=value, in enum encoderOpts order. The notes are from
+ * test encodes; sw is set for the knobs the software backend has an equivalent for.
+ */
+static const struct {
+   const char *name;
+   int min, max;
+   int rate;            /* Value is bits or bits/second: k and M are allowed */
+   int sw;
+   const char *help;
+} encoderOptions[NXOPTS] = {
+   { "deblock",      0, 2,       0, 0, "Deblocking filter strength (DeblockIDC): 2 is the most smoothed" },
+   { "intramb",      0, 7,       0, 0, "Intra macroblock mode: no visible difference on test encodes" },
+   { "hadamard",     0, 1,       0, 0, "Hadamard transform in the motion search (firmware default: 0)" },
+   { "loopfilter",   0, 1,       0, 1, "H.264 in-loop deblocking filter (firmware default: 1)" },
+   { "intrarefresh", 0, 8160,    0, 1, "Cyclic intra refresh: macroblocks refreshed per frame; 0 for off" },
+   { "initq",        1, 51,      0, 0, "Quantiser rate control starts from. VBR only" },
+   { "peakrate",     1, INT_MAX, 1, 1, "Peak bitrate: no less than -b. VBR only" },
+   { "framelimit",   1, INT_MAX, 1, 0, "Frames of more than this many bits are discarded by the encoder. VBR only" },
+};
+
+static OMX_BUFFERHEADERTYPE **allocbufs(struct context *ctx, OMX_HANDLETYPE h, int port);
+static int rawOutput(const char *formatName, const char *oname);
+static void setRawOutput(struct context *ctx);
+static struct context *newRendition(const struct context *opts, struct context *parent, int n);
+static struct context *newThumbnailer(const struct context *opts, struct context *parent);
+static int thumbHeight(struct context *ctx, int w, int h);
+static void freePipeline(struct context *ctx);
+static void pipelineFailed(struct context *ctx, OMX_ERRORTYPE err);
+static OMX_ERRORTYPE requestStateChange(struct context *ctx, OMX_HANDLETYPE handle, enum OMX_STATETYPE rState, int wait);
 static const char *mapComponent(struct context *ctx, OMX_HANDLETYPE handle);
+static void *filterThread(void *arg);
+static void frameWritten(struct context *ctx, int64_t pts);
+static double outputTime(struct context *ctx);
+
+/* A batch job: the segment is as for -s */
+typedef struct {
+   char *iname;
+   char *oname;
+   int64_t segStart, segEnd;
+} OMXTX_JOB;
+
+/* Batch mode: the job file, or the segments of -S, shared by the worker threads, each with a pipeline of its own */
+static struct {
+   pthread_mutex_t lock;   /* Held to read the next job and to update the counts */
+   OMXTX_JOB *segs;        /* -S: the segment jobs, in place of a job file */
+   int nSegs, nextSeg;
+   FILE *fp;
+   int fifo;               /* Job file is a FIFO: open it again at end of file */
+   char *line;
+   size_t len;
+   int workers;
+   pthread_t reader;       /* The worker reading the job file, while reading is set */
+   volatile _Atomic int reading;
+   int jobs, failed;
+   int firsts, later;      /* Jobs run on a new pipeline, and on one set up by an earlier job */
+   int64_t firstOverhead, laterOverhead;
+} batch;
+
+/* Metrics (-M): latency histograms updated lock free by every pipeline, and queue depth
+ * gauges read from the pipelines. metricsThread() writes them out as JSON or in the
+ * Prometheus text format every interval seconds, and at exit.
+ */
+enum metricHists {
+   HIST_DEMUXQ,      /* Packet in the read ahead queue */
+   HIST_DECWAIT,     /* Feeder waiting for a free decoder input buffer */
+   HIST_DECBUF,      /* OMX_EmptyThisBuffer() to emptied() */
+   HIST_FRAME,       /* Decoder input to encoder output */
+   HIST_ENCINT,      /* Between encoder output buffers */
+   HIST_DRAINQ,      /* filled() to the drain thread */
+   HIST_NAL,         /* NAL assembly */
+   HIST_MUX,         /* Muxer write */
+   NHISTS
+};
+
+static const struct {
+   const char *name;
+   const char *help;
+} histInfo[NHISTS] = {
+   { "demux_queue_seconds", "Time a packet waited in the read ahead queue" },
+   { "dec_buffer_wait_seconds", "Time the feeder waited for a free decoder input buffer" },
+   { "dec_buffer_seconds", "Time from OMX_EmptyThisBuffer() to emptied() for a decoder input buffer" },
+   { "frame_seconds", "Time from decoder input to encoder output for a frame" },
+   { "enc_interval_seconds", "Time between encoder output buffers" },
+   { "drain_queue_seconds", "Time from filled() until the drain thread took the buffer" },
+   { "nal_seconds", "Time to assemble a NAL from encoder output buffers" },
+   { "mux_write_seconds", "Time to write a packet to the muxer" },
+};
+
+typedef struct {
+   volatile _Atomic uint64_t bucket[METRIC_BUCKETS];
+   volatile _Atomic uint64_t sum;     /* us */
+   volatile _Atomic uint64_t max;     /* us */
+} OMXTX_HISTOGRAM;
+
+static struct {
+   int enabled;
+   const char *file;
+   int json;               /* JSON, or the Prometheus text format */
+   int interval;           /* Seconds */
+   pthread_t thread;
+   volatile _Atomic int stop;
+   pthread_mutex_t lock;   /* Held to change or read the list of pipelines */
+   struct context *pipelines;
+   OMXTX_HISTOGRAM hist[NHISTS];
+   volatile _Atomic uint64_t framesIn, framesOut, bytesOut;
+} metrics = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* Trace (-T): each thread records events in its own ring, without locking, and the rings
+ * are written out at exit as Chrome trace event JSON (chrome://tracing, ui.perfetto.dev).
+ */
+typedef struct {
+   int64_t ts, dur;        /* us from the start of the trace; dur for 'X' events */
+   const char *name;
+   const char *cat;
+   const char *comp;       /* Component, or NULL */
+   const void *id;         /* Buffer, for the async 'b' and 'e' events */
+   const char *argName;    /* NULL if there is no argument */
+   int64_t arg;
+   char ph;                /* Event phase: 'i' instant, 'X' complete, 'b' / 'e' async */
+} OMXTX_TRACE_EVENT;
+
+typedef struct traceRing {
+   struct traceRing *next;
+   pid_t tid;
+   const char *threadName;
+   uint64_t n;             /* Events recorded: the ring holds the last TRACE_EVENTS */
+   OMXTX_TRACE_EVENT ev[TRACE_EVENTS];
+} OMXTX_TRACE_RING;
+
+static struct {
+   int enabled;
+   const char *file;
+   int64_t start;
+   pthread_mutex_t lock;   /* Held to add a ring */
+   OMXTX_TRACE_RING *rings;
+} trace = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static __thread OMXTX_TRACE_RING *traceRing;   /* This thread's ring */
+
+static volatile _Atomic int interrupted;  /* Set by ctrl-c: finish the running jobs and stop */
+static pthread_once_t omxOnce = PTHREAD_ONCE_INIT;
+static OMX_ERRORTYPE omxInitError = OMX_ErrorUndefined;  /* Until OMX_Init() has been called */
+static int64_t omxInitTime;               /* Time (us) for bcm_host_init() and OMX_Init() */
+
+/* The IL core is loaded at run time by loadILCore(), so that omxtx runs without the
+ * VideoCore libraries, on the software backend. These are the only functions of the
+ * core: the other OMX_ calls are macros that call through the component handle.
+ */
+static struct {
+   void *lib;
+   void (*hostInit)(void);    /* bcm_host_init(): NULL if the core doesn't need it */
+   OMX_ERRORTYPE (*init)(void);
+   OMX_ERRORTYPE (*deinit)(void);
+   OMX_ERRORTYPE (*getHandle)(OMX_HANDLETYPE *handle, OMX_STRING name, OMX_PTR appData, OMX_CALLBACKTYPE *callbacks);
+   OMX_ERRORTYPE (*freeHandle)(OMX_HANDLETYPE handle);
+   OMX_ERRORTYPE (*setupTunnel)(OMX_HANDLETYPE out, OMX_U32 outPort, OMX_HANDLETYPE in, OMX_U32 inPort);
+} ilCore;
+
+static const OMXTX_BACKEND omxBackend, swBackend;
+
+/* Monotonic time in micro seconds */
+static int64_t timeUs(void) {
+   struct timespec t;
+
+   clock_gettime(CLOCK_MONOTONIC, &t);
+   return (int64_t)t.tv_sec*1000000LL + t.tv_nsec/1000;
+}
+
+/* Metrics: add a time in us to histogram h */
+static void metricObserve(int h, int64_t us) {
+   OMXTX_HISTOGRAM *m = &metrics.hist[h];
+   uint64_t max;
+   int b;
+
+   if (us < 0)
+      us = 0;
+   for (b = 0; b < METRIC_BUCKETS-1 && us > (1LL<<b); b++);
+   atomic_fetch_add_explicit(&m->bucket[b], 1, memory_order_relaxed);
+   atomic_fetch_add_explicit(&m->sum, us, memory_order_relaxed);
+   max = atomic_load_explicit(&m->max, memory_order_relaxed);
+   while ((uint64_t)us > max && !atomic_compare_exchange_weak_explicit(&m->max, &max, us, memory_order_relaxed, memory_order_relaxed));
+}
+
+/* Metrics: add the time since t0 to histogram h. Returns now. */
+static int64_t metricSince(int h, int64_t t0) {
+   int64_t now = timeUs();
+
+   metricObserve(h, now - t0);
+   return now;
+}
+
+/* Metrics: a frame with OMX tick t has been passed to the decoder, or has come out of the encoder */
+static void metricFrameIn(struct context *ctx, int64_t t) {
+   int slot = (uint64_t)t % FRAME_TIMES;
+
+   ctx->frameTimes[slot].time = timeUs();
+   atomic_store_explicit(&ctx->frameTimes[slot].tick, t, memory_order_release);
+}
+
+static void metricFrameOut(struct context *ctx, int64_t t) {
+   int slot = (uint64_t)t % FRAME_TIMES;
+
+   if (atomic_load_explicit(&ctx->frameTimes[slot].tick, memory_order_acquire) == t) {
+      metricSince(HIST_FRAME, ctx->frameTimes[slot].time);
+      ctx->frameTimes[slot].tick = AV_NOPTS_VALUE;   /* Count it once */
+   }
+}
+
+/* Trace: this thread's ring, made on first use */
+static OMXTX_TRACE_RING *traceGetRing(void) {
+   OMXTX_TRACE_RING *r = traceRing;
+
+   if (r == NULL) {
+      if ((r = calloc(1, sizeof(OMXTX_TRACE_RING))) == NULL)
+         return NULL;
+      r->tid = syscall(SYS_gettid);
+      pthread_mutex_lock(&trace.lock);
+      r->next = trace.rings;
+      trace.rings = r;
+      pthread_mutex_unlock(&trace.lock);
+      traceRing = r;
+   }
+   return r;
+}
+
+static void traceEvent(char ph, const char *cat, const char *name, const char *comp, const void *id, int64_t t0, const char *argName, int64_t arg) {
+   OMXTX_TRACE_RING *r = traceGetRing();
+   OMXTX_TRACE_EVENT *e;
+   int64_t now = timeUs();
+
+   if (r == NULL)
+      return;
+   e = &r->ev[r->n % TRACE_EVENTS];
+   e->ph = ph;
+   e->cat = cat;
+   e->name = name;
+   e->comp = comp;
+   e->id = id;
+   e->ts = (ph == 'X' ? t0 : now) - trace.start;
+   e->dur = ph == 'X' ? now - t0 : 0;
+   e->argName = argName;
+   e->arg = arg;
+   r->n++;
+}
+
+/* Trace: name the calling thread in the viewer */
+static void traceThread(const char *name) {
+   if (trace.enabled && traceGetRing() != NULL)
+      traceRing->threadName = name;
+}
+
+/* Trace: an instant event, e.g. a command sent */
+static void traceInstant(const char *name, const char *comp, const char *argName, int64_t arg) {
+   if (trace.enabled)
+      traceEvent('i', "omx", name, comp, NULL, 0, argName, arg);
+}
+
+/* Trace: something that took from t0 until now, e.g. a wait */
+static void traceSpan(const char *cat, const char *name, const char *comp, int64_t t0, const char *argName, int64_t arg) {
+   if (trace.enabled)
+      traceEvent('X', cat, name, comp, NULL, t0, argName, arg);
+}
+
+/* Trace: a buffer passed to a component ('b') and returned by it ('e') */
+static void traceBuffer(char ph, const char *name, const void *buf, int64_t bytes) {
+   if (trace.enabled)
+      traceEvent(ph, "buffer", name, NULL, buf, 0, "bytes", bytes);
+}
 
 /* Print some useful information about the state of the port: */
-static void dumpport(OMX_HANDLETYPE handle, int port) {
-   OMX_PARAM_PORTDEFINITIONTYPE   *portdef;
-   MAKEME(portdef, OMX_PARAM_PORTDEFINITIONTYPE);
-   portdef->nPortIndex = port;
-   OERR(OMX_GetParameter(handle, OMX_IndexParamPortDefinition, portdef));
-   fprintf(stderr, "%s port %d is %s, %s\n", mapComponent(&ctx, handle), portdef->nPortIndex,
-      (portdef->eDir == 0 ? "input" : "output"),
-      (portdef->bEnabled == 0 ? "disabled" : "enabled"));
+static void dumpport(struct context *ctx, OMX_HANDLETYPE handle, int port) {
+   OMX_PARAM_PORTDEFINITIONTYPE   portdef;
+   INITME(portdef);
+   portdef.nPortIndex = port;
+   if (OMX_GetParameter(handle, OMX_IndexParamPortDefinition, &portdef) != OMX_ErrorNone) {
+      fprintf(stderr, "%s port %d: can't get the port definition\n", mapComponent(ctx, handle), port);
+      return;
+   }
+   fprintf(stderr, "%s port %d is %s, %s\n", mapComponent(ctx, handle), portdef.nPortIndex,
+      (portdef.eDir == 0 ? "input" : "output"),
+      (portdef.bEnabled == 0 ? "disabled" : "enabled"));
    fprintf(stderr, "Wants %d bufs, needs %d, size %d, enabled: %d, pop: %d, aligned %d\n",
-      portdef->nBufferCountActual,
-      portdef->nBufferCountMin, portdef->nBufferSize,
-      portdef->bEnabled, portdef->bPopulated,
-      portdef->nBufferAlignment);
+      portdef.nBufferCountActual,
+      portdef.nBufferCountMin, portdef.nBufferSize,
+      portdef.bEnabled, portdef.bPopulated,
+      portdef.nBufferAlignment);
 
-   switch (portdef->eDomain) {
+   switch (portdef.eDomain) {
    case OMX_PortDomainVideo:
       fprintf(stderr, "Video type is currently:\n"
          "\tMIME:\t\t%s\n"
@@ -252,19 +936,19 @@ static void dumpport(OMX_HANDLETYPE handle, int port) {
          "\tError hiding:\t%d\n"
          "\tCodec:\t\t%d\n"
          "\tColour:\t\t%d\n",
-         portdef->format.video.cMIMEType,
-         portdef->format.video.pNativeRender,
-         portdef->format.video.nFrameWidth,
-         portdef->format.video.nFrameHeight,
-         portdef->format.video.nStride,
-         portdef->format.video.nSliceHeight,
-         portdef->format.video.nBitrate,
-         portdef->format.video.xFramerate,
-         portdef->format.video.xFramerate,
-         ((float)portdef->format.video.xFramerate/(float)(1<<16)), /* Q16 format */
-         portdef->format.video.bFlagErrorConcealment,
-         portdef->format.video.eCompressionFormat,
-         portdef->format.video.eColorFormat);
+         portdef.format.video.cMIMEType,
+         portdef.format.video.pNativeRender,
+         portdef.format.video.nFrameWidth,
+         portdef.format.video.nFrameHeight,
+         portdef.format.video.nStride,
+         portdef.format.video.nSliceHeight,
+         portdef.format.video.nBitrate,
+         portdef.format.video.xFramerate,
+         portdef.format.video.xFramerate,
+         ((float)portdef.format.video.xFramerate/(float)(1<<16)), /* Q16 format */
+         portdef.format.video.bFlagErrorConcealment,
+         portdef.format.video.eCompressionFormat,
+         portdef.format.video.eColorFormat);
       break;
    case OMX_PortDomainImage:
       fprintf(stderr, "Image type is currently:\n"
@@ -277,22 +961,21 @@ static void dumpport(OMX_HANDLETYPE handle, int port) {
          "\tError hiding:\t%d\n"
          "\tCodec:\t\t%d\n"
          "\tColour:\t\t%d\n",
-         portdef->format.image.cMIMEType,
-         portdef->format.image.pNativeRender,
-         portdef->format.image.nFrameWidth,
-         portdef->format.image.nFrameHeight,
-         portdef->format.image.nStride,
-         portdef->format.image.nSliceHeight,
-         portdef->format.image.bFlagErrorConcealment,
-         portdef->format.image.eCompressionFormat,
-         portdef->format.image.eColorFormat);
+         portdef.format.image.cMIMEType,
+         portdef.format.image.pNativeRender,
+         portdef.format.image.nFrameWidth,
+         portdef.format.image.nFrameHeight,
+         portdef.format.image.nStride,
+         portdef.format.image.nSliceHeight,
+         portdef.format.image.bFlagErrorConcealment,
+         portdef.format.image.eCompressionFormat,
+         portdef.format.image.eColorFormat);
       break;
 /* Feel free to add others. */
    default:
       fprintf(stderr,"This port is not defined in this program!\n");
       break;
    }
-   free(portdef);
 }
 
 /* OMX_FreeBuffer to be called:
@@ -301,20 +984,42 @@ static void dumpport(OMX_HANDLETYPE handle, int port) {
  * during the stopping of the component)
  * i.e. request loaded state, but don't wait for the transition.
  */
-static void freeBuffers(OMX_HANDLETYPE h, int port, OMX_BUFFERHEADERTYPE *omxBufs) {
+static void freeBuffers(struct context *ctx, OMX_HANDLETYPE h, int port, OMX_BUFFERHEADERTYPE **omxBufs) {
    int i;
-   OMX_BUFFERHEADERTYPE *buf;
-   OMX_PARAM_PORTDEFINITIONTYPE *portdef;
 
-   MAKEME(portdef, OMX_PARAM_PORTDEFINITIONTYPE);
-   portdef->nPortIndex = port;
-   OERR(OMX_GetParameter(h, OMX_IndexParamPortDefinition, portdef));
-   buf=omxBufs;
-   for (i = 0; i < portdef->nBufferCountActual; i++) {
-      OERR(OMX_FreeBuffer(h, port, buf));
-      buf = buf->pAppPrivate;
+   if (omxBufs == NULL)
+      return;
+   for (i = 0; omxBufs[i] != NULL; i++)
+      OLOG(OMX_FreeBuffer(h, port, omxBufs[i]));
+   free(omxBufs);
+}
+
+/* The components of a pipeline in pipeline order, each with the context that owns it:
+ * the renditions' (-l) and the thumbnailer's (-k) come after the pipeline's own. Handles
+ * that were never obtained are NULL. Returns the number of components.
+ */
+static int pipelineComponents(struct context *ctx, struct context **owner, OMX_HANDLETYPE *comps) {
+   OMX_HANDLETYPE own[] = { ctx->dec, ctx->dei, ctx->rsz, ctx->spl, ctx->vid, ctx->enc };
+   struct context *r;
+   int i, n;
+
+   for (n = 0; n < NCOMPONENTS; n++) {
+      owner[n] = ctx;
+      comps[n] = own[n];
+   }
+   for (i = 0; i < ctx->nRenditions; i++) {
+      if ((r = ctx->renditions[i]) == NULL)
+         continue;
+      owner[n] = r;
+      comps[n++] = r->rsz;
+      owner[n] = r;
+      comps[n++] = r->enc;
    }
-   free(portdef);
+   if ((r = ctx->thumbnailer) != NULL) {
+      owner[n] = r;
+      comps[n++] = r->rsz;
+   }
+   return n;
 }
 
 /* Free all buffers:
@@ -324,76 +1029,75 @@ static void freeBuffers(OMX_HANDLETYPE h, int port, OMX_BUFFERHEADERTYPE *omxBuf
  * (tunnelled components will free buffers automatically on request for state loaded)
  * Wait for the transition to loaded for each component
  * Free handles
- * Call OMX_Deinit()
+ * A state change that fails or times out is reported, but the teardown carries on.
+ * Components are taken in pipeline order, whatever the options: in batch mode any
+ * of them may have been used by an earlier job, and be parked in Idle. Handles
+ * that were never obtained are NULL and skipped. The renditions' components (-l) are
+ * taken with the pipeline's, as is the thumbnailer's resizer (-k): they are tunnelled from
+ * its splitter. OMX_Deinit() is left to main(): other pipelines may still be running.
  */
 static void cleanup(struct context *ctx) {
-
-   requestStateChange(ctx->dec, OMX_StateIdle, 1);
-   if (ctx->userFlags & UFLAGS_DEINTERLACE)
-      requestStateChange(ctx->dei, OMX_StateIdle, 1);
-   if (ctx->userFlags & UFLAGS_RESIZE || ctx->userFlags & UFLAGS_CROP)
-      requestStateChange(ctx->rsz, OMX_StateIdle, 1);
-   if (ctx->userFlags & UFLAGS_MONITOR) {
-      requestStateChange(ctx->spl, OMX_StateIdle, 1);
-      requestStateChange(ctx->vid, OMX_StateIdle, 1);
+   struct context *owner[NCOMPONENTS + 2*MAX_RENDITIONS + 1];
+   OMX_HANDLETYPE comps[NCOMPONENTS + 2*MAX_RENDITIONS + 1];
+   enum OMX_STATETYPE state;
+   struct context *r;
+   int i, n;
+
+   n = pipelineComponents(ctx, owner, comps);
+   for (i = 0; i < n; i++) {
+      if (comps[i] == NULL)
+         continue;
+      OMX_GetState(comps[i], &state);
+      if (state == OMX_StateExecuting || state == OMX_StatePause)
+         requestStateChange(owner[i], comps[i], OMX_StateIdle, 1);
    }
-   requestStateChange(ctx->enc, OMX_StateIdle, 1);
 
-   requestStateChange(ctx->dec, OMX_StateLoaded, 0);
-   if (ctx->userFlags & UFLAGS_DEINTERLACE)
-      requestStateChange(ctx->dei, OMX_StateLoaded, 0);
-   if (ctx->userFlags & UFLAGS_RESIZE || ctx->userFlags & UFLAGS_CROP)
-      requestStateChange(ctx->rsz, OMX_StateLoaded, 0);
-   if (ctx->userFlags & UFLAGS_MONITOR) {
-      requestStateChange(ctx->spl, OMX_StateLoaded, 0);
-      requestStateChange(ctx->vid, OMX_StateLoaded, 0);
+   for (i = 0; i < n; i++)
+      if (comps[i] != NULL)
+         requestStateChange(owner[i], comps[i], OMX_StateLoaded, 0);
+   freeBuffers(ctx, ctx->dec, PORT_DEC, ctx->decbufs);
+   freeBuffers(ctx, ctx->enc, PORT_ENC+1, ctx->encbufs);
+   ctx->decbufs = NULL;
+   ctx->encbufs = NULL;
+   freeBuffers(ctx, ctx->filter.src, ctx->filter.srcPort, ctx->filter.srcbufs);
+   freeBuffers(ctx, ctx->filter.dst, ctx->filter.dstPort, ctx->filter.dstbufs);
+   ctx->filter.srcbufs = ctx->filter.dstbufs = NULL;
+   for (i = 0; i < ctx->nRenditions; i++) {
+      if ((r = ctx->renditions[i]) == NULL)
+         continue;
+      freeBuffers(r, r->enc, PORT_ENC+1, r->encbufs);
+      r->encbufs = NULL;
+   }
+   if ((r = ctx->thumbnailer) != NULL) {
+      freeBuffers(r, r->rsz, PORT_RSZ+1, r->encbufs);
+      r->encbufs = NULL;
    }
-   requestStateChange(ctx->enc, OMX_StateLoaded, 0);
-   freeBuffers(ctx->dec, PORT_DEC, ctx->decbufs);
-   freeBuffers(ctx->enc, PORT_ENC+1, ctx->encbufs);
+   free(ctx->decBufInfo);
+   ctx->decBufInfo = NULL;
 
    /* Wait for state changes to loaded state after all buffers are de-allocated
     * Since handles were obtained for all components, unused ones will
     * already be in the loaded state.
     */
-   requestStateChange(ctx->enc, OMX_StateLoaded, 2);
-   requestStateChange(ctx->vid, OMX_StateLoaded, 2);
-   requestStateChange(ctx->spl, OMX_StateLoaded, 2);
-   requestStateChange(ctx->rsz, OMX_StateLoaded, 2);
-   requestStateChange(ctx->dei, OMX_StateLoaded, 2);
-   requestStateChange(ctx->dec, OMX_StateLoaded, 2);
+   for (i = n-1; i >= 0; i--)
+      if (comps[i] != NULL)
+         requestStateChange(owner[i], comps[i], OMX_StateLoaded, 2);
 
    /* OMX_TeardownTunnel not defined on rpi */
 
-   OERR(OMX_FreeHandle(ctx->dec));
-   OERR(OMX_FreeHandle(ctx->dei));
-   OERR(OMX_FreeHandle(ctx->rsz));
-   OERR(OMX_FreeHandle(ctx->spl));
-   OERR(OMX_FreeHandle(ctx->vid));
-   OERR(OMX_FreeHandle(ctx->enc));
-   OERR(OMX_Deinit());
-}
-
-static void exitHandler(void) {
-   enum OMX_STATETYPE state;
-
-   if (ctx.userFlags & UFLAGS_VERBOSE) {
-      fprintf(stderr, "In exit handler, after %lli frames:\n", ctx.framesOut);
-      dumpport(ctx.dec, PORT_DEC);
-      dumpport(ctx.dec, PORT_DEC+1);
-      dumpport(ctx.enc, PORT_ENC+1);
-
-      OMX_GetState(ctx.dec, &state);
-      fprintf(stderr, "Decoder state: %d\n", state);
-      OMX_GetState(ctx.enc, &state);
-      fprintf(stderr, "Encoder state: %d\n", state);
-      fprintf(stderr, "********** Starting teardown **********\n");
-   }
-   cleanup(&ctx);
+   for (i = 0; i < n; i++)
+      if (comps[i] != NULL)
+         OLOG(ilCore.freeHandle(comps[i]));
+   ctx->dec = ctx->enc = ctx->rsz = ctx->dei = ctx->spl = ctx->vid = NULL;
+   for (i = 0; i < ctx->nRenditions; i++)
+      if ((r = ctx->renditions[i]) != NULL)
+         r->rsz = r->enc = NULL;
+   if (ctx->thumbnailer != NULL)
+      ctx->thumbnailer->rsz = NULL;
 }
 
-static int mapCodec(enum AVCodecID id) {
-   if (ctx.userFlags & UFLAGS_VERBOSE)
+static int mapCodec(struct context *ctx, enum AVCodecID id) {
+   if (ctx->userFlags & UFLAGS_VERBOSE)
       fprintf(stderr, "Mapping codec ID %d (%x)\n", id, id);
    switch (id) {
       case AV_CODEC_ID_MPEG2VIDEO:
@@ -411,8 +1115,8 @@ static int mapCodec(enum AVCodecID id) {
    }
 }
 
-static int mapProfile(enum OMX_VIDEO_AVCPROFILETYPE id) {
-   if (ctx.userFlags & UFLAGS_VERBOSE)
+static int mapProfile(struct context *ctx, enum OMX_VIDEO_AVCPROFILETYPE id) {
+   if (ctx->userFlags & UFLAGS_VERBOSE)
       fprintf(stderr, "Mapping profile ID %d (%x)\n", id, id);
    switch (id) {
       case OMX_VIDEO_AVCProfileBaseline:
@@ -436,8 +1140,8 @@ static int mapProfile(enum OMX_VIDEO_AVCPROFILETYPE id) {
    }
 }
 
-static int mapLevel(enum OMX_VIDEO_AVCLEVELTYPE id) {
-   if (ctx.userFlags & UFLAGS_VERBOSE)
+static int mapLevel(struct context *ctx, enum OMX_VIDEO_AVCLEVELTYPE id) {
+   if (ctx->userFlags & UFLAGS_VERBOSE)
       fprintf(stderr, "Mapping level ID %d (%x)\n", id, id);
    switch (id) {
       case OMX_VIDEO_AVCLevel1:
@@ -477,8 +1181,8 @@ static int mapLevel(enum OMX_VIDEO_AVCLEVELTYPE id) {
    }
 }
 
-static int mapColour(enum OMX_COLOR_FORMATTYPE id) {
-   if (ctx.userFlags & UFLAGS_VERBOSE)
+static int mapColour(struct context *ctx, enum OMX_COLOR_FORMATTYPE id) {
+   if (ctx->userFlags & UFLAGS_VERBOSE)
       fprintf(stderr, "Mapping colour ID %d (%x)\n", id, id);
    switch (id) {
       case OMX_COLOR_FormatYUV420PackedPlanar:
@@ -533,6 +1237,23 @@ static const char *mapEvents(OMX_EVENTTYPE event) {
    }
 }
 
+static const char *mapCommand(OMX_COMMANDTYPE command) {
+   switch (command) {
+      case OMX_CommandStateSet:
+         return "OMX_CommandStateSet";
+      case OMX_CommandFlush:
+         return "OMX_CommandFlush";
+      case OMX_CommandPortDisable:
+         return "OMX_CommandPortDisable";
+      case OMX_CommandPortEnable:
+         return "OMX_CommandPortEnable";
+      case OMX_CommandMarkBuffer:
+         return "OMX_CommandMarkBuffer";
+      default:
+         return "Unknown";
+   }
+}
+
 /* Map OMX handle to component type, used for info in printf statements only */
 static const char *mapComponent(struct context *ctx, OMX_HANDLETYPE handle) {
    if (handle == ctx->dec)
@@ -550,51 +1271,41 @@ static const char *mapComponent(struct context *ctx, OMX_HANDLETYPE handle) {
    return "Unknown";
 }
 
-/* oname is output filename, ctx->oname, idx is video stream index ctx->inVidStreamIdx
- * ic - input AVFormatContext; allocated by avformat_open_input() on input file open
+/* Make the output context for ctx->oname: stream 0 is the encoded video, described by
+ * vpar, and stream 1 the audio stream copied from the input, if there is one.
  */
-static AVFormatContext *makeOutputContext(AVFormatContext *ic, const char *oname, int idx, const OMX_PARAM_PORTDEFINITIONTYPE *prt, OMX_VIDEO_PARAM_PROFILELEVELTYPE *level) {
-   const OMX_VIDEO_PORTDEFINITIONTYPE *viddef;
+static AVFormatContext *makeOutputContext(struct context *ctx, const AVCodecParameters *vpar) {
    AVFormatContext   *oc=NULL;
    AVStream          *iflow, *oflow;
 
-   viddef = &prt->format.video; /* Decoder output format structure */
-
    /* allocate avformat context - avformat_free_context() can be used to free */
-   if (ctx.formatName == NULL)
-      avformat_alloc_output_context2(&oc, NULL, NULL, oname);
+   if (ctx->formatName == NULL)
+      avformat_alloc_output_context2(&oc, NULL, NULL, ctx->oname);
    else
-      avformat_alloc_output_context2(&oc, NULL, ctx.formatName, NULL);
+      avformat_alloc_output_context2(&oc, NULL, ctx->formatName, NULL);
 
    if (!oc) {
       fprintf(stderr, "Failed to alloc outputcontext\n");
-      exit(1);
+      return NULL;
    }
 
-   iflow = ic->streams[ctx.inVidStreamIdx];
+   iflow = ctx->ic->streams[ctx->inVidStreamIdx];
    oflow = avformat_new_stream(oc, NULL); /* Stream 0 */
 
    
-   if (!oflow) {
+   if (!oflow || avcodec_parameters_copy(oflow->codecpar, vpar) < 0) {
       av_log(NULL, AV_LOG_ERROR, "Failed allocating output stream\n");
-      exit(1);
+      avformat_free_context(oc);
+      return NULL;
    }
-   oflow->codecpar->codec_type = AVMEDIA_TYPE_VIDEO;
-   oflow->codecpar->codec_id = AV_CODEC_ID_H264;
-      
-   oflow->codecpar->width = viddef->nFrameWidth;   /* Set  AVCodecContext details to OMX_VIDEO reported values */
-   oflow->codecpar->height = viddef->nFrameHeight;
-   oflow->codecpar->bit_rate = ctx.bitrate;        /* User specified bit rate or default */
-   oflow->codecpar->profile = mapProfile(level->eProfile);
-   oflow->codecpar->level = mapLevel(level->eLevel);
-
-   oflow->time_base = ctx.omxtimebase;             /* Set timebase hint for muxer: will be overwritten on header write depending on container format */
-   oflow->codecpar->format = mapColour(viddef->eColorFormat);
-   oflow->avg_frame_rate = ctx.nalEntry.fps;
-   oflow->r_frame_rate = ctx.nalEntry.fps;
-
-   if (ctx.userFlags & UFLAGS_RESIZE) {
-      if ((ctx.userFlags & UFLAGS_AUTO_SCALE_X) || (ctx.userFlags & UFLAGS_AUTO_SCALE_Y)) {
+   oflow->codecpar->codec_tag = 0;
+
+   oflow->time_base = ctx->omxtimebase;             /* Set timebase hint for muxer: will be overwritten on header write depending on container format */
+   oflow->avg_frame_rate = ctx->nalEntry.fps;
+   oflow->r_frame_rate = ctx->nalEntry.fps;
+
+   if (ctx->userFlags & UFLAGS_RESIZE) {
+      if ((ctx->userFlags & UFLAGS_AUTO_SCALE_X) || (ctx->userFlags & UFLAGS_AUTO_SCALE_Y)) {
          oflow->codecpar->sample_aspect_ratio.num = 1;
          oflow->codecpar->sample_aspect_ratio.den = 1;
          oflow->sample_aspect_ratio.num = 1;
@@ -614,10 +1325,10 @@ static AVFormatContext *makeOutputContext(AVFormatContext *ic, const char *oname
       oflow->sample_aspect_ratio.den = iflow->codecpar->sample_aspect_ratio.den;
    }
 
-   fprintf(stderr, "*** Mapping input video stream #%i to output video stream #%i ***\n", ctx.inVidStreamIdx, 0);
-   if (ctx.inAudioStreamIdx>0) {
-      fprintf(stderr, "*** Mapping input audio stream #%i to output audio stream #%i ***\n", ctx.inAudioStreamIdx, 1);
-      iflow = ic->streams[ctx.inAudioStreamIdx];
+   fprintf(stderr, "*** Mapping input video stream #%i to output video stream #%i ***\n", ctx->inVidStreamIdx, 0);
+   if (ctx->inAudioStreamIdx>0) {
+      fprintf(stderr, "*** Mapping input audio stream #%i to output audio stream #%i ***\n", ctx->inAudioStreamIdx, 1);
+      iflow = ctx->ic->streams[ctx->inAudioStreamIdx];
       oflow = avformat_new_stream(oc, NULL); /* Stream 1 */
       if (avcodec_parameters_copy(oflow->codecpar, iflow->codecpar) < 0) /* This copies extradata */
          fprintf(stderr,"ERROR: Copying parameters for audio stream failed.\n");
@@ -626,68 +1337,126 @@ static AVFormatContext *makeOutputContext(AVFormatContext *ic, const char *oname
    }
    /* Show output format info */
    fprintf(stderr,"\n");
-   av_dump_format(oc, 0, oname, 1);
+   av_dump_format(oc, 0, ctx->oname, 1);
    return oc;
 }
 
-static void writeAudioPacket(AVPacket *pkt) {
-   int ret;
+static void writeAudioPacket(struct context *ctx, AVPacket *pkt) {
+   int ret, size;
+   int64_t t0;
    pkt->stream_index=1;
    
-   if (! (ctx.userFlags & UFLAGS_MAKE_UP_PTS) && pkt->dts > ctx.audioPTS)
-      ctx.audioPTS=pkt->dts;
+   if (! (ctx->userFlags & UFLAGS_MAKE_UP_PTS) && pkt->dts > ctx->audioPTS)
+      ctx->audioPTS=pkt->dts;
    else
-      ctx.audioPTS+=pkt->duration; /* Use packet duration */
+      ctx->audioPTS+=pkt->duration; /* Use packet duration */
 
    pkt->duration = av_rescale_q(pkt->duration,
-              ctx.ic->streams[ctx.inAudioStreamIdx]->time_base,
-              ctx.oc->streams[1]->time_base);
-   pkt->pts = av_rescale_q(ctx.audioPTS,
-              ctx.ic->streams[ctx.inAudioStreamIdx]->time_base,
-              ctx.oc->streams[1]->time_base);
+              ctx->ic->streams[ctx->inAudioStreamIdx]->time_base,
+              ctx->oc->streams[1]->time_base);
+   pkt->pts = av_rescale_q(ctx->audioPTS,
+              ctx->ic->streams[ctx->inAudioStreamIdx]->time_base,
+              ctx->oc->streams[1]->time_base);
    pkt->dts=pkt->pts; /* Audio packet: dts=pts */
-//   fprintf(stderr,"audioPTS: %lld; timebase: %i/%i\n", ctx.audioPTS, ctx.ic->streams[ctx.inAudioStreamIdx]->time_base.num, ctx.ic->streams[ctx.inAudioStreamIdx]->time_base.den);
-
-   ret=av_interleaved_write_frame(ctx.oc, pkt);   /* This frees pkt */
+//   fprintf(stderr,"audioPTS: %lld; timebase: %i/%i\n", ctx->audioPTS, ctx->ic->streams[ctx->inAudioStreamIdx]->time_base.num, ctx->ic->streams[ctx->inAudioStreamIdx]->time_base.den);
+
+   t0 = metrics.enabled || trace.enabled ? timeUs() : 0;
+   size = pkt->size;
+   ret=av_interleaved_write_frame(ctx->oc, pkt);   /* This frees pkt */
+   if (metrics.enabled)
+      metricSince(HIST_MUX, t0);
+   traceSpan("mux", "Write audio", NULL, t0, "bytes", size);
    if (ret < 0) {
       fprintf(stderr, "ERROR:omxtx: Failed to write audio frame.\n");
    }
 }
 
+/* Segmented output (-H): options for ffmpeg's hls or dash muxer. It cuts a segment at the
+ * first keyframe past each boundary, which is the IDR forced there by segmentIdrDue(), and
+ * publishes it with the playlist as soon as it is complete. With a playlist size, older
+ * segments are deleted, so the disk space used doesn't grow with the input.
+ */
+static void setSegmenterOptions(struct context *ctx, AVDictionary **opts) {
+   char duration[32];
+
+   snprintf(duration, sizeof(duration), "%g", ctx->segmentTime);
+   if (strcmp(ctx->oc->oformat->name, "dash") == 0) {
+      av_dict_set(opts, "seg_duration", duration, 0);
+      av_dict_set_int(opts, "window_size", ctx->playlistSize, 0);
+   }
+   else {
+      av_dict_set(opts, "hls_time", duration, 0);
+      av_dict_set_int(opts, "hls_list_size", ctx->playlistSize, 0);
+      av_dict_set(opts, "hls_flags", ctx->playlistSize > 0 ? "delete_segments+independent_segments+temp_file" : "independent_segments+temp_file", 0);
+   }
+}
+
+/* Segmented output (-H): returns 1 if an IDR should be forced for the frame at pts, which
+ * is lead us ahead of the frame the encoder will start next. The segment boundaries are
+ * every segmentTime seconds from the first frame, as the segmenter counts them.
+ */
+static int segmentIdrDue(struct context *ctx, int64_t pts, int64_t lead) {
+   int64_t step = (int64_t)(ctx->segmentTime * 1E6);
+
+   if (step <= 0)
+      return 0;
+   if (ctx->nextIdr == AV_NOPTS_VALUE) {   /* First frame: an IDR anyway */
+      ctx->nextIdr = pts + step;
+      return 0;
+   }
+   if (pts + lead < ctx->nextIdr)
+      return 0;
+   while (ctx->nextIdr <= pts + lead)
+      ctx->nextIdr += step;
+   return 1;
+}
+
 static int openOutput(struct context *ctx) {
    int i, ret;
    struct packetentry *packet, *next;
+   AVDictionary *muxOpts = NULL;
 
    if (ctx->userFlags & UFLAGS_VERBOSE)
       fprintf(stderr, "Got SPS and PPS data: opening output file '%s'\n", ctx->oname);
 
    if (!(ctx->oc->oformat->flags & AVFMT_NOFILE)) {
-     ret = avio_open(&ctx->oc->pb, ctx->oname, AVIO_FLAG_WRITE);
+     ret = avio_open(&ctx->oc->pb, strcmp(ctx->oname, "-")==0 ? "pipe:1" : ctx->oname, AVIO_FLAG_WRITE);
      if (ret < 0) {
          fprintf(stderr, "ERROR: Could not open output file '%s'\n", ctx->oname);
-         exit(1);
+         return 1;
      }
    }
    /* init muxer, write output file header */
-   ret = avformat_write_header(ctx->oc, NULL);
+   if (ctx->segmentTime > 0)
+      setSegmenterOptions(ctx, &muxOpts);
+   if (ctx->liveLatency > 0) {   /* Write each packet out at once */
+      av_dict_set(&muxOpts, "flush_packets", "1", 0);
+      av_dict_set_int(&muxOpts, "max_interleave_delta", ctx->liveLatency * 1000LL, 0);
+   }
+   ret = avformat_write_header(ctx->oc, &muxOpts);
+   if (ret >= 0 && av_dict_count(muxOpts) > 0)
+      fprintf(stderr, "WARNING: This version of ffmpeg's %s muxer doesn't take all the segmenter / live options\n", ctx->oc->oformat->name);
+   av_dict_free(&muxOpts);
    if (ret < 0) {
      av_log(NULL, AV_LOG_ERROR, "Error occurred when opening output file\n");
-     exit(1);
+     return 1;
    }
 
    if (ctx->inAudioStreamIdx>0) {
-      for (i = 0, packet = TAILQ_FIRST(&packetq); packet; packet = next) {
+      for (i = 0, packet = TAILQ_FIRST(&ctx->packetq); packet; packet = next) {
          next = TAILQ_NEXT(packet, link);
-         writeAudioPacket(packet->packet);
+         writeAudioPacket(ctx, packet->packet);
          i++;
-         TAILQ_REMOVE(&packetq, packet, link);
+         TAILQ_REMOVE(&ctx->packetq, packet, link);
          av_packet_free(&packet->packet);
+         free(packet);
       }
       if (ctx->userFlags & UFLAGS_VERBOSE)
          fprintf(stderr, "Wrote %d saved frames saved during OMX init.\n", i);
    }
 
-   fprintf(stderr, "\n*** Press ctrl-c to abort ***\n\n");
+   if (ctx->workers <= 1 && ctx->parent == NULL)
+      fprintf(stderr, "\n*** Press ctrl-c to abort ***\n\n");
    return 0;
 }
 
@@ -700,20 +1469,36 @@ OMX_ERRORTYPE genericEventHandler(OMX_HANDLETYPE handle, struct context *ctx, OM
    return OMX_ErrorNone;
 }
 
+/* Called from the component event handlers on command complete or error:
+ * clear the component flag and wake up any waiting thread.
+ */
+static void completeCommand(struct context *ctx, int comp, OMX_ERRORTYPE error) {
+   OMXTX_COMPLETION *c = &ctx->completion[comp];
+
+   pthread_mutex_lock(&c->lock);
+   if (error == OMX_ErrorNone || error == OMX_ErrorSameState)
+      ctx->componentFlags &= ~(1U<<comp);  /* Done, or component is already in requested state */
+   else
+      c->error = error;
+   c->events++;
+   pthread_cond_broadcast(&c->cond);
+   pthread_mutex_unlock(&c->lock);
+}
+
 OMX_ERRORTYPE decEventHandler(OMX_HANDLETYPE handle, struct context *ctx, OMX_EVENTTYPE event, OMX_U32 data1, OMX_U32 data2, OMX_PTR eventdata) {
+   traceInstant(mapEvents(event), mapComponent(ctx, handle), "data1", data1);
    switch (event) {
-      case OMX_EventPortSettingsChanged:
-         ctx->state = TUNNELSETUP; /* Port setting identified (decoder needs some frames to setup port parameters) call configure() from main loop to set up tunnels now we have those settings */
+      case OMX_EventPortSettingsChanged: {
+         enum states expected = DECINIT;
+         atomic_compare_exchange_strong(&ctx->state, &expected, TUNNELSETUP); /* Port setting identified (decoder needs some frames to setup port parameters) call configure() from main loop to set up tunnels now we have those settings */
+      }
       break;
       case OMX_EventError:
          fprintf(stderr, "ERROR:%s %p: %x\n", mapComponent(ctx, handle), handle, data1);
-         if (data1==OMX_ErrorSameState && ctx->componentFlags&CFLAGS_DEC)
-            ctx->componentFlags &= ~CFLAGS_DEC; /* Clear flag - component is already in requested state */
+         completeCommand(ctx, COMP_DEC, data1);
       break;
       case OMX_EventCmdComplete:
-         if (ctx->componentFlags&CFLAGS_DEC) {
-            ctx->componentFlags &= ~CFLAGS_DEC;
-         }
+         completeCommand(ctx, COMP_DEC, OMX_ErrorNone);
       break;
       default:
          genericEventHandler(handle, ctx, event, data1, data2, eventdata);
@@ -722,15 +1507,14 @@ OMX_ERRORTYPE decEventHandler(OMX_HANDLETYPE handle, struct context *ctx, OMX_EV
 }
 
 OMX_ERRORTYPE encEventHandler(OMX_HANDLETYPE handle, struct context *ctx, OMX_EVENTTYPE event, OMX_U32 data1, OMX_U32 data2, OMX_PTR eventdata) {
+   traceInstant(mapEvents(event), mapComponent(ctx, handle), "data1", data1);
    switch (event) {
       case OMX_EventError:
          fprintf(stderr, "ERROR:%s %p: %x\n", mapComponent(ctx, handle), handle, data1);
-         if (data1==OMX_ErrorSameState && ctx->componentFlags&CFLAGS_ENC)
-            ctx->componentFlags &= ~CFLAGS_ENC; /* Clear flag - component is already in requested state */
+         completeCommand(ctx, COMP_ENC, data1);
       break;
       case OMX_EventCmdComplete:
-         if (ctx->componentFlags&CFLAGS_ENC)
-            ctx->componentFlags &= ~CFLAGS_ENC;
+         completeCommand(ctx, COMP_ENC, OMX_ErrorNone);
       break;
       default:
          genericEventHandler(handle, ctx, event, data1, data2, eventdata);
@@ -739,16 +1523,14 @@ OMX_ERRORTYPE encEventHandler(OMX_HANDLETYPE handle, struct context *ctx, OMX_EV
 }
 
 OMX_ERRORTYPE rszEventHandler(OMX_HANDLETYPE handle, struct context *ctx, OMX_EVENTTYPE event, OMX_U32 data1, OMX_U32 data2, OMX_PTR eventdata) {
+   traceInstant(mapEvents(event), mapComponent(ctx, handle), "data1", data1);
    switch (event) {
       case OMX_EventError:
          fprintf(stderr, "ERROR:%s %p: %x\n", mapComponent(ctx, handle), handle, data1);
-         if (data1==OMX_ErrorSameState && ctx->componentFlags&CFLAGS_RSZ)
-            ctx->componentFlags &= ~CFLAGS_RSZ; /* Clear flag - component is already in requested state */
+         completeCommand(ctx, COMP_RSZ, data1);
       break;
       case OMX_EventCmdComplete:
-         if (ctx->componentFlags&CFLAGS_RSZ) {
-            ctx->componentFlags &= ~CFLAGS_RSZ;
-         }
+         completeCommand(ctx, COMP_RSZ, OMX_ErrorNone);
       break;
       default:
          genericEventHandler(handle, ctx, event, data1, data2, eventdata);
@@ -757,15 +1539,14 @@ OMX_ERRORTYPE rszEventHandler(OMX_HANDLETYPE handle, struct context *ctx, OMX_EV
 }
 
 OMX_ERRORTYPE deiEventHandler(OMX_HANDLETYPE handle, struct context *ctx, OMX_EVENTTYPE event, OMX_U32 data1, OMX_U32 data2, OMX_PTR eventdata) {
+   traceInstant(mapEvents(event), mapComponent(ctx, handle), "data1", data1);
    switch (event) {
       case OMX_EventError:
          fprintf(stderr, "ERROR:%s %p: %x\n", mapComponent(ctx, handle), handle, data1);
-         if (data1==OMX_ErrorSameState && ctx->componentFlags&CFLAGS_DEI)
-            ctx->componentFlags &= ~CFLAGS_DEI; /* Clear flag - component is already in requested state */
+         completeCommand(ctx, COMP_DEI, data1);
       break;
       case OMX_EventCmdComplete:
-         if (ctx->componentFlags&CFLAGS_DEI)
-            ctx->componentFlags &= ~CFLAGS_DEI;
+         completeCommand(ctx, COMP_DEI, OMX_ErrorNone);
       break;
       default:
          genericEventHandler(handle, ctx, event, data1, data2, eventdata);
@@ -774,15 +1555,14 @@ OMX_ERRORTYPE deiEventHandler(OMX_HANDLETYPE handle, struct context *ctx, OMX_EV
 }
 
 OMX_ERRORTYPE splEventHandler(OMX_HANDLETYPE handle, struct context *ctx, OMX_EVENTTYPE event, OMX_U32 data1, OMX_U32 data2, OMX_PTR eventdata) {
+   traceInstant(mapEvents(event), mapComponent(ctx, handle), "data1", data1);
    switch (event) {
       case OMX_EventError:
          fprintf(stderr, "ERROR:%s %p: %x\n", mapComponent(ctx, handle), handle, data1);
-         if (data1==OMX_ErrorSameState && ctx->componentFlags&CFLAGS_SPL)
-            ctx->componentFlags &= ~CFLAGS_SPL; /* Clear flag - component is already in requested state */
+         completeCommand(ctx, COMP_SPL, data1);
       break;
       case OMX_EventCmdComplete:
-         if (ctx->componentFlags&CFLAGS_SPL)
-            ctx->componentFlags &= ~CFLAGS_SPL;
+         completeCommand(ctx, COMP_SPL, OMX_ErrorNone);
       break;
       default:
          genericEventHandler(handle, ctx, event, data1, data2, eventdata);
@@ -791,15 +1571,14 @@ OMX_ERRORTYPE splEventHandler(OMX_HANDLETYPE handle, struct context *ctx, OMX_EV
 }
 
 OMX_ERRORTYPE vidEventHandler(OMX_HANDLETYPE handle, struct context *ctx, OMX_EVENTTYPE event, OMX_U32 data1, OMX_U32 data2, OMX_PTR eventdata) {
+   traceInstant(mapEvents(event), mapComponent(ctx, handle), "data1", data1);
    switch (event) {
       case OMX_EventError:
          fprintf(stderr, "ERROR:%s %p: %x\n", mapComponent(ctx, handle), handle, data1);
-         if (data1==OMX_ErrorSameState && ctx->componentFlags&CFLAGS_VID)
-            ctx->componentFlags &= ~CFLAGS_VID; /* Clear flag - component is already in requested state */
+         completeCommand(ctx, COMP_VID, data1);
       break;
       case OMX_EventCmdComplete:
-         if (ctx->componentFlags&CFLAGS_VID)
-            ctx->componentFlags &= ~CFLAGS_VID;
+         completeCommand(ctx, COMP_VID, OMX_ErrorNone);
       break;
       default:
          genericEventHandler(handle, ctx, event, data1, data2, eventdata);
@@ -812,50 +1591,169 @@ OMX_ERRORTYPE genericBufferCallback(OMX_HANDLETYPE handle, struct context *ctx,
    return OMX_ErrorNone;
 }
 
+/* (Re)initialise an empty ring for the NULL terminated array bufs; returns 0 on success */
+static int bufRingInit(OMXTX_BUF_RING *ring, OMX_BUFFERHEADERTYPE **bufs) {
+   int i;
+
+   for (i = 0; bufs[i] != NULL; i++);
+   free(ring->bufs);
+   free(ring->pushed);
+   ring->size = i+1;   /* One slot is always left empty to tell full from empty */
+   ring->bufs = calloc(ring->size, sizeof(OMX_BUFFERHEADERTYPE *));
+   ring->pushed = calloc(ring->size, sizeof(int64_t));
+   if (ring->bufs == NULL || ring->pushed == NULL) {
+      fprintf(stderr, "ERROR: Can't allocate memory for buffer ring\n");
+      return 1;
+   }
+   ring->head = 0;
+   ring->tail = 0;
+   return 0;
+}
+
+static void bufRingPush(OMXTX_BUF_RING *ring, OMX_BUFFERHEADERTYPE *buf) {
+   unsigned int head = ring->head;
+
+   ring->bufs[head] = buf;
+   if (metrics.enabled)
+      ring->pushed[head] = timeUs();
+   ring->head = (head + 1) % ring->size;  /* Publish after the slot is written */
+}
+
+/* Returns NULL if the ring is empty */
+static OMX_BUFFERHEADERTYPE *bufRingPop(OMXTX_BUF_RING *ring) {
+   unsigned int tail = ring->tail;
+   OMX_BUFFERHEADERTYPE *buf;
+
+   if (tail == ring->head)
+      return NULL;
+   buf = ring->bufs[tail];
+   ring->popped = ring->pushed[tail];
+   ring->tail = (tail + 1) % ring->size;
+   return buf;
+}
+
+static int bufRingEmpty(OMXTX_BUF_RING *ring) {
+   return ring->tail == ring->head;
+}
+
+/* Pass a buffer to the decoder / encoder */
+static OMX_ERRORTYPE emptyDecBuffer(struct context *ctx, OMX_BUFFERHEADERTYPE *buf) {
+   traceBuffer('b', "Decoder input buffer", buf, buf->nFilledLen);
+   return OMX_EmptyThisBuffer(ctx->dec, buf);
+}
+
+static OMX_ERRORTYPE fillEncBuffer(struct context *ctx, OMX_BUFFERHEADERTYPE *buf) {
+   traceBuffer('b', "Encoder output buffer", buf, 0);
+   return OMX_FillThisBuffer(ctx->enc, buf);
+}
+
+static OMX_ERRORTYPE fillThumbBuffer(struct context *ctx, OMX_BUFFERHEADERTYPE *buf) {
+   traceBuffer('b', "Thumbnail buffer", buf, 0);
+   return OMX_FillThisBuffer(ctx->rsz, buf);
+}
+
+static OMX_ERRORTYPE fillFilterBuffer(struct context *ctx, OMX_BUFFERHEADERTYPE *buf) {
+   traceBuffer('b', "Filter input buffer", buf, 0);
+   return OMX_FillThisBuffer(ctx->filter.src, buf);
+}
+
+static OMX_ERRORTYPE emptyFilterBuffer(struct context *ctx, OMX_BUFFERHEADERTYPE *buf) {
+   traceBuffer('b', "Filter output buffer", buf, buf->nFilledLen);
+   return OMX_EmptyThisBuffer(ctx->filter.dst, buf);
+}
+
+/* Wake up a thread waiting on cond for a buffer callback */
+static void signalBuffers(pthread_mutex_t *lock, pthread_cond_t *cond) {
+   pthread_mutex_lock(lock);
+   pthread_cond_signal(cond);
+   pthread_mutex_unlock(lock);
+}
+
 OMX_ERRORTYPE emptied(OMX_HANDLETYPE handle, struct context *ctx, OMX_BUFFERHEADERTYPE *buf) {
+   OMXTX_DEC_BUF *info = buf->pAppPrivate;
+
    #ifdef DEBUG
       fprintf(stderr, "*** DEBUG *** Got a buffer emptied event on %s %p, buf %p\n", mapComponent(ctx, handle), handle, buf);
    #endif
-   pthread_mutex_lock(&ctx->decBufLock);
-   buf->nFilledLen = 0; /* Flag buffer emptied */
-   pthread_mutex_unlock(&ctx->decBufLock);
+   if (metrics.enabled && info->sent != 0)
+      metricSince(HIST_DECBUF, info->sent);
+   traceBuffer('e', "Decoder input buffer", buf, 0);
+   bufRingPush(&ctx->decFree, buf); /* Buffer is free for re-use */
+   if (ctx->decWaiting)    /* Only take bufLock if the feeder is asleep: see getSpareDecBuffer() */
+      signalBuffers(&ctx->bufLock, &ctx->bufCond);
    return OMX_ErrorNone;
 }
 
 /* This is a blocking call; encoder will not continue until this returns.
- * OMX_FillThisBuffer() *must* not be called until this function returns,
- * otherwise some kind of deadlock happens!
+ * OMX_FillThisBuffer() *must* not be called from this function,
+ * otherwise some kind of deadlock happens! Queue the buffer for drainEncoder().
  */
 OMX_ERRORTYPE filled(OMX_HANDLETYPE handle, struct context *ctx, OMX_BUFFERHEADERTYPE *buf) {
    #ifdef DEBUG
       fprintf(stderr, "*** DEBUG *** Got a buffer filled event on %s %p, buf %p\n", mapComponent(ctx, handle), handle, buf);
    #endif
-   ctx->encBufferFilled=1;
+   if (metrics.enabled) {
+      if (ctx->lastFilled != 0)
+         metricObserve(HIST_ENCINT, timeUs() - ctx->lastFilled);
+      ctx->lastFilled = timeUs();
+   }
+   traceBuffer('e', "Encoder output buffer", buf, buf->nFilledLen);
+   bufRingPush(&ctx->encFilled, buf);
+   signalBuffers(&ctx->encLock, &ctx->encCond);
+   return OMX_ErrorNone;
+}
+
+/* Thumbnailer (-k): a resizer output buffer holds a frame. Queued for thumbnailThread(), as filled() does */
+OMX_ERRORTYPE thumbFilled(OMX_HANDLETYPE handle, struct context *ctx, OMX_BUFFERHEADERTYPE *buf) {
+   traceBuffer('e', "Thumbnail buffer", buf, buf->nFilledLen);
+   bufRingPush(&ctx->encFilled, buf);
+   signalBuffers(&ctx->encLock, &ctx->encCond);
+   return OMX_ErrorNone;
+}
+
+/* Filter stage (-I, -D on OMX): an output buffer of the stage before it holds a frame.
+ * Queued for filterThread(), as filled() does.
+ */
+OMX_ERRORTYPE frameFilled(OMX_HANDLETYPE handle, struct context *ctx, OMX_BUFFERHEADERTYPE *buf) {
+   traceBuffer('e', "Filter input buffer", buf, buf->nFilledLen);
+   bufRingPush(&ctx->filter.filled, buf);
+   signalBuffers(&ctx->filterLock, &ctx->filterCond);
+   return OMX_ErrorNone;
+}
+
+/* Filter stage: an input buffer of the stage after it is free for the next frame */
+OMX_ERRORTYPE frameEmptied(OMX_HANDLETYPE handle, struct context *ctx, OMX_BUFFERHEADERTYPE *buf) {
+   traceBuffer('e', "Filter output buffer", buf, 0);
+   bufRingPush(&ctx->filter.free, buf);
+   signalBuffers(&ctx->filterLock, &ctx->filterCond);
    return OMX_ErrorNone;
 }
 
+/* The buffer callbacks of the links that may be the filter stage's are only made for it:
+ * the others are tunnelled
+ */
 OMX_CALLBACKTYPE encEventCallback = {
    (void (*))encEventHandler,
-   (void (*))genericBufferCallback,
+   (void (*))frameEmptied,
    (void (*))filled
 };
 
 OMX_CALLBACKTYPE decEventCallback = {
    (void (*)) decEventHandler,
    (void (*)) emptied,
-   (void (*)) genericBufferCallback
+   (void (*)) frameFilled
 };
 
 OMX_CALLBACKTYPE rszEventCallback = {
    (void (*)) rszEventHandler,
-   (void (*)) genericBufferCallback,
-   (void (*)) genericBufferCallback
+   (void (*)) frameEmptied,
+   (void (*)) frameFilled
 };
 
 OMX_CALLBACKTYPE deiEventCallback = {
    (void (*)) deiEventHandler,
    (void (*)) genericBufferCallback,
-   (void (*)) genericBufferCallback
+   (void (*)) frameFilled
 };
 
 OMX_CALLBACKTYPE vidEventCallback = {
@@ -866,116 +1764,401 @@ OMX_CALLBACKTYPE vidEventCallback = {
 
 OMX_CALLBACKTYPE splEventCallback = {
    (void (*)) splEventHandler,
+   (void (*)) frameEmptied,
+   (void (*)) frameFilled
+};
+
+OMX_CALLBACKTYPE thmEventCallback = {
+   (void (*)) rszEventHandler,
    (void (*)) genericBufferCallback,
-   (void (*)) genericBufferCallback
+   (void (*)) thumbFilled
 };
 
+/* Progress line, once a second. Checks for the end of the job every 100ms so that
+ * runJob() can join it without waiting long.
+ */
 static void *fps(void *p) {
+   struct context *ctx = p;
    uint64_t lastframe;
+   int i;
 
-   while (ctx.state!=DECEOF) {
-      lastframe = ctx.framesOut;
-      if (sleep(1)>0) break;
-      
-      fprintf(stderr, "Frame %6lld (%5.2fs).  Frames last second: %lli   pts delta: %llims  kbps: %5.1f     \r",
-         ctx.framesOut, (double)ctx.framesOut/ctx.omxFPS, ctx.framesOut-lastframe, ctx.ptsDelta, (double)ctx.curSize*8.0*ctx.omxFPS/(1024*ctx.framesOut));
+   while (ctx->state!=ENCEOS && ctx->state!=FAILED) {
+      lastframe = ctx->framesOut;
+      for (i = 0; i < 10 && ctx->state!=ENCEOS && ctx->state!=FAILED; i++)
+         usleep(100000);
+      if (i < 10) break;
+
+      if (ctx->liveLatency > 0)
+         fprintf(stderr, "Frame %6lld (%5.2fs).  Frames last second: %lli   latency: %4lldms  dropped: %llu  kbps: %5.1f     \r",
+            ctx->framesOut, outputTime(ctx), ctx->framesOut-lastframe, ctx->latencyLast/1000, ctx->liveDropped, (double)ctx->curSize*8.0/(1024*outputTime(ctx)));
+      else
+         fprintf(stderr, "Frame %6lld (%5.2fs).  Frames last second: %lli   pts delta: %llims  kbps: %5.1f     \r",
+            ctx->framesOut, outputTime(ctx), ctx->framesOut-lastframe, ctx->ptsDelta, (double)ctx->curSize*8.0/(1024*outputTime(ctx)));
       fflush(stderr);
    }
    fprintf(stderr, "\n");
    return NULL;
 }
 
-/* Allocated buffers are stored as a linked list in pAppPrivate:
- * each pAppPrivate points to the next OMX_BUFFERHEADER in the list
- * Final buffer in the list has pAppPrivate set to NULL.
+/* Allocated buffers are returned as an array of pointers to the buffer headers.
+ * The final element of the array is set to NULL.
+ * pAppPrivate is left free for per buffer data.
+ * Returns NULL on failure, with any buffers already allocated freed again.
  */
-static OMX_BUFFERHEADERTYPE *allocbufs(OMX_HANDLETYPE h, int port) {
+static OMX_BUFFERHEADERTYPE **allocbufs(struct context *ctx, OMX_HANDLETYPE h, int port) {
    int i;
-   OMX_BUFFERHEADERTYPE *list = NULL, **end = &list;
-   OMX_PARAM_PORTDEFINITIONTYPE *portdef;
+   OMX_BUFFERHEADERTYPE **list;
+   OMX_PARAM_PORTDEFINITIONTYPE portdef;
+   OMX_ERRORTYPE err;
+
+   INITME(portdef);
+   portdef.nPortIndex = port;
+   if (OMX_GetParameter(h, OMX_IndexParamPortDefinition, &portdef) != OMX_ErrorNone) {
+      fprintf(stderr, "ERROR: Can't get the %s port %d definition\n", mapComponent(ctx, h), port);
+      return NULL;
+   }
 
-   MAKEME(portdef, OMX_PARAM_PORTDEFINITIONTYPE);
-   portdef->nPortIndex = port;
-   OERR(OMX_GetParameter(h, OMX_IndexParamPortDefinition, portdef));
+   list = calloc(portdef.nBufferCountActual+1, sizeof(OMX_BUFFERHEADERTYPE *));
+   if (list == NULL) {
+      fprintf(stderr, "ERROR: Can't allocate memory for buffer list\n");
+      return NULL;
+   }
 
-   if (ctx.userFlags & UFLAGS_VERBOSE)
-      fprintf(stderr, "Allocate %i %s buffers of %d bytes\n", portdef->nBufferCountActual, mapComponent(&ctx, h), portdef->nBufferSize);
-   for (i = 0; i < portdef->nBufferCountActual; i++) {
-      //OMX_U8 *buf= vcos_malloc_aligned(portdef->nBufferSize, portdef->nBufferAlignment, "buffer");
-      //OERR(OMX_UseBuffer(h, end, port, NULL, portdef->nBufferSize, buf));
-      OERR(OMX_AllocateBuffer(h, end, port, NULL, portdef->nBufferSize));
-      end = (OMX_BUFFERHEADERTYPE **) &((*end)->pAppPrivate);
+   if (ctx->userFlags & UFLAGS_VERBOSE)
+      fprintf(stderr, "Allocate %i %s buffers of %d bytes\n", portdef.nBufferCountActual, mapComponent(ctx, h), portdef.nBufferSize);
+   for (i = 0; i < portdef.nBufferCountActual; i++) {
+      err = OMX_AllocateBuffer(h, &list[i], port, NULL, portdef.nBufferSize);
+      if (err != OMX_ErrorNone) {
+         fprintf(stderr, "ERROR: Failed to allocate %s buffer %d: %x\n", mapComponent(ctx, h), i, err);
+         list[i] = NULL;
+         freeBuffers(ctx, h, port, list);   /* Frees list */
+         return NULL;
+      }
+      list[i]->pAppPrivate = NULL;
    }
 
-   free(portdef);
    return list;
 }
 
+/* Map OMX handle to component index */
+static int componentIndex(struct context *ctx, OMX_HANDLETYPE handle) {
+   if (handle == ctx->dec)
+      return COMP_DEC;
+   if (handle == ctx->enc)
+      return COMP_ENC;
+   if (handle == ctx->rsz)
+      return COMP_RSZ;
+   if (handle == ctx->dei)
+      return COMP_DEI;
+   if (handle == ctx->spl)
+      return COMP_SPL;
+   return COMP_VID;
+}
+
+/* Absolute CLOCK_MONOTONIC time timeout ms from now, for pthread_cond_timedwait() */
+static void getDeadline(struct timespec *deadline, int timeout) {
+   clock_gettime(CLOCK_MONOTONIC, deadline);
+   deadline->tv_sec += timeout/1000;
+   deadline->tv_nsec += (timeout%1000)*1000000L;
+   if (deadline->tv_nsec >= 1000000000L) {
+      deadline->tv_sec++;
+      deadline->tv_nsec -= 1000000000L;
+   }
+}
+
 /* Request a component to change state and optionally wait:
  * wait == 0 Send request but don't wait for change
  * wait == 1 Send request and wait for state change
  * wait == 2 Don't send request, wait for an earlier requested state change
+ * Nothing is sent to a component already in rState: its OMX_ErrorSameState reply could
+ * be taken for the completion of a later command.
+ * The wait sleeps until the component sends an event, and gives up after ctx->omxTimeout ms.
+ * OMX_GetState() is never called with the completion lock held: the event handlers need it.
  */
-static void requestStateChange(OMX_HANDLETYPE handle, enum OMX_STATETYPE rState, int wait) {
+static OMX_ERRORTYPE requestStateChange(struct context *ctx, OMX_HANDLETYPE handle, enum OMX_STATETYPE rState, int wait) {
+   OMXTX_COMPLETION *c = &ctx->completion[componentIndex(ctx, handle)];
    enum OMX_STATETYPE aState;
-   int i=0;
-
-   if (wait != 2)
+   struct timespec deadline;
+   unsigned int events;
+   int64_t t0;
+   int rc=0;
+
+   if (wait != 2) {
+      OMX_GetState(handle, &aState);
+      if (aState == rState)
+         return OMX_ErrorNone;   /* e.g. a component parked in Idle between batch jobs */
+      c->error = OMX_ErrorNone;
+      traceInstant(mapCommand(OMX_CommandStateSet), mapComponent(ctx, handle), "state", rState);
       OERR(OMX_SendCommand(handle, OMX_CommandStateSet, rState, NULL));
+   }
    if (wait > 0) {
-      do {
-         usleep(100);
+      t0 = trace.enabled ? timeUs() : 0;
+      getDeadline(&deadline, ctx->omxTimeout);
+      while (1) {
+         events = c->events;
          OMX_GetState(handle, &aState);
-         i++;
-      } while (i<10000 && aState!=rState);   /* Timeout 1s */
+         if (aState == rState || c->error != OMX_ErrorNone || rc == ETIMEDOUT)
+            break;
+         pthread_mutex_lock(&c->lock);
+         while (c->events == events && rc != ETIMEDOUT)
+            rc = pthread_cond_timedwait(&c->cond, &c->lock, &deadline);
+         pthread_mutex_unlock(&c->lock);
+      }
+      traceSpan("omx", "Wait for state", mapComponent(ctx, handle), t0, "state", aState);
 
       if (aState!=rState) {
-         fprintf(stderr,"ERROR: timeout waiting for state change: wanted %i, got %i\n",rState, aState);
-         exit(1);
+         if (c->error != OMX_ErrorNone) {
+            fprintf(stderr,"ERROR: %s failed to change state: wanted %i, got %i; error %x\n", mapComponent(ctx, handle), rState, aState, c->error);
+            return c->error;
+         }
+         fprintf(stderr,"ERROR: %s timeout waiting for state change: wanted %i, got %i\n", mapComponent(ctx, handle), rState, aState);
+         return OMX_ErrorTimeout;
       }
    }
+   return OMX_ErrorNone;
 }
 
-static void waitForEvents(OMX_HANDLETYPE handle, uint8_t cFlag) {
-   int i=0;
-   do {  /* Wait command to complete */
-      usleep(100);
-      i++;
-   } while (i<10000 && (ctx.componentFlags&cFlag));   /* Timeout 1s */
-   if (ctx.componentFlags&cFlag) {
-      fprintf(stderr,"ERROR: %s timeout waiting for command to complete.\n", mapComponent(&ctx, handle));
-      exit(1);
+/* Wait for the command(s) flagged in cFlag to complete; see sendCommand(ctx, ) */
+static OMX_ERRORTYPE waitForEvents(struct context *ctx, OMX_HANDLETYPE handle, uint8_t cFlag) {
+   OMXTX_COMPLETION *c = &ctx->completion[__builtin_ctz(cFlag)];
+   struct timespec deadline;
+   OMX_ERRORTYPE err;
+   int64_t t0 = trace.enabled ? timeUs() : 0;
+   int rc=0;
+
+   getDeadline(&deadline, ctx->omxTimeout);
+   pthread_mutex_lock(&c->lock);
+   while ((ctx->componentFlags&cFlag) && c->error == OMX_ErrorNone && rc != ETIMEDOUT)
+      rc = pthread_cond_timedwait(&c->cond, &c->lock, &deadline);
+   err = c->error;
+   pthread_mutex_unlock(&c->lock);
+   traceSpan("omx", "Wait for command", mapComponent(ctx, handle), t0, "error", err);
+
+   if (ctx->componentFlags&cFlag) {
+      if (err != OMX_ErrorNone) {
+         fprintf(stderr,"ERROR: %s command failed: %x\n", mapComponent(ctx, handle), err);
+         return err;
+      }
+      fprintf(stderr,"ERROR: %s timeout waiting for command to complete.\n", mapComponent(ctx, handle));
+      return OMX_ErrorTimeout;
    }
+   return OMX_ErrorNone;
 }
 
-static void sendCommand(OMX_HANDLETYPE handle, OMX_COMMANDTYPE command, OMX_U32 port, uint8_t cFlag, int wait) {
-   ctx.componentFlags|=cFlag;
+static OMX_ERRORTYPE sendCommand(struct context *ctx, OMX_HANDLETYPE handle, OMX_COMMANDTYPE command, OMX_U32 port, uint8_t cFlag, int wait) {
+   ctx->completion[__builtin_ctz(cFlag)].error = OMX_ErrorNone;
+   ctx->componentFlags|=cFlag;
+   traceInstant(mapCommand(command), mapComponent(ctx, handle), command == OMX_CommandStateSet ? "state" : "port", port);
    OERR(OMX_SendCommand(handle, command, port, NULL));
 
-   if (wait>0) waitForEvents(handle, cFlag);
+   if (wait>0)
+      return waitForEvents(ctx, handle, cFlag);
+   return OMX_ErrorNone;
 }
 
-static OMX_PARAM_PORTDEFINITIONTYPE *configureResizer(struct context *ctx, OMX_PARAM_PORTDEFINITIONTYPE *portdef) {
-   /* Resize and/or crop:
-    * Do using hardware resizer: set input port size to input video size, output port size to
-    * required rescale size. Crop is applied to input using OMX_IndexConfigCommonInputCrop
-    */
-   OMX_VIDEO_PORTDEFINITIONTYPE *viddef;
-   OMX_PARAM_PORTDEFINITIONTYPE *imgportdef;
-   OMX_IMAGE_PORTDEFINITIONTYPE *imgdef;
-   
-   MAKEME(imgportdef, OMX_PARAM_PORTDEFINITIONTYPE);
+/* If the port definition can't be read the port is taken to be enabled: the
+ * disable command that follows will then report the error.
+ */
+static int portEnabled(struct context *ctx, OMX_HANDLETYPE handle, int port) {
+   OMX_PARAM_PORTDEFINITIONTYPE portdef;
+   int enabled = 1;
+
+   INITME(portdef);
+   portdef.nPortIndex = port;
+   if (OMX_GetParameter(handle, OMX_IndexParamPortDefinition, &portdef) == OMX_ErrorNone)
+      enabled = portdef.bEnabled;
+   return enabled;
+}
 
-   sendCommand(ctx->rsz, OMX_CommandPortDisable, PORT_RSZ, CFLAGS_RSZ, 1);
-   sendCommand(ctx->rsz, OMX_CommandPortDisable, PORT_RSZ+1, CFLAGS_RSZ, 1);
+/* Disable a port and wait, unless it is already disabled: in batch mode the
+ * tunnelled ports are left disabled between jobs by parkPipeline().
+ */
+static OMX_ERRORTYPE disablePort(struct context *ctx, OMX_HANDLETYPE handle, int port, uint8_t cFlag) {
+   if (!portEnabled(ctx, handle, port))
+      return OMX_ErrorNone;
+   return sendCommand(ctx, handle, OMX_CommandPortDisable, port, cFlag, 1);
+}
 
-   /* Setup input port parameters */
-   imgportdef->nPortIndex = PORT_RSZ;
-   OERR(OMX_GetParameter(ctx->rsz, OMX_IndexParamPortDefinition, imgportdef));
-   imgdef = &imgportdef->format.image;
-   viddef = &portdef->format.video;
+/* Disable both ends of a tunnel, then tear it down; the components free the tunnel buffers.
+ * Both ports must be disabled before either command can complete.
+ */
+static OMX_ERRORTYPE disableTunnel(struct context *ctx, OMX_HANDLETYPE src, int srcPort, uint8_t srcFlag, OMX_HANDLETYPE dst, int dstPort, uint8_t dstFlag) {
+   int srcEnabled = portEnabled(ctx, src, srcPort);
+   int dstEnabled = portEnabled(ctx, dst, dstPort);
+
+   if (srcEnabled)
+      OERR(sendCommand(ctx, src, OMX_CommandPortDisable, srcPort, srcFlag, 0));
+   if (dstEnabled)
+      OERR(sendCommand(ctx, dst, OMX_CommandPortDisable, dstPort, dstFlag, 0));
+   if (srcEnabled)
+      OERR(waitForEvents(ctx, src, srcFlag));
+   if (dstEnabled)
+      OERR(waitForEvents(ctx, dst, dstFlag));
+   ilCore.setupTunnel(src, srcPort, NULL, 0);   /* OMX_TeardownTunnel not defined on rpi */
+   ilCore.setupTunnel(dst, dstPort, NULL, 0);
+   return OMX_ErrorNone;
+}
 
-   /* Set input port image parameters to be same as previous output port */
+/* Compare the parts of a video port format that are set by omxtx */
+static int sameVideoFormat(const OMX_VIDEO_PORTDEFINITIONTYPE *a, const OMX_VIDEO_PORTDEFINITIONTYPE *b) {
+   return a->nFrameWidth == b->nFrameWidth && a->nFrameHeight == b->nFrameHeight
+      && a->nStride == b->nStride && a->nSliceHeight == b->nSliceHeight
+      && a->nBitrate == b->nBitrate && a->xFramerate == b->xFramerate
+      && a->eCompressionFormat == b->eCompressionFormat && a->eColorFormat == b->eColorFormat;
+}
+
+/* Free the decoder input buffers with the decoder in Idle: the port disable
+ * completes once all the buffers have been freed.
+ */
+static OMX_ERRORTYPE releaseDecBuffers(struct context *ctx) {
+   OERR(sendCommand(ctx, ctx->dec, OMX_CommandPortDisable, PORT_DEC, CFLAGS_DEC, 0));
+   freeBuffers(ctx, ctx->dec, PORT_DEC, ctx->decbufs);
+   ctx->decbufs = NULL;
+   free(ctx->decBufInfo);
+   ctx->decBufInfo = NULL;
+   return waitForEvents(ctx, ctx->dec, CFLAGS_DEC);
+}
+
+static OMX_ERRORTYPE releaseEncBuffers(struct context *ctx) {
+   OERR(sendCommand(ctx, ctx->enc, OMX_CommandPortDisable, PORT_ENC+1, CFLAGS_ENC, 0));
+   freeBuffers(ctx, ctx->enc, PORT_ENC+1, ctx->encbufs);
+   ctx->encbufs = NULL;
+   return waitForEvents(ctx, ctx->enc, CFLAGS_ENC);
+}
+
+/* All decoder input buffers are free: nothing has been passed to the decoder yet,
+ * or the decoder has returned them all on the transition to Idle.
+ */
+static int resetDecBuffers(struct context *ctx) {
+   int i;
+
+   if (bufRingInit(&ctx->decFree, ctx->decbufs) != 0)
+      return 1;
+   for (i = 0; ctx->decbufs[i] != NULL; i++)
+      bufRingPush(&ctx->decFree, ctx->decbufs[i]);
+   return 0;
+}
+
+/* Tunnel the output of one stage of the pipeline to the input of the next, or leave the
+ * link to the host filter stage: inverse telecine (-I) takes the decoder output, before a
+ * resize can blend the fields, and decimation on its own (-D) the encoder input, so that
+ * the frames are dropped after the other stages have done their work on them.
+ */
+static OMX_ERRORTYPE linkStages(struct context *ctx, OMX_HANDLETYPE src, int srcPort, OMX_HANDLETYPE dst, int dstPort) {
+   if ((ctx->ivtc && src == ctx->dec) || (!ctx->ivtc && ctx->decimate && dst == ctx->enc)) {
+      ctx->filter.src = src;
+      ctx->filter.srcPort = srcPort;
+      ctx->filter.dst = dst;
+      ctx->filter.dstPort = dstPort;
+      return OMX_ErrorNone;
+   }
+   return ilCore.setupTunnel(src, srcPort, dst, dstPort);
+}
+
+/* Enable a port of the pipeline, as sendCommand() does. The ends of the filter stage's link
+ * aren't tunnelled: their buffers are allocated here, as the encoder output's are, with the
+ * component in Idle or Executing, and the enable is always waited for.
+ */
+static OMX_ERRORTYPE enablePort(struct context *ctx, OMX_HANDLETYPE h, int port, uint8_t cFlag, int wait) {
+   OMXTX_FILTER *fl = &ctx->filter;
+   OMX_PARAM_PORTDEFINITIONTYPE portdef;
+   OMX_BUFFERHEADERTYPE **bufs;
+   int src = h == fl->src && port == fl->srcPort;
+   int i, width, height, stride, slice;
+
+   if (!src && (h != fl->dst || port != fl->dstPort))
+      return sendCommand(ctx, h, OMX_CommandPortEnable, port, cFlag, wait);
+
+   INITME(portdef);
+   portdef.nPortIndex = port;
+   OERR(OMX_GetParameter(h, OMX_IndexParamPortDefinition, &portdef));
+   if (portdef.nBufferCountActual < FILTER_BUFFERS) {
+      portdef.nBufferCountActual = FILTER_BUFFERS;
+      OERR(OMX_SetParameter(h, OMX_IndexParamPortDefinition, &portdef));
+   }
+   if (portdef.eDomain == OMX_PortDomainImage) {   /* The resizer input */
+      width = portdef.format.image.nFrameWidth;
+      height = portdef.format.image.nFrameHeight;
+      stride = portdef.format.image.nStride;
+      slice = portdef.format.image.nSliceHeight;
+   }
+   else {
+      width = portdef.format.video.nFrameWidth;
+      height = portdef.format.video.nFrameHeight;
+      stride = portdef.format.video.nStride;
+      slice = portdef.format.video.nSliceHeight;
+   }
+   if (slice <= 0)
+      slice = height;
+
+   OERR(sendCommand(ctx, h, OMX_CommandPortEnable, port, cFlag, 0));
+   if ((bufs = allocbufs(ctx, h, port)) == NULL)
+      return OMX_ErrorInsufficientResources;
+   if (src) {
+      fl->srcbufs = bufs;
+      fl->srcFlag = cFlag;
+      fl->width = width;
+      fl->height = height;
+      fl->srcStride = stride;
+      fl->srcSlice = slice;
+   }
+   else {
+      fl->dstbufs = bufs;
+      fl->dstFlag = cFlag;
+      fl->dstStride = stride;
+      fl->dstSlice = slice;
+   }
+   OERR(waitForEvents(ctx, h, cFlag));
+   if (bufRingInit(src ? &fl->filled : &fl->free, bufs) != 0)
+      return OMX_ErrorInsufficientResources;
+   for (i = 0; !src && bufs[i] != NULL; i++)
+      bufRingPush(&fl->free, bufs[i]);   /* The input buffers of the next stage are all free */
+   return OMX_ErrorNone;
+}
+
+/* Free the buffers on the ends of the filter stage's link with the components in Idle, as
+ * releaseDecBuffers() does. The ports are left disabled: the next job may not need the link.
+ */
+static OMX_ERRORTYPE releaseFilter(struct context *ctx) {
+   OMXTX_FILTER *fl = &ctx->filter;
+
+   if (fl->srcbufs != NULL) {
+      OERR(sendCommand(ctx, fl->src, OMX_CommandPortDisable, fl->srcPort, fl->srcFlag, 0));
+      freeBuffers(ctx, fl->src, fl->srcPort, fl->srcbufs);
+      fl->srcbufs = NULL;
+      OERR(waitForEvents(ctx, fl->src, fl->srcFlag));
+   }
+   if (fl->dstbufs != NULL) {
+      OERR(sendCommand(ctx, fl->dst, OMX_CommandPortDisable, fl->dstPort, fl->dstFlag, 0));
+      freeBuffers(ctx, fl->dst, fl->dstPort, fl->dstbufs);
+      fl->dstbufs = NULL;
+      OERR(waitForEvents(ctx, fl->dst, fl->dstFlag));
+   }
+   fl->src = fl->dst = NULL;
+   return OMX_ErrorNone;
+}
+
+static OMX_ERRORTYPE configureResizer(struct context *ctx, OMX_PARAM_PORTDEFINITIONTYPE *portdef) {
+   /* Resize and/or crop:
+    * Do using hardware resizer: set input port size to input video size, output port size to
+    * required rescale size. Crop is applied to input using OMX_IndexConfigCommonInputCrop
+    */
+   OMX_VIDEO_PORTDEFINITIONTYPE *viddef;
+   OMX_PARAM_PORTDEFINITIONTYPE imgportdef;
+   OMX_IMAGE_PORTDEFINITIONTYPE *imgdef;
+   
+   INITME(imgportdef);
+
+   OERR(disablePort(ctx, ctx->rsz, PORT_RSZ, CFLAGS_RSZ));
+   OERR(disablePort(ctx, ctx->rsz, PORT_RSZ+1, CFLAGS_RSZ));
+
+   /* Setup input port parameters */
+   imgportdef.nPortIndex = PORT_RSZ;
+   OERR(OMX_GetParameter(ctx->rsz, OMX_IndexParamPortDefinition, &imgportdef));
+   imgdef = &imgportdef.format.image;
+   viddef = &portdef->format.video;
+
+   /* Set input port image parameters to be same as previous output port */
    imgdef->nFrameWidth = viddef->nFrameWidth;
    imgdef->nFrameHeight = viddef->nFrameHeight;
    imgdef->nStride = viddef->nStride;
@@ -984,7 +2167,7 @@ static OMX_PARAM_PORTDEFINITIONTYPE *configureResizer(struct context *ctx, OMX_P
    imgdef->eCompressionFormat = viddef->eCompressionFormat;
    imgdef->eColorFormat = viddef->eColorFormat;
    imgdef->pNativeWindow = viddef->pNativeWindow;
-   OERR(OMX_SetParameter(ctx->rsz, OMX_IndexParamPortDefinition, imgportdef)); /* Set input port parameters */
+   OERR(OMX_SetParameter(ctx->rsz, OMX_IndexParamPortDefinition, &imgportdef)); /* Set input port parameters */
 
    /* Set output port image parameters: same as input port except for output port size */
    if (ctx->userFlags & UFLAGS_CROP) {
@@ -1021,11 +2204,11 @@ static OMX_PARAM_PORTDEFINITIONTYPE *configureResizer(struct context *ctx, OMX_P
    imgdef->nStride = 0;
    imgdef->nSliceHeight = 0;
 
-   imgportdef->nPortIndex = PORT_RSZ+1;
-   OERR(OMX_SetParameter(ctx->rsz, OMX_IndexParamPortDefinition, imgportdef));
+   imgportdef.nPortIndex = PORT_RSZ+1;
+   OERR(OMX_SetParameter(ctx->rsz, OMX_IndexParamPortDefinition, &imgportdef));
    
    /* Setup video port definition for next component */
-   OERR(OMX_GetParameter(ctx->rsz, OMX_IndexParamPortDefinition, imgportdef));
+   OERR(OMX_GetParameter(ctx->rsz, OMX_IndexParamPortDefinition, &imgportdef));
    viddef->nFrameWidth = imgdef->nFrameWidth;
    viddef->nFrameHeight = imgdef->nFrameHeight;
    viddef->nStride = imgdef->nStride;
@@ -1035,51 +2218,51 @@ static OMX_PARAM_PORTDEFINITIONTYPE *configureResizer(struct context *ctx, OMX_P
    viddef->eColorFormat = imgdef->eColorFormat;
    viddef->pNativeWindow = imgdef->pNativeWindow;
 
-   return portdef;
+   return OMX_ErrorNone;
 }
 
-static OMX_PARAM_PORTDEFINITIONTYPE *configureDeinterlacer(struct context *ctx, OMX_PARAM_PORTDEFINITIONTYPE *portdef) {
-   OMX_CONFIG_IMAGEFILTERPARAMSTYPE *image_filter;
+static OMX_ERRORTYPE configureDeinterlacer(struct context *ctx, OMX_PARAM_PORTDEFINITIONTYPE *portdef) {
+   OMX_CONFIG_IMAGEFILTERPARAMSTYPE image_filter;
    OMX_VIDEO_PORTDEFINITIONTYPE *viddef;
-   OMX_PARAM_PORTDEFINITIONTYPE *imgportdef;
+   OMX_PARAM_PORTDEFINITIONTYPE imgportdef;
    OMX_IMAGE_PORTDEFINITIONTYPE *imgdef;
 
    /* Set input port parameters */
-   sendCommand(ctx->dei, OMX_CommandPortDisable, PORT_DEI, CFLAGS_DEI, 1);
+   OERR(disablePort(ctx, ctx->dei, PORT_DEI, CFLAGS_DEI));
 
    /* omxplayer does this */
-   OMX_PARAM_U32TYPE *extra_buffers;
-   MAKEME(extra_buffers, OMX_PARAM_U32TYPE);
-   extra_buffers->nU32 = -2;
-   extra_buffers->nPortIndex = PORT_DEI;
-   OERR(OMX_SetParameter(ctx->dei, OMX_IndexParamBrcmExtraBuffers, extra_buffers));
+   OMX_PARAM_U32TYPE extra_buffers;
+   INITME(extra_buffers);
+   extra_buffers.nU32 = -2;
+   extra_buffers.nPortIndex = PORT_DEI;
+   OERR(OMX_SetParameter(ctx->dei, OMX_IndexParamBrcmExtraBuffers, &extra_buffers));
 
    /*portdef->nPortIndex = PORT_DEI;
    OERR(OMX_SetParameter(ctx->dei, OMX_IndexParamPortDefinition, portdef));*/
 
    /* Setup output port parameters */
-   sendCommand(ctx->dei, OMX_CommandPortDisable, PORT_DEI+1, CFLAGS_DEI, 1);
+   OERR(disablePort(ctx, ctx->dei, PORT_DEI+1, CFLAGS_DEI));
 
    portdef->nPortIndex = PORT_DEI+1;
    OERR(OMX_SetParameter(ctx->dei, OMX_IndexParamPortDefinition, portdef));
-   MAKEME(image_filter, OMX_CONFIG_IMAGEFILTERPARAMSTYPE);
+   INITME(image_filter);
    
    /* Setup filter parameters */
-   image_filter->nPortIndex = PORT_DEI+1;
-   image_filter->nNumParams = 4;
-   image_filter->nParams[0] = ctx->interlaceMode; /* OMX_INTERLACETYPE: see OMX_Broadcom.h. "Modes 1 and 2 are not handled. The line doubler algorithm only takes values 3 or 4, whilst the other two accept 0, 3, 4, or 5."; omxplayer hard codes this to 3. */
-   image_filter->nParams[1] = 0; /* default frame interval */
-   image_filter->nParams[2] = ctx->dei_ofpf; /* Setting one frame per field: NOTE this will double the frame rate and screw up the pts! This will be corrected in emptyEncoderBuffers() by using the duration. */
-   image_filter->nParams[3] = 1; /* use qpus - quad processing units in the gpu */
-   image_filter->eImageFilter = OMX_ImageFilterDeInterlaceAdvanced; /* Options are OMX_ImageFilterDeInterlaceLineDouble, OMX_ImageFilterDeInterlaceAdvanced, and OMX_ImageFilterDeInterlaceFast; see OMX_IVCommon.h for available filters; omxplayer uses OMX_ImageFilterDeInterlaceAdvanced for < 720x576 */
-   OERR(OMX_SetConfig(ctx->dei, OMX_IndexConfigCommonImageFilterParameters, image_filter));
+   image_filter.nPortIndex = PORT_DEI+1;
+   image_filter.nNumParams = 4;
+   image_filter.nParams[0] = ctx->interlaceMode; /* OMX_INTERLACETYPE: see OMX_Broadcom.h. "Modes 1 and 2 are not handled. The line doubler algorithm only takes values 3 or 4, whilst the other two accept 0, 3, 4, or 5."; omxplayer hard codes this to 3. */
+   image_filter.nParams[1] = 0; /* default frame interval */
+   image_filter.nParams[2] = ctx->dei_ofpf; /* Setting one frame per field: NOTE this will double the frame rate and screw up the pts! This will be corrected in emptyEncoderBuffer() by using the duration. */
+   image_filter.nParams[3] = 1; /* use qpus - quad processing units in the gpu */
+   image_filter.eImageFilter = OMX_ImageFilterDeInterlaceAdvanced; /* Options are OMX_ImageFilterDeInterlaceLineDouble, OMX_ImageFilterDeInterlaceAdvanced, and OMX_ImageFilterDeInterlaceFast; see OMX_IVCommon.h for available filters; omxplayer uses OMX_ImageFilterDeInterlaceAdvanced for < 720x576 */
+   OERR(OMX_SetConfig(ctx->dei, OMX_IndexConfigCommonImageFilterParameters, &image_filter));
 
    /* Setup video port definition for next component */
-   MAKEME(imgportdef, OMX_PARAM_PORTDEFINITIONTYPE);
-   imgportdef->nPortIndex = PORT_DEI+1;
-   OERR(OMX_GetParameter(ctx->dei, OMX_IndexParamPortDefinition, imgportdef));
+   INITME(imgportdef);
+   imgportdef.nPortIndex = PORT_DEI+1;
+   OERR(OMX_GetParameter(ctx->dei, OMX_IndexParamPortDefinition, &imgportdef));
 
-   imgdef = &imgportdef->format.image;
+   imgdef = &imgportdef.format.image;
    viddef = &portdef->format.video;
 
    viddef->nFrameWidth = imgdef->nFrameWidth;
@@ -1091,60 +2274,77 @@ static OMX_PARAM_PORTDEFINITIONTYPE *configureDeinterlacer(struct context *ctx,
    viddef->eColorFormat = imgdef->eColorFormat;
    viddef->pNativeWindow = imgdef->pNativeWindow;
 
-   if (image_filter->nParams[2]==0)
+   if (image_filter.nParams[2]==0)
       viddef->xFramerate*=2;
 
-   return portdef;
+   return OMX_ErrorNone;
 }
 
-static OMX_PARAM_PORTDEFINITIONTYPE *configureMonitor(struct context *ctx, OMX_PARAM_PORTDEFINITIONTYPE *portdef) {
+/* The splitter copies its input to each output: output 1 feeds the encoder, output 2 the
+ * video render with -m, and the renditions (-l) and then the thumbnailer (-k) take the
+ * outputs after those.
+ */
+static OMX_ERRORTYPE configureSplitter(struct context *ctx, OMX_PARAM_PORTDEFINITIONTYPE *portdef) {
    OMX_DISPLAYRECTTYPE vidRect;
-   OMX_CONFIG_DISPLAYREGIONTYPE *vidConf;
+   OMX_CONFIG_DISPLAYREGIONTYPE vidConf;
    int i;
 
    for (i = 0; i < 5; i++)
-      sendCommand(ctx->spl, OMX_CommandPortDisable, PORT_SPL+i, CFLAGS_SPL, 1);
-   sendCommand(ctx->vid, OMX_CommandPortDisable, PORT_VID, CFLAGS_VID, 1);
-
-   MAKEME(vidConf,OMX_CONFIG_DISPLAYREGIONTYPE);
-   // TODO: correct aspect ratio
-   /* Don't show video full screen: define size 512x288 */
-   vidRect.x_offset=0;
-   vidRect.y_offset=0;
-   vidRect.width=512;
-   vidRect.height=288;
-
-   vidConf->nPortIndex=PORT_VID;
-   vidConf->set=OMX_DISPLAY_SET_FULLSCREEN|OMX_DISPLAY_SET_DEST_RECT;
-   vidConf->fullscreen=OMX_FALSE;
-   vidConf->dest_rect=vidRect;
-   OERR(OMX_SetConfig(ctx->vid, OMX_IndexConfigDisplayRegion, vidConf));
+      OERR(disablePort(ctx, ctx->spl, PORT_SPL+i, CFLAGS_SPL));
+
+   if (ctx->userFlags & UFLAGS_MONITOR) {
+      OERR(disablePort(ctx, ctx->vid, PORT_VID, CFLAGS_VID));
+
+      INITME(vidConf);
+      // TODO: correct aspect ratio
+      /* Don't show video full screen: define size 512x288 */
+      vidRect.x_offset=0;
+      vidRect.y_offset=0;
+      vidRect.width=512;
+      vidRect.height=288;
+
+      vidConf.nPortIndex=PORT_VID;
+      vidConf.set=OMX_DISPLAY_SET_FULLSCREEN|OMX_DISPLAY_SET_DEST_RECT;
+      vidConf.fullscreen=OMX_FALSE;
+      vidConf.dest_rect=vidRect;
+      OERR(OMX_SetConfig(ctx->vid, OMX_IndexConfigDisplayRegion, &vidConf));
+   }
 
    portdef->nPortIndex = PORT_SPL; /* Input to splitter */
    OERR(OMX_SetParameter(ctx->spl, OMX_IndexParamPortDefinition, portdef));
    portdef->nPortIndex = PORT_SPL+1;
    OERR(OMX_SetParameter(ctx->spl, OMX_IndexParamPortDefinition, portdef));
-   portdef->nPortIndex = PORT_SPL+2;
-   OERR(OMX_SetParameter(ctx->spl, OMX_IndexParamPortDefinition, portdef));
+   if (ctx->userFlags & UFLAGS_MONITOR) {
+      portdef->nPortIndex = PORT_SPL+2;
+      OERR(OMX_SetParameter(ctx->spl, OMX_IndexParamPortDefinition, portdef));
+   }
+   for (i = 0; i < ctx->nRenditions; i++) {
+      portdef->nPortIndex = ctx->renditions[i]->splPort;
+      OERR(OMX_SetParameter(ctx->spl, OMX_IndexParamPortDefinition, portdef));
+   }
+   if (ctx->thumbnailer != NULL) {
+      portdef->nPortIndex = ctx->thumbnailer->splPort;
+      OERR(OMX_SetParameter(ctx->spl, OMX_IndexParamPortDefinition, portdef));
+   }
 
-   return portdef; /* Unchanged in this case: outputs are a copy of input */
+   return OMX_ErrorNone; /* portdef unchanged in this case: outputs are a copy of input */
 }
 
-static void configureBitRate(struct context *ctx) {
-   OMX_PARAM_U32TYPE *qMin, *qMax;
-//   OMX_PARAM_U32TYPE *initQuant, *fLimitBits, *peakRate, *encodeQpP;
-   OMX_VIDEO_PARAM_BITRATETYPE *bitrate;
-   OMX_VIDEO_PARAM_QUANTIZATIONTYPE *quantizationType;
+static OMX_ERRORTYPE configureBitRate(struct context *ctx) {
+   OMX_PARAM_U32TYPE qMin, qMax, initQuant, fLimitBits, peakRate;
+//   OMX_PARAM_U32TYPE *encodeQpP;
+   OMX_VIDEO_PARAM_BITRATETYPE bitrate;
+   OMX_VIDEO_PARAM_QUANTIZATIONTYPE quantizationType;
 
-   MAKEME(bitrate, OMX_VIDEO_PARAM_BITRATETYPE);
-   bitrate->nPortIndex = PORT_ENC+1;
-   bitrate->eControlRate = ctx->controlRateType;
+   INITME(bitrate);
+   bitrate.nPortIndex = PORT_ENC+1;
+   bitrate.eControlRate = ctx->controlRateType;
    switch (ctx->controlRateType) {
       case OMX_Video_ControlRateVariable:
-         bitrate->nTargetBitrate = ctx->bitrate;
+         bitrate.nTargetBitrate = ctx->abrRate;   /* ctx->bitrate, or where -A / -F start from */
       break;
       case OMX_Video_ControlRateDisable:
-         bitrate->nTargetBitrate = 0;
+         bitrate.nTargetBitrate = 0;
       break;
       case OMX_Video_ControlRateConstant:
          /* Constant bit rates are only supported on baseline profile
@@ -1160,9 +2360,9 @@ static void configureBitRate(struct context *ctx) {
           */
       default:
          fprintf(stderr, "ERROR: Rate control mode not supported!\n");
-         exit(1);
+         return OMX_ErrorUnsupportedSetting;
    }
-   OERR(OMX_SetParameter(ctx->enc, OMX_IndexParamVideoBitrate, bitrate));
+   OERR(OMX_SetParameter(ctx->enc, OMX_IndexParamVideoBitrate, &bitrate));
 
    /* VBR mode settings: note that the target bit rate is still used.
     * Set target bit rate high to use rate control based on only
@@ -1170,42 +2370,43 @@ static void configureBitRate(struct context *ctx) {
     */
    if (ctx->controlRateType==OMX_Video_ControlRateVariable) {
       if (ctx->qMin > 0) {
-         MAKEME(qMin, OMX_PARAM_U32TYPE);
-         qMin->nPortIndex = PORT_ENC+1;
-         qMin->nU32 = ctx->qMin;
-         OERR(OMX_SetParameter(ctx->enc, OMX_IndexParamBrcmVideoEncodeMinQuant, qMin));
+         INITME(qMin);
+         qMin.nPortIndex = PORT_ENC+1;
+         qMin.nU32 = ctx->qMin;
+         OERR(OMX_SetParameter(ctx->enc, OMX_IndexParamBrcmVideoEncodeMinQuant, &qMin));
       }
       if (ctx->qMax > 0) {
-         MAKEME(qMax, OMX_PARAM_U32TYPE);
-         qMax->nPortIndex = PORT_ENC+1;
-         qMax->nU32 = ctx->qMax;
-         OERR(OMX_SetParameter(ctx->enc, OMX_IndexParamBrcmVideoEncodeMaxQuant, qMax));
+         INITME(qMax);
+         qMax.nPortIndex = PORT_ENC+1;
+         qMax.nU32 = ctx->qMax;
+         OERR(OMX_SetParameter(ctx->enc, OMX_IndexParamBrcmVideoEncodeMaxQuant, &qMax));
       }
       /* Used in RC: frames larger than this will be discarded by the encoder */
-      /* Not tested
-      MAKEME(fLimitBits, OMX_PARAM_U32TYPE);
-      fLimitBits->nPortIndex = PORT_ENC+1;
-      fLimitBits->nU32 = 0;
-      OERR(OMX_SetParameter(ctx->enc, OMX_IndexParamBrcmVideoFrameLimitBits, fLimitBits));
-      */
+      if (ctx->encOpt[XOPT_FRAMELIMIT] > 0) {
+         INITME(fLimitBits);
+         fLimitBits.nPortIndex = PORT_ENC+1;
+         fLimitBits.nU32 = ctx->encOpt[XOPT_FRAMELIMIT];
+         OERR(OMX_SetParameter(ctx->enc, OMX_IndexParamBrcmVideoFrameLimitBits, &fLimitBits));
+      }
 
       /* Used in RC: Peak video bitrate in bits per second.
        * Must be larger or equal to the average video bitrate.
        * Ignored for constant bitrate mode
        */
-      /* Not tested
-      MAKEME(peakRate, OMX_PARAM_U32TYPE);
-      peakRate->nPortIndex = PORT_ENC+1;
-      peakRate->nU32 = 0;
-      OERR(OMX_SetParameter(ctx->enc, OMX_IndexParamBrcmVideoPeakRate, peakRate));
-      */
-      /* Not tested - I assume this only applies to RC?
-      MAKEME(initQuant, OMX_PARAM_U32TYPE);
-      initQuant->nPortIndex = PORT_ENC+1;
-      initQuant->nU32 = 2;
-      OERR(OMX_GetParameter(ctx->enc, OMX_IndexParamBrcmVideoInitialQuant, initQuant));
-      printf("OMX_IndexParamBrcmVideoInitialQuant: q=%li\n", initQuant->nU32);
-      */
+      if (ctx->encOpt[XOPT_PEAKRATE] > 0) {
+         INITME(peakRate);
+         peakRate.nPortIndex = PORT_ENC+1;
+         peakRate.nU32 = ctx->encOpt[XOPT_PEAKRATE];
+         OERR(OMX_SetParameter(ctx->enc, OMX_IndexParamBrcmVideoPeakRate, &peakRate));
+      }
+
+      /* I assume this only applies to RC? */
+      if (ctx->encOpt[XOPT_INITQ] > 0) {
+         INITME(initQuant);
+         initQuant.nPortIndex = PORT_ENC+1;
+         initQuant.nU32 = ctx->encOpt[XOPT_INITQ];
+         OERR(OMX_SetParameter(ctx->enc, OMX_IndexParamBrcmVideoInitialQuant, &initQuant));
+      }
    }
 
    /* Constant quantisation mode settings: set target Qp / QI */
@@ -1220,118 +2421,315 @@ static void configureBitRate(struct context *ctx) {
       */
       
       /* This is only used for OMX_Video_ControlRateDisable */
-      MAKEME(quantizationType, OMX_VIDEO_PARAM_QUANTIZATIONTYPE);
-      quantizationType->nPortIndex = PORT_ENC+1;
-      quantizationType->nQpI=ctx->qI;
-      quantizationType->nQpP=ctx->qP;
-      quantizationType->nQpB=0;  /* No B frames on rpi: must be set to 0 */
-      OERR(OMX_SetParameter(ctx->enc, OMX_IndexParamVideoQuantization, quantizationType));
+      INITME(quantizationType);
+      quantizationType.nPortIndex = PORT_ENC+1;
+      quantizationType.nQpI=ctx->qI;
+      quantizationType.nQpP=ctx->qP;
+      quantizationType.nQpB=0;  /* No B frames on rpi: must be set to 0 */
+      OERR(OMX_SetParameter(ctx->enc, OMX_IndexParamVideoQuantization, &quantizationType));
    }
+   return OMX_ErrorNone;
 }
 
-/* This is called after configureBitRate() and is intended to
- * test available parameters
+/* Encoder tuning knobs (-X): called after configureBitRate(). Also tried, and not
+ * exposed:
+ * OMX_IndexConfigBrcmVideoH264LowLatency: hangs omxtx if set to OMX_TRUE, and blocks
+ *    the HW - had to reboot! No error in log (/opt/vc/bin/vcdbg log msg)
+ * OMX_IndexParamBrcmVideoRCSliceDQuant: doesn't seem to do anything - probably for VC1
+ * OMX_IndexParamVideoMotionVector, OMX_IndexParamVideoVBSMC: not supported, return
+ *    error code 0x8000101A: OMX_ErrorUnsupportedIndex
  */
-static void configureTestOpts(struct context *ctx) {
-   /* Codec specific settings - not all are supported
-    * loop filter on / off seemed to work (defaults to on)
-    * bUseHadamard seemed to work (defaults to FALSE)
-    */
-/*
-   OMX_VIDEO_PARAM_AVCTYPE *avcSettings;
-   MAKEME(avcSettings, OMX_VIDEO_PARAM_AVCTYPE);
-   avcSettings->nPortIndex = PORT_ENC+1;
-   OERR(OMX_GetParameter(ctx->enc, OMX_IndexParamVideoAvc, avcSettings));
-   avcSettings->eLoopFilterMode=OMX_VIDEO_AVCLoopFilterEnable;
-   avcSettings->bUseHadamard=OMX_FALSE;
-   OERR(OMX_SetParameter(ctx->enc, OMX_IndexParamVideoAvc, avcSettings));
-*/
+static OMX_ERRORTYPE configureEncoderOpts(struct context *ctx) {
+   OMX_VIDEO_PARAM_AVCTYPE avcSettings;
+   OMX_VIDEO_PARAM_INTRAREFRESHTYPE iRefreshType;
+   OMX_PARAM_U32TYPE deblockIDC, intraMB;
+   int i;
+
+   if (ctx->userFlags & UFLAGS_VERBOSE)
+      for (i=0; i<NXOPTS; i++)
+         if (ctx->encOpt[i] >= 0)
+            fprintf(stderr, "Encoder option %s=%d\n", encoderOptions[i].name, ctx->encOpt[i]);
+
+   /* Codec specific settings: loop filter defaults to on, bUseHadamard to FALSE */
+   if (ctx->encOpt[XOPT_LOOPFILTER] >= 0 || ctx->encOpt[XOPT_HADAMARD] >= 0) {
+      INITME(avcSettings);
+      avcSettings.nPortIndex = PORT_ENC+1;
+      OERR(OMX_GetParameter(ctx->enc, OMX_IndexParamVideoAvc, &avcSettings));
+      if (ctx->encOpt[XOPT_LOOPFILTER] >= 0)
+         avcSettings.eLoopFilterMode = ctx->encOpt[XOPT_LOOPFILTER] ? OMX_VIDEO_AVCLoopFilterEnable : OMX_VIDEO_AVCLoopFilterDisable;
+      if (ctx->encOpt[XOPT_HADAMARD] >= 0)
+         avcSettings.bUseHadamard = ctx->encOpt[XOPT_HADAMARD] ? OMX_TRUE : OMX_FALSE;
+      OERR(OMX_SetParameter(ctx->enc, OMX_IndexParamVideoAvc, &avcSettings));
+   }
 
    /* Seems to take values 0-2.9, i.e. probably integer 0, 1 or 2
     * Seems to affect the strength of the deblocking filter, with 2 being most smoothed
     */
-/*
-   MAKEME(deblockIDC, OMX_PARAM_U32TYPE);
-   deblockIDC->nPortIndex = PORT_ENC+1;
-   deblockIDC->nU32 = 2;
-   OERR(OMX_SetConfig(ctx->enc, OMX_IndexConfigBrcmVideoH264DeblockIDC, deblockIDC));
-*/
-   
+   if (ctx->encOpt[XOPT_DEBLOCK] >= 0) {
+      INITME(deblockIDC);
+      deblockIDC.nPortIndex = PORT_ENC+1;
+      deblockIDC.nU32 = ctx->encOpt[XOPT_DEBLOCK];
+      OERR(OMX_SetConfig(ctx->enc, OMX_IndexConfigBrcmVideoH264DeblockIDC, &deblockIDC));
+   }
+
    /* Takes values 0 to 7: no visible difference on test encode */
-/*
-   MAKEME(intraMB, OMX_PARAM_U32TYPE);
-   intraMB->nPortIndex = PORT_ENC+1;
-   intraMB->nU32 = 0;
-   OERR(OMX_SetConfig(ctx->enc, OMX_IndexConfigBrcmVideoH264IntraMBMode, intraMB));
-*/
-   
-   /* This causes omxtx to hang if set to OMX_TRUE
-    * and blocks HW - had to reboot!
-    * no error in log (/opt/vc/bin/vcdbg log msg)
+   if (ctx->encOpt[XOPT_INTRAMB] >= 0) {
+      INITME(intraMB);
+      intraMB.nPortIndex = PORT_ENC+1;
+      intraMB.nU32 = ctx->encOpt[XOPT_INTRAMB];
+      OERR(OMX_SetConfig(ctx->enc, OMX_IndexConfigBrcmVideoH264IntraMBMode, &intraMB));
+   }
+
+   /* Cyclic only: OMX_VIDEO_IntraRefreshAdaptive is accepted too, but untested */
+   if (ctx->encOpt[XOPT_INTRAREFRESH] >= 0) {
+      INITME(iRefreshType);
+      iRefreshType.nPortIndex = PORT_ENC+1;
+      OERR(OMX_GetParameter(ctx->enc, OMX_IndexParamVideoIntraRefresh, &iRefreshType));
+      iRefreshType.eRefreshMode = OMX_VIDEO_IntraRefreshCyclic;
+      iRefreshType.nCirMBs = ctx->encOpt[XOPT_INTRAREFRESH];
+      OERR(OMX_SetParameter(ctx->enc, OMX_IndexParamVideoIntraRefresh, &iRefreshType));
+   }
+   return OMX_ErrorNone;
+}
+
+/* The frame rate of the frames the encoder gets, in place of *xFramerate (Q16), the rate
+ * into the filter stage: the film rate, 4/5 of it, with -I, and no more than the rate of
+ * -D. It is kept exactly in filter.fps for configureOutput(), from the input stream's
+ * rate if that is the same. A rendition only sees the frames -D drops if -I puts the
+ * filter stage ahead of the splitter: see linkStages().
+ */
+static void filterFrameRate(struct context *ctx, OMX_U32 *xFramerate) {
+   AVRational fps;
+
+   ctx->filter.fps = (AVRational){0, 1};
+   if (*xFramerate == 0)   /* Unknown: configureOutput() uses the input's */
+      return;
+   ctx->filter.frameTime = (double)ctx->omxtimebase.den*(1<<16) / *xFramerate;
+   if (ctx->ivtc) {
+      fps = av_guess_frame_rate(ctx->ic, ctx->ic->streams[ctx->inVidStreamIdx], NULL);
+      if (fps.num <= 0 || fps.den <= 0 || fabs(av_q2d(fps)*(1<<16) - *xFramerate) > 1)
+         fps = (AVRational){*xFramerate, 1<<16};
+      ctx->filter.fps = av_mul_q(fps, (AVRational){IVTC_CYCLE-1, IVTC_CYCLE});
+   }
+   if (ctx->decimate && ctx->decimateFps > 0 && (ctx->parent == NULL || ctx->ivtc)
+         && ctx->decimateFps*(1<<16) < (ctx->filter.fps.num > 0 ? av_q2d(ctx->filter.fps)*(1<<16) : *xFramerate))
+      ctx->filter.fps = av_d2q(ctx->decimateFps, 1001000);
+   if (ctx->filter.fps.num > 0)
+      *xFramerate = av_q2d(ctx->filter.fps)*(1<<16) + 0.5;
+}
+
+/* Set up the encoder input port from portdef, the output port of the component before it.
+ * In batch mode the encoder output buffers from the last job are kept if the output
+ * format is the same. If not, free them before the input port is changed.
+ */
+static OMX_ERRORTYPE configureEncoderInput(struct context *ctx, OMX_PARAM_PORTDEFINITIONTYPE *portdef) {
+   OMX_VIDEO_PORTDEFINITIONTYPE encFormat;
+
+   filterFrameRate(ctx, &portdef->format.video.xFramerate);
+   encFormat = portdef->format.video;
+   encFormat.nBitrate = ctx->bitrate;
+   encFormat.eCompressionFormat = OMX_VIDEO_CodingAVC;
+   if (ctx->encbufs != NULL && !sameVideoFormat(&ctx->encFormat, &encFormat))
+      OERR(releaseEncBuffers(ctx));
+
+   OERR(disablePort(ctx, ctx->enc, PORT_ENC, CFLAGS_ENC));
+   if (ctx->encbufs == NULL)
+      OERR(disablePort(ctx, ctx->enc, PORT_ENC+1, CFLAGS_ENC));
+
+   portdef->nPortIndex = PORT_ENC;
+   OERR(OMX_SetParameter(ctx->enc, OMX_IndexParamPortDefinition, portdef)); /* Copy portdef of last component */
+   return OMX_ErrorNone;
+}
+
+/* Set up the encoder output port and allocate its buffers, with the encoder in Idle.
+ * portdef is the encoder input port definition on entry, and the output port's on return.
+ */
+static OMX_ERRORTYPE configureEncoderOutput(struct context *ctx, OMX_PARAM_PORTDEFINITIONTYPE *portdef) {
+   OMX_VIDEO_PORTDEFINITIONTYPE *viddef = &portdef->format.video;
+
+   if (ctx->encbufs == NULL) {
+      /* setup encoder output port  - viddef points to format.video of previous component output port */
+      viddef->nBitrate = ctx->bitrate; /* Target bit rate for VBR mode; rate control disabled if set to 0; overriden by OMX_IndexParamVideoBitrate below */
+      viddef->eCompressionFormat = OMX_VIDEO_CodingAVC;
+      ctx->encFormat = *viddef;
+      portdef->nPortIndex = PORT_ENC+1;
+      OERR(OMX_SetParameter(ctx->enc, OMX_IndexParamPortDefinition, portdef));
+
+      OERR(configureBitRate(ctx));
+      OERR(configureEncoderOpts(ctx));
+
+      /* Allowed values for pixel aspect are: 1:1, 10:11, 16:11, 40:33, 59:54, and 118:81
+       * Note that these aspect ratios do not include overscan.
+       * Corresponding display aspect ratio (DVD):
+       * NTSC 10:11 -> 4:3 DAR
+       * NTSC 40:33 -> 16:9 DAR
+       * PAL 59:54 -> 4:3 DAR (for ANALOGUE signals: won't produce an integer of 16)
+       * PAL 16:11 -> 16:9 DAR
+       * PAL 118:81 -> 16:9 DAR (for ANALOGUE signals: won't produce an integer of 16)
+       */
+      if (ctx->userFlags & UFLAGS_RESIZE) { /* Probably defaults to this anyway... */
+         OMX_CONFIG_POINTTYPE pixaspect; 
+         INITME(pixaspect);
+         pixaspect.nPortIndex = PORT_ENC+1;
+         pixaspect.nX = 1;
+         pixaspect.nY = 1;
+         OERR(OMX_SetParameter(ctx->enc, OMX_IndexParamBrcmPixelAspectRatio, &pixaspect));
+      }
+
+      /* Allocate buffers; state must be idle & port disabled
+       * Buffer allocation occurs during transition to state enabled.
+       * Encoder only requires 1 output buffer; the buffer size varies
+       * depending on input image size, doesn't seem to change with output size.
+       * Around 500k for dvd stream, 3.5M for 1080p h264 stream.
+       * Ask for at least ENC_BUFFERS so that the encoder can carry on filling
+       * buffers whilst drainEncoder() is muxing the previous ones.
+       */
+      OERR(OMX_GetParameter(ctx->enc, OMX_IndexParamPortDefinition, portdef));
+      if (portdef->nBufferCountActual < ENC_BUFFERS) {
+         portdef->nBufferCountActual = ENC_BUFFERS;
+         OERR(OMX_SetParameter(ctx->enc, OMX_IndexParamPortDefinition, portdef));
+      }
+      OERR(sendCommand(ctx, ctx->enc, OMX_CommandPortEnable, PORT_ENC+1, CFLAGS_ENC, 0));
+      ctx->encbufs = allocbufs(ctx, ctx->enc, PORT_ENC+1);
+      if (ctx->encbufs == NULL)
+         return OMX_ErrorInsufficientResources;
+      OERR(waitForEvents(ctx, ctx->enc, CFLAGS_ENC));
+   }
+   else {
+      if (ctx->userFlags & UFLAGS_VERBOSE)
+         fprintf(stderr, "Encoder output format unchanged: keeping the output buffers\n");
+      portdef->nPortIndex = PORT_ENC+1;
+      OERR(OMX_GetParameter(ctx->enc, OMX_IndexParamPortDefinition, portdef));
+   }
+   if (bufRingInit(&ctx->encFilled, ctx->encbufs) != 0)
+      return OMX_ErrorInsufficientResources;
+   return OMX_ErrorNone;
+}
+
+/* Enable the splitter ports, and the monitor, rendition and thumbnailer branches tunnelled
+ * from them. As for the rest of the pipeline, the input end of each tunnel is waited for
+ * and the output end isn't: see configure(). The thumbnailer's resizer output isn't
+ * tunnelled: its buffers are allocated here, as the encoder's are, with it in Idle.
+ */
+static OMX_ERRORTYPE enableSplitter(struct context *ctx) {
+   OMX_PARAM_PORTDEFINITIONTYPE portdef;
+   struct context *r;
+   int i;
+
+   if (ctx->userFlags & UFLAGS_MONITOR)
+      OERR(sendCommand(ctx, ctx->vid, OMX_CommandPortEnable, PORT_VID, CFLAGS_VID, 1));
+   OERR(enablePort(ctx, ctx->spl, PORT_SPL, CFLAGS_SPL, 1));
+   OERR(enablePort(ctx, ctx->spl, PORT_SPL+1, CFLAGS_SPL, 0)); /* Encoder - don't wait, encoder port not yet enabled */
+   if (ctx->userFlags & UFLAGS_MONITOR)
+      OERR(sendCommand(ctx, ctx->spl, OMX_CommandPortEnable, PORT_SPL+2, CFLAGS_SPL, 1)); /* Video render */
+   for (i = 0; i < ctx->nRenditions; i++) {
+      r = ctx->renditions[i];
+      OERR(sendCommand(ctx, ctx->spl, OMX_CommandPortEnable, r->splPort, CFLAGS_SPL, 0));
+      OERR(sendCommand(r, r->rsz, OMX_CommandPortEnable, PORT_RSZ, CFLAGS_RSZ, 1));
+      OERR(sendCommand(r, r->rsz, OMX_CommandPortEnable, PORT_RSZ+1, CFLAGS_RSZ, 0)); /* Don't wait */
+      OERR(sendCommand(r, r->enc, OMX_CommandPortEnable, PORT_ENC, CFLAGS_ENC, 1));
+      OERR(waitForEvents(r, r->rsz, CFLAGS_RSZ));
+   }
+   if ((r = ctx->thumbnailer) != NULL) {
+      OERR(sendCommand(ctx, ctx->spl, OMX_CommandPortEnable, r->splPort, CFLAGS_SPL, 0));
+      OERR(sendCommand(r, r->rsz, OMX_CommandPortEnable, PORT_RSZ, CFLAGS_RSZ, 1));
+      INITME(portdef);
+      portdef.nPortIndex = PORT_RSZ+1;
+      OERR(OMX_GetParameter(r->rsz, OMX_IndexParamPortDefinition, &portdef));
+      if (portdef.nBufferCountActual < THUMB_BUFFERS) {
+         portdef.nBufferCountActual = THUMB_BUFFERS;
+         OERR(OMX_SetParameter(r->rsz, OMX_IndexParamPortDefinition, &portdef));
+      }
+      OERR(sendCommand(r, r->rsz, OMX_CommandPortEnable, PORT_RSZ+1, CFLAGS_RSZ, 0));
+      r->encbufs = allocbufs(r, r->rsz, PORT_RSZ+1);
+      if (r->encbufs == NULL)
+         return OMX_ErrorInsufficientResources;
+      OERR(waitForEvents(r, r->rsz, CFLAGS_RSZ));
+      if (bufRingInit(&r->encFilled, r->encbufs) != 0)
+         return OMX_ErrorInsufficientResources;
+   }
+   return OMX_ErrorNone;
+}
+
+/* The frame rate and output context, from portdef, the encoder output port definition */
+static OMX_ERRORTYPE configureOutput(struct context *ctx, OMX_PARAM_PORTDEFINITIONTYPE *portdef) {
+   OMX_VIDEO_PARAM_PROFILELEVELTYPE level;
+   AVCodecParameters *vpar;
+
+   INITME(level);
+   level.nPortIndex = PORT_ENC+1;
+   OERR(OMX_GetParameter(ctx->enc, OMX_IndexParamVideoProfileLevelCurrent, &level));
+
+   /* Get the frame rate at the encoder output
+    * This is detected and set by the decoder:
+    * seems to be set from stream data if present or from omx ticks
+    * Constant framerate is assumed.
     */
-/*
-   OMX_CONFIG_BOOLEANTYPE *lowLat;
-   MAKEME(lowLat, OMX_CONFIG_BOOLEANTYPE);
-   lowLat->bEnabled=OMX_FALSE;
-   OERR(OMX_SetConfig(ctx->enc, OMX_IndexConfigBrcmVideoH264LowLatency, lowLat));
-*/
-   
-   /* This doesn't seem to do anything - probably for VC1 */
-/*
-   MAKEME(dQuant, OMX_PARAM_U32TYPE);
-   dQuant->nPortIndex = PORT_ENC+1;
-   dQuant->nU32 = 0;
-   OERR(OMX_SetParameter(ctx->enc, OMX_IndexParamBrcmVideoRCSliceDQuant, dQuant));
-*/
+   if (portdef->format.video.xFramerate==0) {   /* If unknown use average fps from input */
+      fprintf(stderr, "WARNING: frame rate unknown - setting rate from input. This may not be correct!\n");
+      portdef->format.video.xFramerate=(ctx->ic->streams[ctx->inVidStreamIdx]->avg_frame_rate.num/ctx->ic->streams[ctx->inVidStreamIdx]->avg_frame_rate.den)*(1<<16);
+   }
+
+   ctx->nalEntry.fps.num=portdef->format.video.xFramerate;   /* Q16 format */
+   ctx->nalEntry.fps.den=(1<<16);
+   if (ctx->filter.fps.num > 0)
+      ctx->nalEntry.fps = ctx->filter.fps;   /* -I, -D: as filterFrameRate() set it */
    
-   /* Not supported - returns error code 0x8000101A: OMX_ErrorUnsupportedIndex */
-/*
-   OMX_VIDEO_PARAM_MOTIONVECTORTYPE *mVectorType;
-   MAKEME(mVectorType, OMX_VIDEO_PARAM_MOTIONVECTORTYPE);
-   mVectorType->nPortIndex = PORT_ENC+1;
-   OERR(OMX_GetParameter(ctx->enc, OMX_IndexParamVideoMotionVector, mVectorType));
-   mVectorType->eAccuracy=OMX_Video_MotionVectorPixel;
-   OERR(OMX_SetParameter(ctx->enc, OMX_IndexParamVideoMotionVector, mVectorType));
-*/
-
-   /* This is supported */
-/*
-   OMX_VIDEO_PARAM_INTRAREFRESHTYPE *iRefreshType;
-   MAKEME(iRefreshType, OMX_VIDEO_PARAM_INTRAREFRESHTYPE);
-   iRefreshType->nPortIndex = PORT_ENC+1;
-   OERR(OMX_GetParameter(ctx->enc, OMX_IndexParamVideoIntraRefresh, iRefreshType));
-   //iRefreshType->eRefreshMode=OMX_VIDEO_IntraRefreshAdaptive;
-   iRefreshType->eRefreshMode=OMX_VIDEO_IntraRefreshCyclic;
-   iRefreshType->nCirMBs=16;
-   OERR(OMX_SetParameter(ctx->enc, OMX_IndexParamVideoIntraRefresh, iRefreshType));
-*/
-
-   /* Not supported - returns error code 0x8000101A: OMX_ErrorUnsupportedIndex */
-/*
-   OMX_VIDEO_PARAM_VBSMCTYPE *variableBlockSizeMC;
-   MAKEME(variableBlockSizeMC, OMX_VIDEO_PARAM_INTRAREFRESHTYPE);
-   variableBlockSizeMC->nPortIndex = PORT_ENC+1;
-   OERR(OMX_GetParameter(ctx->enc, OMX_IndexParamVideoVBSMC, variableBlockSizeMC));
-   variableBlockSizeMC->b16x16=OMX_FALSE;
-   OERR(OMX_SetParameter(ctx->enc, OMX_IndexParamVideoVBSMC, variableBlockSizeMC));
-*/
-}
-
-static void configure(struct context *ctx) {
-   OMX_VIDEO_PARAM_PROFILELEVELTYPE *level;
-   OMX_PARAM_PORTDEFINITIONTYPE *portdef;
-   OMX_VIDEO_PORTDEFINITIONTYPE *viddef;
+   ctx->omxFPS=av_q2d(ctx->nalEntry.fps); /* Convert to double */
+   ctx->nalEntry.duration=(double)ctx->omxtimebase.den/ctx->omxFPS;  /* Estimate frame duration in omx timebase units */
+
+   /* Make an output context if output is not raw: the OMX_VIDEO reported values describe the video */
+   if ((ctx->userFlags & UFLAGS_RAW) == 0) {
+      vpar = avcodec_parameters_alloc();
+      if (vpar != NULL) {
+         vpar->codec_type = AVMEDIA_TYPE_VIDEO;
+         vpar->codec_id = AV_CODEC_ID_H264;
+         vpar->width = portdef->format.video.nFrameWidth;
+         vpar->height = portdef->format.video.nFrameHeight;
+         vpar->bit_rate = ctx->bitrate;        /* User specified bit rate or default */
+         vpar->profile = mapProfile(ctx, level.eProfile);
+         vpar->level = mapLevel(ctx, level.eLevel);
+         vpar->format = mapColour(ctx, portdef->format.video.eColorFormat);
+         ctx->oc = makeOutputContext(ctx, vpar);
+         avcodec_parameters_free(&vpar);
+      }
+      if (!ctx->oc) {
+         fprintf(stderr, "ERROR: Create output AVFormatContext failed.\n");
+         return OMX_ErrorInsufficientResources;
+      }
+   }
+   ctx->state=OPENOUTPUT;
+   return OMX_ErrorNone;
+}
+
+/* Set up and start the pipeline from the decoder output:
+ *    dec -> [dei] -> [rsz] -> [spl -> vid] -> enc
+ * With renditions (-l) the splitter comes before the resizer, and each rendition has
+ * a resizer and encoder of its own on a splitter output, so that the input is decoded
+ * (and deinterlaced) once for all the outputs. The thumbnailer (-k) is a branch of the
+ * same kind, with a resizer whose output buffers are returned to the host:
+ *    dec -> [dei] -> spl -> [rsz] -> enc
+ *                       -> [vid]
+ *                       -> rsz -> enc, for each rendition
+ *                       -> rsz -> host, for the thumbnails (-k)
+ */
+static OMX_ERRORTYPE configure(struct context *ctx) {
+   OMX_PARAM_PORTDEFINITIONTYPE portdef;
+   OMX_PARAM_PORTDEFINITIONTYPE rdef[MAX_RENDITIONS];   /* Renditions: the output of their resizer, then encoder */
+   OMX_PARAM_PORTDEFINITIONTYPE tdef;   /* Thumbnailer: the output of its resizer */
    OMX_HANDLETYPE prev; /* Used in setting pipelines: previous handle */
-   OMX_CONFIG_INTERLACETYPE *interlaceType;
-   int pp;
+   OMX_CONFIG_INTERLACETYPE interlaceType;
+   struct context *r, *t = ctx->thumbnailer;
+   int branches = ctx->nRenditions > 0 || t != NULL;   /* Splitter straight after the decoder / deinterlacer */
+   int pp, i, j;
 
-   MAKEME(portdef, OMX_PARAM_PORTDEFINITIONTYPE);
+   INITME(portdef);
 
    /* Get type of interlacing used, if any */
-   MAKEME(interlaceType, OMX_CONFIG_INTERLACETYPE);
-   interlaceType->nPortIndex = PORT_DEC+1;
-   OERR(OMX_GetConfig(ctx->dec, OMX_IndexConfigCommonInterlace, interlaceType));
-   ctx->interlaceMode=interlaceType->eMode;
+   INITME(interlaceType);
+   interlaceType.nPortIndex = PORT_DEC+1;
+   OERR(OMX_GetConfig(ctx->dec, OMX_IndexConfigCommonInterlace, &interlaceType));
+   ctx->interlaceMode=interlaceType.eMode;
    switch (ctx->interlaceMode) {
       case OMX_InterlaceProgressive: /* mode 0: no need for de-interlacer */
          if (ctx->userFlags & UFLAGS_DEINTERLACE)
@@ -1350,11 +2748,11 @@ static void configure(struct context *ctx) {
       case OMX_InterlaceFieldsInterleavedUpperFirst:
       case OMX_InterlaceFieldsInterleavedLowerFirst:
       case OMX_InterlaceMixed:
-         fprintf(stderr, "WARNING: *** Interlaced source material detected! Interlace type: %i ***\n", interlaceType->eMode);
+         fprintf(stderr, "WARNING: *** Interlaced source material detected! Interlace type: %i ***\n", interlaceType.eMode);
          fprintf(stderr, "WARNING: *** Consider using the de-interlacer option -d ***\n");
       break;
       default:
-         fprintf(stderr, "WARNING: *** Unknown interlace / progressive scan type: %i ***\n", interlaceType->eMode);
+         fprintf(stderr, "WARNING: *** Unknown interlace / progressive scan type: %i ***\n", interlaceType.eMode);
       break;
    }
 
@@ -1362,293 +2760,467 @@ static void configure(struct context *ctx) {
       fprintf(stderr, "Setting up encoder.\n");
 
    /* Get the decoder OUTPUT port state */
-   portdef->nPortIndex = PORT_DEC+1;
-   OERR(OMX_GetParameter(ctx->dec, OMX_IndexParamPortDefinition, portdef));
+   portdef.nPortIndex = PORT_DEC+1;
+   OERR(OMX_GetParameter(ctx->dec, OMX_IndexParamPortDefinition, &portdef));
 
    if (ctx->userFlags & UFLAGS_DEINTERLACE) 
-      portdef=configureDeinterlacer(ctx, portdef);
+      OERR(configureDeinterlacer(ctx, &portdef));
+
+   if (branches) {
+      OERR(configureSplitter(ctx, &portdef));
+      for (i = 0; i < ctx->nRenditions; i++) {
+         r = ctx->renditions[i];
+         rdef[i] = portdef;
+         OERR(configureResizer(r, &rdef[i]));
+         OERR(configureEncoderInput(r, &rdef[i]));
+      }
+      if (t != NULL) {
+         tdef = portdef;
+         if (t->thumbs.height == 0)
+            t->outputHeight = t->thumbs.height = (ctx->userFlags & UFLAGS_CROP)
+               ? thumbHeight(ctx, ctx->cropRect->nWidth, ctx->cropRect->nHeight)
+               : thumbHeight(ctx, portdef.format.video.nFrameWidth, portdef.format.video.nFrameHeight);
+         OERR(configureResizer(t, &tdef));
+         t->thumbs.stride = tdef.format.video.nStride;
+         t->thumbs.sliceHeight = tdef.format.video.nSliceHeight > 0 ? tdef.format.video.nSliceHeight : t->outputHeight;
+      }
+   }
 
    if (ctx->userFlags & UFLAGS_RESIZE || ctx->userFlags & UFLAGS_CROP)
-      portdef=configureResizer(ctx, portdef);
-
-   if (ctx->userFlags & UFLAGS_MONITOR)
-     portdef=configureMonitor(ctx, portdef);
+      OERR(configureResizer(ctx, &portdef));
 
-   sendCommand(ctx->enc, OMX_CommandPortDisable, PORT_ENC, CFLAGS_ENC, 1);
-   sendCommand(ctx->enc, OMX_CommandPortDisable, PORT_ENC+1, CFLAGS_ENC, 1);
+   if (ctx->userFlags & UFLAGS_MONITOR && !branches)
+      OERR(configureSplitter(ctx, &portdef));
 
    /* Setup the encoder input port: portdef points to output port definition of the last component */
-   viddef = &portdef->format.video;
-   portdef->nPortIndex = PORT_ENC;
-   OERR(OMX_SetParameter(ctx->enc, OMX_IndexParamPortDefinition, portdef)); /* Copy portdef of last component */
+   OERR(configureEncoderInput(ctx, &portdef));
 
-   /* Setup the tunnel(s): */
+   /* Setup the tunnel(s), and the link taken by the filter stage (-I, -D) if any: */
+   ctx->filter.src = ctx->filter.dst = NULL;
    prev = ctx->dec;   /* Start of tunnel: the decoder */
    pp = PORT_DEC+1;   /* Start of tunnel: decoder output */
 
    if (ctx->userFlags & UFLAGS_DEINTERLACE) {
-      OERR(OMX_SetupTunnel(prev, pp, ctx->dei, PORT_DEI));
+      OERR(linkStages(ctx, prev, pp, ctx->dei, PORT_DEI));
       prev = ctx->dei;
       pp = PORT_DEI + 1;
    }
+   if (branches) {
+      OERR(linkStages(ctx, prev, pp, ctx->spl, PORT_SPL));
+      prev = ctx->spl;
+      pp = PORT_SPL+1;
+      for (i = 0; i < ctx->nRenditions; i++) {
+         r = ctx->renditions[i];
+         OERR(ilCore.setupTunnel(ctx->spl, r->splPort, r->rsz, PORT_RSZ));
+         OERR(ilCore.setupTunnel(r->rsz, PORT_RSZ+1, r->enc, PORT_ENC));
+      }
+      if (t != NULL)
+         OERR(ilCore.setupTunnel(ctx->spl, t->splPort, t->rsz, PORT_RSZ));
+   }
    if (ctx->userFlags & UFLAGS_RESIZE || ctx->userFlags & UFLAGS_CROP) {
-      OERR(OMX_SetupTunnel(prev, pp, ctx->rsz, PORT_RSZ));
+      OERR(linkStages(ctx, prev, pp, ctx->rsz, PORT_RSZ));
       prev = ctx->rsz;
       pp = PORT_RSZ+1;
    }
    if (ctx->userFlags & UFLAGS_MONITOR) {
-      OERR(OMX_SetupTunnel(prev, pp, ctx->spl, PORT_SPL)); /* Connect previous output to input of splitter */
+      if (!branches) {
+         OERR(linkStages(ctx, prev, pp, ctx->spl, PORT_SPL)); /* Connect previous output to input of splitter */
+         prev = ctx->spl;
+         pp = PORT_SPL+1;   /* First output sent to next stage in pipeline */
+      }
       /* Tunnel 2nd port from splitter to video render */
-      OERR(OMX_SetupTunnel(ctx->spl, PORT_SPL+2, ctx->vid, PORT_VID));
-      prev = ctx->spl;
-      pp = PORT_SPL+1;   /* First output sent to next stage in pipeline */
+      OERR(ilCore.setupTunnel(ctx->spl, PORT_SPL+2, ctx->vid, PORT_VID));
    }
 
-   OERR(OMX_SetupTunnel(prev, pp, ctx->enc, PORT_ENC)); /* Final destination of pipeline */
+   OERR(linkStages(ctx, prev, pp, ctx->enc, PORT_ENC)); /* Final destination of pipeline */
    /* Set the pipeline to idle (waiting for data); call after setting up pipelines to auto allocate correct buffers; only buffers left to define are input and output to the pipeline */
 
    /* Now transition components to idle - do this here after all resources aquired */
    if (ctx->userFlags & UFLAGS_DEINTERLACE)
-      requestStateChange(ctx->dei, OMX_StateIdle, 1);
+      OERR(requestStateChange(ctx, ctx->dei, OMX_StateIdle, 1));
 
    if (ctx->userFlags & UFLAGS_RESIZE || ctx->userFlags & UFLAGS_CROP)
-      requestStateChange(ctx->rsz, OMX_StateIdle, 1);
-
-   if (ctx->userFlags & UFLAGS_MONITOR) {
-      requestStateChange(ctx->spl, OMX_StateIdle, 1);
-      requestStateChange(ctx->vid, OMX_StateIdle, 1);
-   }
+      OERR(requestStateChange(ctx, ctx->rsz, OMX_StateIdle, 1));
 
-   requestStateChange(ctx->enc, OMX_StateIdle, 1);
-
-   /* setup encoder output port  - viddef points to format.video of previous component output port */
-   viddef->nBitrate = ctx->bitrate; /* Target bit rate for VBR mode; rate control disabled if set to 0; overriden by OMX_IndexParamVideoBitrate below */
-   viddef->eCompressionFormat = OMX_VIDEO_CodingAVC;
-   portdef->nPortIndex = PORT_ENC+1;
-   OERR(OMX_SetParameter(ctx->enc, OMX_IndexParamPortDefinition, portdef));
+   if (ctx->userFlags & UFLAGS_MONITOR || branches)
+      OERR(requestStateChange(ctx, ctx->spl, OMX_StateIdle, 1));
+   if (ctx->userFlags & UFLAGS_MONITOR)
+      OERR(requestStateChange(ctx, ctx->vid, OMX_StateIdle, 1));
 
-   configureBitRate(ctx);
-   configureTestOpts(ctx);
+   for (i = 0; i < ctx->nRenditions; i++) {
+      r = ctx->renditions[i];
+      OERR(requestStateChange(r, r->rsz, OMX_StateIdle, 1));
+      OERR(requestStateChange(r, r->enc, OMX_StateIdle, 1));
+      OERR(configureEncoderOutput(r, &rdef[i]));
+   }
+   if (t != NULL)
+      OERR(requestStateChange(t, t->rsz, OMX_StateIdle, 1));
 
-   /* Allowed values for pixel aspect are: 1:1, 10:11, 16:11, 40:33, 59:54, and 118:81
-    * Note that these aspect ratios do not include overscan.
-    * Corresponding display aspect ratio (DVD):
-    * NTSC 10:11 -> 4:3 DAR
-    * NTSC 40:33 -> 16:9 DAR
-    * PAL 59:54 -> 4:3 DAR (for ANALOGUE signals: won't produce an integer of 16)
-    * PAL 16:11 -> 16:9 DAR
-    * PAL 118:81 -> 16:9 DAR (for ANALOGUE signals: won't produce an integer of 16)
-    */
-   if (ctx->userFlags & UFLAGS_RESIZE) { /* Probably defaults to this anyway... */
-      OMX_CONFIG_POINTTYPE *pixaspect; 
-      MAKEME(pixaspect, OMX_CONFIG_POINTTYPE);
-      pixaspect->nPortIndex = PORT_ENC+1;
-      pixaspect->nX = 1;
-      pixaspect->nY = 1;
-      OERR(OMX_SetParameter(ctx->enc, OMX_IndexParamBrcmPixelAspectRatio, pixaspect));
-   }
-
-   /* Allocate buffers; state must be idle & port disabled
-    * Buffer allocation occurs during transition to state enabled.
-    * Encoder only requires 1 output buffer; the buffer size varies
-    * depending on input image size, doesn't seem to change with output size.
-    * Around 500k for dvd stream, 3.5M for 1080p h264 stream.
-    * If it does ask for more buffers, allocate them to get a state change,
-    * but the current code set-up won't use them.
-    */
-   if (portdef->nBufferCountActual>1)
-      fprintf(stderr,"WARNING: Encoder wants more than 1 output buffer: extra buffers not used!\n");
-   sendCommand(ctx->enc, OMX_CommandPortEnable, PORT_ENC+1, CFLAGS_ENC, 0);
-   ctx->encbufs = allocbufs(ctx->enc, PORT_ENC+1);
-   waitForEvents(ctx->enc, CFLAGS_ENC);
+   OERR(requestStateChange(ctx, ctx->enc, OMX_StateIdle, 1));
+   OERR(configureEncoderOutput(ctx, &portdef));
 
    /* Enable ports: For port enable to succeed, *BOTH* ends of the pipeline need to be enabled.
     * Therefore, don't wait for output ports to be enabled - just queue command.
     * When destination port on the final component is enabled (always the encoder input port)
     * then wait for the other ports to enable in reverse order (i.e from encoder to components
-    * further up the pipeline)
+    * further up the pipeline). The ends of the filter stage's link have their buffers
+    * allocated by enablePort() instead.
     */
-   sendCommand(ctx->dec, OMX_CommandPortEnable, PORT_DEC+1, CFLAGS_DEC, 0); /* Don't wait */
+   OERR(enablePort(ctx, ctx->dec, PORT_DEC+1, CFLAGS_DEC, 0)); /* Don't wait */
 
    if (ctx->userFlags & UFLAGS_DEINTERLACE) {
-      sendCommand(ctx->dei, OMX_CommandPortEnable, PORT_DEI, CFLAGS_DEI, 1);
-      sendCommand(ctx->dei, OMX_CommandPortEnable, PORT_DEI+1, CFLAGS_DEI, 0); /* Don't wait */
+      OERR(enablePort(ctx, ctx->dei, PORT_DEI, CFLAGS_DEI, 1));
+      OERR(enablePort(ctx, ctx->dei, PORT_DEI+1, CFLAGS_DEI, 0)); /* Don't wait */
    }
 
+   if (branches)
+      OERR(enableSplitter(ctx));
+
    if (ctx->userFlags & UFLAGS_RESIZE || ctx->userFlags & UFLAGS_CROP) {
-      sendCommand(ctx->rsz, OMX_CommandPortEnable, PORT_RSZ, CFLAGS_RSZ, 1);
-      sendCommand(ctx->rsz, OMX_CommandPortEnable, PORT_RSZ+1, CFLAGS_RSZ, 0); /* Don't wait */
+      OERR(enablePort(ctx, ctx->rsz, PORT_RSZ, CFLAGS_RSZ, 1));
+      OERR(enablePort(ctx, ctx->rsz, PORT_RSZ+1, CFLAGS_RSZ, 0)); /* Don't wait */
    }
 
-   if (ctx->userFlags & UFLAGS_MONITOR) {
-      sendCommand(ctx->vid, OMX_CommandPortEnable, PORT_VID, CFLAGS_VID, 1);
-      sendCommand(ctx->spl, OMX_CommandPortEnable, PORT_SPL, CFLAGS_SPL, 1);
-      sendCommand(ctx->spl, OMX_CommandPortEnable, PORT_SPL+1, CFLAGS_SPL, 0); /* Encoder - don't wait, encoder port not yet enabled */
-      sendCommand(ctx->spl, OMX_CommandPortEnable, PORT_SPL+2, CFLAGS_SPL, 1); /* Video render */
-   }
+   if (ctx->userFlags & UFLAGS_MONITOR && !branches)
+      OERR(enableSplitter(ctx));
 
-   sendCommand(ctx->enc, OMX_CommandPortEnable, PORT_ENC, CFLAGS_ENC, 1);
+   OERR(enablePort(ctx, ctx->enc, PORT_ENC, CFLAGS_ENC, 1));
    /* Wait for port enable commands to complete
     * This shouldn't be neccessary as we wait for encoder above;
     * if encoder enable completes then all of these should also
     * have completed, but lets check anyway!
     */
-   waitForEvents(ctx->rsz, CFLAGS_DEC);
-   waitForEvents(ctx->rsz, CFLAGS_RSZ);
-   waitForEvents(ctx->dei, CFLAGS_DEI);
-   waitForEvents(ctx->spl, CFLAGS_SPL);
+   OERR(waitForEvents(ctx, ctx->rsz, CFLAGS_DEC));
+   OERR(waitForEvents(ctx, ctx->rsz, CFLAGS_RSZ));
+   OERR(waitForEvents(ctx, ctx->dei, CFLAGS_DEI));
+   OERR(waitForEvents(ctx, ctx->spl, CFLAGS_SPL));
 
    /* Transition to state executing */
    if (ctx->userFlags & UFLAGS_DEINTERLACE)
-      requestStateChange(ctx->dei, OMX_StateExecuting, 1);
+      OERR(requestStateChange(ctx, ctx->dei, OMX_StateExecuting, 1));
 
    if (ctx->userFlags & UFLAGS_RESIZE || ctx->userFlags & UFLAGS_CROP)
-      requestStateChange(ctx->rsz, OMX_StateExecuting, 1);
-
-   if (ctx->userFlags & UFLAGS_MONITOR) {
-      requestStateChange(ctx->spl, OMX_StateExecuting, 1);
-      requestStateChange(ctx->vid, OMX_StateExecuting, 1);
-   }
+      OERR(requestStateChange(ctx, ctx->rsz, OMX_StateExecuting, 1));
 
-   requestStateChange(ctx->enc, OMX_StateExecuting, 1);
+   if (ctx->userFlags & UFLAGS_MONITOR || branches)
+      OERR(requestStateChange(ctx, ctx->spl, OMX_StateExecuting, 1));
+   if (ctx->userFlags & UFLAGS_MONITOR)
+      OERR(requestStateChange(ctx, ctx->vid, OMX_StateExecuting, 1));
 
-   /* Start encoding */
-   OERR(OMX_FillThisBuffer(ctx->enc, ctx->encbufs));
+   for (i = 0; i < ctx->nRenditions; i++) {
+      r = ctx->renditions[i];
+      OERR(requestStateChange(r, r->rsz, OMX_StateExecuting, 1));
+      OERR(requestStateChange(r, r->enc, OMX_StateExecuting, 1));
+   }
+   if (t != NULL)
+      OERR(requestStateChange(t, t->rsz, OMX_StateExecuting, 1));
+
+   OERR(requestStateChange(ctx, ctx->enc, OMX_StateExecuting, 1));
+
+   /* Start encoding: filled buffers are queued until drainEncoder() is started */
+   for (i = 0; ctx->encbufs[i] != NULL; i++)
+      OERR(fillEncBuffer(ctx, ctx->encbufs[i]));
+   for (j = 0; j < ctx->nRenditions; j++) {
+      r = ctx->renditions[j];
+      for (i = 0; r->encbufs[i] != NULL; i++)
+         OERR(fillEncBuffer(r, r->encbufs[i]));
+   }
+   for (i = 0; t != NULL && t->encbufs[i] != NULL; i++)
+      OERR(fillThumbBuffer(t, t->encbufs[i]));
+   for (i = 0; ctx->filter.srcbufs != NULL && ctx->filter.srcbufs[i] != NULL; i++)
+      OERR(fillFilterBuffer(ctx, ctx->filter.srcbufs[i]));   /* Frames are queued until filterThread() is started */
 
    /* Dump current port states: */
    
    if (ctx->userFlags & UFLAGS_VERBOSE) {
-      dumpport(ctx->dec, PORT_DEC);
-      dumpport(ctx->dec, PORT_DEC+1);
+      dumpport(ctx, ctx->dec, PORT_DEC);
+      dumpport(ctx, ctx->dec, PORT_DEC+1);
       if (ctx->userFlags & UFLAGS_DEINTERLACE) {
-         dumpport(ctx->dei, PORT_DEI);
-         dumpport(ctx->dei, PORT_DEI+1);
+         dumpport(ctx, ctx->dei, PORT_DEI);
+         dumpport(ctx, ctx->dei, PORT_DEI+1);
       }
       if (ctx->userFlags & UFLAGS_RESIZE || ctx->userFlags & UFLAGS_CROP) {
-         dumpport(ctx->rsz, PORT_RSZ);
-         dumpport(ctx->rsz, PORT_RSZ+1);
+         dumpport(ctx, ctx->rsz, PORT_RSZ);
+         dumpport(ctx, ctx->rsz, PORT_RSZ+1);
       }
-      dumpport(ctx->enc, PORT_ENC);
-      dumpport(ctx->enc, PORT_ENC+1);
-   }
-
-   MAKEME(level, OMX_VIDEO_PARAM_PROFILELEVELTYPE);
-   level->nPortIndex = PORT_ENC+1;
-   OERR(OMX_GetParameter(ctx->enc, OMX_IndexParamVideoProfileLevelCurrent, level));
-
-   /* Get the frame rate at the encoder output
-    * This is detected and set by the decoder:
-    * seems to be set from stream data if present or from omx ticks
-    * Constant framerate is assumed.
-    */
-   if (portdef->format.video.xFramerate==0) {   /* If unknown use average fps from input */
-      fprintf(stderr, "WARNING: frame rate unknown - setting rate from input. This may not be correct!\n");
-      portdef->format.video.xFramerate=(ctx->ic->streams[ctx->inVidStreamIdx]->avg_frame_rate.num/ctx->ic->streams[ctx->inVidStreamIdx]->avg_frame_rate.den)*(1<<16);
-   }
-
-   ctx->nalEntry.fps.num=portdef->format.video.xFramerate;   /* Q16 format */
-   ctx->nalEntry.fps.den=(1<<16);
-   
-   ctx->omxFPS=av_q2d(ctx->nalEntry.fps); /* Convert to double */
-   ctx->nalEntry.duration=(double)ctx->omxtimebase.den/ctx->omxFPS;  /* Estimate frame duration in omx timebase units */
-
-   /* Make an output context if output is not raw: */
-   if ((ctx->userFlags & UFLAGS_RAW) == 0) {
-      ctx->oc = makeOutputContext(ctx->ic, ctx->oname, ctx->inVidStreamIdx, portdef, level);
-      if (!ctx->oc) {
-         fprintf(stderr, "ERROR: Create output AVFormatContext failed.\n");
-         exit(1);
+      dumpport(ctx, ctx->enc, PORT_ENC);
+      dumpport(ctx, ctx->enc, PORT_ENC+1);
+      for (i = 0; i < ctx->nRenditions; i++) {
+         r = ctx->renditions[i];
+         dumpport(r, r->rsz, PORT_RSZ+1);
+         dumpport(r, r->enc, PORT_ENC+1);
       }
+      if (t != NULL)
+         dumpport(t, t->rsz, PORT_RSZ+1);
    }
 
-   ctx->state=OPENOUTPUT;
+   for (i = 0; i < ctx->nRenditions; i++)
+      OERR(configureOutput(ctx->renditions[i], &rdef[i]));
+   return configureOutput(ctx, &portdef);
 }
 
-static OMX_BUFFERHEADERTYPE *configDecoder(struct context *ctx) {
-   OMX_PARAM_PORTDEFINITIONTYPE *portdef;
-   OMX_VIDEO_PORTDEFINITIONTYPE *viddef;
-   OMX_BUFFERHEADERTYPE *decbufs;
-   OMX_NALSTREAMFORMATTYPE *nalStreamFormat;
-
-   MAKEME(portdef, OMX_PARAM_PORTDEFINITIONTYPE);
-
-   sendCommand(ctx->dec, OMX_CommandPortDisable, PORT_DEC, CFLAGS_DEC, 1);
-   sendCommand(ctx->dec, OMX_CommandPortDisable, PORT_DEC+1, CFLAGS_DEC, 1);
+/* Batch mode, naluInputFormat changed back to 0: the NAL stream format can't be
+ * reset, so replace the decoder handle.
+ */
+static OMX_ERRORTYPE resetDecoder(struct context *ctx) {
+   if (ctx->userFlags & UFLAGS_VERBOSE)
+      fprintf(stderr, "Getting a new decoder handle\n");
+   if (ctx->decbufs != NULL)
+      OERR(releaseDecBuffers(ctx));
+   OERR(requestStateChange(ctx, ctx->dec, OMX_StateLoaded, 1));
+   OERR(ilCore.freeHandle(ctx->dec));
+   OERR(ilCore.getHandle(&ctx->dec, DECNAME, ctx, &decEventCallback));
+   ctx->decNaluFormat = 0;
+   return OMX_ErrorNone;
+}
 
-   portdef->nPortIndex = PORT_DEC;
-   OERR(OMX_GetParameter(ctx->dec, OMX_IndexParamPortDefinition, portdef));
-   viddef = &portdef->format.video;
-   viddef->nFrameWidth = ctx->ic->streams[ctx->inVidStreamIdx]->codecpar->width;
-   viddef->nFrameHeight = ctx->ic->streams[ctx->inVidStreamIdx]->codecpar->height;
-   viddef->eCompressionFormat = mapCodec(ctx->ic->streams[ctx->inVidStreamIdx]->codecpar->codec_id);
-   viddef->bFlagErrorConcealment = 0;
-   /* It is NOT required to set xFramerate from ffmpeg avg_frame_rate.den; the encoder will be passed the detected frame rate (I assume from the timestamps / omxtick or from raw stream data). */
-   OERR(OMX_SetParameter(ctx->dec, OMX_IndexParamPortDefinition, portdef));
+/* Set up the decoder input port and start the decoder.
+ * In batch mode the input buffers allocated for the last job are kept if the
+ * input format is the same; otherwise they are freed and allocated again.
+ */
+static OMX_ERRORTYPE configDecoder(struct context *ctx) {
+   OMX_PARAM_PORTDEFINITIONTYPE portdef;
+   OMX_VIDEO_PORTDEFINITIONTYPE *viddef;
+   OMX_BUFFERHEADERTYPE **decbufs;
+   OMX_NALSTREAMFORMATTYPE nalStreamFormat;
+   int i;
 
 /* TODO! */
+   ctx->naluInputFormat=0;
    if (ctx->ic->streams[ctx->inVidStreamIdx]->codecpar->codec_id==AV_CODEC_ID_H264) {
       if (ctx->ic->streams[ctx->inVidStreamIdx]->codecpar->extradata==NULL) ctx->naluInputFormat=1;
       else if (ctx->ic->streams[ctx->inVidStreamIdx]->codecpar->extradata_size<7) ctx->naluInputFormat=1;
       else if (*(ctx->ic->streams[ctx->inVidStreamIdx]->codecpar->extradata)!=1) ctx->naluInputFormat=1; // omxplayer: valid avcC atom data always starts with the value 1 (version), otherwise annexb
       else ctx->naluInputFormat=0;
-      if (ctx->naluInputFormat==1) {
+      if (ctx->naluInputFormat==1)
          fprintf(stderr, "WARNING: ** h264 annexb format detected: TODO!\n");
-         MAKEME(nalStreamFormat, OMX_NALSTREAMFORMATTYPE);
+   }
+   if (ctx->decNaluFormat==1 && ctx->naluInputFormat==0)
+      OERR(resetDecoder(ctx));
+
+   INITME(portdef);
+   portdef.nPortIndex = PORT_DEC;
+   OERR(OMX_GetParameter(ctx->dec, OMX_IndexParamPortDefinition, &portdef));
+   viddef = &portdef.format.video;
+   viddef->nFrameWidth = ctx->ic->streams[ctx->inVidStreamIdx]->codecpar->width;
+   viddef->nFrameHeight = ctx->ic->streams[ctx->inVidStreamIdx]->codecpar->height;
+   viddef->eCompressionFormat = mapCodec(ctx, ctx->ic->streams[ctx->inVidStreamIdx]->codecpar->codec_id);
+   viddef->bFlagErrorConcealment = 0;
+   /* It is NOT required to set xFramerate from ffmpeg avg_frame_rate.den; the encoder will be passed the detected frame rate (I assume from the timestamps / omxtick or from raw stream data). */
+
+   if (ctx->decbufs != NULL && (!sameVideoFormat(&ctx->decFormat, viddef) || ctx->decNaluFormat != ctx->naluInputFormat))
+      OERR(releaseDecBuffers(ctx));
 
-         nalStreamFormat->nPortIndex = PORT_DEC;
-         nalStreamFormat->eNaluFormat = OMX_NaluFormatStartCodes;
-         OERR(OMX_SetParameter(ctx->dec, OMX_IndexParamNalStreamFormatSelect, nalStreamFormat));
+   OERR(disablePort(ctx, ctx->dec, PORT_DEC+1, CFLAGS_DEC));
+   if (ctx->decbufs == NULL) {
+      OERR(disablePort(ctx, ctx->dec, PORT_DEC, CFLAGS_DEC));
+      OERR(OMX_SetParameter(ctx->dec, OMX_IndexParamPortDefinition, &portdef));
+      if (ctx->naluInputFormat==1) {
+         INITME(nalStreamFormat);
+         nalStreamFormat.nPortIndex = PORT_DEC;
+         nalStreamFormat.eNaluFormat = OMX_NaluFormatStartCodes;
+         OERR(OMX_SetParameter(ctx->dec, OMX_IndexParamNalStreamFormatSelect, &nalStreamFormat));
       }
+      ctx->decFormat = *viddef;
+      ctx->decNaluFormat = ctx->naluInputFormat;
    }
+   else if (ctx->userFlags & UFLAGS_VERBOSE)
+      fprintf(stderr, "Decoder input format unchanged: keeping the input buffers\n");
 
    /* Allocate the input buffers: port needs to be in idle state, and disabled.
     * Note that it doesn't actually enable until after all buffers allocated, so
     * wait for port enable after allocation.
     */
-   requestStateChange(ctx->dec, OMX_StateIdle, 1);
-   sendCommand(ctx->dec, OMX_CommandPortEnable, PORT_DEC, CFLAGS_DEC, 0);
-   decbufs = allocbufs(ctx->dec, PORT_DEC); /* returns a linked list of buffers */
-   waitForEvents(ctx->dec, CFLAGS_DEC);
+   OERR(requestStateChange(ctx, ctx->dec, OMX_StateIdle, 1));
+   if (ctx->decbufs == NULL) {
+      OERR(sendCommand(ctx, ctx->dec, OMX_CommandPortEnable, PORT_DEC, CFLAGS_DEC, 0));
+      decbufs = allocbufs(ctx, ctx->dec, PORT_DEC);  /* returns an array of buffers */
+      if (decbufs == NULL)
+         return OMX_ErrorInsufficientResources;
+      OERR(waitForEvents(ctx, ctx->dec, CFLAGS_DEC));
+
+      for (i = 0; decbufs[i] != NULL; i++);
+      ctx->decBufInfo = calloc(i, sizeof(OMXTX_DEC_BUF));
+      if (ctx->decBufInfo == NULL) {
+         fprintf(stderr, "ERROR: Can't allocate memory for decoder buffer data\n");
+         freeBuffers(ctx, ctx->dec, PORT_DEC, decbufs);
+         return OMX_ErrorInsufficientResources;
+      }
+      for (i = 0; decbufs[i] != NULL; i++)
+         decbufs[i]->pAppPrivate = &ctx->decBufInfo[i];
+      ctx->decbufs = decbufs;
+   }
+   if (resetDecBuffers(ctx) != 0)   /* Safe to push from this thread: the decoder doesn't have any buffers */
+      return OMX_ErrorInsufficientResources;
 
    ctx->state = DECINIT;
-   requestStateChange(ctx->dec, OMX_StateExecuting, 1);    /* Start decoder */
+   OERR(requestStateChange(ctx, ctx->dec, OMX_StateExecuting, 1));    /* Start decoder */
 
-   free(portdef);
-   return decbufs;
+   return OMX_ErrorNone;
 }
 
-static void usage(const char *name) {
-   fprintf(stdout, "Usage: %s <infile> [opts] -o <outfile>\n\n"
-      "Where opts are:\n"
-      "   -a[y] Auto scale the video stream to produce a sample aspect ratio (pixel aspect ratio)\n"
-      "         of 1:1. By default, the scaling is in the x-direction (image width); this usually\n"
-      "         results in more (interpolated) pixels in the x-direction. If 'y' is specified, the\n"
-      "         scaling is done in the y-direction; this usually results in a reduction in resolution\n"
-      "         in the y-direction. Useful for DVD where sample aspect ratio is not 1:1, and the\n"
-      "         playback device doesn't scale the video correctly\n"
-      "   -b n  Target bitrate n[k|M] in bits/second (default: 2Mb/s)\n"
-      "   -c C  Crop: 'C' is specified in pixels as width:height:left:top\n"
-      "   -d[0] Deinterlace: The default, is to output one frame per two interlaced fields.\n"
-      "         If 0 is specified, one frame per field will be output\n"
-      "   -f    Specify the output container format: see output of 'ffmpeg -formats' for\n"
-      "         a list of supported formats. Defaults to 'matroska' if no format specified.\n"
-      "   -i n  Select audio stream n.\n"
-      "   -m    Monitor.  Display the decoder's output\n"
-      "   -o O  Output filename with standard container extension, eg. out.mkv\n"
-      "   -p    Make up pts. Default is to use input stream dts.\n"
-      "   -q Q  Rate control: 'Q' is specified as RC:A:B where:\n"
+/* Batch mode: at the end of a job, put the components back in Idle ready for the next one.
+ * The tunnels are disabled and torn down, since the next job may need a different pipeline,
+ * and the buffers of the filter stage (-I, -D) are freed. The decoder input and encoder
+ * output buffers are kept: they have all been returned by the transition to Idle.
+ * configDecoder() and configure() free them if the next job needs a different format.
+ */
+static OMX_ERRORTYPE parkPipeline(struct context *ctx) {
+   OMX_HANDLETYPE comps[] = { ctx->dec, ctx->dei, ctx->rsz, ctx->spl, ctx->vid, ctx->enc };
+   enum OMX_STATETYPE state;
+   OMX_HANDLETYPE prev;
+   uint8_t prevFlag;
+   int i, pp;
+   int64_t t0 = timeUs();
+
+   if (ctx->dec == NULL)   /* No job has got as far as the components */
+      return OMX_ErrorNone;
+   for (i = 0; i < NCOMPONENTS; i++) {
+      OMX_GetState(comps[i], &state);
+      if (state == OMX_StateExecuting || state == OMX_StatePause)
+         OERR(requestStateChange(ctx, comps[i], OMX_StateIdle, 1));
+   }
+
+   /* Same pipeline as configure(). The ends of the filter stage's link are disabled first:
+    * disableTunnel() finds them so, and has nothing to do for that link.
+    */
+   OERR(releaseFilter(ctx));
+   prev = ctx->dec;
+   pp = PORT_DEC+1;
+   prevFlag = CFLAGS_DEC;
+   if (ctx->userFlags & UFLAGS_DEINTERLACE) {
+      OERR(disableTunnel(ctx, prev, pp, prevFlag, ctx->dei, PORT_DEI, CFLAGS_DEI));
+      prev = ctx->dei;
+      pp = PORT_DEI+1;
+      prevFlag = CFLAGS_DEI;
+   }
+   if (ctx->userFlags & UFLAGS_RESIZE || ctx->userFlags & UFLAGS_CROP) {
+      OERR(disableTunnel(ctx, prev, pp, prevFlag, ctx->rsz, PORT_RSZ, CFLAGS_RSZ));
+      prev = ctx->rsz;
+      pp = PORT_RSZ+1;
+      prevFlag = CFLAGS_RSZ;
+   }
+   if (ctx->userFlags & UFLAGS_MONITOR) {
+      OERR(disableTunnel(ctx, prev, pp, prevFlag, ctx->spl, PORT_SPL, CFLAGS_SPL));
+      OERR(disableTunnel(ctx, ctx->spl, PORT_SPL+2, CFLAGS_SPL, ctx->vid, PORT_VID, CFLAGS_VID));
+      prev = ctx->spl;
+      pp = PORT_SPL+1;
+      prevFlag = CFLAGS_SPL;
+   }
+   OERR(disableTunnel(ctx, prev, pp, prevFlag, ctx->enc, PORT_ENC, CFLAGS_ENC));
+
+   if (ctx->decbufs != NULL && resetDecBuffers(ctx) != 0)
+      return OMX_ErrorInsufficientResources;
+   if (ctx->encbufs != NULL && bufRingInit(&ctx->encFilled, ctx->encbufs) != 0)   /* Discard buffers returned on the way to Idle */
+      return OMX_ErrorInsufficientResources;
+
+   ctx->setupTime += timeUs() - t0;
+   return OMX_ErrorNone;
+}
+
+static void usage(const char *name) {
+   fprintf(stdout, "Usage: %s <infile> [opts] -o <outfile>\n"
+      "       %s -j <jobfile> [opts]\n"
+      "       %s <segmentlist> -C -o <outfile>\n\n"
+      "Where opts are:\n"
+      "   -a[y] Auto scale the video stream to produce a sample aspect ratio (pixel aspect ratio)\n"
+      "         of 1:1. By default, the scaling is in the x-direction (image width); this usually\n"
+      "         results in more (interpolated) pixels in the x-direction. If 'y' is specified, the\n"
+      "         scaling is done in the y-direction; this usually results in a reduction in resolution\n"
+      "         in the y-direction. Useful for DVD where sample aspect ratio is not 1:1, and the\n"
+      "         playback device doesn't scale the video correctly\n"
+      "   -A    Adaptive bitrate: the bitrate achieved over each GOP is measured, and the\n"
+      "         encoder's target retuned while it runs so that the output as a whole comes\n"
+      "         out at the bitrate given with -b. VBR mode only\n"
+      "   -b n  Target bitrate n[k|M] in bits/second (default: 2Mb/s)\n"
+      "   -c C  Crop: 'C' is specified in pixels as width:height:left:top, or 'auto' to crop the\n"
+      "         black borders found in frames sampled across the input\n"
+      "   -C    Join: <infile> is a list of segment files made with -s, one per line, in order.\n"
+      "         They are joined into <outfile> without re-encoding\n"
+      "   -d[0] Deinterlace: The default, is to output one frame per two interlaced fields.\n"
+      "         If 0 is specified, one frame per field will be output\n"
+      "   -D F  Decimate: 'F' is fps[:t]. Frames over fps a second are dropped, and frames that are\n"
+      "         repeats of the last one, the mean difference of their luma in 8x8 blocks no more\n"
+      "         than t levels (default: 1; 0 keeps them). Timestamps are kept, so the output is\n"
+      "         variable frame rate. fps 0: drop repeats only. On OMX the frames come to the\n"
+      "         host for it before the encoder\n"
+      "   -E B  Backend: 'hw' for the OMX components, 'sw' for libavcodec and swscale on the host\n"
+      "         CPU, using all its cores. Defaults to 'hw' if the OMX IL core can be loaded\n"
+      "         ($OMXTX_IL_CORE, or libopenmaxil.so), 'sw' otherwise\n"
+      "   -F n  Target file size n[k|M|G] bytes. The input is sampled to plan the bitrate over\n"
+      "         the file, more for complex parts and less for simple ones, a short trial encode\n"
+      "         measures the encoder, and the plan is followed as with -A. The copied audio and\n"
+      "         the container overhead are allowed for. The input must be seekable. Replaces -b\n"
+      "   -f    Specify the output container format: see output of 'ffmpeg -formats' for\n"
+      "         a list of supported formats. Defaults to 'matroska' if no format specified.\n"
+      "   -H n  Segmented output for live streaming: HLS, or DASH with -f dash. <outfile> is the\n"
+      "         playlist (e.g. out.m3u8). An IDR frame is forced every n seconds and a segment\n"
+      "         cut there; segments are published as they are completed. n:l keeps the last l\n"
+      "         segments in the playlist and deletes the older ones (default: 6; 0 keeps all)\n"
+      "   -I    Inverse telecine: match the fields of 3:2 pulldown (film at 23.976 fps in 29.97\n"
+      "         fps video) and drop the repeated frames. On OMX the decoded frames come to the\n"
+      "         host for it, and go back to the resizer or encoder\n"
+      "   -i n  Select audio stream n.\n"
+      "   -j J  Batch mode: run the jobs in file J, one '<infile> <outfile>' per line (use a tab\n"
+      "         to separate names containing spaces). The options apply to every job. The OMX\n"
+      "         components are set up once and kept between jobs. If J is a FIFO, omxtx waits\n"
+      "         for more jobs at end of file; J may be '-' for stdin\n"
+      "   -J n  Batch mode: run up to n jobs at once, each on its own set of OMX components\n"
+      "         (default: 1; with -S, one per segment). A job that fails doesn't stop the others\n"
+      "   -k K  Thumbnails: 'K' is interval[:width[xheight][:columnsxrows]]. A frame of the output\n"
+      "         picture is taken every interval seconds, or with 'key' at each input keyframe,\n"
+      "         and written as <out>-00001.jpg etc, where <out> is <outfile> without its\n"
+      "         extension. They are tiled into sprite sheets, <out>-sprite-001.jpg etc (default:\n"
+      "         10x10 per sheet), indexed for a player's seek bar by <out>.vtt (WebVTT). The width\n"
+      "         defaults to 160, the height to the picture's aspect. Taken in the same pass, from a\n"
+      "         video splitter output with its own resizer on the OMX backend\n"
+      "   -L[n] Live: <infile> is a real time source, e.g. '-' for stdin, a FIFO or a socket\n"
+      "         (unix:/path). The input is probed as little as possible, each packet is written\n"
+      "         out at once (<outfile> may be '-' for stdout, with -f), and the glass to output\n"
+      "         latency is shown. Video more than n ms late (default: 1000) is dropped up to a\n"
+      "         keyframe to catch up. A regular file is read at its real time rate\n"
+      "   -l R  Rendition: an extra output made from the same decode, so that an ABR ladder costs\n"
+      "         one decode. 'R' is widthxheight:bitrate:outfile, e.g. 640x360:800k:out360.mkv;\n"
+      "         may be given up to 3 times, less one each for -m and -k. Each rendition has its\n"
+      "         own resizer and encoder on a video splitter output. The crop, rate control and -X\n"
+      "         options and the copied audio are the same for every output. OMX backend only\n"
+      "   -m    Monitor.  Display the decoder's output\n"
+      "   -M M  Metrics: 'M' is fmt:file[:n]. Per stage latency histograms, queue depths and\n"
+      "         frame counts are written to file every n seconds (default: 10) and at exit.\n"
+      "         fmt is 'json' or 'prom' (Prometheus text format). A regular file is replaced\n"
+      "         each time; a FIFO or /dev/fd/n has each set appended (JSON: one per line)\n"
+      "   -o O  Output filename with standard container extension, eg. out.mkv\n"
+      "   -p    Make up pts. Default is to use input stream dts.\n"
+      "   -P n  Read ahead: n packets, or n[k|M] bytes, are demuxed ahead of the decoder\n"
+      "         (default: 256 packets / 32M)\n"
+      "   -q Q  Rate control: 'Q' is specified as RC:A:B where:\n"
       "                       RC is control method: 'V' for VBR mode, 'Q' for contant q (CQ) mode;\n"
       "                       For VBR: A is minimum quantiser q (minq), B is maximum q (maxq);\n"
       "                       For CQ : A is q for I frames (qI), B is q for P frames (qP);\n"
       "                       q must be integer in range 1 - 51; maxq > minq.\n"
       "         Defaults to VBR with minq=20, maxq=50\n"
+      "   -Q[n] Quality: when the job is done, one GOP in n of the output (default: 10; 1 for all)\n"
+      "         and the matching input frames are decoded on the host, and the PSNR and SSIM of\n"
+      "         the output shown: overall, for the worst GOP, and with -v for each GOP measured\n"
       "   -r S  Resize: 'S' is in pixels specified as widthxheight\n"
+      "   -s S  Segment: encode part of the input. 'S' is from:to in seconds from the start of\n"
+      "         the file; either may be left out. The video starts at the first keyframe at or\n"
+      "         after 'from' and ends before the first keyframe at or after 'to', so segments\n"
+      "         with adjacent ranges, encoded on one or several machines, can be joined with -C\n"
+      "   -S n  Split the input at keyframes into n segments of about the same length, encode\n"
+      "         them at once (see -J), and join them into <outfile>\n"
+      "   -t n  Timeout in ms for OMX state changes and commands (default: 5000)\n"
+      "   -T F  Trace: OMX commands and events, buffers passed to and returned by the decoder\n"
+      "         and encoder, waits and muxer writes are written to F at exit, as Chrome trace\n"
+      "         event JSON for chrome://tracing or ui.perfetto.dev\n"
       "   -v    Verbose: show input / output states of OMX components\n"
+      "   -X K  Encoder tuning: 'K' is name=value[,name=value...], e.g. deblock=2,hadamard=1;\n"
+      "         may be repeated. '-X help' lists the knobs. See bench/sweep.sh to compare them\n"
       "\n"
       "Output container is guessed based on filename extension. Use '.nal' for raw output.\n"
       "\n"
       "Input file must contain one of MPEG2, H.264, MPEG4 (H.263), MJPEG or vp8 video.\n"
-      "\n", name);
+      "\n", name, name, name);
    exit(1);
 }
 
@@ -1684,38 +3256,337 @@ static int parsebitrate(const char *s) {
    return -1;
 }
 
+static unsigned int pktQueueDepth(OMXTX_PKT_QUEUE *q) {
+   return (q->head + q->size - q->tail) % q->size;
+}
+
+/* Live mode: called by the demux thread for each packet read. A paced input (a regular file)
+ * is read at the rate it would have been captured. The least difference seen between the
+ * wall clock and the input video timestamps is taken as when the input timestamps were
+ * captured, so that liveLatency() can time a frame from capture to output.
+ */
+static void liveInput(struct context *ctx, AVPacket *pkt) {
+   int64_t t, now, wait;
+
+   if (pkt->stream_index != ctx->inVidStreamIdx || pkt->dts == AV_NOPTS_VALUE)
+      return;
+   t = av_rescale_q(pkt->dts, ctx->ic->streams[pkt->stream_index]->time_base, ctx->omxtimebase);   /* As the OMX ticks */
+   now = timeUs();
+   if (ctx->livePaced) {
+      wait = ctx->paceStart == AV_NOPTS_VALUE ? 0 : ctx->paceStart + t - now;
+      if (ctx->paceStart == AV_NOPTS_VALUE || wait > AV_TIME_BASE || wait < -AV_TIME_BASE)
+         ctx->paceStart = now - t;   /* Start, or a timestamp jump */
+      else if (wait > 0) {
+         usleep(wait);
+         now = timeUs();
+      }
+   }
+   if (ctx->clockOffset == AV_NOPTS_VALUE || now - t < ctx->clockOffset)
+      ctx->clockOffset = now - t;
+}
+
+/* Live mode: a frame with OMX tick t has been written: record its glass to output latency */
+static void liveOutput(struct context *ctx, int64_t t) {
+   int64_t offset = ctx->clockOffset, latency;
+
+   if (ctx->liveLatency == 0 || offset == AV_NOPTS_VALUE || (ctx->userFlags & UFLAGS_MAKE_UP_PTS))
+      return;
+   latency = timeUs() - (t + offset);
+   ctx->latencyLast = latency;
+   ctx->latencySum += latency;
+   ctx->latencyFrames++;
+   if (latency > ctx->latencyMax)
+      ctx->latencyMax = latency;
+}
+
+/* Live mode: once the output is running, drop the video from a packet that arrives more
+ * than the target latency late up to the next keyframe that is in time, so that the latency
+ * doesn't build up when the input comes faster than it can be encoded. Returns 1 to drop pkt.
+ */
+static int liveBehind(struct context *ctx, AVPacket *pkt) {
+   int64_t offset = ctx->clockOffset, late;
+
+   if (!ctx->outputOpen || offset == AV_NOPTS_VALUE || pkt->dts == AV_NOPTS_VALUE)
+      return 0;
+   late = timeUs() - (av_rescale_q(pkt->dts, ctx->ic->streams[pkt->stream_index]->time_base, ctx->omxtimebase) + offset);
+   if (late > ctx->liveLatency * 1000LL)
+      ctx->liveCatchUp = 1;
+   else if (pkt->flags & AV_PKT_FLAG_KEY)
+      ctx->liveCatchUp = 0;
+   if (ctx->liveCatchUp)
+      ctx->liveDropped++;
+   return ctx->liveCatchUp;
+}
+
+/* Read ahead thread: keep the packet queue topped up so that a slow read
+ * (USB, NFS...) doesn't stall the hardware pipeline.
+ */
+static void *demuxThread(void *arg) {
+   struct context *ctx = arg;
+   OMXTX_PKT_QUEUE *q = &ctx->readq;
+   unsigned int head;
+
+   traceThread("demux");
+   while (!q->stop) {
+      head = q->head;
+      if ((head + 1) % q->size == q->tail || (q->maxBytes > 0 && q->bytes >= q->maxBytes)) {
+         pthread_mutex_lock(&q->lock);    /* Queue full: wait for the consumer */
+         q->stalls++;
+         while (!q->stop && ((head + 1) % q->size == q->tail || (q->maxBytes > 0 && q->bytes >= q->maxBytes)))
+            pthread_cond_wait(&q->cond, &q->lock);
+         pthread_mutex_unlock(&q->lock);
+         continue;
+      }
+      if (av_read_frame(ctx->ic, q->pkts[head]) != 0) {   /* This allocates buf */
+         q->eof = 1;
+      }
+      else {
+         if (ctx->liveLatency > 0)
+            liveInput(ctx, q->pkts[head]);
+         if (metrics.enabled)
+            q->readTime[head] = timeUs();
+         q->bytes += q->pkts[head]->size;
+         q->head = (head + 1) % q->size;  /* Publish after the slot is written */
+      }
+      pthread_mutex_lock(&q->lock);
+      pthread_cond_signal(&q->cond);
+      pthread_mutex_unlock(&q->lock);
+      if (q->eof)
+         break;
+   }
+   return NULL;
+}
+
+static int startDemux(struct context *ctx) {
+   OMXTX_PKT_QUEUE *q = &ctx->readq;
+   unsigned int i;
+
+   q->size = ctx->prefetchPackets + 1;
+   q->pkts = calloc(q->size, sizeof(AVPacket *));
+   q->spares = calloc(q->size, sizeof(AVPacket *));
+   q->readTime = calloc(q->size, sizeof(int64_t));
+   if (q->pkts == NULL || q->spares == NULL || q->readTime == NULL)
+      return 1;
+   for (i = 0; i < q->size; i++) {
+      q->pkts[i] = av_packet_alloc();
+      q->spares[i] = av_packet_alloc();
+      if (q->pkts[i] == NULL || q->spares[i] == NULL)
+         return 1;
+   }
+   q->nSpares = q->size;
+   q->maxBytes = ctx->prefetchBytes;
+   q->reads = q->depthSum = q->underruns = q->stalls = 0;
+   q->maxDepth = 0;
+   q->head = q->tail = 0;
+   q->bytes = 0;
+   q->eof = q->stop = 0;
+   pthread_mutex_init(&q->lock, NULL);
+   pthread_cond_init(&q->cond, NULL);
+   return pthread_create(&ctx->demuxThread, NULL, demuxThread, ctx);
+}
+
+/* Stop the read ahead thread and free any packets left in the queue:
+ * must be called before the input context is closed.
+ */
+static void stopDemux(struct context *ctx) {
+   OMXTX_PKT_QUEUE *q = &ctx->readq;
+   unsigned int i;
+
+   pthread_mutex_lock(&q->lock);
+   q->stop = 1;
+   pthread_cond_signal(&q->cond);
+   pthread_mutex_unlock(&q->lock);
+   pthread_join(ctx->demuxThread, NULL);
+
+   if (ctx->userFlags & UFLAGS_VERBOSE)
+      fprintf(stderr, "Read ahead queue: %u packets max; average depth %.1f, max depth %u; %llu underruns, %llu stalls\n",
+         q->size-1, q->reads ? (double)q->depthSum/q->reads : 0.0, q->maxDepth, q->underruns, q->stalls);
+
+   for (i = 0; i < q->size; i++)
+      av_packet_free(&q->pkts[i]);
+   while (q->nSpares > 0)
+      av_packet_free(&q->spares[--q->nSpares]);
+   free(q->pkts);
+   free(q->spares);
+   q->spares = NULL;
+   free(q->readTime);
+   q->readTime = NULL;
+   q->head = q->tail = 0;   /* Nothing queued, for the metrics */
+   pthread_cond_destroy(&q->cond);
+   pthread_mutex_destroy(&q->lock);
+}
+
+/* Take the next packet from the read ahead queue; returns NULL at end of file, or if
+ * there is no memory for a packet to put in its slot, when the job has failed.
+ * The packet goes back to the spares with recyclePacket().
+ */
+static AVPacket *readPacket(struct context *ctx) {
+   OMXTX_PKT_QUEUE *q = &ctx->readq;
+   AVPacket *pkt, *spare;
+   unsigned int depth, tail;
+
+   depth = pktQueueDepth(q);
+   if (depth == 0) {
+      pthread_mutex_lock(&q->lock);
+      if (!q->eof)
+         q->underruns++;
+      while ((depth = pktQueueDepth(q)) == 0 && !q->eof)
+         pthread_cond_wait(&q->cond, &q->lock);
+      pthread_mutex_unlock(&q->lock);
+      if (depth == 0)
+         return NULL;      /* End of file and queue drained */
+   }
+   spare = q->nSpares > 0 ? q->spares[--q->nSpares] : av_packet_alloc();   /* Spares run out while audio is saved */
+   if (spare == NULL) {
+      fprintf(stderr, "ERROR: Out of memory reading the input\n");
+      pipelineFailed(ctx, OMX_ErrorInsufficientResources);
+      return NULL;
+   }
+   q->reads++;
+   q->depthSum += depth;
+   if (depth > q->maxDepth)
+      q->maxDepth = depth;
+
+   tail = q->tail;
+   if (metrics.enabled)
+      metricSince(HIST_DEMUXQ, q->readTime[tail]);
+   q->bytes -= q->pkts[tail]->size;
+   pkt = q->pkts[tail];
+   q->pkts[tail] = spare;     /* demuxThread() doesn't touch the slot until tail has moved on */
+   q->tail = (tail + 1) % q->size;
+
+   pthread_mutex_lock(&q->lock);
+   pthread_cond_signal(&q->cond);   /* Space available */
+   pthread_mutex_unlock(&q->lock);
+   return pkt;
+}
+
+/* Give a packet from readPacket() back to the spares, or free it if there are enough */
+static void recyclePacket(struct context *ctx, AVPacket **pkt) {
+   OMXTX_PKT_QUEUE *q = &ctx->readq;
+
+   if (*pkt == NULL)
+      return;
+   if (q->spares == NULL || q->nSpares == q->size) {
+      av_packet_free(pkt);
+      return;
+   }
+   av_packet_unref(*pkt);
+   q->spares[q->nSpares++] = *pkt;
+   *pkt = NULL;
+}
+
+/* Start of the input in us, which -s times are from */
+static int64_t inputStart(AVFormatContext *ic) {
+   return ic->start_time != AV_NOPTS_VALUE ? ic->start_time : 0;
+}
+
+/* Packet time in us from the start of the input, or AV_NOPTS_VALUE */
+static int64_t packetTime(AVFormatContext *ic, AVPacket *pkt) {
+   int64_t ts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+
+   if (ts == AV_NOPTS_VALUE)
+      return AV_NOPTS_VALUE;
+   return av_rescale_q(ts, ic->streams[pkt->stream_index]->time_base, AV_TIME_BASE_Q) - inputStart(ic);
+}
+
+/* Segment encoding (-s, -S): pass the video from the first keyframe at or after segStart
+ * up to, but not including, the first keyframe at or after segEnd, and the audio from
+ * segStart to segEnd. Segments made with adjacent ranges, on this or another machine, so
+ * start and end on the same keyframe and can be joined with joinSegments().
+ * Returns 0 to pass the packet on, 1 to drop it, or 2 at the end of the segment.
+ */
+static int segmentFilter(struct context *ctx, AVPacket *pkt) {
+   int64_t ts = packetTime(ctx->ic, pkt);
+   int key = (pkt->flags & AV_PKT_FLAG_KEY) && ts != AV_NOPTS_VALUE;
+   int audio = ctx->inAudioStreamIdx >= 0 && !(ctx->userFlags & UFLAGS_RAW);
+
+   if (pkt->stream_index == ctx->inVidStreamIdx) {
+      if (ctx->segState == SEG_BEFORE && key && (ctx->segStart == AV_NOPTS_VALUE || ts >= ctx->segStart))
+         ctx->segState = SEG_IN;
+      else if (ctx->segState == SEG_IN && key && ctx->segEnd != AV_NOPTS_VALUE && ts >= ctx->segEnd)
+         ctx->segState = SEG_AFTER;
+      if (ctx->segState == SEG_AFTER && (!audio || (ts != AV_NOPTS_VALUE && ts >= ctx->segEnd + SEGMENT_MARGIN)))
+         ctx->segState = SEG_END;   /* No audio, or it ends before the video */
+      if (ctx->segState == SEG_END)
+         return 2;
+      return ctx->segState == SEG_IN ? 0 : 1;
+   }
+
+   if (ts == AV_NOPTS_VALUE)
+      return ctx->segState == SEG_IN ? 0 : 1;
+   if (ctx->segEnd != AV_NOPTS_VALUE && ts >= ctx->segEnd) {
+      if (ctx->segState != SEG_AFTER)
+         return 1;   /* Audio is read ahead of the video at the end of the segment */
+      ctx->segState = SEG_END;
+      return 2;
+   }
+   return (ctx->segStart == AV_NOPTS_VALUE || ts >= ctx->segStart) ? 0 : 1;
+}
+
+/* Write an audio packet out, or if the output file isn't open yet save it for openOutput().
+ * Returns 1 if pkt was saved, and is freed by openOutput(); the caller frees it otherwise.
+ */
+static int muxAudioPacket(struct context *ctx, AVPacket *pkt) {
+   struct packetentry *entry;
+
+   pthread_mutex_lock(&ctx->muxLock);   /* Output may be opened by the drain thread */
+   if (ctx->outputOpen)  /* Write out audio packet */
+      writeAudioPacket(ctx, pkt);
+   else { /* Encoder not running: save packet for remux when we open the output file */
+      entry = malloc(sizeof(struct packetentry));
+      if (entry!=NULL) {
+         entry->packet = pkt; /* Take ref */
+         TAILQ_INSERT_TAIL(&ctx->packetq, entry, link);
+         pthread_mutex_unlock(&ctx->muxLock);
+         return 1;
+      }
+   }
+   pthread_mutex_unlock(&ctx->muxLock);
+   return 0;
+}
+
 /* If the encoder isn't running, save any audio packets for remux after the output file has been opened.
  * The output file can't be opened until SPS and PPS information have been read into codec->extradata
+ * Each rendition (-l) has the audio copied to its output too.
  */
 static AVPacket *getNextVideoPacket(struct context *ctx) {
-   int rc;
-   AVPacket *pkt=NULL;
+   AVPacket *pkt=NULL, *copy;
+   int r, i;
 
    while(1) {
-      pkt=av_packet_alloc();
-      rc = av_read_frame(ctx->ic, pkt);   /* This allocates buf */
-      if (rc != 0) {
-         av_packet_free(&pkt);
-         pkt=NULL;
+      if (ctx->segState == SEG_END)
          break;
+      pkt=readPacket(ctx);
+      if (pkt == NULL)
+         break;
+      if (ctx->segStart != AV_NOPTS_VALUE || ctx->segEnd != AV_NOPTS_VALUE) {
+         r = segmentFilter(ctx, pkt);
+         if (r != 0) {
+            recyclePacket(ctx, &pkt);
+            if (r == 2)
+               break;
+            continue;
+         }
       }
-      if (pkt->stream_index == ctx->inVidStreamIdx)   /* Found a video packet: return it */
+      if (pkt->stream_index == ctx->inVidStreamIdx) {   /* Found a video packet: return it */
+         if (ctx->liveLatency > 0 && liveBehind(ctx, pkt)) {
+            recyclePacket(ctx, &pkt);
+            continue;
+         }
          break;
+      }
 
       if (pkt->stream_index == ctx->inAudioStreamIdx) { /* ctx->inAudioStreamIdx<0 if no audio stream */
-         if (ctx->state == RUNNING)  /* Write out audio packet */
-            writeAudioPacket(pkt);
-         else { /* Encoder not running: save packet for remux when we open the output file */
-            struct packetentry *entry;
-            entry = malloc(sizeof(struct packetentry));
-            if (entry!=NULL) {
-               entry->packet = pkt; /* Take ref */
-               TAILQ_INSERT_TAIL(&packetq, entry, link);
-               continue;
-            }
-         }
+         for (i = 0; i < ctx->nRenditions; i++)   /* A reference to the same data: writeAudioPacket() changes the timestamps */
+            if ((copy = av_packet_clone(pkt)) != NULL && !muxAudioPacket(ctx->renditions[i], copy))
+               av_packet_free(&copy);
+         if (muxAudioPacket(ctx, pkt))
+            pkt = NULL;
+         recyclePacket(ctx, &pkt);
+         continue;
       }
-      av_packet_free(&pkt);          /* If discard packet */ 
+      recyclePacket(ctx, &pkt);          /* If discard packet */
    };
 
    return pkt;
@@ -1724,6 +3595,10 @@ static AVPacket *getNextVideoPacket(struct context *ctx) {
 static int setCropRectangle(struct context *ctx, const char *optArg) {
    int cropLeft, cropTop, cropWidth, cropHeight;
 
+   if (optArg!=NULL && strcmp(optArg, "auto") == 0) {
+      ctx->autoCrop = 1;
+      return 0;
+   }
    if (optArg!=NULL) {
       if (sscanf(optArg, "%d:%d:%d:%d", &cropWidth, &cropHeight, &cropLeft, &cropTop) == 4) {
          cropTop += 0x04;  /* Interlaced material requires y offset is a multiple of 4 */ 
@@ -1734,6 +3609,10 @@ static int setCropRectangle(struct context *ctx, const char *optArg) {
          cropHeight &= ~0x0f;
          if (cropWidth > 16 && cropHeight > 16) {
             MAKEME(ctx->cropRect,OMX_CONFIG_RECTTYPE);
+            if (ctx->cropRect == NULL) {
+               fprintf(stderr,"ERROR: Out of memory\n");
+               return 1;
+            }
             ctx->cropRect->nPortIndex = PORT_RSZ;
             ctx->cropRect->nLeft=cropLeft;
             ctx->cropRect->nTop=cropTop;
@@ -1823,16 +3702,425 @@ static char *getArg(int argc, char *argv[], int *i) {
    if (argv[*i][2] != '\0')
       return &argv[*i][2];    /* Argument follows option in same argv[] element */
 
-   if (j > argc)
+   if (j >= argc)
       return NULL;            /* Out of array elements: Expected argument missing */
 
-   if (argv[j][0] == '-')
-      return NULL;            /* Next option: Expected argument missing */
+   if (argv[j][0] == '-' && argv[j][1] != '\0')
+      return NULL;            /* Next option: Expected argument missing ('-' alone is an argument: stdin) */
 
    *i=j;
    return argv[*i];
 }
 
+/* Read ahead size: n packets, or n[k|M] bytes */
+static int setPrefetch(struct context *ctx, const char *optArg) {
+   int n;
+   char specifier;
+
+   if (optArg!=NULL) {
+      switch (sscanf(optArg, "%d%c", &n, &specifier)) {
+         case 1:
+            if (n > 0) {
+               ctx->prefetchPackets = n;
+               ctx->prefetchBytes = 0;
+               return 0;
+            }
+         break;
+         case 2:
+            if (n > 0 && (specifier == 'k' || specifier == 'K' || specifier == 'm' || specifier == 'M')) {
+               ctx->prefetchBytes = (int64_t)n * ((specifier == 'k' || specifier == 'K') ? 1024 : 1024*1024);
+               ctx->prefetchPackets = PREFETCH_MAX_PACKETS;   /* Limited by size */
+               return 0;
+            }
+         break;
+      }
+   }
+   fprintf(stderr,"ERROR: Invalid read ahead size\n");
+   return 1;
+}
+
+/* Rendition: WxH:bitrate:outfile. The size is rounded up to multiples of 16, as for -r */
+static int addRendition(struct context *ctx, char *optArg) {
+   OMXTX_RENDITION *r;
+   char *rate, *name;
+
+   if (ctx->nRenditions == MAX_RENDITIONS) {
+      fprintf(stderr, "ERROR: Option l can be given up to %d times\n", MAX_RENDITIONS);
+      return 1;
+   }
+   r = &ctx->renditionOpts[ctx->nRenditions];
+   if (optArg!=NULL && (rate = strchr(optArg, ':')) != NULL && (name = strchr(rate+1, ':')) != NULL && name[1] != '\0') {
+      *rate++ = '\0';
+      *name++ = '\0';
+      if (sscanf(optArg, "%dx%d", &r->width, &r->height) == 2 && (r->bitrate = parsebitrate(rate)) > 0) {
+         r->width = (r->width + 0x0f) & ~0x0f;
+         r->height = (r->height + 0x0f) & ~0x0f;
+         if (r->width > 16 && r->height > 16) {
+            r->oname = name;
+            ctx->nRenditions++;
+            return 0;
+         }
+      }
+   }
+   fprintf(stderr,"ERROR: Rendition must be widthxheight:bitrate:outfile\n");
+   return 1;
+}
+
+/* Thumbnails: interval[:width[xheight][:columnsxrows]]; interval is in seconds, or 'key' for
+ * each input keyframe. Sizes are rounded up to even numbers for the 4:2:0 JPEGs.
+ */
+static int setThumbnails(struct context *ctx, const char *optArg) {
+   OMXTX_THUMBS *t = &ctx->thumbs;
+   char *end;
+
+   t->width = THUMB_WIDTH;
+   t->height = 0;
+   t->columns = THUMB_COLUMNS;
+   t->rows = THUMB_ROWS;
+   if (optArg!=NULL) {
+      if (strncmp(optArg, "key", 3) == 0) {
+         t->interval = 0;
+         end = (char *)optArg + 3;
+      }
+      else if ((t->interval = strtod(optArg, &end)) <= 0)
+         end = (char *)optArg;
+      if (end != optArg && *end == ':') {
+         t->width = strtol(end+1, &end, 10);
+         if (*end == 'x')
+            t->height = strtol(end+1, &end, 10);
+         if (*end == ':') {
+            t->columns = strtol(end+1, &end, 10);
+            t->rows = *end == 'x' ? strtol(end+1, &end, 10) : 0;
+         }
+      }
+      t->width = (t->width + 1) & ~1;
+      t->height = (t->height + 1) & ~1;
+      if (end != optArg && *end == '\0' && t->width >= 16 && (t->height == 0 || t->height >= 16)
+            && t->columns > 0 && t->rows > 0 && t->columns * t->width <= 8192 && (t->height == 0 || t->rows * t->height <= 8192)) {
+         t->enabled = 1;
+         return 0;
+      }
+   }
+   fprintf(stderr,"ERROR: Thumbnails must be interval[:width[xheight][:columnsxrows]]: interval in seconds or 'key', sprite sheets up to 8192 pixels across\n");
+   return 1;
+}
+
+/* Segmented output: n[:list], n seconds per segment and list segments in the playlist */
+static int setSegmenter(struct context *ctx, const char *optArg) {
+   char *end;
+
+   if (optArg!=NULL) {
+      ctx->segmentTime = strtod(optArg, &end);
+      if (ctx->segmentTime > 0 && *end == ':')
+         ctx->playlistSize = strtol(end+1, &end, 10);
+      if (ctx->segmentTime > 0 && *end == '\0' && ctx->playlistSize >= 0)
+         return 0;
+   }
+   fprintf(stderr,"ERROR: Segmented output must be n[:list]: n seconds per segment, list segments in the playlist\n");
+   return 1;
+}
+
+/* Target file size: n[k|M|G] bytes */
+static int setTargetSize(struct context *ctx, const char *optArg) {
+   char *end;
+   double size;
+
+   if (optArg!=NULL) {
+      size = strtod(optArg, &end);
+      switch (*end) {
+         case 'G': case 'g': size *= 1024; /* Fall through */
+         case 'M': case 'm': size *= 1024; /* Fall through */
+         case 'K': case 'k': size *= 1024; end++;
+      }
+      if (size >= 1024 && *end == '\0') {
+         ctx->targetSize = size;
+         ctx->adaptive = 1;   /* The plan is followed by the adaptive bitrate controller */
+         return 0;
+      }
+   }
+   fprintf(stderr,"ERROR: Target file size must be n[k|M|G] bytes\n");
+   return 1;
+}
+
+/* Encoder tuning: name=value[,name=value...]; 'help' lists the knobs */
+static int setEncoderOpts(struct context *ctx, const char *optArg) {
+   char buf[256], *opt, *val, *save, *end;
+   int i, n;
+
+   if (optArg!=NULL && strcmp(optArg, "help")==0) {
+      fprintf(stdout, "Encoder tuning knobs for -X name=value:\n");
+      for (i=0; i<NXOPTS; i++) {
+         if (encoderOptions[i].rate)
+            fprintf(stdout, "   %-13s n[k|M] %s%s\n", encoderOptions[i].name, encoderOptions[i].help,
+               encoderOptions[i].sw ? "" : " (OMX only)");
+         else
+            fprintf(stdout, "   %-13s %d-%-4d %s%s\n", encoderOptions[i].name, encoderOptions[i].min, encoderOptions[i].max,
+               encoderOptions[i].help, encoderOptions[i].sw ? "" : " (OMX only)");
+      }
+      exit(0);
+   }
+   if (optArg==NULL || strlen(optArg) >= sizeof(buf)) {
+      fprintf(stderr, "ERROR: Encoder options must be name=value[,name=value...]: -X help lists them\n");
+      return 1;
+   }
+   strcpy(buf, optArg);
+   for (opt=strtok_r(buf, ",", &save); opt!=NULL; opt=strtok_r(NULL, ",", &save)) {
+      val = strchr(opt, '=');
+      if (val!=NULL)
+         *val++ = '\0';
+      for (i=0; i<NXOPTS && strcmp(opt, encoderOptions[i].name)!=0; i++)
+         ;
+      if (i==NXOPTS || val==NULL) {
+         fprintf(stderr, "ERROR: Unknown encoder option '%s': must be name=value; -X help lists them\n", opt);
+         return 1;
+      }
+      if (encoderOptions[i].rate)
+         n = parsebitrate(val);
+      else {
+         n = strtol(val, &end, 10);
+         if (*end != '\0' || end == val)
+            n = -1;
+      }
+      if (n < encoderOptions[i].min || n > encoderOptions[i].max) {
+         fprintf(stderr, "ERROR: Encoder option %s must be %d - %d\n", opt, encoderOptions[i].min, encoderOptions[i].max);
+         return 1;
+      }
+      ctx->encOpt[i] = n;
+   }
+   return 0;
+}
+
+/* Segment: from:to in seconds from the start of the input; either may be left out */
+static int setSegment(struct context *ctx, const char *optArg) {
+   const char *sep;
+   char *end;
+   double from, to;
+
+   if (optArg!=NULL && (sep=strchr(optArg, ':'))!=NULL) {
+      from = strtod(optArg, &end);
+      if (end==optArg)
+         from = -1;   /* Start of the file */
+      else if (end!=sep || from<0)
+         goto invalid;
+      to = strtod(sep+1, &end);
+      if (end==sep+1)
+         to = -1;     /* End of the file */
+      else if (*end!='\0' || to<=0 || (from>=0 && to<=from))
+         goto invalid;
+      ctx->segStart = from<0 ? AV_NOPTS_VALUE : (int64_t)(from*AV_TIME_BASE);
+      ctx->segEnd = to<0 ? AV_NOPTS_VALUE : (int64_t)(to*AV_TIME_BASE);
+      return 0;
+   }
+invalid:
+   fprintf(stderr,"ERROR: Segment must be from:to in seconds, with from < to\n");
+   return 1;
+}
+
+/* Metrics: the queue depths summed over the running pipelines */
+static void metricGauges(uint64_t *demuxq, uint64_t *decBusy, uint64_t *encQueued, int *pipelines) {
+   struct context *ctx;
+   OMXTX_BUF_RING *r;
+
+   *demuxq = *decBusy = *encQueued = 0;
+   *pipelines = 0;
+   pthread_mutex_lock(&metrics.lock);
+   for (ctx = metrics.pipelines; ctx != NULL; ctx = ctx->nextPipeline) {
+      if (ctx->parent == NULL)   /* Renditions (-l) are part of their parent's pipeline */
+         (*pipelines)++;
+      if (ctx->readq.size > 0)
+         *demuxq += pktQueueDepth(&ctx->readq);
+      r = &ctx->decFree;
+      if (r->size > 0)
+         *decBusy += r->size - 1 - (r->head + r->size - r->tail) % r->size;
+      r = &ctx->encFilled;
+      if (r->size > 0)
+         *encQueued += (r->head + r->size - r->tail) % r->size;
+   }
+   pthread_mutex_unlock(&metrics.lock);
+}
+
+static void writeMetricsTo(FILE *f) {
+   uint64_t demuxq, decBusy, encQueued, count, n;
+   int pipelines, h, b;
+   OMXTX_HISTOGRAM *m;
+
+   metricGauges(&demuxq, &decBusy, &encQueued, &pipelines);
+   if (metrics.json) {
+      fprintf(f, "{\"time\":%.3f,\"pipelines\":%d,\"demux_queue\":%llu,\"dec_buffers_busy\":%llu,"
+         "\"enc_buffers_queued\":%llu,\"frames_in\":%llu,\"frames_out\":%llu,\"bytes_out\":%llu,\"histograms\":{",
+         (double)time(NULL), pipelines, (unsigned long long)demuxq, (unsigned long long)decBusy,
+         (unsigned long long)encQueued, (unsigned long long)metrics.framesIn,
+         (unsigned long long)metrics.framesOut, (unsigned long long)metrics.bytesOut);
+      for (h = 0; h < NHISTS; h++) {
+         m = &metrics.hist[h];
+         fprintf(f, "%s\"%s\":{\"buckets_us\":[", h ? "," : "", histInfo[h].name);
+         for (b = count = 0; b < METRIC_BUCKETS; b++) {
+            n = m->bucket[b];
+            count += n;
+            fprintf(f, "%s%llu", b ? "," : "", (unsigned long long)n);
+         }
+         fprintf(f, "],\"count\":%llu,\"sum_us\":%llu,\"max_us\":%llu}", (unsigned long long)count,
+            (unsigned long long)m->sum, (unsigned long long)m->max);
+      }
+      fprintf(f, "}}\n");
+      return;
+   }
+
+   fprintf(f, "# HELP omxtx_pipelines Running pipelines\n# TYPE omxtx_pipelines gauge\nomxtx_pipelines %d\n", pipelines);
+   fprintf(f, "# HELP omxtx_demux_queue Packets in the read ahead queues\n# TYPE omxtx_demux_queue gauge\nomxtx_demux_queue %llu\n",
+      (unsigned long long)demuxq);
+   fprintf(f, "# HELP omxtx_dec_buffers_busy Decoder input buffers held by the decoder\n# TYPE omxtx_dec_buffers_busy gauge\n"
+      "omxtx_dec_buffers_busy %llu\n", (unsigned long long)decBusy);
+   fprintf(f, "# HELP omxtx_enc_buffers_queued Encoder output buffers waiting for the drain thread\n# TYPE omxtx_enc_buffers_queued gauge\n"
+      "omxtx_enc_buffers_queued %llu\n", (unsigned long long)encQueued);
+   fprintf(f, "# HELP omxtx_frames_in_total Frames passed to the decoder\n# TYPE omxtx_frames_in_total counter\n"
+      "omxtx_frames_in_total %llu\n", (unsigned long long)metrics.framesIn);
+   fprintf(f, "# HELP omxtx_frames_out_total Frames written\n# TYPE omxtx_frames_out_total counter\n"
+      "omxtx_frames_out_total %llu\n", (unsigned long long)metrics.framesOut);
+   fprintf(f, "# HELP omxtx_bytes_out_total Video bytes written\n# TYPE omxtx_bytes_out_total counter\n"
+      "omxtx_bytes_out_total %llu\n", (unsigned long long)metrics.bytesOut);
+   for (h = 0; h < NHISTS; h++) {
+      m = &metrics.hist[h];
+      fprintf(f, "# HELP omxtx_%s %s\n# TYPE omxtx_%s histogram\n", histInfo[h].name, histInfo[h].help, histInfo[h].name);
+      for (b = count = 0; b < METRIC_BUCKETS; b++) {
+         count += m->bucket[b];
+         if (b < METRIC_BUCKETS-1)
+            fprintf(f, "omxtx_%s_bucket{le=\"%g\"} %llu\n", histInfo[h].name, (double)(1LL<<b)*1e-6, (unsigned long long)count);
+         else
+            fprintf(f, "omxtx_%s_bucket{le=\"+Inf\"} %llu\n", histInfo[h].name, (unsigned long long)count);
+      }
+      fprintf(f, "omxtx_%s_sum %g\nomxtx_%s_count %llu\n", histInfo[h].name, (double)m->sum*1e-6,
+         histInfo[h].name, (unsigned long long)count);
+   }
+}
+
+/* Write the metrics. A regular file is replaced as a whole, so that a reader (e.g. the
+ * node exporter textfile collector) never sees half of it; anything else, such as a FIFO
+ * or /dev/fd/n, has each set of metrics appended.
+ */
+static void writeMetrics(void) {
+   struct stat st;
+   char *tmp;
+   FILE *f;
+
+   if (stat(metrics.file, &st) != 0 || S_ISREG(st.st_mode)) {
+      tmp = malloc(strlen(metrics.file) + 5);
+      sprintf(tmp, "%s.tmp", metrics.file);
+      if ((f = fopen(tmp, "w")) != NULL) {
+         writeMetricsTo(f);
+         if (fclose(f) != 0 || rename(tmp, metrics.file) != 0) {
+            fprintf(stderr, "WARNING: Failed to write metrics to %s: %s\n", metrics.file, strerror(errno));
+            unlink(tmp);
+         }
+      } else {
+         fprintf(stderr, "WARNING: Failed to write metrics to %s: %s\n", tmp, strerror(errno));
+      }
+      free(tmp);
+   } else if ((f = fopen(metrics.file, "a")) != NULL) {
+      writeMetricsTo(f);
+      fclose(f);
+   } else {
+      fprintf(stderr, "WARNING: Failed to write metrics to %s: %s\n", metrics.file, strerror(errno));
+   }
+}
+
+static void *metricsThread(void *arg) {
+   struct timespec tick = { 0, 100000000 };
+   int i;
+
+   while (!metrics.stop) {
+      for (i = 0; i < metrics.interval*10 && !metrics.stop; i++)
+         nanosleep(&tick, NULL);
+      if (!metrics.stop)
+         writeMetrics();
+   }
+   return NULL;
+}
+
+/* Metrics: fmt:file[:secs], fmt is json or prom */
+static int setMetrics(const char *optArg) {
+   const char *sep;
+   char *last, *end;
+   int n;
+
+   if (optArg==NULL || (sep=strchr(optArg, ':'))==NULL || sep[1]=='\0')
+      goto invalid;
+   if (sep-optArg==4 && strncmp(optArg, "json", 4)==0)
+      metrics.json = 1;
+   else if (sep-optArg==4 && strncmp(optArg, "prom", 4)==0)
+      metrics.json = 0;
+   else
+      goto invalid;
+   metrics.file = sep+1;
+   metrics.interval = 10;
+   last = strrchr(sep+1, ':');
+   if (last!=NULL && last[1]!='\0') {
+      n = strtol(last+1, &end, 10);
+      if (*end=='\0') {   /* A trailing :n is the interval; otherwise it's part of the name */
+         if (n <= 0)
+            goto invalid;
+         metrics.interval = n;
+         metrics.file = strndup(sep+1, last-sep-1);
+      }
+   }
+   metrics.enabled = 1;
+   return 0;
+invalid:
+   fprintf(stderr,"ERROR: Metrics must be fmt:file[:secs], with fmt json or prom\n");
+   return 1;
+}
+
+/* Write the trace rings out as Chrome trace event JSON */
+static void writeTrace(void) {
+   OMXTX_TRACE_RING *r;
+   OMXTX_TRACE_EVENT *e;
+   uint64_t i;
+   int pid = getpid(), first = 1;
+   FILE *f;
+
+   if ((f = fopen(trace.file, "w")) == NULL) {
+      fprintf(stderr, "WARNING: Failed to write the trace to %s: %s\n", trace.file, strerror(errno));
+      return;
+   }
+   fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+   pthread_mutex_lock(&trace.lock);
+   for (r = trace.rings; r != NULL; r = r->next) {
+      if (r->threadName != NULL) {
+         fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+            first ? "" : ",\n", pid, (int)r->tid, r->threadName);
+         first = 0;
+      }
+      if (r->n > TRACE_EVENTS)
+         fprintf(stderr, "WARNING: Trace: the first %llu events of thread %d were lost\n", (unsigned long long)(r->n - TRACE_EVENTS), (int)r->tid);
+      for (i = r->n > TRACE_EVENTS ? r->n - TRACE_EVENTS : 0; i < r->n; i++) {
+         e = &r->ev[i % TRACE_EVENTS];
+         fprintf(f, "%s{\"name\":\"%s%s%s\",\"cat\":\"%s\",\"ph\":\"%c\",\"ts\":%lld,\"pid\":%d,\"tid\":%d",
+            first ? "" : ",\n", e->comp ? e->comp : "", e->comp ? ": " : "", e->name, e->cat, e->ph, (long long)e->ts, pid, (int)r->tid);
+         first = 0;
+         if (e->ph == 'X')
+            fprintf(f, ",\"dur\":%lld", (long long)e->dur);
+         else if (e->ph == 'i')
+            fprintf(f, ",\"s\":\"t\"");
+         else
+            fprintf(f, ",\"id\":\"%p\"", e->id);
+         if (e->argName != NULL)
+            fprintf(f, ",\"args\":{\"%s\":%lld}", e->argName, (long long)e->arg);
+         fprintf(f, "}");
+      }
+   }
+   pthread_mutex_unlock(&trace.lock);
+   fprintf(f, "\n]}\n");
+   if (fclose(f) != 0)
+      fprintf(stderr, "WARNING: Failed to write the trace to %s: %s\n", trace.file, strerror(errno));
+}
+
+/* A regular file: one that can be opened again and read from the start, as -c auto and -Q do */
+static int regularFile(const char *name) {
+   struct stat st;
+
+   return strcmp(name, "-") != 0 && stat(name, &st) == 0 && S_ISREG(st.st_mode);
+}
+
 static int setupUserOpts(struct context *ctx, int argc, char *argv[]) {
    int i, j;
    char *optArg;
@@ -1850,11 +4138,31 @@ static int setupUserOpts(struct context *ctx, int argc, char *argv[]) {
    ctx->controlRateType=OMX_Video_ControlRateVariable; /* Default rate control */
    ctx->qI=20;                   /* Default for CQ mode: controlRateType=OMX_Video_ControlRateDisable */
    ctx->qP=20;                   /* Default for CQ mode: controlRateType=OMX_Video_ControlRateDisable */
-
-   i=2;
+   ctx->omxTimeout=OMX_TIMEOUT;  /* Default timeout for OMX state changes and commands */
+   ctx->prefetchPackets=PREFETCH_PACKETS; /* Default read ahead */
+   ctx->prefetchBytes=PREFETCH_BYTES;
+   ctx->workers=0;               /* Batch mode: one job at a time; -S: one job per segment */
+   ctx->segStart=AV_NOPTS_VALUE; /* Default: the whole input */
+   ctx->segEnd=AV_NOPTS_VALUE;
+   ctx->playlistSize=6;          /* Segmented output: a rolling playlist of the last 6 segments */
+   for (i=0; i<NXOPTS; i++)
+      ctx->encOpt[i]=-1;         /* Encoder tuning: firmware defaults */
+
+   ctx->iname=NULL;
+   i=1;
+   if (argv[1][0]!='-') {   /* No input file with -j */
+      ctx->iname=argv[1];
+      i=2;
+   }
    while (i < argc) {
       if (argv[i][0]=='-') {
          switch (argv[i][1]) {
+            case 'A':
+               ctx->adaptive = 1;
+               optArg=getArg(argc, argv, &i);
+               if (optArg!=NULL)
+                  fprintf(stderr, "Unexpected argument %s to option A ignored.\n", argv[i]);
+            break;
             case 'a':
                optArg=getArg(argc, argv, &i);
                ctx->userFlags |= UFLAGS_RESIZE;
@@ -1873,7 +4181,14 @@ static int setupUserOpts(struct context *ctx, int argc, char *argv[]) {
                optArg=getArg(argc, argv, &i);
                if (setCropRectangle(ctx, optArg)!=0)
                   return 1;
-               ctx->userFlags |= UFLAGS_CROP;
+               if (!ctx->autoCrop)
+                  ctx->userFlags |= UFLAGS_CROP;
+            break;
+            case 'C':
+               ctx->join=1;
+               optArg=getArg(argc, argv, &i);
+               if (optArg!=NULL)
+                  fprintf(stderr, "Unexpected argument %s to option C ignored.\n", argv[i]);
             break;
             case 'd':
                optArg=getArg(argc, argv, &i);
@@ -1881,6 +4196,32 @@ static int setupUserOpts(struct context *ctx, int argc, char *argv[]) {
                if (optArg!=NULL && optArg[0]=='0')
                   ctx->dei_ofpf=0;
             break;
+            case 'D':
+               optArg=getArg(argc, argv, &i);
+               ctx->decimate=1;
+               ctx->decimateThreshold=DECIMATE_THRESHOLD;
+               if (optArg==NULL || sscanf(optArg, "%lf:%lf", &ctx->decimateFps, &ctx->decimateThreshold) < 1
+                     || ctx->decimateFps < 0 || ctx->decimateThreshold < 0 || (ctx->decimateFps == 0 && ctx->decimateThreshold == 0)) {
+                  fprintf(stderr, "ERROR: Option D must be fps[:threshold], with a frame rate, a threshold, or both\n");
+                  return 1;
+               }
+            break;
+            case 'E':
+               optArg=getArg(argc, argv, &i);
+               if (optArg!=NULL && strcmp(optArg, "hw")==0)
+                  ctx->backend=&omxBackend;
+               else if (optArg!=NULL && strcmp(optArg, "sw")==0)
+                  ctx->backend=&swBackend;
+               else {
+                  fprintf(stderr, "ERROR: Backend for option E must be 'hw' or 'sw'\n");
+                  return 1;
+               }
+            break;
+            case 'F':
+               optArg=getArg(argc, argv, &i);
+               if (setTargetSize(ctx, optArg)==1)
+                  return 1;
+            break;
             case 'f':
                optArg=getArg(argc, argv, &i);
                setOutputFormat(ctx, optArg);
@@ -1889,28 +4230,87 @@ static int setupUserOpts(struct context *ctx, int argc, char *argv[]) {
                usage(argv[0]);
                return 1;
             break;
+            case 'H':
+               optArg=getArg(argc, argv, &i);
+               if (setSegmenter(ctx, optArg)==1)
+                  return 1;
+            break;
+            case 'I':
+               ctx->ivtc=1;
+            break;
             case 'i':
                optArg=getArg(argc, argv, &i);
                if (optArg!=NULL)
                   ctx->userAudioStreamIdx=atoi(optArg);
              break;
-            case 'm':
-               ctx->userFlags |= UFLAGS_MONITOR;
+            case 'j':
                optArg=getArg(argc, argv, &i);
-               if (optArg!=NULL)
-                  fprintf(stderr, "Unexpected argument %s to option m ignored.\n", argv[i]);
+               if (optArg==NULL) {
+                  fprintf(stderr, "ERROR: Job file expected for option j\n");
+                  return 1;
+               }
+               ctx->jobFile=optArg;
             break;
-            case 'o':
+            case 'J':
                optArg=getArg(argc, argv, &i);
-               if (optArg!=NULL)
-                  ctx->oname=optArg;
+               if (optArg==NULL || (ctx->workers=atoi(optArg)) <= 0) {
+                  fprintf(stderr, "ERROR: Invalid number of batch jobs\n");
+                  return 1;
+               }
             break;
-            case 'p':
+            case 'k':
+               optArg=getArg(argc, argv, &i);
+               if (setThumbnails(ctx, optArg)==1)
+                  return 1;
+            break;
+            case 'l':
+               optArg=getArg(argc, argv, &i);
+               if (addRendition(ctx, optArg)==1)
+                  return 1;
+            break;
+            case 'L':
+               optArg=getArg(argc, argv, &i);
+               ctx->liveLatency = 1000;   /* Default target: 1s */
+               if (optArg!=NULL && (ctx->liveLatency=atoi(optArg)) <= 0) {
+                  fprintf(stderr, "ERROR: Invalid target latency for option L\n");
+                  return 1;
+               }
+            break;
+            case 'M':
+               optArg=getArg(argc, argv, &i);
+               if (setMetrics(optArg)==1)
+                  return 1;
+            break;
+            case 'm':
+               ctx->userFlags |= UFLAGS_MONITOR;
+               optArg=getArg(argc, argv, &i);
+               if (optArg!=NULL)
+                  fprintf(stderr, "Unexpected argument %s to option m ignored.\n", argv[i]);
+            break;
+            case 'o':
+               optArg=getArg(argc, argv, &i);
+               if (optArg!=NULL)
+                  ctx->oname=optArg;
+            break;
+            case 'p':
                ctx->userFlags |= UFLAGS_MAKE_UP_PTS;
                optArg=getArg(argc, argv, &i);
                if (optArg!=NULL)
                   fprintf(stderr, "Unexpected argument %s to option p ignored.\n", argv[i]);
             break;
+            case 'P':
+               optArg=getArg(argc, argv, &i);
+               if (setPrefetch(ctx, optArg)==1)
+                  return 1;
+            break;
+            case 'Q':
+               optArg=getArg(argc, argv, &i);
+               ctx->qualityGops=QUALITY_GOPS;
+               if (optArg!=NULL && (ctx->qualityGops=atoi(optArg)) <= 0) {
+                  fprintf(stderr, "ERROR: Quality must be measured on one GOP in n, n > 0\n");
+                  return 1;
+               }
+            break;
             case 'q':
                optArg=getArg(argc, argv, &i);
                if (setQuantOpts(ctx, optArg)==1)
@@ -1922,12 +4322,45 @@ static int setupUserOpts(struct context *ctx, int argc, char *argv[]) {
                   return 1;
                ctx->userFlags |= UFLAGS_RESIZE;
             break;
+            case 's':
+               optArg=getArg(argc, argv, &i);
+               if (setSegment(ctx, optArg)==1)
+                  return 1;
+            break;
+            case 'S':
+               optArg=getArg(argc, argv, &i);
+               if (optArg==NULL || (ctx->segments=atoi(optArg)) <= 1) {
+                  fprintf(stderr, "ERROR: Number of segments for option S must be 2 or more\n");
+                  return 1;
+               }
+            break;
+            case 't':
+               optArg=getArg(argc, argv, &i);
+               if (optArg==NULL || (ctx->omxTimeout=atoi(optArg)) <= 0) {
+                  fprintf(stderr, "ERROR: Invalid timeout\n");
+                  return 1;
+               }
+            break;
+            case 'T':
+               optArg=getArg(argc, argv, &i);
+               if (optArg==NULL) {
+                  fprintf(stderr, "ERROR: Trace file expected for option T\n");
+                  return 1;
+               }
+               trace.file=optArg;
+               trace.enabled=1;
+            break;
             case 'v':
                ctx->userFlags |= UFLAGS_VERBOSE;
                optArg=getArg(argc, argv, &i);
                if (optArg!=NULL)
                   fprintf(stderr, "Unexpected argument %s to option v ignored.\n", argv[i]);
             break;
+            case 'X':
+               optArg=getArg(argc, argv, &i);
+               if (setEncoderOpts(ctx, optArg)==1)
+                  return 1;
+            break;
             default:
                fprintf(stderr, "Unknown option %s.\n", argv[i]);
                usage(argv[0]);
@@ -1938,33 +4371,167 @@ static int setupUserOpts(struct context *ctx, int argc, char *argv[]) {
       i++;
    }
 
-   ctx->iname = argv[1];
+   if (ctx->jobFile==NULL && ctx->segments==0 && ctx->workers>1) {
+      fprintf(stderr, "ERROR: Option J is only used with -j or -S\n");
+      return 1;
+   }
+   if (ctx->workers==0)
+      ctx->workers = ctx->segments>0 ? ctx->segments : 1;
+   if ((ctx->segments>0 || ctx->segStart!=AV_NOPTS_VALUE || ctx->segEnd!=AV_NOPTS_VALUE) && (ctx->userFlags & UFLAGS_MAKE_UP_PTS)) {
+      fprintf(stderr, "ERROR: Segments need the input timestamps: option p can't be used with -s or -S\n");
+      return 1;
+   }
+   if (ctx->segments>0 && (ctx->jobFile!=NULL || ctx->join)) {
+      fprintf(stderr, "ERROR: Option S can't be used with -j or -C\n");
+      return 1;
+   }
+   if (ctx->liveLatency>0 && (ctx->segments>0 || ctx->join || ctx->segStart!=AV_NOPTS_VALUE || ctx->segEnd!=AV_NOPTS_VALUE)) {
+      fprintf(stderr, "ERROR: Option L can't be used with -s, -S or -C\n");
+      return 1;
+   }
+   if (ctx->segmentTime>0) {
+      if (ctx->formatName==NULL)
+         ctx->formatName="hls";
+      else if (strcmp(ctx->formatName, "hls")!=0 && strcmp(ctx->formatName, "dash")!=0) {
+         fprintf(stderr, "ERROR: Option H needs the hls or dash format, not '%s'\n", ctx->formatName);
+         return 1;
+      }
+      if (ctx->segments>0 || ctx->join) {
+         fprintf(stderr, "ERROR: Option H can't be used with -S or -C\n");
+         return 1;
+      }
+   }
+   if (ctx->adaptive && ctx->controlRateType!=OMX_Video_ControlRateVariable) {
+      fprintf(stderr, "ERROR: Options A and F need a target bitrate: they can't be used with constant q (-q Q:...)\n");
+      return 1;
+   }
+   if (ctx->controlRateType!=OMX_Video_ControlRateVariable
+         && (ctx->encOpt[XOPT_INITQ]>0 || ctx->encOpt[XOPT_PEAKRATE]>0 || ctx->encOpt[XOPT_FRAMELIMIT]>0))
+      fprintf(stderr, "WARNING: Encoder options initq, peakrate and framelimit are for VBR: ignored with constant q\n");
+   if (ctx->encOpt[XOPT_PEAKRATE]>0 && ctx->targetSize==0 && ctx->encOpt[XOPT_PEAKRATE]<ctx->bitrate) {
+      fprintf(stderr, "ERROR: Encoder option peakrate must be no less than the bitrate (-b)\n");
+      return 1;
+   }
+   if (ctx->qualityGops>0 && (ctx->segments>0 || ctx->join || ctx->liveLatency>0 || ctx->segmentTime>0
+         || ctx->segStart!=AV_NOPTS_VALUE || ctx->segEnd!=AV_NOPTS_VALUE)) {
+      fprintf(stderr, "ERROR: Option Q compares a whole output file with its input: it can't be used with -s, -S, -C, -H or -L\n");
+      return 1;
+   }
+   if (ctx->targetSize>0 && (ctx->jobFile!=NULL || ctx->segments>0 || ctx->join || ctx->liveLatency>0 || ctx->segmentTime>0
+         || ctx->segStart!=AV_NOPTS_VALUE || ctx->segEnd!=AV_NOPTS_VALUE)) {
+      fprintf(stderr, "ERROR: Option F is for one whole output file: it can't be used with -j, -s, -S, -C, -H or -L\n");
+      return 1;
+   }
+   if (ctx->nRenditions>0) {
+      if (ctx->jobFile!=NULL || ctx->segments>0 || ctx->join || ctx->liveLatency>0 || ctx->segmentTime>0 || ctx->targetSize>0) {
+         fprintf(stderr, "ERROR: Option l can't be used with -j, -S, -C, -H, -L or -F\n");
+         return 1;
+      }
+      for (j=0; j<ctx->nRenditions; j++)
+         if (ctx->encOpt[XOPT_PEAKRATE]>0 && ctx->encOpt[XOPT_PEAKRATE]<ctx->renditionOpts[j].bitrate) {
+            fprintf(stderr, "ERROR: Encoder option peakrate must be no less than the bitrate of each rendition (-l)\n");
+            return 1;
+         }
+   }
+   if (ctx->thumbs.enabled && (ctx->jobFile!=NULL || ctx->segments>0 || ctx->join)) {
+      fprintf(stderr, "ERROR: Option k can't be used with -j, -S or -C\n");
+      return 1;
+   }
+   if (((ctx->userFlags & UFLAGS_MONITOR) ? 1 : 0) + ctx->nRenditions + ctx->thumbs.enabled > MAX_RENDITIONS) {
+      fprintf(stderr, "ERROR: The splitter has %d outputs after the encoder's: the monitor (-m), thumbnails (-k) and each rendition (-l) take one\n", MAX_RENDITIONS);
+      return 1;
+   }
+   if (ctx->ivtc && (ctx->userFlags & UFLAGS_DEINTERLACE)) {
+      fprintf(stderr, "ERROR: Option I makes progressive frames from the fields: it can't be used with -d\n");
+      return 1;
+   }
+   if (ctx->autoCrop && (ctx->join || ctx->liveLatency>0)) {
+      fprintf(stderr, "ERROR: Option c auto samples frames from across the input file: it can't be used with -C or -L\n");
+      return 1;
+   }
+   if (ctx->join && ctx->jobFile!=NULL) {
+      fprintf(stderr, "ERROR: Option C can't be used with -j\n");
+      return 1;
+   }
+   if (ctx->jobFile!=NULL) {
+      if (ctx->iname!=NULL || ctx->oname!=NULL) {
+         fprintf(stderr, "ERROR: Input and output files are given in the job file with -j\n");
+         return 1;
+      }
+      return 0;
+   }
+   if (ctx->iname==NULL) {
+      fprintf(stderr, "ERROR: No input file specified!\n");
+      return 1;
+   }
    if (ctx->oname==NULL) {
       fprintf(stderr, "ERROR: No output name specified!\n");
       return 1;
    }
-   
-   if (ctx->formatName!=NULL) {
-      if (strncmp(ctx->formatName, "nal", 3) == 0 || strncmp(ctx->formatName, "264", 3) == 0)
-         ctx->userFlags |= UFLAGS_RAW;
+   if (ctx->autoCrop && !regularFile(ctx->iname)) {
+      fprintf(stderr, "ERROR: Option c auto reads frames from across the input before the job: '%s' isn't a regular file\n", ctx->iname);
+      return 1;
    }
-   else {
-      j=strlen(ctx->oname);
-      if (j>4 && (strncmp(&(ctx->oname[j-4]), ".nal", 4) == 0 || strncmp(&(ctx->oname[j-4]), ".264", 4) == 0))
-         ctx->userFlags |= UFLAGS_RAW;
+   if (ctx->qualityGops>0 && (!regularFile(ctx->iname) || strcmp(ctx->oname, "-")==0)) {
+      fprintf(stderr, "ERROR: Option Q reads the input and output files again after the job: they must be regular files, not stdin, stdout, a FIFO or a socket\n");
+      return 1;
+   }
+   if (ctx->thumbs.enabled && strcmp(ctx->oname, "-")==0) {
+      fprintf(stderr, "ERROR: Option k names the thumbnails after the output file: it can't be used with output to stdout\n");
+      return 1;
    }
+   setRawOutput(ctx);
+   if (ctx->segments>0 && (ctx->userFlags & UFLAGS_RAW)) {
+      fprintf(stderr, "ERROR: Option S needs a container format for the segments: raw output can't be split\n");
+      return 1;
+   }
+   for (j=0; j<ctx->nRenditions; j++)
+      if ((ctx->userFlags & UFLAGS_RAW) || rawOutput(ctx->formatName, ctx->renditionOpts[j].oname)) {
+         fprintf(stderr, "ERROR: Option l needs a container format: the audio is copied to each output\n");
+         return 1;
+      }
    return 0;
 }
 
+/* Raw output if the format is nal / 264, or the output file name has one of these extensions */
+static int rawOutput(const char *formatName, const char *oname) {
+   int j;
+
+   if (formatName!=NULL)
+      return strncmp(formatName, "nal", 3) == 0 || strncmp(formatName, "264", 3) == 0;
+   j=strlen(oname);
+   return j>4 && (strncmp(&(oname[j-4]), ".nal", 4) == 0 || strncmp(&(oname[j-4]), ".264", 4) == 0);
+}
+
+static void setRawOutput(struct context *ctx) {
+   ctx->userFlags &= ~UFLAGS_RAW;
+   if (rawOutput(ctx->formatName, ctx->oname))
+      ctx->userFlags |= UFLAGS_RAW;
+}
+
 static int openInputFile(struct context *ctx) {
    AVFormatContext *ic=NULL;   /* Input context */
+   AVDictionary *inOpts=NULL;
+   const char *name=ctx->iname;
+   struct stat st;
    int err;
 
 #ifdef FFMPEG_LE_4
    av_register_all();
 #endif
 
-   if ((err = avformat_open_input(&ic, ctx->iname, NULL, NULL) != 0)) {
+   if (ctx->liveLatency > 0) {   /* Start on as little of the input as will do */
+      if (strcmp(name, "-")==0)
+         name = "pipe:0";
+      ctx->livePaced = stat(name, &st)==0 && S_ISREG(st.st_mode);
+      av_dict_set(&inOpts, "probesize", "32768", 0);
+      av_dict_set(&inOpts, "analyzeduration", "500000", 0);
+      av_dict_set(&inOpts, "fpsprobesize", "0", 0);
+      av_dict_set(&inOpts, "fflags", "nobuffer", 0);
+   }
+   err = avformat_open_input(&ic, name, NULL, &inOpts) != 0;
+   av_dict_free(&inOpts);
+   if (err) {
       fprintf(stderr, "ERROR: Failed to open '%s': %s\n", ctx->iname, strerror(err));
       return 1;
    }
@@ -1996,12 +4563,50 @@ static int openInputFile(struct context *ctx) {
 }
 
 static int examineNAL(struct context *ctx) {
-   if (ctx->nalEntry.nalBuf[0] == 0 && ctx->nalEntry.nalBuf[1] == 0 && ctx->nalEntry.nalBuf[2] == 0 && ctx->nalEntry.nalBuf[3] == 1)
-      return ctx->nalEntry.nalBuf[4] & 0x1f;
+   uint8_t *nal = ctx->nalEntry.nalBuf->data;
+
+   if (ctx->nalEntry.nalBufOffset > 4 && nal[0] == 0 && nal[1] == 0 && nal[2] == 0 && nal[3] == 1)
+      return nal[4] & 0x1f;
    else
       return -1;
 }
 
+/* Make sure the NAL buffer can take size bytes plus padding. If it can't, the pool
+ * is replaced by one with larger buffers; buffers from the old pool still held
+ * by the muxer are freed when it releases them. Returns 0 on success.
+ */
+static int reserveNalBuffer(struct context *ctx, size_t size) {
+   OMXTX_NAL_ENTRY *nal = &ctx->nalEntry;
+   AVBufferRef *buf;
+
+   if (size + AV_INPUT_BUFFER_PADDING_SIZE > nal->nalBufSize) {
+      while (size + AV_INPUT_BUFFER_PADDING_SIZE > nal->nalBufSize)
+         nal->nalBufSize *= 2;
+      if (ctx->userFlags & UFLAGS_VERBOSE)
+         fprintf(stderr, "\nINFO: NAL buffers increased to %u bytes\n", nal->nalBufSize);
+      av_buffer_pool_uninit(&nal->nalPool);
+      nal->nalPool = av_buffer_pool_init(nal->nalBufSize, NULL);
+      if (nal->nalPool == NULL) {
+         fprintf(stderr, "\nERROR: Can't allocate memory for NAL buffers.\n");
+         return 1;
+      }
+   }
+   else if (nal->nalBuf != NULL)
+      return 0;
+
+   buf = av_buffer_pool_get(nal->nalPool);
+   if (buf == NULL) {
+      fprintf(stderr, "\nERROR: Can't allocate memory for NAL buffers.\n");
+      return 1;
+   }
+   if (nal->nalBuf != NULL) {   /* Move the partial NAL to the larger buffer */
+      memcpy(buf->data, nal->nalBuf->data, nal->nalBufOffset);
+      av_buffer_unref(&nal->nalBuf);
+   }
+   nal->nalBuf = buf;
+   return 0;
+}
+
 /* Transfer nal buffer to avpacket for writing to file
  * OMX_BUFFERFLAG_SYNCFRAME defined in IL/OMX_Core.h:
  * Sync Frame Flag: This flag is set when the buffer content contains a coded sync frame -
@@ -2012,10 +4617,14 @@ static int examineNAL(struct context *ctx) {
 static void writeVideoPacket(struct context *ctx, int nalType) {
    AVPacket pkt;
    int r=-1;
+   int64_t t0;
    av_init_packet(&pkt); /* pkt.data is set to NULL here */
    pkt.stream_index = 0;
-   pkt.data = ctx->nalEntry.nalBuf;
+   pkt.buf = ctx->nalEntry.nalBuf; /* The packet takes the buffer reference: the muxer won't copy the data */
+   pkt.data = pkt.buf->data;
    pkt.size = ctx->nalEntry.nalBufOffset;
+   memset(pkt.data + pkt.size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+   ctx->nalEntry.nalBuf = NULL;
    pkt.pts=av_rescale_q(ctx->nalEntry.pts, ctx->omxtimebase, ctx->oc->streams[0]->time_base); /* Transform omx pts to output timebase */
    pkt.dts=pkt.pts; /* Out of order b-frames not supported on rpi: so dts=pts */
    ctx->ptsDelta=(ctx->nalEntry.pts-ctx->nalEntry.tick)/1000;
@@ -2024,13 +4633,148 @@ static void writeVideoPacket(struct context *ctx, int nalType) {
    if (nalType==5)   /* This is an IDR frame */
       pkt.flags |= AV_PKT_FLAG_KEY;
 
+   t0 = metrics.enabled || trace.enabled ? timeUs() : 0;
    r = av_interleaved_write_frame(ctx->oc, &pkt);
+   if (metrics.enabled)
+      metricSince(HIST_MUX, t0);
+   traceSpan("mux", "Write video", NULL, t0, "bytes", ctx->nalEntry.nalBufOffset);
    if (r != 0) {
       char err[256];
       av_strerror(r, err, sizeof(err));
       fprintf(stderr,"\nWARNING: Failed to write a video frame: %s (pts: %lld; nal: %i)\n", err, ctx->nalEntry.pts, nalType);
    }
-   else ctx->framesOut++; /* This assumes 1 nalu is equivalent to 1 frame */
+   else
+      frameWritten(ctx, ctx->nalEntry.pts); /* This assumes 1 nalu is equivalent to 1 frame */
+   av_packet_unref(&pkt);  /* Normally already done by the muxer */
+}
+
+/* Segmented output (-H): ask the encoder for an IDR frame. It applies to the next frame
+ * the encoder starts, so the request is made a frame before the segment boundary.
+ */
+static void requestIdr(struct context *ctx) {
+   OMX_CONFIG_PORTBOOLEANTYPE idr;
+
+   memset(&idr, 0, sizeof(idr));
+   idr.nSize = sizeof(idr);
+   idr.nVersion = SpecificationVersion;
+   idr.nPortIndex = PORT_ENC+1;
+   idr.bEnabled = OMX_TRUE;
+   if (OMX_SetConfig(ctx->enc, OMX_IndexConfigBrcmVideoRequestIFrame, &idr) != OMX_ErrorNone && (ctx->userFlags & UFLAGS_VERBOSE))
+      fprintf(stderr, "\nWARNING: I-frame request failed: the segment will be cut at the next keyframe\n");
+}
+
+/* A video frame has been written, with pts in the OMX timebase */
+static void frameWritten(struct context *ctx, int64_t pts) {
+   if (ctx->framesOut == 0) {
+      ctx->firstFrameTime = timeUs();
+      ctx->firstOutPts = ctx->lastOutPts = pts;
+   }
+   else if (pts != AV_NOPTS_VALUE) {   /* Not in order with B frames */
+      if (pts < ctx->firstOutPts)
+         ctx->firstOutPts = pts;
+      if (pts > ctx->lastOutPts)
+         ctx->lastOutPts = pts;
+   }
+   ctx->framesOut++;
+   metrics.framesOut++;
+}
+
+/* Seconds of output written so far, from the pts of the frames: with -I and -D fewer
+ * frames than framesOut / omxFPS assumes cover that time.
+ */
+static double outputTime(struct context *ctx) {
+   if (ctx->framesOut == 0 || ctx->firstOutPts == AV_NOPTS_VALUE)
+      return 0;
+   return (ctx->lastOutPts - ctx->firstOutPts + ctx->nalEntry.duration) / ctx->omxtimebase.den;
+}
+
+/* The video bitrate planned for t seconds into the output: ctx->bitrate unless -F made a plan */
+static int plannedRate(struct context *ctx, double t) {
+   int64_t slot;
+
+   if (ctx->planSlot == 0)
+      return ctx->bitrate;
+   slot = t * AV_TIME_BASE / ctx->planSlot;
+   return ctx->planRate[FFMAX(FFMIN(slot, PLAN_SLOTS-1), 0)];
+}
+
+/* The video bits planned for the first t seconds of the output */
+static double plannedBits(struct context *ctx, double t) {
+   double bits = 0, slot;
+   int i;
+
+   if (ctx->planSlot == 0)
+      return (double)ctx->bitrate * t;
+   slot = (double)ctx->planSlot / AV_TIME_BASE;
+   for (i = 0; i < PLAN_SLOTS-1 && t > slot; i++, t -= slot)
+      bits += ctx->planRate[i] * slot;
+   return bits + ctx->planRate[i] * t;
+}
+
+/* Adaptive bitrate (-A): set the encoder's target bitrate while it runs */
+static void setEncoderBitrate(struct context *ctx, int rate) {
+   OMX_VIDEO_CONFIG_BITRATETYPE bitrate;
+
+   if (ctx->backend == &swBackend) {
+      /* Only libx264 looks at bit_rate again once it's open: swOpenEncoder() may have had to take another */
+      if (strcmp(ctx->sw.enc->codec->name, "libx264") != 0) {
+         fprintf(stderr, "\nWARNING: The %s encoder won't take a new bitrate: adaptive bitrate is off for this job\n", ctx->sw.enc->codec->name);
+         ctx->adaptive = 0;
+         return;
+      }
+      ctx->sw.enc->bit_rate = rate;   /* Reconfigured at the next frame */
+   }
+   else {
+      memset(&bitrate, 0, sizeof(bitrate));
+      bitrate.nSize = sizeof(bitrate);
+      bitrate.nVersion = SpecificationVersion;
+      bitrate.nPortIndex = PORT_ENC+1;
+      bitrate.nEncodeBitrate = rate;
+      if (OMX_SetConfig(ctx->enc, OMX_IndexConfigVideoBitrate, &bitrate) != OMX_ErrorNone) {
+         fprintf(stderr, "\nWARNING: The encoder won't take a new bitrate: adaptive bitrate is off for this job\n");
+         ctx->adaptive = 0;
+         return;
+      }
+   }
+   ctx->abrRate = rate;
+   ctx->abrChanges++;
+   if (rate < ctx->abrMin)
+      ctx->abrMin = rate;
+   if (rate > ctx->abrMax)
+      ctx->abrMax = rate;
+}
+
+/* Adaptive bitrate (-A): called for each frame written, before its size is added to curSize,
+ * with key set for a keyframe. At the end of a window the achieved bitrate gives the
+ * encoder's gain (what it produces for the rate it is set to), and the new setting is the
+ * rate that makes up the difference between the bits written so far and the plan (-b, or
+ * the -F plan) over the next ABR_HORIZON seconds, divided by the gain. Changes are limited
+ * to a factor of two per window and to a quarter to four times the planned rate; changes
+ * under 2% aren't made.
+ */
+static void adaptBitrate(struct context *ctx, int key) {
+   double t = outputTime(ctx);
+   double window = t - ctx->abrTime;
+   double achieved, want;
+   int64_t rate, goal;
+
+   if (window < ABR_MIN_WINDOW || (!key && window < ABR_MAX_WINDOW))
+      return;
+   achieved = (ctx->curSize - ctx->abrBytes) * 8.0 / window;
+   ctx->abrGain = 0.5*ctx->abrGain + 0.5*achieved/ctx->abrRate;
+   ctx->abrBytes = ctx->curSize;
+   ctx->abrTime = t;
+
+   goal = plannedRate(ctx, t);
+   want = goal + (plannedBits(ctx, t) - ctx->curSize * 8.0) / ABR_HORIZON;
+   rate = want / (ctx->abrGain > 0.1 ? ctx->abrGain : 0.1);
+   rate = FFMAX(FFMIN(rate, 2LL*ctx->abrRate), ctx->abrRate/2);
+   rate = FFMAX(FFMIN(rate, 4LL*goal), goal/4);
+   if (ctx->userFlags & UFLAGS_VERBOSE)
+      fprintf(stderr, "\nAdaptive bitrate: %.0fkbps over %.1fs at %dkbps; encoder gain %.2f; set %lldkbps\n",
+         achieved/1000, window, ctx->abrRate/1000, ctx->abrGain, rate/1000);
+   if (llabs(rate - ctx->abrRate) * 50 >= ctx->abrRate)
+      setEncoderBitrate(ctx, rate);
 }
 
 /* The h264 video data is organized into NAL units (annex b), each of which is effectively a packet
@@ -2040,37 +4784,37 @@ static void writeVideoPacket(struct context *ctx, int nalType) {
  * It is possible that 1 NAL unit will not fit into 1 buffer, and may be split over several
  * buffers. Copy the buffer data into nalBuf, advancing the start location by nFilledLen for
  * each incomplete NAL: i.e. sum buf into nalBuf until end of NAL flag.
- * nalBuf points to a buffer of size nalEntry.nalBufSize; this is re-used and should not be freed here.
+ * nalBuf is a pool buffer of size nalEntry.nalBufSize, replaced by a larger one if the NAL
+ * doesn't fit; it is passed on to the muxer by writeVideoPacket().
  * For mkv files:
  *    Extract extradata required *before* output file header can be written: first two nals from rpi
  *    are sps followed by pps. These must be known before the output file can be opened.
+ * Returns an error if the job can't go on; OMX_ErrorUndefined if the output can't be written.
  */
-static void emptyEncoderBuffers(struct context *ctx) {
+static OMX_ERRORTYPE emptyEncoderBuffer(struct context *ctx, OMX_BUFFERHEADERTYPE *encbuf) {
    int nalType=-1;
    size_t curNalSize;
    int i;
 
-   if (ctx->encBufferFilled==0) {
-      ctx->encWaitTime++;
-      return;  /* Buffer is empty - return to main loop */
-   }
-
    if (ctx->userFlags & UFLAGS_RAW) {
-      write(ctx->raw_fd, ctx->encbufs->pBuffer + ctx->encbufs->nOffset, ctx->encbufs->nFilledLen);
+      if (write(ctx->raw_fd, encbuf->pBuffer + encbuf->nOffset, encbuf->nFilledLen) != (ssize_t)encbuf->nFilledLen) {
+         fprintf(stderr, "\nERROR: Failed to write to the output file: %s\n", strerror(errno));
+         return OMX_ErrorUndefined;
+      }
    }
    else {
-      if (ctx->state==OPENOUTPUT && (ctx->encbufs->nFlags & OMX_BUFFERFLAG_CODECCONFIG)) {
+      if (!ctx->outputOpen && (encbuf->nFlags & OMX_BUFFERFLAG_CODECCONFIG)) {
          if (ctx->userFlags & UFLAGS_VERBOSE)
             fprintf(stderr, "Examining extradata...\n");
          /* This code was copied from ffmpeg */
-         if (av_reallocp(&ctx->oc->streams[0]->codecpar->extradata, ctx->oc->streams[0]->codecpar->extradata_size + ctx->encbufs->nFilledLen + AV_INPUT_BUFFER_PADDING_SIZE) == 0) {
-            memcpy(ctx->oc->streams[0]->codecpar->extradata + ctx->oc->streams[0]->codecpar->extradata_size, ctx->encbufs->pBuffer + ctx->encbufs->nOffset, ctx->encbufs->nFilledLen);
-            ctx->oc->streams[0]->codecpar->extradata_size += ctx->encbufs->nFilledLen;
+         if (av_reallocp(&ctx->oc->streams[0]->codecpar->extradata, ctx->oc->streams[0]->codecpar->extradata_size + encbuf->nFilledLen + AV_INPUT_BUFFER_PADDING_SIZE) == 0) {
+            memcpy(ctx->oc->streams[0]->codecpar->extradata + ctx->oc->streams[0]->codecpar->extradata_size, encbuf->pBuffer + encbuf->nOffset, encbuf->nFilledLen);
+            ctx->oc->streams[0]->codecpar->extradata_size += encbuf->nFilledLen;
             memset(ctx->oc->streams[0]->codecpar->extradata + ctx->oc->streams[0]->codecpar->extradata_size, 0, AV_INPUT_BUFFER_PADDING_SIZE); /* Add extra zeroed bytes to prevent certain optimised readers from reading past the end */
          }
          else  {
             fprintf(stderr, "\nERROR: Failed to allocate memory for extradata.\n");
-            exit(1);
+            return OMX_ErrorInsufficientResources;
          }
          int nals[32] = { 0 };   /* Check that we have both sps and pps in extradata: newer versions of rpi libs put both in one buffer, older versions used separate buffers */
          for (i = 0; i + 4 < ctx->oc->streams[0]->codecpar->extradata_size; i++) {
@@ -2082,45 +4826,407 @@ static void emptyEncoderBuffers(struct context *ctx) {
              }
          }
          if (nals[7] && nals[8]) {
-            openOutput(ctx);
-            ctx->state = RUNNING;
+            enum states expected = OPENOUTPUT;
+            pthread_mutex_lock(&ctx->muxLock);
+            if (openOutput(ctx) != 0) {
+               pthread_mutex_unlock(&ctx->muxLock);
+               return OMX_ErrorUndefined;
+            }
+            ctx->outputOpen = 1;
+            pthread_mutex_unlock(&ctx->muxLock);
+            atomic_compare_exchange_strong(&ctx->state, &expected, RUNNING); /* Unless the feeder has already moved on */
          }
       }
       else {
-         curNalSize=ctx->nalEntry.nalBufOffset+ctx->encbufs->nFilledLen;
-         if (curNalSize>ctx->nalEntry.nalBufSize) {
-            fprintf(stderr, "\nERROR: nalBufSize exceeded.\n");
-            exit(1);
-         }
-         memcpy(ctx->nalEntry.nalBuf + ctx->nalEntry.nalBufOffset, ctx->encbufs->pBuffer + ctx->encbufs->nOffset, ctx->encbufs->nFilledLen);
+         if (metrics.enabled && ctx->nalEntry.nalBufOffset == 0)
+            ctx->nalStart = timeUs();
+         curNalSize=ctx->nalEntry.nalBufOffset+encbuf->nFilledLen;
+         if (reserveNalBuffer(ctx, curNalSize) != 0)
+            return OMX_ErrorInsufficientResources;
+         memcpy(ctx->nalEntry.nalBuf->data + ctx->nalEntry.nalBufOffset, encbuf->pBuffer + encbuf->nOffset, encbuf->nFilledLen);
          ctx->nalEntry.nalBufOffset=curNalSize;
-         ctx->nalEntry.tick=((((int64_t) ctx->encbufs->nTimeStamp.nHighPart)<<32) | ctx->encbufs->nTimeStamp.nLowPart);
+         ctx->nalEntry.tick=((((int64_t) encbuf->nTimeStamp.nHighPart)<<32) | encbuf->nTimeStamp.nLowPart);
          if (ctx->nalEntry.tick > ctx->nalEntry.pts)
             ctx->nalEntry.pts=ctx->nalEntry.tick; /* This is propagated through from the decoder */
          else
             ctx->nalEntry.pts+=ctx->nalEntry.duration; /* Something went wrong - make up pts based on detected framerate */
 
-         if (ctx->encbufs->nFlags & OMX_BUFFERFLAG_ENDOFNAL) { /* At end of nal */
+         if (encbuf->nFlags & OMX_BUFFERFLAG_ENDOFNAL) { /* At end of nal */
             nalType=examineNAL(ctx);
-            if (ctx->state == RUNNING) writeVideoPacket(ctx, nalType);
-            else if (ctx->state==OPENOUTPUT && nalType==5) {
+            if (metrics.enabled)
+               metricSince(HIST_NAL, ctx->nalStart);
+            if (ctx->outputOpen) {
+               if (ctx->adaptive && (nalType==1 || nalType==5))
+                  adaptBitrate(ctx, nalType==5);
+               pthread_mutex_lock(&ctx->muxLock);
+               writeVideoPacket(ctx, nalType);
+               pthread_mutex_unlock(&ctx->muxLock);
+               if ((nalType==1 || nalType==5) && segmentIdrDue(ctx, ctx->nalEntry.pts, ctx->nalEntry.duration))
+                  requestIdr(ctx);
+            }
+            else if (nalType==5) {
                fprintf(stderr, "\nERROR: sps or pps or both missing from encoder stream.\n");
-               exit(1);
+               return OMX_ErrorUndefined;
             }
             ctx->nalEntry.nalBufOffset = 0;
          }
-         else if ( ! ctx->encbufs->nFlags & OMX_BUFFERFLAG_EOS)
+         else if ( ! encbuf->nFlags & OMX_BUFFERFLAG_EOS)
             fprintf(stderr, "\nWARNING: End of NAL not found!\n");
       }
    }
-   ctx->curSize+=ctx->encbufs->nFilledLen;
-   ctx->encBufferFilled=0;                /* Flag that the buffer is empty */
-   ctx->encbufs->nFilledLen = 0;
-   ctx->encbufs->nOffset = 0;
-   if (ctx->encbufs->nFlags & OMX_BUFFERFLAG_EOS) /* This is the last buffer */
+   if ((encbuf->nFlags & OMX_BUFFERFLAG_ENDOFFRAME) && !(encbuf->nFlags & (OMX_BUFFERFLAG_CODECCONFIG | OMX_BUFFERFLAG_EOS))) {
+      liveOutput(ctx, (((int64_t) encbuf->nTimeStamp.nHighPart)<<32) | encbuf->nTimeStamp.nLowPart);
+      if (metrics.enabled)
+         metricFrameOut(ctx, (((int64_t) encbuf->nTimeStamp.nHighPart)<<32) | encbuf->nTimeStamp.nLowPart);
+   }
+   ctx->curSize+=encbuf->nFilledLen;
+   metrics.bytesOut+=encbuf->nFilledLen;
+   encbuf->nFilledLen = 0;
+   encbuf->nOffset = 0;
+   if (encbuf->nFlags & OMX_BUFFERFLAG_EOS) /* This is the last buffer */
       ctx->state=ENCEOS;
    else
-      OERR(OMX_FillThisBuffer(ctx->enc, ctx->encbufs)); /* Finished processing buffer - request buffer refill */
+      OERR(fillEncBuffer(ctx, encbuf)); /* Finished processing buffer - request buffer refill */
+   return OMX_ErrorNone;
+}
+
+/* The job can't go on: record the first error, and wake up the feeder, drain and
+ * filter threads if they are waiting for buffers so that they can give up.
+ */
+static void pipelineFailed(struct context *ctx, OMX_ERRORTYPE err) {
+   OMX_ERRORTYPE none = OMX_ErrorNone;
+
+   atomic_compare_exchange_strong(&ctx->error, &none, err);
+   ctx->state = FAILED;
+   signalBuffers(&ctx->bufLock, &ctx->bufCond);
+   signalBuffers(&ctx->encLock, &ctx->encCond);
+   signalBuffers(&ctx->filterLock, &ctx->filterCond);
+}
+
+/* Drain thread: empty encoder output buffers as filled() queues them,
+ * so the encoder never waits for the feeder loop. Runs until end of stream,
+ * or until the job fails.
+ */
+static void *drainEncoder(void *arg) {
+   struct context *ctx = arg;
+   OMX_BUFFERHEADERTYPE *buf;
+   OMX_ERRORTYPE err;
+   int64_t t0;
+
+   traceThread("drain");
+   while (ctx->state != ENCEOS && ctx->state != FAILED) {
+      t0 = timeUs();
+      pthread_mutex_lock(&ctx->encLock);
+      while ((buf = bufRingPop(&ctx->encFilled)) == NULL && ctx->state != FAILED)
+         pthread_cond_wait(&ctx->encCond, &ctx->encLock);
+      pthread_mutex_unlock(&ctx->encLock);
+      ctx->encWaitTime += timeUs() - t0;
+      traceSpan("omx", "Wait for encoder buffer", "Encoder", t0, NULL, 0);
+      if (buf == NULL)
+         break;
+      if (metrics.enabled)
+         metricSince(HIST_DRAINQ, ctx->encFilled.popped);
+
+      err = emptyEncoderBuffer(ctx, buf);
+      if (err != OMX_ErrorNone) {
+         pipelineFailed(ctx, err);
+         if (ctx->parent != NULL)   /* Rendition: its splitter output would fill up and stall the others */
+            pipelineFailed(ctx->parent, err);
+      }
+   }
+   return NULL;
+}
+
+/* Thumbnails (-k): frames of the output picture are taken every interval seconds, or at each
+ * input keyframe, and written as <prefix>-00001.jpg and so on with the libavcodec MJPEG
+ * encoder. They are tiled, columns x rows to a sheet, into <prefix>-sprite-001.jpg and so on,
+ * and <prefix>.vtt is a WebVTT index of where each one is in the sheets, for a player's seek
+ * bar. <prefix> is the output name without its extension. On the OMX backend the frames come
+ * from the thumbnailer's resizer, already at the thumbnail size; on the software backend they
+ * are the encoder's input, and are scaled here.
+ */
+
+/* The thumbnail height that keeps the display aspect of a w x h picture from the pipeline */
+static int thumbHeight(struct context *ctx, int w, int h) {
+   AVRational sar = { 1, 1 };
+
+   if (!(ctx->userFlags & (UFLAGS_RESIZE | UFLAGS_AUTO_SCALE_X | UFLAGS_AUTO_SCALE_Y)) && ctx->ic != NULL
+         && ctx->ic->streams[ctx->inVidStreamIdx]->codecpar->sample_aspect_ratio.num > 0
+         && ctx->ic->streams[ctx->inVidStreamIdx]->codecpar->sample_aspect_ratio.den > 0)
+      sar = ctx->ic->streams[ctx->inVidStreamIdx]->codecpar->sample_aspect_ratio;
+   h = (int64_t)ctx->thumbs.width * h * sar.den / ((int64_t)w * sar.num);
+   return FFMAX((h + 1) & ~1, 16);
+}
+
+/* Encode a AV_PIX_FMT_YUVJ420P frame as a JPEG file. Returns 0 on success. */
+static int writeJpeg(AVFrame *f, const char *name) {
+   const AVCodec *codec;
+   AVCodecContext *enc = NULL;
+   AVPacket *pkt;
+   FILE *out;
+   int r;
+
+   pkt = av_packet_alloc();
+   if (pkt == NULL || (codec = avcodec_find_encoder(AV_CODEC_ID_MJPEG)) == NULL || (enc = avcodec_alloc_context3(codec)) == NULL) {
+      av_packet_free(&pkt);
+      return 1;
+   }
+   enc->width = f->width;
+   enc->height = f->height;
+   enc->pix_fmt = AV_PIX_FMT_YUVJ420P;
+   enc->time_base = (AVRational){ 1, 25 };
+   enc->flags |= AV_CODEC_FLAG_QSCALE;
+   enc->global_quality = f->quality = FF_QP2LAMBDA * THUMB_QUALITY;
+   r = avcodec_open2(enc, codec, NULL) < 0 || avcodec_send_frame(enc, f) < 0 || avcodec_send_frame(enc, NULL) < 0
+      || avcodec_receive_packet(enc, pkt) < 0;
+   if (r == 0) {
+      out = fopen(name, "wb");
+      r = out == NULL || fwrite(pkt->data, 1, pkt->size, out) != pkt->size;
+      if (out != NULL && fclose(out) != 0)
+         r = 1;
+   }
+   av_packet_free(&pkt);
+   avcodec_free_context(&enc);
+   return r;
+}
+
+/* Write the sprite sheet: its first rows rows, so that the last one isn't padded out */
+static int writeSheet(OMXTX_THUMBS *t, int rows) {
+   AVFrame *part;
+   int r = 1;
+
+   part = av_frame_alloc();
+   if (part != NULL && av_frame_ref(part, t->sheet) == 0) {
+      part->height = rows * t->height;
+      sprintf(t->name, "%s-sprite-%03d.jpg", t->prefix, t->sheets+1);
+      r = writeJpeg(part, t->name);
+   }
+   av_frame_free(&part);
+   t->sheets++;
+   return r;
+}
+
+/* Write the cue for thumbnail n, shown from start to end (pts in us) */
+static void thumbCue(OMXTX_THUMBS *t, int n, int64_t start, int64_t end) {
+   const char *base = strrchr(t->prefix, '/');
+   int64_t ts[2] = { start - t->origin, end - t->origin };
+   char times[2][16];
+   int i, pos = n % (t->columns * t->rows);
+
+   for (i = 0; i < 2; i++) {
+      ts[i] = FFMAX(ts[i], 0) / 1000;   /* ms */
+      snprintf(times[i], sizeof(times[i]), "%02d:%02d:%02d.%03d", (int)(ts[i]/3600000), (int)(ts[i]/60000%60),
+         (int)(ts[i]/1000%60), (int)(ts[i]%1000));
+   }
+   fprintf(t->vtt, "%s --> %s\n%s-sprite-%03d.jpg#xywh=%d,%d,%d,%d\n\n", times[0], times[1],
+      base != NULL ? base+1 : t->prefix, n / (t->columns * t->rows) + 1,
+      pos % t->columns * t->width, pos / t->columns * t->height, t->width, t->height);
+}
+
+/* Start the thumbnails for a job. Returns 0 on success. */
+static int thumbsOpen(struct context *ctx) {
+   OMXTX_THUMBS *t = &ctx->thumbs;
+   char *dot, *slash;
+
+   t->count = t->sheets = t->failed = 0;
+   t->origin = t->cueStart = t->lastPts = t->lastKey = t->keyTick = AV_NOPTS_VALUE;
+   t->frameGap = 0;
+   t->prefix = malloc(strlen(ctx->oname) + 1);
+   t->name = malloc(strlen(ctx->oname) + 32);
+   if (t->prefix == NULL || t->name == NULL) {
+      fprintf(stderr, "ERROR: Can't allocate memory for the thumbnail names\n");
+      return 1;
+   }
+   strcpy(t->prefix, ctx->oname);
+   dot = strrchr(t->prefix, '.');
+   slash = strrchr(t->prefix, '/');
+   if (dot != NULL && (slash == NULL || dot > slash) && dot != t->prefix)
+      *dot = '\0';
+   sprintf(t->name, "%s.vtt", t->prefix);
+   t->vtt = fopen(t->name, "w");
+   if (t->vtt == NULL) {
+      fprintf(stderr, "ERROR: Can't open the thumbnail index %s: %s\n", t->name, strerror(errno));
+      return 1;
+   }
+   fprintf(t->vtt, "WEBVTT\n\n");
+   return 0;
+}
+
+/* Scale frame f, with pts in us, into t->frame if a thumbnail is due. Returns 1 if it was
+ * taken: f isn't needed after that, and thumbWrite() does the rest.
+ */
+static int thumbTake(struct context *ctx, const AVFrame *f, int64_t pts) {
+   OMXTX_THUMBS *t = &ctx->thumbs;
+   int64_t key = t->keyTick;
+
+   if (t->vtt == NULL || t->failed)
+      return 0;
+   if (t->origin == AV_NOPTS_VALUE)
+      t->origin = t->next = pts;
+   if (t->lastPts != AV_NOPTS_VALUE && pts > t->lastPts)
+      t->frameGap = pts - t->lastPts;
+   if (t->lastPts == AV_NOPTS_VALUE || pts > t->lastPts)
+      t->lastPts = pts;
+   if (t->interval > 0) {
+      if (pts < t->next)
+         return 0;
+      while (t->next <= pts)
+         t->next += t->interval * AV_TIME_BASE;
+   }
+   else {
+      if (key == AV_NOPTS_VALUE || key == t->lastKey || pts < key)
+         return 0;
+      t->lastKey = key;
+   }
+
+   if (t->frame == NULL) {
+      if (t->height == 0)
+         t->height = thumbHeight(ctx, f->width, f->height);
+      t->frame = av_frame_alloc();
+      t->sheet = av_frame_alloc();
+      if (t->frame == NULL || t->sheet == NULL)
+         goto failed;
+      t->frame->format = t->sheet->format = AV_PIX_FMT_YUVJ420P;
+      t->frame->width = t->width;
+      t->frame->height = t->height;
+      t->sheet->width = t->columns * t->width;
+      t->sheet->height = t->rows * t->height;
+      if (av_frame_get_buffer(t->frame, 32) < 0 || av_frame_get_buffer(t->sheet, 32) < 0)
+         goto failed;
+   }
+   t->sws = sws_getCachedContext(t->sws, f->width, f->height, f->format, t->width, t->height, AV_PIX_FMT_YUVJ420P,
+      SWS_BICUBIC, NULL, NULL, NULL);
+   if (t->sws == NULL)
+      goto failed;
+   sws_scale(t->sws, (const uint8_t * const *)f->data, f->linesize, 0, f->height, t->frame->data, t->frame->linesize);
+   return 1;
+
+failed:
+   fprintf(stderr, "\nWARNING: Can't write %s: no more thumbnails are made\n", t->name);
+   t->failed = 1;
+   return 0;
+}
+
+/* Write the thumbnail thumbTake() took at pts, and tile it into the sprite sheet */
+static void thumbWrite(struct context *ctx, int64_t pts) {
+   OMXTX_THUMBS *t = &ctx->thumbs;
+   int p, y, w, h, x0, y0, pos;
+
+   sprintf(t->name, "%s-%05d.jpg", t->prefix, t->count+1);
+   if (writeJpeg(t->frame, t->name) != 0)
+      goto failed;
+
+   /* Tile it into the sheet: black (full range) behind the thumbnails still to come */
+   pos = t->count % (t->columns * t->rows);
+   if (pos == 0)
+      for (p = 0; p < 3; p++)
+         memset(t->sheet->data[p], p == 0 ? 0 : 128, t->sheet->linesize[p] * (p == 0 ? t->sheet->height : t->sheet->height/2));
+   for (p = 0; p < 3; p++) {
+      w = p == 0 ? t->width : t->width/2;
+      h = p == 0 ? t->height : t->height/2;
+      x0 = pos % t->columns * w;
+      y0 = pos / t->columns * h;
+      for (y = 0; y < h; y++)
+         memcpy(t->sheet->data[p] + (y0+y)*t->sheet->linesize[p] + x0, t->frame->data[p] + y*t->frame->linesize[p], w);
+   }
+   if (t->count > 0)
+      thumbCue(t, t->count-1, t->cueStart, pts);
+   t->cueStart = pts;
+   t->count++;
+   if (pos == t->columns * t->rows - 1 && writeSheet(t, t->rows) != 0)
+      goto failed;
+   return;
+
+failed:
+   fprintf(stderr, "\nWARNING: Can't write %s: no more thumbnails are made\n", t->name);
+   t->failed = 1;
+}
+
+/* Take frame f, with pts in us, as a thumbnail if one is due */
+static void thumbFrame(struct context *ctx, const AVFrame *f, int64_t pts) {
+   if (thumbTake(ctx, f, pts))
+      thumbWrite(ctx, pts);
+}
+
+/* Finish the job's thumbnails: the last cue and sheet, and the index */
+static void thumbsClose(struct context *ctx) {
+   OMXTX_THUMBS *t = &ctx->thumbs;
+   int pos;
+
+   if (t->vtt != NULL) {
+      if (t->count > 0) {
+         thumbCue(t, t->count-1, t->cueStart, t->lastPts + t->frameGap);
+         pos = (t->count-1) % (t->columns * t->rows);
+         if (!t->failed && pos != t->columns * t->rows - 1 && writeSheet(t, pos / t->columns + 1) != 0)
+            fprintf(stderr, "WARNING: Can't write %s\n", t->name);
+      }
+      if (fclose(t->vtt) != 0)
+         fprintf(stderr, "WARNING: Can't write the thumbnail index %s.vtt\n", t->prefix);
+      else
+         fprintf(stderr, "Thumbnails: %d, %dx%d, in %d sprite sheets; index %s.vtt\n", t->count, t->width, t->height, t->sheets, t->prefix);
+      t->vtt = NULL;
+   }
+   free(t->prefix);
+   free(t->name);
+   t->prefix = t->name = NULL;
+   av_frame_free(&t->frame);
+   av_frame_free(&t->sheet);
+   sws_freeContext(t->sws);
+   t->sws = NULL;
+}
+
+/* Thumbnailer thread (-k, OMX): take the thumbnails from the resizer output buffers as
+ * thumbFilled() queues them, and give the buffers back. A buffer goes back as soon as its
+ * frame is copied out, before the JPEG and sheet are written, so that a slow write doesn't
+ * hold up the splitter and with it the main encode. Runs until the buffer with end of
+ * stream, or until omxTranscode() stops it. If a buffer can't be given back the job fails:
+ * the splitter would stall when the resizer runs out.
+ */
+static void *thumbnailThread(void *arg) {
+   struct context *ctx = arg;
+   OMX_BUFFERHEADERTYPE *buf;
+   OMX_ERRORTYPE err;
+   AVFrame *f;
+   int64_t pts;
+   int eos = 0, taken;
+
+   traceThread("thumbnails");
+   f = av_frame_alloc();
+   if (f == NULL) {
+      pipelineFailed(ctx->parent, OMX_ErrorInsufficientResources);
+      return NULL;
+   }
+   f->format = AV_PIX_FMT_YUV420P;
+   f->width = ctx->outputWidth;
+   f->height = ctx->outputHeight;
+   f->linesize[0] = ctx->thumbs.stride;
+   f->linesize[1] = f->linesize[2] = ctx->thumbs.stride/2;
+   while (!eos) {
+      pthread_mutex_lock(&ctx->encLock);
+      while ((buf = bufRingPop(&ctx->encFilled)) == NULL && ctx->state != ENCEOS && ctx->state != FAILED)
+         pthread_cond_wait(&ctx->encCond, &ctx->encLock);
+      pthread_mutex_unlock(&ctx->encLock);
+      if (buf == NULL)
+         break;
+      taken = 0;
+      pts = (((int64_t) buf->nTimeStamp.nHighPart)<<32) | buf->nTimeStamp.nLowPart;
+      if (buf->nFilledLen > 0) {   /* YUV 4:2:0 planar, in slices of sliceHeight lines */
+         f->data[0] = buf->pBuffer + buf->nOffset;
+         f->data[1] = f->data[0] + ctx->thumbs.stride * ctx->thumbs.sliceHeight;
+         f->data[2] = f->data[1] + ctx->thumbs.stride/2 * ctx->thumbs.sliceHeight/2;
+         taken = thumbTake(ctx, f, pts);
+      }
+      eos = buf->nFlags & OMX_BUFFERFLAG_EOS;
+      if (!eos && ctx->state != FAILED && (err = fillThumbBuffer(ctx, buf)) != OMX_ErrorNone) {
+         fprintf(stderr, "\nERROR: Can't pass a buffer back to the thumbnail resizer: %x\n", err);
+         pipelineFailed(ctx->parent, err);
+         break;
+      }
+      if (taken)
+         thumbWrite(ctx, pts);
+   }
+   av_frame_free(&f);
+   return NULL;
 }
 
 static void *sigHandler_thread(void *arg) {
@@ -2131,30 +5237,46 @@ static void *sigHandler_thread(void *arg) {
       s = sigwait(set, &sig);
       if (s != 0)
          perror("sigwait()");
-      else
-         ctx.state=QUIT;
+      else {
+         interrupted=1; /* The feeder loops stop and finish the output, and the batch workers take no more jobs */
+         while (batch.reading) {   /* A worker waiting on the job file: interrupt the read (wakeReader()) */
+            pthread_kill(batch.reader, SIGUSR1);
+            usleep(10000);
+         }
+      }
    }
    
    return NULL;
 }
 
+/* Get a free decoder input buffer: if all buffers are in use, sleep until emptied() returns one.
+ * decWaiting is set before the ring is looked at again, so that emptied() either sees it and
+ * signals, or has pushed the buffer that the second look finds. Returns NULL if the job has failed.
+ */
 OMX_BUFFERHEADERTYPE *getSpareDecBuffer(struct context *ctx) {
    OMX_BUFFERHEADERTYPE *spare;
-
-   do {
-      emptyEncoderBuffers(ctx); /* Empty filled encoder buffers as required */
-      spare = ctx->decbufs;
-      while (spare!=NULL && spare->nFilledLen != 0) /* Find a free buffer (indicated by nFilledLen == 0); if spare==NULL all buffers are used (pAppPrivate of last buffer is NULL) */
-         spare = spare->pAppPrivate;
-      usleep(10);
-   } while (spare==NULL);
+   int64_t t0 = metrics.enabled || trace.enabled ? timeUs() : 0;
+
+   if ((spare = bufRingPop(&ctx->decFree)) == NULL) {
+      pthread_mutex_lock(&ctx->bufLock);
+      ctx->decWaiting = 1;
+      while ((spare = bufRingPop(&ctx->decFree)) == NULL && ctx->state != FAILED)
+         pthread_cond_wait(&ctx->bufCond, &ctx->bufLock);
+      ctx->decWaiting = 0;
+      pthread_mutex_unlock(&ctx->bufLock);
+   }
+   if (metrics.enabled)
+      metricSince(HIST_DECWAIT, t0);
+   traceSpan("omx", "Wait for decoder buffer", "Decoder", t0, NULL, 0);
    return spare;
 }
 
-void fillDecBuffers(struct context *ctx, int i, AVPacket *p) {
+/* Pass a packet to the decoder, split over as many input buffers as needed */
+OMX_ERRORTYPE fillDecBuffers(struct context *ctx, int i, AVPacket *p) {
    int offset;
    int size, nsize;
    OMX_BUFFERHEADERTYPE *spare;
+   OMXTX_DEC_BUF *info;
    OMX_TICKS tick;
    int64_t omxTicks;
 
@@ -2170,10 +5292,12 @@ void fillDecBuffers(struct context *ctx, int i, AVPacket *p) {
    tick.nLowPart = (uint32_t) (omxTicks & 0xffffffff);
    tick.nHighPart = (uint32_t) ((omxTicks & 0xffffffff00000000) >> 32);
 
-   size = p->buf->size;
+   size = p->size;
    offset = 0;
    while (size>0) {
       spare=getSpareDecBuffer(ctx);
+      if (spare == NULL)
+         return ctx->error;
       if (i==0) spare->nFlags=OMX_BUFFERFLAG_STARTTIME;
       else spare->nFlags=0;
 
@@ -2184,202 +5308,3121 @@ void fillDecBuffers(struct context *ctx, int i, AVPacket *p) {
          nsize = size;     /* Frame will fit in buffer */
          spare->nFlags |= OMX_BUFFERFLAG_ENDOFFRAME;
       }
-      memcpy(spare->pBuffer, p->buf->data+offset, nsize);
+      memcpy(spare->pBuffer, p->data+offset, nsize);
 
-      if (p->flags & AV_PKT_FLAG_KEY)
+      if (p->flags & AV_PKT_FLAG_KEY) {
          spare->nFlags |= OMX_BUFFERFLAG_SYNCFRAME;
+         if (ctx->thumbnailer != NULL && offset == 0)
+            ctx->thumbnailer->thumbs.keyTick = omxTicks;
+      }
 
       spare->nTimeStamp = tick;
-      pthread_mutex_lock(&ctx->decBufLock);
       spare->nFilledLen = nsize;
-      pthread_mutex_unlock(&ctx->decBufLock);
       spare->nOffset = 0;
-      OERR(OMX_EmptyThisBuffer(ctx->dec, spare));
+      if (metrics.enabled) {
+         if (offset == 0)
+            metricFrameIn(ctx, omxTicks);
+         info = spare->pAppPrivate;
+         info->sent = timeUs();
+      }
+      OERR(emptyDecBuffer(ctx, spare));
       size -= nsize;
       offset += nsize;
    }
    ctx->framesIn++; /* This assumes 1 frame per buffer */
+   metrics.framesIn++;
+   return OMX_ErrorNone;
 }
 
-int main(int argc, char *argv[]) {
-   int i, j;
-   time_t start, end;
-   AVPacket *p=NULL;
-   OMX_BUFFERHEADERTYPE *spare;
-   pthread_t fpst;
-   pthread_attr_t fpsa;
-   sigset_t set;
-   pthread_t sigThread;
+/* Load the IL core named by $OMXTX_IL_CORE, or the VideoCore one, libopenmaxil.so,
+ * which needs bcm_host_init() from libbcm_host.so. Returns 0 on success, or 1 if there
+ * is no IL core: the reason is shown if verbose is set.
+ */
+static int loadILCore(int verbose) {
+   const char *name = getenv("OMXTX_IL_CORE");
+   void *host;
 
-   if (setupUserOpts(&ctx, argc, argv)==1)
+   if (ilCore.lib != NULL)
+      return 0;
+   if (name == NULL) {
+      name = "libopenmaxil.so";
+      host = dlopen("libbcm_host.so", RTLD_NOW | RTLD_GLOBAL);
+      if (host != NULL)
+         ilCore.hostInit = (void (*)(void)) dlsym(host, "bcm_host_init");
+   }
+   ilCore.lib = dlopen(name, RTLD_NOW | RTLD_GLOBAL);
+   if (ilCore.lib == NULL) {
+      if (verbose)
+         fprintf(stderr, "INFO: No OMX IL core: %s\n", dlerror());
+      return 1;
+   }
+   ilCore.init = (OMX_ERRORTYPE (*)(void)) dlsym(ilCore.lib, "OMX_Init");
+   ilCore.deinit = (OMX_ERRORTYPE (*)(void)) dlsym(ilCore.lib, "OMX_Deinit");
+   ilCore.getHandle = (OMX_ERRORTYPE (*)(OMX_HANDLETYPE *, OMX_STRING, OMX_PTR, OMX_CALLBACKTYPE *)) dlsym(ilCore.lib, "OMX_GetHandle");
+   ilCore.freeHandle = (OMX_ERRORTYPE (*)(OMX_HANDLETYPE)) dlsym(ilCore.lib, "OMX_FreeHandle");
+   ilCore.setupTunnel = (OMX_ERRORTYPE (*)(OMX_HANDLETYPE, OMX_U32, OMX_HANDLETYPE, OMX_U32)) dlsym(ilCore.lib, "OMX_SetupTunnel");
+   if (ilCore.init == NULL || ilCore.deinit == NULL || ilCore.getHandle == NULL || ilCore.freeHandle == NULL || ilCore.setupTunnel == NULL) {
+      fprintf(stderr, "WARNING: %s is not an OMX IL core\n", name);
+      dlclose(ilCore.lib);
+      ilCore.lib = NULL;
       return 1;
+   }
+   return 0;
+}
 
-   /* Block SIGINT and SIGQUIT; other threads created by main()
-    * will inherit a copy of the signal mask. */
+/* Initialise OMX, once per process: called through pthread_once() by the first pipeline to need it */
+static void initOMX(void) {
+   int64_t t0 = timeUs();
 
-   sigemptyset(&set);
-   sigaddset(&set, SIGINT);
-   sigaddset(&set, SIGQUIT);
-   i=pthread_sigmask(SIG_BLOCK, &set, NULL);
-   i+=pthread_create(&sigThread, NULL, &sigHandler_thread, (void *) &set);
-   if (i!=0) {
-      fprintf(stderr,"ERROR: signal handling init failed.\n");
-      return 1;
+   if (ilCore.hostInit != NULL)
+      ilCore.hostInit();
+   omxInitError = ilCore.init();
+   omxInitTime = timeUs() - t0;
+}
+
+/* Get handles for all the components: done once for each pipeline, before its first job.
+ * On failure any handles obtained are freed by cleanup().
+ */
+static OMX_ERRORTYPE openComponents(struct context *ctx) {
+   struct context *r;
+   int64_t t0;
+   int i;
+
+   pthread_once(&omxOnce, initOMX);
+   if (omxInitError != OMX_ErrorNone) {
+      fprintf(stderr, "ERROR: OMX_Init() failed: %x\n", omxInitError);
+      return omxInitError;
+   }
+   t0 = timeUs();
+   OERR(ilCore.getHandle(&ctx->dec, DECNAME, ctx, &decEventCallback));
+   OERR(ilCore.getHandle(&ctx->enc, ENCNAME, ctx, &encEventCallback));
+   OERR(ilCore.getHandle(&ctx->rsz, RSZNAME, ctx, &rszEventCallback));
+   OERR(ilCore.getHandle(&ctx->dei, DEINAME, ctx, &deiEventCallback));
+   OERR(ilCore.getHandle(&ctx->spl, SPLNAME, ctx, &splEventCallback));
+   OERR(ilCore.getHandle(&ctx->vid, VIDNAME, ctx, &vidEventCallback));
+   for (i = 0; i < ctx->nRenditions; i++) {   /* Their events go to the rendition's own context */
+      r = ctx->renditions[i];
+      OERR(ilCore.getHandle(&r->rsz, RSZNAME, r, &rszEventCallback));
+      OERR(ilCore.getHandle(&r->enc, ENCNAME, r, &encEventCallback));
    }
+   if ((r = ctx->thumbnailer) != NULL)
+      OERR(ilCore.getHandle(&r->rsz, RSZNAME, r, &thmEventCallback));
+   ctx->initTime = timeUs() - t0;
+   return OMX_ErrorNone;
+}
 
-   i=pthread_mutex_init(&ctx.decBufLock, NULL);
-   if (i!=0) {
-      fprintf(stderr,"ERROR: mutex init failed; exit.\n");
-      return 1;
+/* Free the audio packets saved for an output file that was never opened */
+static void freeSavedPackets(struct context *ctx) {
+   struct packetentry *packet;
+
+   while ((packet = TAILQ_FIRST(&ctx->packetq)) != NULL) {
+      TAILQ_REMOVE(&ctx->packetq, packet, link);
+      av_packet_free(&packet->packet);
+      free(packet);
    }
+}
 
-   ctx.omxtimebase.num=1;
-   ctx.omxtimebase.den=1000000; /* OMX timebase is in micro seconds */
-   ctx.nalEntry.nalBufSize=1024*1024*2; /* 2MB buffer */
-   ctx.nalEntry.nalBuf=av_malloc(ctx.nalEntry.nalBufSize);
-   if (ctx.nalEntry.nalBuf==NULL) {
-      fprintf(stderr,"ERROR: Can't allocate memory for nalBuf\n");
-      return 1;
+/* Reset the per job state: the options and the OMX components are kept */
+static void resetJob(struct context *ctx) {
+   int i;
+
+   ctx->userFlags = ctx->baseFlags;   /* configure() may have turned the deinterlacer off */
+   setRawOutput(ctx);
+   ctx->ic = NULL;
+   ctx->oc = NULL;
+   ctx->raw_fd = -1;
+   av_buffer_unref(&ctx->nalEntry.nalBuf);
+   ctx->nalEntry.nalBufOffset=0;
+   ctx->nalEntry.pts=0;
+   ctx->curSize=0;
+   ctx->framesOut=0;
+   ctx->framesIn=0;
+   ctx->ptsDelta=0;
+   ctx->firstOutPts=0;
+   ctx->lastOutPts=0;
+   ctx->componentFlags=0;
+   ctx->outputOpen=0;
+   ctx->naluInputFormat=0;
+   ctx->firstFrameTime=0;
+   ctx->setupTime=0;
+   ctx->encWaitTime=0;
+   ctx->error=OMX_ErrorNone;
+   ctx->state=DECINIT;
+   ctx->segState=SEG_BEFORE;
+   ctx->nextIdr=AV_NOPTS_VALUE;
+   ctx->paceStart=AV_NOPTS_VALUE;
+   ctx->clockOffset=AV_NOPTS_VALUE;
+   ctx->latencyLast=0;
+   ctx->latencySum=0;
+   ctx->latencyMax=0;
+   ctx->latencyFrames=0;
+   ctx->liveDropped=0;
+   ctx->liveCatchUp=0;
+   ctx->nalStart=0;
+   ctx->lastFilled=0;
+   ctx->abrGain=ctx->trialGain > 0 ? ctx->trialGain : 1.0;
+   ctx->abrRate=plannedRate(ctx, 0) / ctx->abrGain;   /* The encoder's starting target */
+   ctx->abrBytes=0;
+   ctx->abrTime=0;
+   ctx->abrChanges=0;
+   ctx->abrMin=ctx->abrMax=ctx->abrRate;
+   for (i = 0; i < FRAME_TIMES; i++)
+      ctx->frameTimes[i].tick=AV_NOPTS_VALUE;
+   freeSavedPackets(ctx);   /* Audio saved by a job that failed */
+}
+
+/* End of input, or the job failed before the encoder was started */
+static void closeInput(struct context *ctx) {
+   int i;
+
+   stopDemux(ctx);
+   avformat_close_input(&ctx->ic);
+   for (i = 0; i < ctx->nRenditions; i++)
+      ctx->renditions[i]->ic = NULL;
+   if (ctx->thumbnailer != NULL)
+      ctx->thumbnailer->ic = NULL;
+}
+
+/* Finish the output file, and those of any renditions (-l). If the job failed the files are closed as they are. */
+static void closeOutput(struct context *ctx) {
+   int i;
+
+   for (i = 0; i < ctx->nRenditions; i++)
+      closeOutput(ctx->renditions[i]);
+   if (ctx->oc) {
+      if (ctx->outputOpen)
+         av_write_trailer(ctx->oc);
+      avio_close(ctx->oc->pb);
+      avformat_free_context(ctx->oc);
+      ctx->oc = NULL;
+   }
+   else if (ctx->raw_fd >= 0) {
+      close(ctx->raw_fd);
+      ctx->raw_fd = -1;
    }
-   ctx.nalEntry.nalBufOffset=0;
-   ctx.nalEntry.pts=0;
-   ctx.curSize=0;
-   ctx.framesOut=0;
-   ctx.framesIn=0;
-   ctx.componentFlags=0;
-   ctx.componentFlags=0;
-   ctx.encBufferFilled=0;
-   ctx.naluInputFormat=0;
+}
 
-   TAILQ_INIT(&packetq);
+/* Renditions (-l): wait for the first n drain threads to finish. If the job has failed the
+ * renditions are stopped too: end of stream may never reach them.
+ */
+static void joinRenditions(struct context *ctx, pthread_t *threads, int n) {
+   struct context *r;
+   int i;
 
-   if (openInputFile(&ctx)==1)
-      return 1;
+   for (i = 0; i < n; i++) {
+      r = ctx->renditions[i];
+      if (ctx->state == FAILED && r->state != ENCEOS && r->state != FAILED)
+         pipelineFailed(r, ctx->error);
+      pthread_join(threads[i], NULL);
+   }
+}
 
-   if (ctx.userFlags & UFLAGS_RAW) {
-      ctx.raw_fd = open(ctx.oname, O_CREAT|O_TRUNC|O_WRONLY, 0666);
-      if (ctx.raw_fd == -1) {
-         fprintf(stderr, "ERROR: Failed to open the output file for writing: %s\n", strerror(errno));
-         avformat_close_input(&ctx.ic);
-         return 1;
-      }
+/* Thumbnailer (-k): stop its thread once the encoder has finished, or the job has failed.
+ * Frames reach it from the splitter along with the encoder's, so by then the last of them
+ * are queued: they are taken before it stops.
+ */
+static void joinThumbnailer(struct context *ctx, pthread_t thread) {
+   struct context *t = ctx->thumbnailer;
+
+   if (ctx->state == FAILED)
+      pipelineFailed(t, ctx->error);
+   else {
+      t->state = ENCEOS;
+      signalBuffers(&t->encLock, &t->encCond);
    }
+   pthread_join(thread, NULL);
+}
 
-   atexit(exitHandler); /* Not called if interrupted by a signal */
-   bcm_host_init();
-   OERR(OMX_Init());
-   OERR(OMX_GetHandle(&ctx.dec, DECNAME, &ctx, &decEventCallback));
-   OERR(OMX_GetHandle(&ctx.enc, ENCNAME, &ctx, &encEventCallback));
-   OERR(OMX_GetHandle(&ctx.rsz, RSZNAME, &ctx, &rszEventCallback));
-   OERR(OMX_GetHandle(&ctx.dei, DEINAME, &ctx, &deiEventCallback));
-   OERR(OMX_GetHandle(&ctx.spl, SPLNAME, &ctx, &splEventCallback));
-   OERR(OMX_GetHandle(&ctx.vid, VIDNAME, &ctx, &vidEventCallback));
+/* OMX backend: the components are set up on the first job. runJob() has opened the input
+ * and any raw output file; the output is left for runJob() to close.
+ */
+static int omxTranscode(struct context *ctx) {
+   int i, j;
+   AVPacket *p=NULL;
+   OMX_BUFFERHEADERTYPE *spare;
+   OMX_ERRORTYPE err;
+   pthread_t fpst, drainThread, renditionThreads[MAX_RENDITIONS], thumbThread, filterTh;
+   int fpsRunning=0;
+   enum states state;
+   int64_t t0;
+
+   if (ctx->dec == NULL && openComponents(ctx) != OMX_ErrorNone) {
+      fprintf(stderr, "ERROR: Failed to get the OMX component handles.\n");
+      avformat_close_input(&ctx->ic);
+      return -1;
+   }
 
-   ctx.decbufs=configDecoder(&ctx);
+   ctx->startTime=timeUs();
+   if (configDecoder(ctx) != OMX_ErrorNone) {
+      fprintf(stderr, "ERROR: Failed to set up the decoder.\n");
+      avformat_close_input(&ctx->ic);
+      return -1;
+   }
+   ctx->setupTime += timeUs()-ctx->startTime;
+   if (ctx->userFlags & UFLAGS_VERBOSE)
+      fprintf(stderr, "Decoder set up in %.1fms\n", (timeUs()-ctx->startTime)/1000.0);
    /* If there is extradata send it to the decoder to have a look at */
-   if (ctx.ic->streams[ctx.inVidStreamIdx]->codecpar->extradata!=NULL
-         && ctx.ic->streams[ctx.inVidStreamIdx]->codecpar->extradata_size>0) {
-      if (ctx.userFlags & UFLAGS_VERBOSE)
+   if (ctx->ic->streams[ctx->inVidStreamIdx]->codecpar->extradata!=NULL
+         && ctx->ic->streams[ctx->inVidStreamIdx]->codecpar->extradata_size>0) {
+      if (ctx->userFlags & UFLAGS_VERBOSE)
          fprintf(stderr, "** Found extradata in video stream...\n");
-      spare=ctx.decbufs;
-      if (ctx.ic->streams[ctx.inVidStreamIdx]->codecpar->extradata_size < spare->nAllocLen) {
-         spare->nFilledLen=ctx.ic->streams[ctx.inVidStreamIdx]->codecpar->extradata_size;
-         memcpy(spare->pBuffer, ctx.ic->streams[ctx.inVidStreamIdx]->codecpar->extradata, spare->nFilledLen);
+      if (ctx->ic->streams[ctx->inVidStreamIdx]->codecpar->extradata_size < ctx->decbufs[0]->nAllocLen) {
+         spare=getSpareDecBuffer(ctx);   /* Not NULL: nothing can have failed yet */
+         spare->nFilledLen=ctx->ic->streams[ctx->inVidStreamIdx]->codecpar->extradata_size;
+         spare->nOffset=0;
+         memcpy(spare->pBuffer, ctx->ic->streams[ctx->inVidStreamIdx]->codecpar->extradata, spare->nFilledLen);
          spare->nFlags=OMX_BUFFERFLAG_CODECCONFIG | OMX_BUFFERFLAG_ENDOFFRAME;
-         OERR(OMX_EmptyThisBuffer(ctx.dec, spare));
+         if ((err = emptyDecBuffer(ctx, spare)) != OMX_ErrorNone) {
+            fprintf(stderr, "ERROR: Failed to pass extradata to the decoder: %x\n", err);
+            avformat_close_input(&ctx->ic);
+            return -1;
+         }
       }
       else
          fprintf(stderr,"WARNING: extradata too big for input buffer - ignoring...\n");
    }
 
-   ctx.audioPTS=ctx.ic->streams[ctx.inAudioStreamIdx]->start_time;
-   ctx.videoPTS=ctx.ic->streams[ctx.inVidStreamIdx]->start_time;
-   if (ctx.userFlags & UFLAGS_MAKE_UP_PTS) {
-      if (ctx.audioPTS>ctx.videoPTS) { /* Audio starts later than video */
-         ctx.audioPTS=ctx.audioPTS-ctx.videoPTS;
-         ctx.videoPTS=0;
-      }
-      else {
-         ctx.videoPTS=ctx.videoPTS-ctx.audioPTS;
-         ctx.audioPTS=0;
-      }
+   if (startDemux(ctx) != 0) {
+      fprintf(stderr, "ERROR: Failed to start demux thread.\n");
+      avformat_close_input(&ctx->ic);
+      return -1;
    }
-      
+
    /* Feed the decoder frames until the parameters are identified and port 131 changes state */
-   for (j=0; ctx.state!=TUNNELSETUP; j++) {
-      p=getNextVideoPacket(&ctx);
+   for (j=0; ctx->state==DECINIT; j++) {
+      if (interrupted) {
+         ctx->state = QUIT;
+         break;
+      }
+      p=getNextVideoPacket(ctx);
       if (p!=NULL) {
-         fillDecBuffers(&ctx,j,p);
-         av_packet_free(&p);
+         err=fillDecBuffers(ctx,j,p);
+         recyclePacket(ctx, &p);
+         if (err != OMX_ErrorNone)
+            pipelineFailed(ctx, err);
       }
-      else
-         ctx.state = DECEOF;
-      if (j==120)
-         ctx.state=DECFAILED;
+      else if (ctx->state != FAILED)
+         ctx->state = DECEOF;
+      if (j==120 && ctx->state==DECINIT)
+         ctx->state=DECFAILED;
    }
-   switch (ctx.state) {
+   switch (ctx->state) {
       case DECFAILED:
          fprintf(stderr, "ERROR: Failed to set the parameters after %d video frames.  Giving up.\n", j);
-         exit(1);
-         break;
+         closeInput(ctx);
+         return 1;
       case DECEOF:
          fprintf(stderr, "ERROR: End of file before parameters could be set.\n");
-         exit(1);
-         break;
+         closeInput(ctx);
+         return 1;
       case TUNNELSETUP:
-         if (ctx.userFlags & UFLAGS_VERBOSE)
+         if (ctx->userFlags & UFLAGS_VERBOSE)
             fprintf(stderr, "Identified the parameters after %d video frames.\n", j);
-         start = time(NULL);
-         configure(&ctx);
-         fprintf(stderr, "INFO: OMX detected %lf fps\n", ctx.omxFPS);
-         pthread_attr_init(&fpsa);
-         pthread_attr_setdetachstate(&fpsa, PTHREAD_CREATE_DETACHED);
-         pthread_create(&fpst, &fpsa, fps, NULL); /* Run fps calculator in another thread */
+         ctx->runStart = time(NULL);
+         t0 = timeUs();
+         if (configure(ctx) != OMX_ErrorNone) {
+            fprintf(stderr, "ERROR: Failed to set up the encoder pipeline.\n");
+            closeInput(ctx);
+            return -1;
+         }
+         ctx->setupTime += timeUs()-t0;
+         fprintf(stderr, "INFO: OMX detected %lf fps\n", ctx->omxFPS);
+         if (ctx->thumbnailer != NULL && pthread_create(&thumbThread, NULL, thumbnailThread, ctx->thumbnailer) != 0) {
+            fprintf(stderr, "ERROR: Failed to start the thumbnail thread.\n");
+            closeInput(ctx);
+            return -1;
+         }
+         if (ctx->filter.src != NULL) {   /* -I, -D: frames may be waiting for the filter stage already */
+            memset(&ctx->filter.ivtc, 0, sizeof(ctx->filter.ivtc));   /* filterThread() freed the frames of the last job */
+            memset(&ctx->filter.decimate, 0, sizeof(ctx->filter.decimate));
+            ctx->filter.ivtc.enabled = ctx->ivtc;   /* The frames are always 8 bit planar */
+            ctx->filter.decimate.enabled = ctx->decimate;
+            ctx->filter.decimate.threshold = ctx->decimateThreshold;
+            if (pthread_create(&filterTh, NULL, filterThread, ctx) != 0) {
+               fprintf(stderr, "ERROR: Failed to start the filter thread.\n");
+               pipelineFailed(ctx, OMX_ErrorInsufficientResources);
+               if (ctx->thumbnailer != NULL)
+                  joinThumbnailer(ctx, thumbThread);
+               closeInput(ctx);
+               return -1;
+            }
+         }
+         for (i = 0; i < ctx->nRenditions; i++)
+            if (pthread_create(&renditionThreads[i], NULL, drainEncoder, ctx->renditions[i]) != 0)
+               break;
+         if (i < ctx->nRenditions || pthread_create(&drainThread, NULL, drainEncoder, ctx) != 0) {
+            fprintf(stderr, "ERROR: Failed to start encoder drain thread.\n");
+            pipelineFailed(ctx, OMX_ErrorInsufficientResources);
+            joinRenditions(ctx, renditionThreads, i);
+            if (ctx->thumbnailer != NULL)
+               joinThumbnailer(ctx, thumbThread);
+            if (ctx->filter.src != NULL)
+               pthread_join(filterTh, NULL);
+            closeInput(ctx);
+            return -1;
+         }
+         if (ctx->workers <= 1)   /* Progress lines from several jobs would be unreadable */
+            fpsRunning = pthread_create(&fpst, NULL, fps, ctx) == 0; /* Run fps calculator in another thread */
          break;
+      case FAILED:
+         fprintf(stderr, "ERROR: Failed to pass the input to the decoder: %x\n", ctx->error);
+         closeInput(ctx);
+         return -1;
       case QUIT:
-         exit(1);
+         closeInput(ctx);
+         return -1;
       default:
-         fprintf(stderr, "ERROR: System in an unexpected state: %i.\n", ctx.state);
-         exit(1);
+         fprintf(stderr, "ERROR: System in an unexpected state: %i.\n", ctx->state);
+         closeInput(ctx);
+         return -1;
    }
    
    /* Main loop */
-   for (i = j+1; ctx.state != QUIT; i++) {
-      p = getNextVideoPacket(&ctx);
+   for (i = j+1; ctx->state != FAILED && !interrupted; i++) {
+      p = getNextVideoPacket(ctx);
       if (p == NULL) break;
-      fillDecBuffers(&ctx,i,p);
-      av_packet_free(&p);
+      err = fillDecBuffers(ctx,i,p);
+      recyclePacket(ctx, &p);
+      if (err != OMX_ErrorNone)
+         pipelineFailed(ctx, err);
    } /* End of main loop */
 
-   ctx.state = DECEOF;  /* Signal fps thread to finish */
-   avformat_close_input(&ctx.ic);
-   spare=getSpareDecBuffer(&ctx);
-   spare->nFilledLen=0;
-   spare->nOffset = 0;
-   spare->nFlags=OMX_BUFFERFLAG_ENDOFFRAME | OMX_BUFFERFLAG_EOS | OMX_BUFFERFLAG_TIME_UNKNOWN;
-   OERR(OMX_EmptyThisBuffer(ctx.dec, spare));
+   closeInput(ctx);
+   /* End of input, unless the drain thread has failed: it may still move the state on from OPENOUTPUT */
+   state = ctx->state;
+   while (state != FAILED && !atomic_compare_exchange_weak(&ctx->state, &state, DECEOF));
+   if (state != FAILED) {
+      spare=getSpareDecBuffer(ctx);
+      if (spare != NULL) {
+         spare->nFilledLen=0;
+         spare->nOffset = 0;
+         spare->nFlags=OMX_BUFFERFLAG_ENDOFFRAME | OMX_BUFFERFLAG_EOS | OMX_BUFFERFLAG_TIME_UNKNOWN;
+         if ((err = emptyDecBuffer(ctx, spare)) != OMX_ErrorNone)
+            pipelineFailed(ctx, err);
+      }
+   }
 
    /* Wait for encoder to finish processing */
-   while (ctx.state != ENCEOS) {
-      emptyEncoderBuffers(&ctx);
-      usleep(10);
+   pthread_join(drainThread, NULL);
+   if (ctx->filter.src != NULL)
+      pthread_join(filterTh, NULL);   /* Done once it passed on the end of stream, or failed */
+   joinRenditions(ctx, renditionThreads, ctx->nRenditions);
+   if (ctx->thumbnailer != NULL)
+      joinThumbnailer(ctx, thumbThread);
+   if (fpsRunning)
+      pthread_join(fpst, NULL);
+
+   if (ctx->state == FAILED) {
+      fprintf(stderr, "\nERROR: Job failed after %lli frames: %x\n", ctx->framesOut, ctx->error);
+      return -1;
    }
    
-   end = time(NULL);
+   return 0;
+}
 
-   fprintf(stderr, "\n\nDropped frames: %f\%\n",100*(ctx.framesIn-ctx.framesOut)/ctx.framesIn);
-   fprintf(stderr, "Processed %lli frames in %d seconds; %llif/s\n", ctx.framesOut, end-start, (ctx.framesOut/(end-start)));
-   if (ctx.userFlags & UFLAGS_VERBOSE)
-      fprintf(stderr, "Time waiting for encoder to finish: %.2lfs\n",(double)ctx.encWaitTime*1E-5);
-   
-   if (ctx.oc) {
-      av_write_trailer(ctx.oc);
-      avio_close(ctx.oc->pb);
+
+/* Inverse telecine: free the frames held, at the end of a job */
+static void ivtcFree(OMXTX_IVTC *iv) {
+   int i;
+
+   for (i = 0; i < 3; i++)
+      av_frame_free(&iv->in[i]);
+   for (i = 0; i < iv->n; i++)
+      av_frame_free(&iv->cycle[i]);
+   iv->n = 0;
+   av_frame_free(&iv->last);
+}
+
+/* Filter stage (-I, -D): free the frames held, at the end of a job */
+static void filterClose(struct context *ctx) {
+   ivtcFree(&ctx->filter.ivtc);
+   av_frame_free(&ctx->filter.decimate.held);
+   av_freep(&ctx->filter.decimate.sig[0]);
+   av_freep(&ctx->filter.decimate.sig[1]);
+}
+
+/* Software backend: free the codecs opened for a job */
+static void swClose(struct context *ctx) {
+   avcodec_free_context(&ctx->sw.dec);
+   avcodec_free_context(&ctx->sw.enc);
+   filterClose(ctx);
+}
+
+/* Software backend: free everything held by the pipeline */
+static void swRelease(struct context *ctx) {
+   swClose(ctx);
+   av_frame_free(&ctx->sw.frame);
+   av_frame_free(&ctx->sw.dei);
+   av_frame_free(&ctx->sw.scaled);
+   av_packet_free(&ctx->sw.pkt);
+   sws_freeContext(ctx->sw.sws);
+   ctx->sw.sws = NULL;
+}
+
+/* Make frame f ready to be written: a new buffer if the size or format has changed,
+ * or a copy if the encoder still holds a reference to the old one. Returns 0 on success.
+ */
+static int swFrameBuffer(AVFrame *f, int width, int height, int format) {
+   if (f->data[0] != NULL && f->width == width && f->height == height && f->format == format)
+      return av_frame_make_writable(f) < 0;
+   av_frame_unref(f);
+   f->width = width;
+   f->height = height;
+   f->format = format;
+   return av_frame_get_buffer(f, 0) < 0;
+}
+
+/* Open a frame threaded decoder for the input video stream. Returns 0 on success. */
+static int swOpenDecoder(struct context *ctx) {
+   OMXTX_SW *sw = &ctx->sw;
+   const AVStream *st = ctx->ic->streams[ctx->inVidStreamIdx];
+   const AVCodec *codec;
+
+   if (sw->frame == NULL) {
+      sw->frame = av_frame_alloc();
+      sw->dei = av_frame_alloc();
+      sw->scaled = av_frame_alloc();
+      sw->pkt = av_packet_alloc();
+      if (sw->frame == NULL || sw->dei == NULL || sw->scaled == NULL || sw->pkt == NULL) {
+         fprintf(stderr, "ERROR: Can't allocate memory for frames\n");
+         return 1;
+      }
+   }
+
+   codec = avcodec_find_decoder(st->codecpar->codec_id);
+   if (codec == NULL) {
+      fprintf(stderr, "ERROR: No decoder for the input video (codec ID %d)\n", st->codecpar->codec_id);
+      return 1;
+   }
+   sw->dec = avcodec_alloc_context3(codec);
+   if (sw->dec == NULL || avcodec_parameters_to_context(sw->dec, st->codecpar) < 0) {
+      fprintf(stderr, "ERROR: Can't allocate the %s decoder\n", codec->name);
+      return 1;
+   }
+   sw->dec->pkt_timebase = st->time_base;
+   sw->dec->thread_count = 0;   /* One thread per core */
+   sw->dec->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+   if (ctx->liveLatency > 0) {   /* Frame threads hold a frame each */
+      sw->dec->thread_type = FF_THREAD_SLICE;
+      sw->dec->flags |= AV_CODEC_FLAG_LOW_DELAY;
+   }
+   if (avcodec_open2(sw->dec, codec, NULL) < 0) {
+      fprintf(stderr, "ERROR: Failed to open the %s decoder\n", codec->name);
+      return 1;
+   }
+   if (ctx->userFlags & UFLAGS_VERBOSE)
+      fprintf(stderr, "Software decoder: %s\n", codec->name);
+   return 0;
+}
+
+/* Open the H.264 encoder for width x height 4:2:0 frames: libx264 if ffmpeg has it.
+ * The rate control options map onto the encoder as for the OMX encoder. Returns 0 on success.
+ */
+static int swOpenEncoder(struct context *ctx, int width, int height, AVRational sar) {
+   OMXTX_SW *sw = &ctx->sw;
+   const AVOutputFormat *of;
+   const AVCodec *codec;
+
+   codec = avcodec_find_encoder_by_name("libx264");
+   if (codec == NULL)
+      codec = avcodec_find_encoder(AV_CODEC_ID_H264);
+   if (codec == NULL) {
+      fprintf(stderr, "ERROR: ffmpeg has no H.264 encoder\n");
+      return 1;
+   }
+   sw->enc = avcodec_alloc_context3(codec);
+   if (sw->enc == NULL) {
+      fprintf(stderr, "ERROR: Can't allocate the %s encoder\n", codec->name);
+      return 1;
+   }
+   sw->enc->width = width;
+   sw->enc->height = height;
+   sw->enc->pix_fmt = AV_PIX_FMT_YUV420P;
+   sw->enc->sample_aspect_ratio = sar;
+   sw->enc->time_base = ctx->omxtimebase;   /* pts are in the OMX timebase, as for the OMX encoder */
+   sw->enc->framerate = ctx->nalEntry.fps;
+   sw->enc->thread_count = 0;
+   sw->enc->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+   av_opt_set(sw->enc, "profile", "high", AV_OPT_SEARCH_CHILDREN);
+   if (ctx->controlRateType == OMX_Video_ControlRateVariable) {
+      sw->enc->bit_rate = ctx->abrRate;
+      if (ctx->qMin > 0)
+         sw->enc->qmin = ctx->qMin;
+      if (ctx->qMax > 0)
+         sw->enc->qmax = ctx->qMax;
+      if (ctx->encOpt[XOPT_PEAKRATE] > 0) {
+         sw->enc->rc_max_rate = ctx->encOpt[XOPT_PEAKRATE];
+         sw->enc->rc_buffer_size = ctx->encOpt[XOPT_PEAKRATE];   /* One second at the peak rate */
+      }
+   }
+   else if (av_opt_set_int(sw->enc, "qp", ctx->qP, AV_OPT_SEARCH_CHILDREN) < 0)   /* I frame q is set by the encoder from qP */
+      fprintf(stderr, "WARNING: The %s encoder doesn't support constant q: using its default rate control\n", codec->name);
+
+   /* -X: the knobs libx264 has a match for; main() warns about the others */
+   if (ctx->encOpt[XOPT_LOOPFILTER] >= 0)
+      av_opt_set(sw->enc, "x264-params", ctx->encOpt[XOPT_LOOPFILTER] ? "deblock=1" : "deblock=0", AV_OPT_SEARCH_CHILDREN);
+   if (ctx->encOpt[XOPT_INTRAREFRESH] >= 0)
+      av_opt_set_int(sw->enc, "intra-refresh", ctx->encOpt[XOPT_INTRAREFRESH] > 0, AV_OPT_SEARCH_CHILDREN);
+   if (ctx->segmentTime > 0)
+      av_opt_set(sw->enc, "forced-idr", "1", AV_OPT_SEARCH_CHILDREN);   /* Segments start on the I frames forced by segmentIdrDue() */
+   if (ctx->liveLatency > 0)
+      av_opt_set(sw->enc, "tune", "zerolatency", AV_OPT_SEARCH_CHILDREN);   /* No look ahead or frame threads */
+   if (!(ctx->userFlags & UFLAGS_RAW)) {
+      of = av_guess_format(ctx->formatName, ctx->formatName == NULL ? ctx->oname : NULL, NULL);
+      if (of != NULL && (of->flags & AVFMT_GLOBALHEADER))
+         sw->enc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+   }
+   if (avcodec_open2(sw->enc, codec, NULL) < 0) {
+      fprintf(stderr, "ERROR: Failed to open the %s encoder\n", codec->name);
+      return 1;
+   }
+   if (ctx->userFlags & UFLAGS_VERBOSE)
+      fprintf(stderr, "Software encoder: %s, %dx%d\n", codec->name, width, height);
+   return 0;
+}
+
+/* First decoded frame: set up the deinterlacer, crop and resize as configure() does for
+ * the OMX components, then open the encoder and the output file. Returns 0 on success.
+ */
+static int swStart(struct context *ctx, const AVFrame *in, const AVPixFmtDescriptor *desc) {
+   OMXTX_SW *sw = &ctx->sw;
+   AVStream *st = ctx->ic->streams[ctx->inVidStreamIdx];
+   AVCodecParameters *vpar;
+   AVRational sar;
+   int i, width, height;
+   int64_t t0 = timeUs();
+
+   if (in->interlaced_frame) {
+      if (!(ctx->userFlags & UFLAGS_DEINTERLACE) && !ctx->ivtc) {
+         fprintf(stderr, "WARNING: *** Interlaced source material detected! ***\n");
+         fprintf(stderr, "WARNING: *** Consider using the de-interlacer option -d ***\n");
+      }
+   }
+   else if (ctx->userFlags & UFLAGS_DEINTERLACE)
+      fprintf(stderr, "INFO: Progresive scan detected, forcing de-interlacer by command line option.\n");
+   else
+      fprintf(stderr, "INFO: Progresive scan detected, de-interlacing not required.\n");
+   if ((ctx->userFlags & UFLAGS_DEINTERLACE) && (desc == NULL || !(desc->flags & AV_PIX_FMT_FLAG_PLANAR) || desc->comp[0].depth != 8)) {
+      fprintf(stderr, "WARNING: The software de-interlacer needs 8 bit planar frames: disabling deinterlacer.\n");
+      ctx->userFlags ^= UFLAGS_DEINTERLACE;
+   }
+   ctx->filter.ivtc.enabled = ctx->ivtc && desc != NULL && (desc->flags & AV_PIX_FMT_FLAG_PLANAR) && desc->comp[0].depth == 8;
+   if (ctx->ivtc && !ctx->filter.ivtc.enabled)
+      fprintf(stderr, "WARNING: Inverse telecine needs 8 bit planar frames: disabling it.\n");
+   ctx->filter.decimate.enabled = ctx->decimate;
+   ctx->filter.decimate.threshold = ctx->decimateThreshold;
+   if (ctx->filter.decimate.threshold > 0 && (desc == NULL || !(desc->flags & AV_PIX_FMT_FLAG_PLANAR) || desc->comp[0].depth != 8)) {
+      fprintf(stderr, "WARNING: Finding repeated frames needs 8 bit planar frames: keeping them.\n");
+      ctx->filter.decimate.threshold = 0;
+   }
+
+   ctx->nalEntry.fps = av_guess_frame_rate(ctx->ic, st, (AVFrame *)in);
+   if (ctx->nalEntry.fps.num <= 0 || ctx->nalEntry.fps.den <= 0) {
+      fprintf(stderr, "WARNING: frame rate unknown - assuming 25fps. This may not be correct!\n");
+      ctx->nalEntry.fps.num = 25;
+      ctx->nalEntry.fps.den = 1;
+   }
+   if ((ctx->userFlags & UFLAGS_DEINTERLACE) && ctx->dei_ofpf == 0)
+      ctx->nalEntry.fps.num *= 2;   /* One frame per field */
+   ctx->filter.frameTime = (double)ctx->omxtimebase.den/av_q2d(ctx->nalEntry.fps);
+   if (ctx->filter.ivtc.enabled)   /* The film frames, 4 of each 5 */
+      ctx->nalEntry.fps = av_mul_q(ctx->nalEntry.fps, (AVRational){IVTC_CYCLE-1, IVTC_CYCLE});
+   if (ctx->filter.decimate.enabled && ctx->decimateFps > 0 && ctx->decimateFps < av_q2d(ctx->nalEntry.fps))
+      ctx->nalEntry.fps = av_d2q(ctx->decimateFps, 1001000);   /* The most the encoder will see */
+   ctx->omxFPS = av_q2d(ctx->nalEntry.fps);
+   ctx->nalEntry.duration = (double)ctx->omxtimebase.den/ctx->omxFPS;
+   fprintf(stderr, "INFO: Output frame rate %lf fps\n", ctx->omxFPS);
+
+   /* Crop and resize: as configureResizer() */
+   width = in->width;
+   height = in->height;
+   sw->cropLeft = sw->cropTop = 0;
+   if (ctx->userFlags & UFLAGS_CROP) {
+      if ((ctx->cropRect->nLeft + ctx->cropRect->nWidth) <= width
+       && (ctx->cropRect->nTop + ctx->cropRect->nHeight) <= height) {
+         sw->cropLeft = ctx->cropRect->nLeft;
+         sw->cropTop = ctx->cropRect->nTop;
+         width = ctx->cropRect->nWidth;
+         height = ctx->cropRect->nHeight;
+      }
+      else {
+         fprintf (stderr,"ERROR: Crop rectangle outside of frame dimensions: ignoring crop\n");
+         ctx->userFlags ^= UFLAGS_CROP;
+      }
+   }
+   sw->srcWidth = width;
+   sw->srcHeight = height;
+
+   if (ctx->userFlags & UFLAGS_AUTO_SCALE_X) {
+      ctx->outputWidth = width*st->codecpar->sample_aspect_ratio.num/st->codecpar->sample_aspect_ratio.den;
+      ctx->outputWidth += 0x0f;
+      ctx->outputWidth &= ~0x0f;
+      ctx->outputHeight = height;
+   }
+   if (ctx->userFlags & UFLAGS_AUTO_SCALE_Y) {
+      ctx->outputHeight = height*st->codecpar->sample_aspect_ratio.den/st->codecpar->sample_aspect_ratio.num;
+      ctx->outputHeight += 0x0f;
+      ctx->outputHeight &= ~0x0f;
+      ctx->outputWidth = width;
+   }
+   if (ctx->userFlags & UFLAGS_RESIZE) {
+      width = ctx->outputWidth;
+      height = ctx->outputHeight;
+   }
+   width &= ~1;   /* 4:2:0 */
+   height &= ~1;
+
+   sw->scale = width != in->width || height != in->height || sw->srcWidth != in->width || sw->srcHeight != in->height || in->format != AV_PIX_FMT_YUV420P;
+   if (sw->scale) {
+      sw->sws = sws_getCachedContext(sw->sws, sw->srcWidth, sw->srcHeight, in->format, width, height, AV_PIX_FMT_YUV420P, SWS_BICUBIC, NULL, NULL, NULL);
+      if (sw->sws == NULL || desc == NULL) {
+         fprintf(stderr, "ERROR: Can't scale %dx%d frames of format %d\n", sw->srcWidth, sw->srcHeight, in->format);
+         return 1;
+      }
+      for (i = 0; i < 4; i++)
+         sw->step[i] = 0;
+      for (i = desc->nb_components-1; i >= 0; i--)
+         sw->step[desc->comp[i].plane] = desc->comp[i].step;
    }
+
+   /* Sample aspect ratio: as makeOutputContext() */
+   if (!(ctx->userFlags & UFLAGS_RESIZE))
+      sar = st->codecpar->sample_aspect_ratio;
+   else if (ctx->userFlags & (UFLAGS_AUTO_SCALE_X | UFLAGS_AUTO_SCALE_Y))
+      sar = (AVRational){ 1, 1 };
    else
-      close(ctx.raw_fd);
+      sar = (AVRational){ 0, 1 };
+
+   if (swOpenEncoder(ctx, width, height, sar) != 0)
+      return 1;
+
+   if (!(ctx->userFlags & UFLAGS_RAW)) {
+      vpar = avcodec_parameters_alloc();
+      if (vpar != NULL) {
+         if (avcodec_parameters_from_context(vpar, sw->enc) >= 0)
+            ctx->oc = makeOutputContext(ctx, vpar);
+         avcodec_parameters_free(&vpar);
+      }
+      if (ctx->oc == NULL) {
+         fprintf(stderr, "ERROR: Create output AVFormatContext failed.\n");
+         return 1;
+      }
+      pthread_mutex_lock(&ctx->muxLock);
+      if (openOutput(ctx) != 0) {
+         pthread_mutex_unlock(&ctx->muxLock);
+         return 1;
+      }
+      ctx->outputOpen = 1;
+      pthread_mutex_unlock(&ctx->muxLock);
+   }
+   ctx->setupTime += timeUs() - t0;
+   ctx->runStart = time(NULL);
+   ctx->state = RUNNING;
+   return 0;
+}
+
+/* Write an encoded packet, pts in the OMX timebase. Returns 0 on success. */
+static int swWritePacket(struct context *ctx, AVPacket *pkt) {
+   int r, size;
+   int64_t t0, pts = pkt->pts;
+
+   if (ctx->adaptive)
+      adaptBitrate(ctx, pkt->flags & AV_PKT_FLAG_KEY);
+   ctx->curSize += pkt->size;
+   metrics.bytesOut += pkt->size;
+   if (pkt->pts != AV_NOPTS_VALUE)
+      liveOutput(ctx, pkt->pts);
+   if (ctx->userFlags & UFLAGS_RAW) {
+      r = write(ctx->raw_fd, pkt->data, pkt->size) != (ssize_t)pkt->size;
+      av_packet_unref(pkt);
+      if (r) {
+         fprintf(stderr, "\nERROR: Failed to write to the output file: %s\n", strerror(errno));
+         return 1;
+      }
+   }
+   else {
+      pkt->stream_index = 0;
+      av_packet_rescale_ts(pkt, ctx->omxtimebase, ctx->oc->streams[0]->time_base);
+      pthread_mutex_lock(&ctx->muxLock);
+      t0 = metrics.enabled || trace.enabled ? timeUs() : 0;
+      size = pkt->size;
+      r = av_interleaved_write_frame(ctx->oc, pkt);
+      if (metrics.enabled)
+         metricSince(HIST_MUX, t0);
+      traceSpan("mux", "Write video", NULL, t0, "bytes", size);
+      pthread_mutex_unlock(&ctx->muxLock);
+      av_packet_unref(pkt);
+      if (r != 0) {
+         char err[256];
+         av_strerror(r, err, sizeof(err));
+         fprintf(stderr,"\nWARNING: Failed to write a video frame: %s\n", err);
+         return 0;
+      }
+   }
+   frameWritten(ctx, pts);
+   return 0;
+}
+
+/* Pass a frame to the encoder, or NULL to flush it, and write what comes out. Returns 0 on success. */
+static int swEncode(struct context *ctx, AVFrame *f) {
+   OMXTX_SW *sw = &ctx->sw;
+   int r;
+
+   r = avcodec_send_frame(sw->enc, f);
+   while (r >= 0) {
+      r = avcodec_receive_packet(sw->enc, sw->pkt);
+      if (r == 0 && swWritePacket(ctx, sw->pkt) != 0)
+         return 1;
+   }
+   if (r != AVERROR(EAGAIN) && r != AVERROR_EOF) {
+      char err[256];
+      av_strerror(r, err, sizeof(err));
+      fprintf(stderr, "\nERROR: Encoder failed: %s\n", err);
+      return 1;
+   }
+   return 0;
+}
+
+/* Decimation (-D): the means of the 8x8 blocks along a row of bw blocks of luma, with ls
+ * bytes per line
+ */
+static void blockMeans(const uint8_t *p, int ls, int bw, uint8_t *out) {
+   int x = 0, y, i, sum;
+#if defined(__ARM_NEON)
+   uint16x8_t acc;
+   uint64x2_t s;
+
+   for (; x + 2 <= bw; x += 2) {   /* Two blocks: pixel pairs summed down the rows (8 * 510 fits), then across */
+      acc = vpaddlq_u8(vld1q_u8(p+8*x));
+      for (y = 1; y < 8; y++)
+         acc = vpadalq_u8(acc, vld1q_u8(p + y*ls + 8*x));
+      s = vpaddlq_u32(vpaddlq_u16(acc));
+      out[x] = (vgetq_lane_u64(s, 0) + 32) >> 6;
+      out[x+1] = (vgetq_lane_u64(s, 1) + 32) >> 6;
+   }
+#elif defined(__SSE2__)
+   __m128i zero = _mm_setzero_si128(), acc;
+
+   for (; x + 2 <= bw; x += 2) {   /* Two blocks: the sums of 8 pixels of each row added up */
+      acc = _mm_setzero_si128();
+      for (y = 0; y < 8; y++)
+         acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(p + y*ls + 8*x)), zero));
+      out[x] = (_mm_cvtsi128_si32(acc) + 32) >> 6;
+      out[x+1] = (_mm_cvtsi128_si32(_mm_srli_si128(acc, 8)) + 32) >> 6;
+   }
+#endif
+   for (; x < bw; x++) {   /* The same exact sum and rounding as the SIMD blocks */
+      for (sum = 0, y = 0; y < 8; y++)
+         for (i = 0; i < 8; i++)
+            sum += p[y*ls + 8*x + i];
+      out[x] = (sum + 32) >> 6;
+   }
+}
+
+/* Sum of |a - b| over n block means, and the largest in *max */
+static uint64_t blockDiff(const uint8_t *a, const uint8_t *b, int n, int *max) {
+   uint8_t lanes[16];
+   uint64_t sad = 0;
+   int i = 0, d, m = 0;
+#if defined(__ARM_NEON)
+   uint32x4_t sum = vdupq_n_u32(0);
+   uint8x16_t ad, mx = vdupq_n_u8(0);
+
+   for (; i + 16 <= n; i += 16) {
+      ad = vabdq_u8(vld1q_u8(a+i), vld1q_u8(b+i));
+      sum = vpadalq_u16(sum, vpaddlq_u8(ad));
+      mx = vmaxq_u8(mx, ad);
+   }
+   sad = (uint64_t)vgetq_lane_u32(sum, 0) + vgetq_lane_u32(sum, 1) + vgetq_lane_u32(sum, 2) + vgetq_lane_u32(sum, 3);
+   vst1q_u8(lanes, mx);
+#elif defined(__SSE2__)
+   __m128i sum = _mm_setzero_si128(), mx = _mm_setzero_si128(), x, y;
+   uint64_t sums[2];
+
+   for (; i + 16 <= n; i += 16) {
+      x = _mm_loadu_si128((const __m128i *)(a+i));
+      y = _mm_loadu_si128((const __m128i *)(b+i));
+      sum = _mm_add_epi64(sum, _mm_sad_epu8(x, y));
+      mx = _mm_max_epu8(mx, _mm_or_si128(_mm_subs_epu8(x, y), _mm_subs_epu8(y, x)));
+   }
+   _mm_storeu_si128((__m128i *)sums, sum);
+   sad = sums[0] + sums[1];
+   _mm_storeu_si128((__m128i *)lanes, mx);
+#else
+   memset(lanes, 0, sizeof(lanes));
+#endif
+   for (d = 0; d < 16; d++)
+      m = lanes[d] > m ? lanes[d] : m;
+   for (; i < n; i++) {
+      d = a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+      sad += d;
+      m = d > m ? d : m;
+   }
+   *max = m;
+   return sad;
+}
+
+/* Decimation (-D): returns 1 if frame f, shown at pts, is to be dropped: it comes before
+ * the next frame is due at the -D frame rate, or it's a repeat of the last frame encoded.
+ * A repeat is a frame whose 8x8 block means of luma differ from the last frame's by no
+ * more than the threshold on average, and by no more than DECIMATE_PEAK times it in any
+ * one block, so noise is a repeat but something moving in a corner of the picture isn't.
+ * A frame is kept at least every DECIMATE_MAX_GAP seconds, however still the picture.
+ */
+static int decimateDrop(struct context *ctx, AVFrame *f, int64_t pts) {
+   OMXTX_DECIMATE *d = &ctx->filter.decimate;
+   int64_t interval = ctx->decimateFps > 0 ? (int64_t)(ctx->omxtimebase.den / ctx->decimateFps) : 0;
+   uint8_t *sig;
+   uint64_t sad;
+   int y, max, bw = f->width/8, bh = f->height/8;
+
+   d->frames++;
+   d->seenPts = pts;
+   if (interval > 0 && d->kept > 0 && pts < d->next - ctx->filter.frameTime/2) {
+      d->rate++;
+      d->heldRepeat = 0;
+      goto drop;
+   }
+   if (d->threshold > 0 && bw > 0 && bh > 0) {
+      if (d->sig[0] == NULL || d->bw != bw || d->bh != bh) {
+         av_freep(&d->sig[0]);
+         av_freep(&d->sig[1]);
+         d->sig[0] = av_malloc(bw*bh);
+         d->sig[1] = av_malloc(bw*bh);
+         d->bw = bw;
+         d->bh = bh;
+         d->have = 0;
+      }
+      if (d->sig[0] != NULL && d->sig[1] != NULL) {
+         for (y = 0; y < bh; y++)
+            blockMeans(f->data[0] + 8*y*f->linesize[0], f->linesize[0], bw, d->sig[1] + y*bw);
+         if (d->have && pts - d->lastPts < DECIMATE_MAX_GAP*(int64_t)ctx->omxtimebase.den) {
+            sad = blockDiff(d->sig[0], d->sig[1], bw*bh, &max);
+            if (sad <= d->threshold*bw*bh && max <= d->threshold*DECIMATE_PEAK) {
+               d->repeats++;
+               d->heldRepeat = 1;
+               goto drop;
+            }
+         }
+         sig = d->sig[0];   /* This frame is the one to compare with now */
+         d->sig[0] = d->sig[1];
+         d->sig[1] = sig;
+         d->have = 1;
+      }
+   }
+   if (interval > 0)   /* On the grid of the -D frame rate, unless it has fallen behind */
+      d->next = d->kept == 0 || pts >= d->next + interval ? pts + interval : d->next + interval;
+   d->kept++;
+   d->lastPts = pts;
+   av_frame_free(&d->held);
+   return 0;
+drop:
+   av_frame_free(&d->held);
+   if ((d->held = av_frame_clone(f)) != NULL)
+      d->heldPts = pts;
+   return 1;
+}
+
+/* Crop, resize and convert frame f as set up by swStart(), and encode it with the given pts */
+static int swScaleEncode(struct context *ctx, AVFrame *f, int64_t pts) {
+   OMXTX_SW *sw = &ctx->sw;
+   const AVPixFmtDescriptor *desc;
+   const uint8_t *src[4];
+   int i, hs, vs;
+
+   if (sw->scale) {
+      desc = av_pix_fmt_desc_get(f->format);
+      for (i = 0; i < 4; i++) {
+         hs = (i == 1 || i == 2) ? desc->log2_chroma_w : 0;
+         vs = (i == 1 || i == 2) ? desc->log2_chroma_h : 0;
+         src[i] = f->data[i] == NULL ? NULL : f->data[i] + (sw->cropTop >> vs)*f->linesize[i] + (sw->cropLeft >> hs)*sw->step[i];
+      }
+      if (swFrameBuffer(sw->scaled, sw->enc->width, sw->enc->height, AV_PIX_FMT_YUV420P) != 0) {
+         fprintf(stderr, "\nERROR: Can't allocate memory for a frame\n");
+         return 1;
+      }
+      sws_scale(sw->sws, src, f->linesize, 0, sw->srcHeight, sw->scaled->data, sw->scaled->linesize);
+      f = sw->scaled;
+   }
+   f->pts = pts;
+   if (ctx->thumbs.enabled)
+      thumbFrame(ctx, f, pts);
+   f->pict_type = AV_PICTURE_TYPE_NONE;   /* Let the encoder choose: don't copy the input frame types */
+   if (segmentIdrDue(ctx, pts, 0))
+      f->pict_type = AV_PICTURE_TYPE_I;   /* An IDR with forced-idr */
+   ctx->nalEntry.pts = pts;
+   sw->frames++;
+   return swEncode(ctx, f);
+}
+
+/* Filter stage, OMX: copy frame f into a free input buffer of the component after the stage,
+ * in the layout of its port, and pass it on with pts; with f NULL, pass on the end of stream.
+ * If no buffer is free, waits for frameEmptied() to return one. Returns 0 on success.
+ */
+static int filterEmptyFrame(struct context *ctx, const AVFrame *f, int64_t pts) {
+   OMXTX_FILTER *fl = &ctx->filter;
+   OMX_BUFFERHEADERTYPE *buf;
+   OMX_ERRORTYPE err;
+   uint8_t *dst;
+   int p, y, w, h, stride;
+
+   pthread_mutex_lock(&ctx->filterLock);
+   while ((buf = bufRingPop(&fl->free)) == NULL && ctx->state != FAILED)
+      pthread_cond_wait(&ctx->filterCond, &ctx->filterLock);
+   pthread_mutex_unlock(&ctx->filterLock);
+   if (buf == NULL)
+      return 1;
 
-   av_free(ctx.nalEntry.nalBuf);
-   pthread_mutex_destroy(&ctx.decBufLock);
+   buf->nOffset = 0;
+   buf->nFilledLen = 0;
+   buf->nFlags = OMX_BUFFERFLAG_ENDOFFRAME | OMX_BUFFERFLAG_EOS | OMX_BUFFERFLAG_TIME_UNKNOWN;
+   if (f != NULL) {   /* YUV 4:2:0 planar, in slices of dstSlice lines */
+      dst = buf->pBuffer;
+      for (p = 0; p < 3; p++) {
+         w = p == 0 ? f->width : f->width/2;
+         h = p == 0 ? f->height : f->height/2;
+         stride = p == 0 ? fl->dstStride : fl->dstStride/2;
+         for (y = 0; y < h; y++)
+            memcpy(dst + y*stride, f->data[p] + y*f->linesize[p], w);
+         dst += stride * (p == 0 ? fl->dstSlice : fl->dstSlice/2);
+      }
+      buf->nFilledLen = dst - buf->pBuffer;
+      buf->nFlags = OMX_BUFFERFLAG_ENDOFFRAME;
+      buf->nTimeStamp.nLowPart = (uint32_t) (pts & 0xffffffff);
+      buf->nTimeStamp.nHighPart = (uint32_t) ((pts & 0xffffffff00000000) >> 32);
+   }
+   if ((err = emptyFilterBuffer(ctx, buf)) != OMX_ErrorNone) {
+      fprintf(stderr, "\nERROR: %s won't take a frame from the filter stage: %x\n", mapComponent(ctx, fl->dst), err);
+      pipelineFailed(ctx, err);
+      return 1;
+   }
    return 0;
 }
+
+/* Pass a frame from the filter stage on with its pts, unless it's decimated (-D): to the
+ * scaler and encoder on the software backend, to the next component on OMX.
+ * Returns 0 on success.
+ */
+static int filterOutput(struct context *ctx, AVFrame *f, int64_t pts) {
+   if (ctx->filter.decimate.enabled && decimateDrop(ctx, f, pts))
+      return 0;
+   if (ctx->backend == &swBackend)
+      return swScaleEncode(ctx, f, pts);
+   return filterEmptyFrame(ctx, f, pts);
+}
+
+/* Deinterlace an 8 bit planar frame. With field < 0 the two fields are blended
+ * by a (1,2,1)/4 vertical filter: one frame per two fields. Otherwise the lines of
+ * that field (0: top) are kept, and the others interpolated: one frame per field.
+ */
+static void swDeinterlace(const AVFrame *in, AVFrame *out, int field, const AVPixFmtDescriptor *desc) {
+   const uint8_t *up, *cur, *down;
+   uint8_t *dst;
+   int p, x, y, w, h;
+
+   for (p = 0; p < 4 && in->data[p] != NULL; p++) {
+      w = in->width;
+      h = in->height;
+      if (p == 1 || p == 2) {
+         w = (w + (1<<desc->log2_chroma_w) - 1) >> desc->log2_chroma_w;
+         h = (h + (1<<desc->log2_chroma_h) - 1) >> desc->log2_chroma_h;
+      }
+      for (y = 0; y < h; y++) {
+         cur = in->data[p] + y*in->linesize[p];
+         up = y > 0 ? cur - in->linesize[p] : cur + in->linesize[p];
+         down = y < h-1 ? cur + in->linesize[p] : cur - in->linesize[p];
+         dst = out->data[p] + y*out->linesize[p];
+         if (h < 2 || (field >= 0 && (y & 1) == field))
+            memcpy(dst, cur, w);
+         else if (field >= 0)
+            for (x = 0; x < w; x++)
+               dst[x] = (up[x] + down[x] + 1) >> 1;
+         else
+            for (x = 0; x < w; x++)
+               dst[x] = (up[x] + 2*cur[x] + down[x] + 2) >> 2;
+      }
+   }
+}
+
+/* Sum of |a - b| along a line */
+static uint64_t sadLine(const uint8_t *a, const uint8_t *b, int n) {
+   uint64_t sad = 0;
+   int i = 0, d;
+#if defined(__ARM_NEON)
+   uint32x4_t sum = vdupq_n_u32(0);
+
+   for (; i + 16 <= n; i += 16)
+      sum = vpadalq_u16(sum, vpaddlq_u8(vabdq_u8(vld1q_u8(a+i), vld1q_u8(b+i))));
+   sad = (uint64_t)vgetq_lane_u32(sum, 0) + vgetq_lane_u32(sum, 1) + vgetq_lane_u32(sum, 2) + vgetq_lane_u32(sum, 3);
+#elif defined(__SSE2__)
+   __m128i sum = _mm_setzero_si128();
+   uint64_t lanes[2];
+
+   for (; i + 16 <= n; i += 16)
+      sum = _mm_add_epi64(sum, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(a+i)), _mm_loadu_si128((const __m128i *)(b+i))));
+   _mm_storeu_si128((__m128i *)lanes, sum);
+   sad = lanes[0] + lanes[1];
+#endif
+   for (; i < n; i++) {
+      d = a[i] - b[i];
+      sad += d < 0 ? -d : d;
+   }
+   return sad;
+}
+
+/* Sum of |cur - (up + down)/2| along a line: how much it combs with the lines of the
+ * other field either side of it
+ */
+static uint64_t combLine(const uint8_t *up, const uint8_t *cur, const uint8_t *down, int n) {
+   uint64_t comb = 0;
+   int i = 0, d;
+#if defined(__ARM_NEON)
+   uint32x4_t sum = vdupq_n_u32(0);
+
+   for (; i + 16 <= n; i += 16)
+      sum = vpadalq_u16(sum, vpaddlq_u8(vabdq_u8(vld1q_u8(cur+i), vrhaddq_u8(vld1q_u8(up+i), vld1q_u8(down+i)))));
+   comb = (uint64_t)vgetq_lane_u32(sum, 0) + vgetq_lane_u32(sum, 1) + vgetq_lane_u32(sum, 2) + vgetq_lane_u32(sum, 3);
+#elif defined(__SSE2__)
+   __m128i sum = _mm_setzero_si128(), avg;
+   uint64_t lanes[2];
+
+   for (; i + 16 <= n; i += 16) {
+      avg = _mm_avg_epu8(_mm_loadu_si128((const __m128i *)(up+i)), _mm_loadu_si128((const __m128i *)(down+i)));
+      sum = _mm_add_epi64(sum, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(cur+i)), avg));
+   }
+   _mm_storeu_si128((__m128i *)lanes, sum);
+   comb = lanes[0] + lanes[1];
+#endif
+   for (; i < n; i++) {
+      d = cur[i] - ((up[i] + down[i] + 1) >> 1);
+      comb += d < 0 ? -d : d;
+   }
+   return comb;
+}
+
+/* Inverse telecine: combing of the luma of the frame woven from the top field of top and
+ * the bottom field of bottom, from the top field lines
+ */
+static uint64_t combMetric(const AVFrame *top, const AVFrame *bottom) {
+   uint64_t comb = 0;
+   int y;
+
+   for (y = 2; y < top->height-1; y += 2)
+      comb += combLine(bottom->data[0] + (y-1)*bottom->linesize[0], top->data[0] + y*top->linesize[0],
+         bottom->data[0] + (y+1)*bottom->linesize[0], top->width);
+   return comb;
+}
+
+/* Mean difference of the luma of two frames, in 1/16ths of a level, over the top field */
+static uint64_t frameDiff(const AVFrame *a, const AVFrame *b) {
+   uint64_t sad = 0;
+   int y;
+
+   for (y = 0; y < a->height; y += 2)
+      sad += sadLine(a->data[0] + y*a->linesize[0], b->data[0] + y*b->linesize[0], a->width);
+   return 16*sad / ((uint64_t)a->width*((a->height+1)/2));
+}
+
+/* Weave the top field of top and the bottom field of bottom into out: 8 bit planar */
+static void ivtcWeave(const AVFrame *top, const AVFrame *bottom, AVFrame *out, const AVPixFmtDescriptor *desc) {
+   const AVFrame *src;
+   int p, y, w, h;
+
+   for (p = 0; p < 4 && top->data[p] != NULL; p++) {
+      w = top->width;
+      h = top->height;
+      if (p == 1 || p == 2) {
+         w = (w + (1<<desc->log2_chroma_w) - 1) >> desc->log2_chroma_w;
+         h = (h + (1<<desc->log2_chroma_h) - 1) >> desc->log2_chroma_h;
+      }
+      for (y = 0; y < h; y++) {
+         src = (y & 1) ? bottom : top;
+         memcpy(out->data[p] + y*out->linesize[p], src->data[p] + y*src->linesize[p], w);
+      }
+   }
+}
+
+/* Match the current frame's top field with the bottom field that combs least with it:
+ * its own, or the previous or next frame's if that combs IVTC_MATCH% as much or less.
+ * Returns the matched frame, or NULL if there's no memory.
+ */
+static AVFrame *ivtcMatch(OMXTX_IVTC *iv) {
+   AVFrame *cur = iv->in[1], *bottom = cur, *m;
+   uint64_t own, best, comb;
+   int i;
+
+   best = own = combMetric(cur, cur);
+   for (i = 0; i <= 2; i += 2)
+      if (iv->in[i] != NULL && iv->in[i]->width == cur->width && iv->in[i]->height == cur->height
+            && iv->in[i]->format == cur->format && (comb = combMetric(cur, iv->in[i])) < best && comb*100 <= own*IVTC_MATCH) {
+         best = comb;
+         bottom = iv->in[i];
+      }
+   if (bottom == cur)
+      return av_frame_clone(cur);
+   m = av_frame_alloc();
+   if (m == NULL || swFrameBuffer(m, cur->width, cur->height, cur->format) != 0) {
+      av_frame_free(&m);
+      return NULL;
+   }
+   ivtcWeave(cur, bottom, m, av_pix_fmt_desc_get(cur->format));
+   if (bottom == iv->in[0])
+      iv->fromPrev++;
+   else
+      iv->fromNext++;
+   return m;
+}
+
+/* Encode the matched frames of a cycle. If the most alike of them differs from the frame
+ * before it by no more than IVTC_REPEAT the cycle is film: that frame is the repeat made
+ * by the pulldown and is dropped, and the other four are spread over the time of the five,
+ * so the frame rate is variable where film and video are mixed. Otherwise, and for the
+ * partial cycle at the end, the frames are encoded as they are. Returns 0 on success.
+ */
+static int ivtcOutput(struct context *ctx) {
+   OMXTX_IVTC *iv = &ctx->filter.ivtc;
+   int i, j, drop = -1, r = 0;
+
+   if (iv->n == IVTC_CYCLE) {
+      iv->cycles++;
+      for (i = 0; i < IVTC_CYCLE; i++)
+         if (drop < 0 || iv->diff[i] < iv->diff[drop])
+            drop = i;
+      if (iv->diff[drop] > IVTC_REPEAT)
+         drop = -1;
+      else
+         iv->decimated++;
+   }
+   for (i = j = 0; i < iv->n; i++) {
+      if (i != drop && r == 0)
+         r = filterOutput(ctx, iv->cycle[i],
+            drop < 0 ? iv->pts[i] : iv->pts[0] + j++*IVTC_CYCLE*ctx->filter.frameTime/(IVTC_CYCLE-1));
+      av_frame_free(&iv->cycle[i]);
+   }
+   iv->n = 0;
+   return r;
+}
+
+/* Inverse telecine (-I): take a decoded frame, or NULL at the end of the input, and match
+ * the one before it now that its next frame is here. Returns 0 on success.
+ */
+static int ivtcFrame(struct context *ctx, AVFrame *in, int64_t pts) {
+   OMXTX_IVTC *iv = &ctx->filter.ivtc;
+   AVFrame *m;
+
+   av_frame_free(&iv->in[0]);
+   iv->in[0] = iv->in[1];
+   iv->in[1] = iv->in[2];
+   iv->inPts[1] = iv->inPts[2];
+   iv->in[2] = NULL;
+   if (in != NULL) {
+      if ((iv->in[2] = av_frame_clone(in)) == NULL)
+         goto nomem;
+      iv->inPts[2] = iv->lastPts = pts;
+      iv->frames++;
+   }
+   if (iv->in[1] == NULL)
+      return 0;
+
+   if ((m = ivtcMatch(iv)) == NULL)
+      goto nomem;
+   iv->diff[iv->n] = iv->last != NULL && iv->last->width == m->width && iv->last->height == m->height ? frameDiff(iv->last, m) : UINT64_MAX;
+   av_frame_free(&iv->last);
+   iv->last = av_frame_clone(m);
+   iv->cycle[iv->n] = m;
+   iv->pts[iv->n++] = iv->inPts[1];
+   return iv->n == IVTC_CYCLE ? ivtcOutput(ctx) : 0;
+nomem:
+   fprintf(stderr, "\nERROR: Can't allocate memory for a frame\n");
+   return 1;
+}
+
+/* End of the input: the filter stage passes on the frames it holds, and shows what it did.
+ * Returns 0 on success.
+ */
+static int filterFlush(struct context *ctx) {
+   OMXTX_FILTER *fl = &ctx->filter;
+   int failed = 0;
+
+   if (fl->ivtc.enabled) {
+      failed = ivtcFrame(ctx, NULL, 0) != 0 || ivtcOutput(ctx) != 0;
+      fprintf(stderr, "\nInverse telecine: %lli frames, %lli matched from the previous frame's field and %lli from the next's; "
+         "%lli of %lli cycles were film, and had their repeated frame dropped\n", fl->ivtc.frames, fl->ivtc.fromPrev,
+         fl->ivtc.fromNext, fl->ivtc.decimated, fl->ivtc.cycles);
+   }
+   if (!failed && fl->decimate.enabled) {
+      fl->decimate.enabled = 0;   /* End on the last frame of the input, even if it was dropped */
+      if (fl->decimate.held != NULL) {   /* Encoded after all */
+         if (fl->decimate.heldRepeat)
+            fl->decimate.repeats--;
+         else
+            fl->decimate.rate--;
+         fl->decimate.kept++;
+         failed = filterOutput(ctx, fl->decimate.held, fl->decimate.heldPts) != 0;
+      }
+      fprintf(stderr, "\nDecimation: %lli frames, %lli dropped for the frame rate and %lli as repeats\n",
+         fl->decimate.frames, fl->decimate.rate, fl->decimate.repeats);
+   }
+   return failed;
+}
+
+/* Filter thread (-I, -D on OMX): take the frames from the output buffers of the component
+ * before the filter stage as frameFilled() queues them, inverse telecine and / or decimate
+ * them as swFilterFrame() does, and pass the frames kept on to the component after it. The
+ * frames held are copies, so a buffer goes back as soon as its frame has been looked at.
+ * Runs until the buffer with end of stream, which is passed on after the frames held, or
+ * until the job fails.
+ */
+static void *filterThread(void *arg) {
+   struct context *ctx = arg;
+   OMXTX_FILTER *fl = &ctx->filter;
+   OMX_BUFFERHEADERTYPE *buf;
+   OMX_ERRORTYPE err;
+   AVFrame *f;
+   int64_t pts;
+   int eos = 0, failed = 0;
+
+   traceThread("filter");
+   f = av_frame_alloc();
+   if (f == NULL) {
+      pipelineFailed(ctx, OMX_ErrorInsufficientResources);
+      return NULL;
+   }
+   f->format = AV_PIX_FMT_YUV420P;
+   f->width = fl->width;
+   f->height = fl->height;
+   f->linesize[0] = fl->srcStride;
+   f->linesize[1] = f->linesize[2] = fl->srcStride/2;
+   while (!eos && !failed) {
+      pthread_mutex_lock(&ctx->filterLock);
+      while ((buf = bufRingPop(&fl->filled)) == NULL && ctx->state != FAILED)
+         pthread_cond_wait(&ctx->filterCond, &ctx->filterLock);
+      pthread_mutex_unlock(&ctx->filterLock);
+      if (buf == NULL)
+         break;
+      if (buf->nFilledLen > 0) {   /* YUV 4:2:0 planar, in slices of srcSlice lines */
+         pts = (((int64_t) buf->nTimeStamp.nHighPart)<<32) | buf->nTimeStamp.nLowPart;
+         f->data[0] = buf->pBuffer + buf->nOffset;
+         f->data[1] = f->data[0] + fl->srcStride * fl->srcSlice;
+         f->data[2] = f->data[1] + fl->srcStride/2 * fl->srcSlice/2;
+         failed = (fl->ivtc.enabled ? ivtcFrame(ctx, f, pts) : filterOutput(ctx, f, pts)) != 0;
+      }
+      eos = buf->nFlags & OMX_BUFFERFLAG_EOS;
+      if (!eos && !failed && (err = fillFilterBuffer(ctx, buf)) != OMX_ErrorNone) {
+         fprintf(stderr, "\nERROR: %s won't take back a buffer from the filter stage: %x\n", mapComponent(ctx, fl->src), err);
+         pipelineFailed(ctx, err);
+         break;
+      }
+   }
+   if (eos && !failed)
+      failed = filterFlush(ctx) != 0 || filterEmptyFrame(ctx, NULL, 0) != 0;
+   if (failed)
+      pipelineFailed(ctx, OMX_ErrorUndefined);
+   filterClose(ctx);
+   av_frame_free(&f);
+   return NULL;
+}
+
+/* Output pts in the OMX timebase for a decoded frame: from the stream as fillDecBuffers()
+ * does, or made up from the frame rate.
+ */
+static int64_t swFramePts(struct context *ctx, const AVFrame *in) {
+   AVStream *st = ctx->ic->streams[ctx->inVidStreamIdx];
+   int64_t pts = AV_NOPTS_VALUE, last = ctx->nalEntry.pts, frames = ctx->sw.frames;
+
+   if (ctx->filter.ivtc.enabled) {   /* Frames are held for a cycle before they're encoded */
+      last = ctx->filter.ivtc.lastPts;
+      frames = ctx->filter.ivtc.frames;
+   }
+   else if (ctx->filter.decimate.enabled)   /* The frames dropped too */
+      last = ctx->filter.decimate.seenPts;
+   if (!(ctx->userFlags & UFLAGS_MAKE_UP_PTS) && in->best_effort_timestamp != AV_NOPTS_VALUE)
+      pts = av_rescale_q(in->best_effort_timestamp, st->time_base, ctx->omxtimebase);
+   if (frames == 0)
+      return pts != AV_NOPTS_VALUE ? pts : av_rescale_q(ctx->videoPTS, st->time_base, ctx->omxtimebase);
+   if (pts != AV_NOPTS_VALUE && pts > last)
+      return pts;
+   return last + ctx->filter.frameTime;
+}
+
+/* Deinterlace or inverse telecine, scale and encode a decoded frame. Returns 0 on success. */
+static int swFilterFrame(struct context *ctx, AVFrame *in) {
+   OMXTX_SW *sw = &ctx->sw;
+   const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(in->format);
+   int64_t pts;
+   int n, nframes, field;
+
+   if (sw->enc == NULL && swStart(ctx, in, desc) != 0)
+      return 1;
+   pts = swFramePts(ctx, in);
+   if (in->key_frame)
+      ctx->thumbs.keyTick = pts;   /* Thumbnails at keyframes (-k key) */
+   if (ctx->filter.ivtc.enabled)
+      return ivtcFrame(ctx, in, pts);
+   if (!(ctx->userFlags & UFLAGS_DEINTERLACE))
+      return filterOutput(ctx, in, pts);
+
+   nframes = ctx->dei_ofpf ? 1 : 2;      /* One frame per two fields, or one per field */
+   field = in->top_field_first ? 0 : 1;  /* Fields in temporal order */
+   for (n = 0; n < nframes; n++, field ^= 1) {
+      if (swFrameBuffer(sw->dei, in->width, in->height, in->format) != 0) {
+         fprintf(stderr, "\nERROR: Can't allocate memory for a frame\n");
+         return 1;
+      }
+      swDeinterlace(in, sw->dei, nframes == 1 ? -1 : field, desc);
+      if (filterOutput(ctx, sw->dei, pts + n*ctx->filter.frameTime) != 0)
+         return 1;
+   }
+   return 0;
+}
+
+/* Software backend: decode, deinterlace, scale and encode on the host with libavcodec
+ * and swscale, in place of the OMX components. The decoder and encoder are frame
+ * threaded, so a job uses all the cores. runJob() has opened the input and any raw
+ * output file; the output is left for runJob() to close.
+ */
+static int swTranscode(struct context *ctx) {
+   OMXTX_SW *sw = &ctx->sw;
+   AVPacket *p;
+   pthread_t fpst;
+   int r, eof, fpsRunning=0, failed=0;
+
+   if (ctx->userFlags & UFLAGS_MONITOR)
+      fprintf(stderr, "WARNING: No monitor with the software backend: ignoring option m\n");
+   ctx->startTime = timeUs();
+   sw->frames = 0;
+   memset(&ctx->filter.ivtc, 0, sizeof(ctx->filter.ivtc));   /* swClose() freed the frames of the last job */
+   memset(&ctx->filter.decimate, 0, sizeof(ctx->filter.decimate));
+   if (swOpenDecoder(ctx) != 0) {
+      avformat_close_input(&ctx->ic);
+      swClose(ctx);
+      return 1;
+   }
+   ctx->setupTime += timeUs()-ctx->startTime;
+   if (startDemux(ctx) != 0) {
+      fprintf(stderr, "ERROR: Failed to start demux thread.\n");
+      avformat_close_input(&ctx->ic);
+      swClose(ctx);
+      return 1;
+   }
+
+   for (eof = 0; !eof && !failed; ) {
+      p = interrupted ? NULL : getNextVideoPacket(ctx);   /* After ctrl-c finish the output, as for OMX */
+      if (p == NULL)
+         eof = 1;      /* Flush the decoder */
+      else
+         ctx->framesIn++;
+      r = avcodec_send_packet(sw->dec, p);
+      recyclePacket(ctx, &p);
+      if (r < 0 && r != AVERROR_EOF)
+         fprintf(stderr, "\nWARNING: Decoder rejected a packet: %d\n", r);
+
+      while ((r = avcodec_receive_frame(sw->dec, sw->frame)) == 0) {
+         failed = swFilterFrame(ctx, sw->frame) != 0;
+         av_frame_unref(sw->frame);
+         if (failed)
+            break;
+         if (!fpsRunning && ctx->workers <= 1)   /* Progress lines from several jobs would be unreadable */
+            fpsRunning = pthread_create(&fpst, NULL, fps, ctx) == 0;
+      }
+      if (!failed && r != AVERROR(EAGAIN) && r != AVERROR_EOF) {
+         fprintf(stderr, "\nERROR: Decoder failed: %d\n", r);
+         failed = 1;
+      }
+   }
+   closeInput(ctx);
+   failed = failed || ctx->state == FAILED;   /* readPacket() ran out of memory */
+
+   if (!failed && sw->enc == NULL) {
+      fprintf(stderr, "ERROR: End of file before any video could be decoded.\n");
+      failed = 1;
+   }
+   if (!failed)
+      failed = filterFlush(ctx) != 0;
+   if (!failed)
+      failed = swEncode(ctx, NULL) != 0;   /* Flush the encoder */
+   if (failed)
+      pipelineFailed(ctx, OMX_ErrorUndefined);
+   else
+      ctx->state = ENCEOS;
+   if (fpsRunning)
+      pthread_join(fpst, NULL);
+   swClose(ctx);
+   if (failed)
+      fprintf(stderr, "\nERROR: Job failed after %lli frames\n", ctx->framesOut);
+   return failed;
+}
+
+static const OMXTX_BACKEND omxBackend = { "hw", omxTranscode, parkPipeline, cleanup };
+static const OMXTX_BACKEND swBackend = { "sw", swTranscode, NULL, swRelease };
+
+/* Quality (-Q): after the job, the output and the input are decoded on the host for one
+ * GOP of the output in every ctx->qualityGops, and the output frames compared with the
+ * input frames shown at the same time, cropped and scaled as the pipeline does it: PSNR
+ * over Y, U and V, and SSIM on Y (8x8 windows on a 4 pixel grid, as ffmpeg's ssim filter).
+ * The kernels use NEON on the Pi (armv7 with -mfpu=neon, or aarch64) and SSE2 on x86.
+ */
+
+/* Sum of squared differences of n pixels */
+static uint64_t sseLine(const uint8_t *a, const uint8_t *b, int n) {
+   uint64_t sse = 0;
+   int i = 0, d;
+#if defined(__ARM_NEON)
+   uint32x4_t sum = vdupq_n_u32(0);
+   uint8x16_t ad;
+
+   for (; i + 16 <= n; i += 16) {   /* Each lane gains up to 4 * 255^2 a loop: good for lines of 256k pixels */
+      ad = vabdq_u8(vld1q_u8(a+i), vld1q_u8(b+i));
+      sum = vpadalq_u16(sum, vmull_u8(vget_low_u8(ad), vget_low_u8(ad)));
+      sum = vpadalq_u16(sum, vmull_u8(vget_high_u8(ad), vget_high_u8(ad)));
+   }
+   sse = (uint64_t)vgetq_lane_u32(sum, 0) + vgetq_lane_u32(sum, 1) + vgetq_lane_u32(sum, 2) + vgetq_lane_u32(sum, 3);
+#elif defined(__SSE2__)
+   __m128i sum = _mm_setzero_si128(), zero = _mm_setzero_si128(), x, y, ad, lo, hi;
+   uint32_t lanes[4];
+
+   for (; i + 16 <= n; i += 16) {   /* As NEON */
+      x = _mm_loadu_si128((const __m128i *)(a+i));
+      y = _mm_loadu_si128((const __m128i *)(b+i));
+      ad = _mm_or_si128(_mm_subs_epu8(x, y), _mm_subs_epu8(y, x));   /* |x - y| */
+      lo = _mm_unpacklo_epi8(ad, zero);
+      hi = _mm_unpackhi_epi8(ad, zero);
+      sum = _mm_add_epi32(sum, _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi)));
+   }
+   _mm_storeu_si128((__m128i *)lanes, sum);
+   sse = (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+   for (; i < n; i++) {
+      d = a[i] - b[i];
+      sse += d*d;
+   }
+   return sse;
+}
+
+/* SSIM sums of each 4x4 block along a line of blocks: a, b, a^2 + b^2 and a*b */
+static void ssimLine(const uint8_t *a, int as, const uint8_t *b, int bs, int (*sums)[4], int blocks) {
+   int x = 0, i, j, p, q;
+#if defined(__ARM_NEON)
+   uint16x8_t sa, sb;
+   uint32x4_t ss, s12, pa, pb;
+   uint8x8_t va, vb;
+
+   for (; x + 2 <= blocks; x += 2) {   /* Two blocks at a time: lanes 0 and 1 of the 32 bit sums are the first */
+      sa = sb = vdupq_n_u16(0);
+      ss = s12 = vdupq_n_u32(0);
+      for (j = 0; j < 4; j++) {
+         va = vld1_u8(a + j*as + 4*x);
+         vb = vld1_u8(b + j*bs + 4*x);
+         sa = vaddw_u8(sa, va);
+         sb = vaddw_u8(sb, vb);
+         ss = vpadalq_u16(ss, vmull_u8(va, va));
+         ss = vpadalq_u16(ss, vmull_u8(vb, vb));
+         s12 = vpadalq_u16(s12, vmull_u8(va, vb));
+      }
+      pa = vpaddlq_u16(sa);
+      pb = vpaddlq_u16(sb);
+      sums[x][0] = vgetq_lane_u32(pa, 0) + vgetq_lane_u32(pa, 1);
+      sums[x+1][0] = vgetq_lane_u32(pa, 2) + vgetq_lane_u32(pa, 3);
+      sums[x][1] = vgetq_lane_u32(pb, 0) + vgetq_lane_u32(pb, 1);
+      sums[x+1][1] = vgetq_lane_u32(pb, 2) + vgetq_lane_u32(pb, 3);
+      sums[x][2] = vgetq_lane_u32(ss, 0) + vgetq_lane_u32(ss, 1);
+      sums[x+1][2] = vgetq_lane_u32(ss, 2) + vgetq_lane_u32(ss, 3);
+      sums[x][3] = vgetq_lane_u32(s12, 0) + vgetq_lane_u32(s12, 1);
+      sums[x+1][3] = vgetq_lane_u32(s12, 2) + vgetq_lane_u32(s12, 3);
+   }
+#elif defined(__SSE2__)
+   __m128i zero = _mm_setzero_si128(), one = _mm_set1_epi16(1), va, vb, sa, sb, ss, s12;
+   int32_t l[4][4];
+
+   for (; x + 2 <= blocks; x += 2) {   /* Two blocks at a time: lanes 0 and 1 of the 32 bit sums are the first */
+      sa = sb = ss = s12 = _mm_setzero_si128();
+      for (j = 0; j < 4; j++) {
+         va = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(a + j*as + 4*x)), zero);
+         vb = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(b + j*bs + 4*x)), zero);
+         sa = _mm_add_epi16(sa, va);
+         sb = _mm_add_epi16(sb, vb);
+         ss = _mm_add_epi32(ss, _mm_add_epi32(_mm_madd_epi16(va, va), _mm_madd_epi16(vb, vb)));
+         s12 = _mm_add_epi32(s12, _mm_madd_epi16(va, vb));
+      }
+      _mm_storeu_si128((__m128i *)l[0], _mm_madd_epi16(sa, one));
+      _mm_storeu_si128((__m128i *)l[1], _mm_madd_epi16(sb, one));
+      _mm_storeu_si128((__m128i *)l[2], ss);
+      _mm_storeu_si128((__m128i *)l[3], s12);
+      for (i = 0; i < 4; i++) {
+         sums[x][i] = l[i][0] + l[i][1];
+         sums[x+1][i] = l[i][2] + l[i][3];
+      }
+   }
+#endif
+   for (; x < blocks; x++) {
+      sums[x][0] = sums[x][1] = sums[x][2] = sums[x][3] = 0;
+      for (j = 0; j < 4; j++)
+         for (i = 0; i < 4; i++) {
+            p = a[j*as + 4*x + i];
+            q = b[j*bs + 4*x + i];
+            sums[x][0] += p;
+            sums[x][1] += q;
+            sums[x][2] += p*p + q*q;
+            sums[x][3] += p*q;
+         }
+   }
+}
+
+/* SSIM of one 8x8 window from the sums of its four blocks */
+static double ssimWindow(double s1, double s2, double ss, double s12) {
+   const double c1 = .01*.01*255*255*64, c2 = .03*.03*255*255*64*63;
+   double vars = ss*64 - s1*s1 - s2*s2;
+   double covar = s12*64 - s1*s2;
+
+   return (2*s1*s2 + c1) * (2*covar + c2) / ((s1*s1 + s2*s2 + c1) * (vars + c2));
+}
+
+/* Mean SSIM of a plane; sums has room for two lines of blocks */
+static double ssimPlane(const uint8_t *a, int as, const uint8_t *b, int bs, int w, int h, int (*sums)[4]) {
+   int (*prev)[4] = sums, (*cur)[4] = sums + w/4, (*t)[4];
+   int x, y, k, bw = w/4, bh = h/4;
+   double total = 0, s[4];
+
+   if (bw < 2 || bh < 2)
+      return 1.0;
+   ssimLine(a, as, b, bs, prev, bw);
+   for (y = 1; y < bh; y++) {
+      ssimLine(a + 4*y*as, as, b + 4*y*bs, bs, cur, bw);
+      for (x = 0; x < bw-1; x++) {
+         for (k = 0; k < 4; k++)
+            s[k] = prev[x][k] + prev[x+1][k] + cur[x][k] + cur[x+1][k];
+         total += ssimWindow(s[0], s[1], s[2], s[3]);
+      }
+      t = prev;
+      prev = cur;
+      cur = t;
+   }
+   return total / ((bw-1)*(bh-1));
+}
+
+static double psnr(uint64_t sse, uint64_t samples) {
+   return sse == 0 ? INFINITY : 10*log10(255.0*255.0*samples/sse);
+}
+
+/* One input to the quality measurement: a file opened for decoding on the host */
+typedef struct {
+   AVFormatContext *fmt;
+   AVCodecContext *dec;
+   AVPacket *pkt;
+   AVFrame *frame;
+   int stream;
+   double timeBase;
+   int64_t start;     /* pts of the first frame */
+   int eof;
+} OMXTX_QDEC;
+
+static int qualityOpen(OMXTX_QDEC *q, const char *name) {
+   const AVCodec *codec;
+   const AVStream *st;
+
+   memset(q, 0, sizeof(*q));
+   if (avformat_open_input(&q->fmt, name, NULL, NULL) < 0 || avformat_find_stream_info(q->fmt, NULL) < 0
+         || (q->stream = av_find_best_stream(q->fmt, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0)) < 0
+         || (codec = avcodec_find_decoder(q->fmt->streams[q->stream]->codecpar->codec_id)) == NULL) {
+      fprintf(stderr, "WARNING: Can't find the video in '%s'\n", name);
+      return 1;
+   }
+   st = q->fmt->streams[q->stream];
+   q->timeBase = av_q2d(st->time_base);
+   q->start = st->start_time;
+   q->dec = avcodec_alloc_context3(codec);
+   q->pkt = av_packet_alloc();
+   q->frame = av_frame_alloc();
+   if (q->dec == NULL || q->pkt == NULL || q->frame == NULL || avcodec_parameters_to_context(q->dec, st->codecpar) < 0) {
+      fprintf(stderr, "WARNING: Can't allocate a decoder for '%s'\n", name);
+      return 1;
+   }
+   q->dec->pkt_timebase = st->time_base;
+   q->dec->thread_count = 0;   /* One thread per core */
+   if (avcodec_open2(q->dec, codec, NULL) < 0) {
+      fprintf(stderr, "WARNING: Can't open the %s decoder\n", codec->name);
+      return 1;
+   }
+   return 0;
+}
+
+static void qualityClose(OMXTX_QDEC *q) {
+   avcodec_free_context(&q->dec);
+   av_packet_free(&q->pkt);
+   av_frame_free(&q->frame);
+   avformat_close_input(&q->fmt);
+}
+
+/* Seek to the last keyframe at or before t seconds from the first frame */
+static void qualitySeek(OMXTX_QDEC *q, double t) {
+   int64_t ts = (q->start != AV_NOPTS_VALUE ? q->start : 0) + (int64_t)(t / q->timeBase);
+
+   if (av_seek_frame(q->fmt, q->stream, ts, AVSEEK_FLAG_BACKWARD) < 0)
+      av_seek_frame(q->fmt, q->stream, q->start != AV_NOPTS_VALUE ? q->start : 0, AVSEEK_FLAG_BACKWARD);
+   avcodec_flush_buffers(q->dec);
+   q->eof = 0;
+}
+
+/* Decode the next frame into q->frame. Returns its time in seconds from the first frame,
+ * or a negative number at the end of the file.
+ */
+static double qualityFrame(OMXTX_QDEC *q) {
+   int r;
+
+   for (;;) {
+      r = avcodec_receive_frame(q->dec, q->frame);
+      if (r == 0) {
+         if (q->start == AV_NOPTS_VALUE)
+            q->start = q->frame->best_effort_timestamp;
+         return (q->frame->best_effort_timestamp - q->start) * q->timeBase;
+      }
+      if (r != AVERROR(EAGAIN) || q->eof)
+         return -1;
+      r = av_read_frame(q->fmt, q->pkt);
+      if (r < 0) {
+         q->eof = 1;
+         avcodec_send_packet(q->dec, NULL);   /* Flush */
+      }
+      else {
+         if (q->pkt->stream_index == q->stream)
+            avcodec_send_packet(q->dec, q->pkt);
+         av_packet_unref(q->pkt);
+      }
+   }
+}
+
+/* Crop and scale the input frame f into s, the size of the output frame o */
+static int qualityScale(struct context *ctx, struct SwsContext **sws, const AVFrame *f, const AVFrame *o, AVFrame *s) {
+   const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(f->format);
+   const uint8_t *src[4];
+   int i, hs, vs, step[4] = { 0, 0, 0, 0 };
+   int left = 0, top = 0, w = f->width, h = f->height;
+
+   if (desc == NULL)
+      return 1;
+   if ((ctx->userFlags & UFLAGS_CROP) && ctx->cropRect->nLeft + ctx->cropRect->nWidth <= w && ctx->cropRect->nTop + ctx->cropRect->nHeight <= h) {
+      left = ctx->cropRect->nLeft;
+      top = ctx->cropRect->nTop;
+      w = ctx->cropRect->nWidth;
+      h = ctx->cropRect->nHeight;
+   }
+   for (i = desc->nb_components-1; i >= 0; i--)
+      step[desc->comp[i].plane] = desc->comp[i].step;
+   for (i = 0; i < 4; i++) {   /* As swScaleEncode() */
+      hs = (i == 1 || i == 2) ? desc->log2_chroma_w : 0;
+      vs = (i == 1 || i == 2) ? desc->log2_chroma_h : 0;
+      src[i] = f->data[i] == NULL ? NULL : f->data[i] + (top >> vs)*f->linesize[i] + (left >> hs)*step[i];
+   }
+   *sws = sws_getCachedContext(*sws, w, h, f->format, o->width, o->height, AV_PIX_FMT_YUV420P, SWS_BICUBIC, NULL, NULL, NULL);
+   if (*sws == NULL)
+      return 1;
+   if (s->width != o->width || s->height != o->height) {
+      av_frame_unref(s);
+      s->width = o->width;
+      s->height = o->height;
+      s->format = AV_PIX_FMT_YUV420P;
+      if (av_frame_get_buffer(s, 32) < 0)
+         return 1;
+   }
+   sws_scale(*sws, src, f->linesize, 0, h, s->data, s->linesize);
+   return 0;
+}
+
+/* Scores over a number of frames */
+typedef struct {
+   uint64_t sse[3];     /* Squared error of Y, U and V */
+   uint64_t samples[3];
+   double ssim;         /* Sum of the SSIM of each frame */
+   int frames;
+} OMXTX_QSCORE;
+
+static double scorePSNR(const OMXTX_QSCORE *s) {
+   return psnr(s->sse[0] + s->sse[1] + s->sse[2], s->samples[0] + s->samples[1] + s->samples[2]);
+}
+
+static void addScore(OMXTX_QSCORE *to, const OMXTX_QSCORE *s) {
+   int p;
+
+   for (p = 0; p < 3; p++) {
+      to->sse[p] += s->sse[p];
+      to->samples[p] += s->samples[p];
+   }
+   to->ssim += s->ssim;
+   to->frames += s->frames;
+}
+
+/* Compare the output frame o with the scaled input frame s */
+static void qualityCompare(const AVFrame *o, const AVFrame *s, int (*sums)[4], OMXTX_QSCORE *score) {
+   int p, y, w, h;
+
+   for (p = 0; p < 3; p++) {
+      w = p ? (o->width+1)/2 : o->width;
+      h = p ? (o->height+1)/2 : o->height;
+      for (y = 0; y < h; y++)
+         score->sse[p] += sseLine(o->data[p] + y*o->linesize[p], s->data[p] + y*s->linesize[p], w);
+      score->samples[p] += (uint64_t)w*h;
+   }
+   score->ssim += ssimPlane(o->data[0], o->linesize[0], s->data[0], s->linesize[0], o->width, o->height, sums);
+   score->frames++;
+}
+
+/* Quality measurement state */
+typedef struct {
+   OMXTX_QDEC out, in;
+   struct SwsContext *sws;
+   AVFrame *scaled;     /* Input frame, cropped and scaled to the output size */
+   int (*sums)[4];      /* Two lines of SSIM block sums */
+   int64_t *keys;       /* pts of the output keyframes */
+   int nkeys;
+   double frameTime;    /* Output frame duration in seconds */
+} OMXTX_QUALITY;
+
+/* Score up to maxFrames frames of output GOP g against the input frames shown offset
+ * seconds later. Returns 0, or 1 if the frames can't be compared at all.
+ */
+static int qualityGop(struct context *ctx, OMXTX_QUALITY *q, int g, double offset, int maxFrames, OMXTX_QSCORE *score) {
+   double t, tIn = -1, tStart, tEnd;
+   int pending = 0, have = 0;
+
+   memset(score, 0, sizeof(*score));
+   tStart = (q->keys[g] - q->out.start) * q->out.timeBase;
+   tEnd = g+1 < q->nkeys ? (q->keys[g+1] - q->out.start) * q->out.timeBase : INFINITY;
+   qualitySeek(&q->out, tStart);
+   qualitySeek(&q->in, tStart + offset);
+   while (score->frames < maxFrames && (t = qualityFrame(&q->out)) >= 0 && t < tEnd - q->frameTime/2) {
+      if (t < tStart - q->frameTime/2)
+         continue;   /* Before the GOP: the seek landed early */
+      if (q->out.frame->format != AV_PIX_FMT_YUV420P && q->out.frame->format != AV_PIX_FMT_YUVJ420P) {
+         fprintf(stderr, "WARNING: Quality: the output isn't 4:2:0\n");
+         return 1;
+      }
+      /* The input frame shown at t: the last that starts no later than half an output frame after it */
+      for (;;) {
+         if (!pending && (tIn = qualityFrame(&q->in)) < 0)
+            break;
+         pending = 1;
+         if (tIn > t + offset + q->frameTime/2)
+            break;
+         pending = 0;
+         if (qualityScale(ctx, &q->sws, q->in.frame, q->out.frame, q->scaled) != 0) {
+            fprintf(stderr, "WARNING: Quality: can't scale the input frames\n");
+            return 1;
+         }
+         have = 1;
+      }
+      if (!have)
+         continue;
+      if (q->sums == NULL && (q->sums = av_malloc_array(q->out.frame->width/2 + 2, sizeof(*q->sums))) == NULL)
+         return 1;
+      qualityCompare(q->out.frame, q->scaled, q->sums, score);
+   }
+   return 0;
+}
+
+/* Measure the quality of ctx->oname against ctx->iname: see above. The output and input
+ * timestamps are compared from the first frame of each; the first output frames are
+ * matched with the input a few frames either side first, to find any fixed offset.
+ */
+static void measureQuality(struct context *ctx) {
+   OMXTX_QUALITY q;
+   OMXTX_QSCORE gop, total, best;
+   double offset = 0, worst = INFINITY, worstTime = 0, t;
+   int64_t *k, started = timeUs();
+   int g, i, gops = 0;
+
+   memset(&q, 0, sizeof(q));
+   memset(&total, 0, sizeof(total));
+   q.scaled = av_frame_alloc();
+   if (q.scaled == NULL || qualityOpen(&q.out, ctx->oname) != 0 || qualityOpen(&q.in, ctx->iname) != 0)
+      goto done;
+
+   /* The output GOPs: keyframe times, from the packets */
+   while (av_read_frame(q.out.fmt, q.out.pkt) >= 0) {
+      if (q.out.pkt->stream_index == q.out.stream && (q.out.pkt->flags & AV_PKT_FLAG_KEY) && q.out.pkt->pts != AV_NOPTS_VALUE) {
+         if ((k = av_realloc_array(q.keys, q.nkeys+1, sizeof(*q.keys))) == NULL)
+            goto done;
+         q.keys = k;
+         q.keys[q.nkeys++] = q.out.pkt->pts;
+      }
+      av_packet_unref(q.out.pkt);
+   }
+   if (q.nkeys == 0) {
+      fprintf(stderr, "WARNING: Quality: no keyframes in the output\n");
+      goto done;
+   }
+   q.out.start = q.keys[0];
+   q.frameTime = ctx->omxFPS > 0 ? 1.0/ctx->omxFPS : 0.04;
+
+   /* Timestamp offset: the best of -2 to +2 frames over the first few frames */
+   memset(&best, 0, sizeof(best));
+   for (i = -2; i <= 2; i++) {
+      if (qualityGop(ctx, &q, 0, i*q.frameTime, QUALITY_ALIGN_FRAMES, &gop) != 0)
+         goto done;
+      if (gop.frames > 0 && (best.frames == 0 || scorePSNR(&gop) > scorePSNR(&best))) {
+         best = gop;
+         offset = i*q.frameTime;
+      }
+   }
+   if (offset != 0 && (ctx->userFlags & UFLAGS_VERBOSE))
+      fprintf(stderr, "Quality: output is %+.0f frames from the input timestamps\n", offset/q.frameTime);
+
+   for (g = 0; g < q.nkeys && !interrupted; g += ctx->qualityGops) {
+      if (qualityGop(ctx, &q, g, offset, INT_MAX, &gop) != 0)
+         goto done;
+      if (gop.frames == 0)
+         continue;
+      t = (q.keys[g] - q.out.start) * q.out.timeBase;
+      if (ctx->userFlags & UFLAGS_VERBOSE)
+         fprintf(stderr, "Quality: GOP at %.2fs, %d frames: PSNR %.2fdB, SSIM %.4f\n", t, gop.frames, scorePSNR(&gop), gop.ssim/gop.frames);
+      if (scorePSNR(&gop) < worst) {
+         worst = scorePSNR(&gop);
+         worstTime = t;
+      }
+      addScore(&total, &gop);
+      gops++;
+   }
+   /* PSNR from the squared error of all the frames measured, SSIM the mean of the frames */
+   if (total.frames > 0)
+      fprintf(stderr, "Quality: %d frames in %d of %d GOPs: PSNR %.2fdB (Y %.2fdB), SSIM %.4f; worst GOP %.2fdB at %.1fs (%.1fs to measure)\n",
+         total.frames, gops, q.nkeys, scorePSNR(&total), psnr(total.sse[0], total.samples[0]),
+         total.ssim/total.frames, worst, worstTime, (timeUs()-started)/1E6);
+   else
+      fprintf(stderr, "WARNING: Quality: no output frames could be matched with the input\n");
+done:
+   av_free(q.keys);
+   av_free(q.sums);
+   av_frame_free(&q.scaled);
+   sws_freeContext(q.sws);
+   qualityClose(&q.out);
+   qualityClose(&q.in);
+}
+
+/* Auto crop (-c auto): the sum of n luma pixels */
+static uint32_t lumaSum(const uint8_t *p, int n) {
+   uint32_t sum = 0;
+   int i = 0;
+#if defined(__ARM_NEON)
+   uint32x4_t acc = vdupq_n_u32(0);
+
+   for (; i + 16 <= n; i += 16)
+      acc = vpadalq_u16(acc, vpaddlq_u8(vld1q_u8(p+i)));
+   sum = vgetq_lane_u32(acc, 0) + vgetq_lane_u32(acc, 1) + vgetq_lane_u32(acc, 2) + vgetq_lane_u32(acc, 3);
+#elif defined(__SSE2__)
+   __m128i acc = _mm_setzero_si128(), zero = _mm_setzero_si128();
+   uint32_t lanes[4];
+
+   for (; i + 16 <= n; i += 16)   /* The sums of each 8 pixels land in lanes 0 and 2 */
+      acc = _mm_add_epi32(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(p+i)), zero));
+   _mm_storeu_si128((__m128i *)lanes, acc);
+   sum = lanes[0] + lanes[2];
+#endif
+   for (; i < n; i++)
+      sum += p[i];
+   return sum;
+}
+
+/* Add a line of n luma pixels to the column sums */
+static void lumaColumns(const uint8_t *p, int n, uint32_t *sums) {
+   int i = 0;
+#if defined(__ARM_NEON)
+   uint8x16_t x;
+   uint16x8_t lo, hi;
+
+   for (; i + 16 <= n; i += 16) {
+      x = vld1q_u8(p+i);
+      lo = vmovl_u8(vget_low_u8(x));
+      hi = vmovl_u8(vget_high_u8(x));
+      vst1q_u32(sums+i, vaddw_u16(vld1q_u32(sums+i), vget_low_u16(lo)));
+      vst1q_u32(sums+i+4, vaddw_u16(vld1q_u32(sums+i+4), vget_high_u16(lo)));
+      vst1q_u32(sums+i+8, vaddw_u16(vld1q_u32(sums+i+8), vget_low_u16(hi)));
+      vst1q_u32(sums+i+12, vaddw_u16(vld1q_u32(sums+i+12), vget_high_u16(hi)));
+   }
+#elif defined(__SSE2__)
+   __m128i zero = _mm_setzero_si128(), x, lo, hi, *s;
+
+   for (; i + 16 <= n; i += 16) {
+      x = _mm_loadu_si128((const __m128i *)(p+i));
+      lo = _mm_unpacklo_epi8(x, zero);
+      hi = _mm_unpackhi_epi8(x, zero);
+      s = (__m128i *)(sums+i);
+      _mm_storeu_si128(s, _mm_add_epi32(_mm_loadu_si128(s), _mm_unpacklo_epi16(lo, zero)));
+      _mm_storeu_si128(s+1, _mm_add_epi32(_mm_loadu_si128(s+1), _mm_unpackhi_epi16(lo, zero)));
+      _mm_storeu_si128(s+2, _mm_add_epi32(_mm_loadu_si128(s+2), _mm_unpacklo_epi16(hi, zero)));
+      _mm_storeu_si128(s+3, _mm_add_epi32(_mm_loadu_si128(s+3), _mm_unpackhi_epi16(hi, zero)));
+   }
+#endif
+   for (; i < n; i++)
+      sums[i] += p[i];
+}
+
+/* The black borders of frame f in pixels: top, bottom, left and right. The rows are
+ * scanned in from the top and bottom, then the columns between them in from each side,
+ * with cols (the frame's width) for the column sums. Returns 1 if the frame is all black.
+ */
+static int frameBorders(const AVFrame *f, uint32_t *cols, int *border) {
+   const uint8_t *y = f->data[0];
+   int w = f->width, h = f->height, ls = f->linesize[0], i, rows;
+
+   for (border[0] = 0; border[0] < h && lumaSum(y + border[0]*ls, w) <= (uint32_t)CROP_BLACK*w; border[0]++);
+   if (border[0] == h)
+      return 1;
+   for (border[1] = 0; lumaSum(y + (h-1-border[1])*ls, w) <= (uint32_t)CROP_BLACK*w; border[1]++);
+   memset(cols, 0, w*sizeof(*cols));
+   for (i = border[0]; i < h - border[1]; i++)
+      lumaColumns(y + i*ls, w, cols);
+   rows = h - border[0] - border[1];
+   for (border[2] = 0; border[2] < w && cols[border[2]] <= (uint32_t)CROP_BLACK*rows; border[2]++);
+   if (border[2] == w)
+      return 1;
+   for (border[3] = 0; cols[w-1-border[3]] <= (uint32_t)CROP_BLACK*rows; border[3]++);
+   return 0;
+}
+
+/* -c auto: find the black borders in CROP_SAMPLES frames spread across ctx->iname, leaving
+ * out the first and last 5% (titles and credits), and crop to the picture inside the
+ * narrowest border seen on each side: a border is cropped only if it is in every sampled
+ * frame that isn't all black, so dark scenes and subtitles in the border don't cut into the
+ * picture. The crop is aligned as setCropRectangle()'s, and set for this job only.
+ */
+static void detectCrop(struct context *ctx) {
+   OMXTX_QDEC q;
+   const AVPixFmtDescriptor *desc;
+   uint32_t *cols = NULL;
+   int64_t started = timeUs();
+   double duration;
+   int border[4], b[4] = { INT_MAX, INT_MAX, INT_MAX, INT_MAX };
+   int i, s, frames = 0, w = 0, h = 0, cropWidth, cropHeight, cropLeft, cropTop;
+
+   if (qualityOpen(&q, ctx->iname) != 0)
+      goto done;
+   duration = q.fmt->duration != AV_NOPTS_VALUE && q.fmt->duration > 0 ? q.fmt->duration / (double)AV_TIME_BASE : 0;
+   for (s = 0; s < CROP_SAMPLES && !interrupted; s++) {
+      qualitySeek(&q, duration * (0.05 + 0.9*(s + 0.5)/CROP_SAMPLES));
+      if (qualityFrame(&q) < 0)
+         continue;
+      if (cols == NULL) {
+         desc = av_pix_fmt_desc_get(q.frame->format);
+         if (desc == NULL || (desc->flags & AV_PIX_FMT_FLAG_RGB) || desc->comp[0].depth != 8 || desc->comp[0].step != 1) {
+            fprintf(stderr, "WARNING: Auto crop: can't scan %s frames\n", desc != NULL ? desc->name : "unknown");
+            goto done;
+         }
+         w = q.frame->width;
+         h = q.frame->height;
+         if ((cols = av_malloc_array(w, sizeof(*cols))) == NULL)
+            goto done;
+      }
+      if (q.frame->width != w || q.frame->height != h || frameBorders(q.frame, cols, border) != 0)
+         continue;
+      for (i = 0; i < 4; i++)
+         b[i] = FFMIN(b[i], border[i]);
+      frames++;
+      if (duration == 0)
+         break;   /* Can't spread the samples: the first frame will do */
+   }
+   if (frames == 0) {
+      fprintf(stderr, "WARNING: Auto crop: no frames sampled from '%s' show a picture: not cropping\n", ctx->iname);
+      goto done;
+   }
+   if (b[0] == 0 && b[1] == 0 && b[2] == 0 && b[3] == 0) {
+      fprintf(stderr, "INFO: Auto crop: no black borders in %d frames sampled (%.1fs to measure)\n", frames, (timeUs()-started)/1E6);
+      goto done;
+   }
+
+   /* The top a multiple of 4 for interlaced material, left even for the chroma, and the
+    * width and height multiples of 16: what the rounding takes comes off both sides
+    */
+   cropTop = (b[0] + 3) & ~3;
+   cropLeft = (b[2] + 1) & ~1;
+   cropHeight = (h - cropTop - b[1]) & ~0x0f;
+   cropWidth = (w - cropLeft - b[3]) & ~0x0f;
+   if (cropWidth <= 16 || cropHeight <= 16) {
+      fprintf(stderr, "WARNING: Auto crop: the picture is too small to crop to: not cropping\n");
+      goto done;
+   }
+   cropTop += ((h - cropTop - b[1] - cropHeight) / 2) & ~3;
+   cropLeft += ((w - cropLeft - b[3] - cropWidth) / 2) & ~1;
+   if (ctx->cropRect == NULL)
+      MAKEME(ctx->cropRect, OMX_CONFIG_RECTTYPE);
+   if (ctx->cropRect == NULL) {
+      fprintf(stderr, "WARNING: Auto crop: out of memory: not cropping\n");
+      goto done;
+   }
+   ctx->cropRect->nPortIndex = PORT_RSZ;
+   ctx->cropRect->nLeft = cropLeft;
+   ctx->cropRect->nTop = cropTop;
+   ctx->cropRect->nWidth = cropWidth;
+   ctx->cropRect->nHeight = cropHeight;
+   ctx->userFlags |= UFLAGS_CROP;
+   fprintf(stderr, "INFO: Auto crop: %d:%d:%d:%d of %dx%d, %d%% of the picture, from %d frames sampled (%.1fs to measure)\n",
+      cropWidth, cropHeight, cropLeft, cropTop, w, h, (int)(100LL*cropWidth*cropHeight/((int64_t)w*h)), frames, (timeUs()-started)/1E6);
+done:
+   av_free(cols);
+   qualityClose(&q);
+}
+
+/* Renditions (-l) and the thumbnailer (-k): the per job state, from the pipeline's once
+ * runJob() has opened the input
+ */
+static void startRenditions(struct context *ctx) {
+   struct context *r;
+   int i;
+
+   for (i = 0; i <= ctx->nRenditions; i++) {
+      r = i < ctx->nRenditions ? ctx->renditions[i] : ctx->thumbnailer;
+      if (r == NULL)
+         continue;
+      resetJob(r);
+      r->jobs++;
+      r->cropRect = ctx->cropRect;   /* -c auto: as found for this job */
+      r->userFlags = (r->userFlags & ~UFLAGS_CROP) | (ctx->userFlags & UFLAGS_CROP);
+      r->ic = ctx->ic;   /* Only read for the stream parameters: closed with the pipeline's input */
+      r->inVidStreamIdx = ctx->inVidStreamIdx;
+      r->inAudioStreamIdx = ctx->inAudioStreamIdx;
+      r->audioPTS = ctx->audioPTS;
+      r->videoPTS = ctx->videoPTS;
+      r->startTime = timeUs();
+   }
+}
+
+/* Transcode ctx->iname to ctx->oname on the pipeline's backend.
+ * Returns 0 on success, 1 if the job failed but the pipeline can be parked and
+ * used again, or -1 if the pipeline is in an unknown state: it must be freed with
+ * freePipeline(), and a new one made for the next job.
+ */
+static int runJob(struct context *ctx) {
+   time_t end;
+   struct stat st;
+   struct rusage usage;
+   struct context *rendition, *thumbs;
+   double cpuTime;
+   int64_t filtered;
+   int r, i;
+
+   resetJob(ctx);
+   ctx->jobs++;
+   getrusage(RUSAGE_SELF, &usage);
+   cpuTime = -(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec)*1E-6);
+
+   if (openInputFile(ctx)==1)
+      return 1;
+
+   if (ctx->userFlags & UFLAGS_RAW) {
+      ctx->raw_fd = open(ctx->oname, O_CREAT|O_TRUNC|O_WRONLY, 0666);
+      if (ctx->raw_fd == -1) {
+         fprintf(stderr, "ERROR: Failed to open the output file for writing: %s\n", strerror(errno));
+         avformat_close_input(&ctx->ic);
+         return 1;
+      }
+   }
+
+   if (ctx->segStart != AV_NOPTS_VALUE && ctx->segStart > SEGMENT_MARGIN
+         && av_seek_frame(ctx->ic, -1, inputStart(ctx->ic) + ctx->segStart - SEGMENT_MARGIN, AVSEEK_FLAG_BACKWARD) < 0)
+      fprintf(stderr, "WARNING: Can't seek to the segment start: reading from the start of '%s'\n", ctx->iname);
+
+   ctx->audioPTS=ctx->ic->streams[ctx->inAudioStreamIdx]->start_time;
+   ctx->videoPTS=ctx->ic->streams[ctx->inVidStreamIdx]->start_time;
+   if (ctx->userFlags & UFLAGS_MAKE_UP_PTS) {
+      if (ctx->audioPTS>ctx->videoPTS) { /* Audio starts later than video */
+         ctx->audioPTS=ctx->audioPTS-ctx->videoPTS;
+         ctx->videoPTS=0;
+      }
+      else {
+         ctx->videoPTS=ctx->videoPTS-ctx->audioPTS;
+         ctx->audioPTS=0;
+      }
+   }
+
+   if (ctx->autoCrop && !regularFile(ctx->iname))   /* A job from -j: not checked by setupUserOpts() */
+      fprintf(stderr, "WARNING: Auto crop: '%s' isn't a regular file, so it can't be read twice: not cropping\n", ctx->iname);
+   else if (ctx->autoCrop)
+      detectCrop(ctx);
+   startRenditions(ctx);
+   thumbs = ctx->thumbnailer != NULL ? ctx->thumbnailer : ctx;
+   if (ctx->thumbs.enabled && thumbsOpen(thumbs) != 0) {
+      thumbsClose(thumbs);
+      avformat_close_input(&ctx->ic);
+      closeOutput(ctx);
+      return 1;
+   }
+   r = ctx->backend->transcode(ctx);
+   if (r != 0) {
+      thumbsClose(thumbs);
+      closeOutput(ctx);
+      return r;
+   }
+
+   end = time(NULL);
+   getrusage(RUSAGE_SELF, &usage);
+   cpuTime += usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec)*1E-6;
+
+   filtered = ctx->filter.ivtc.decimated + ctx->filter.decimate.rate + ctx->filter.decimate.repeats;   /* By -I and -D, not lost */
+   fprintf(stderr, "\n\nDropped frames: %f\%\n", ctx->framesIn ? 100.0*((int64_t)ctx->framesIn-(int64_t)ctx->framesOut-filtered)/ctx->framesIn : 0.0);
+   fprintf(stderr, "Processed %lli frames in %d seconds; %llif/s\n", ctx->framesOut, end-ctx->runStart, (end > ctx->runStart ? ctx->framesOut/(end-ctx->runStart) : ctx->framesOut));
+   if (ctx->workers <= 1) {   /* Process CPU time: with several workers it includes the other jobs */
+      fprintf(stderr, "Host CPU time: %.2lfs; %.3lfms per frame\n", cpuTime, ctx->framesOut ? cpuTime*1000.0/ctx->framesOut : 0.0);
+      fprintf(stderr, "Peak RSS: %ldkB\n", usage.ru_maxrss);
+   }
+   if (ctx->firstFrameTime)
+      fprintf(stderr, "Time to first encoded frame: %.1fms\n", (ctx->firstFrameTime-ctx->startTime)/1000.0);
+   for (i = 0; i < ctx->nRenditions; i++) {
+      rendition = ctx->renditions[i];
+      fprintf(stderr, "Rendition %s: %dx%d, %lli frames; %.0fkbps for a target of %dkbps\n", rendition->oname,
+         rendition->outputWidth, rendition->outputHeight, rendition->framesOut,
+         outputTime(rendition) > 0 ? rendition->curSize*8.0/outputTime(rendition)/1000 : 0.0,
+         rendition->bitrate/1000);
+   }
+   thumbsClose(thumbs);
+   if (ctx->adaptive && outputTime(ctx) > 0)
+      fprintf(stderr, "Adaptive bitrate: %.0fkbps for a target of %dkbps; encoder retuned %d times, %d - %dkbps\n",
+         ctx->curSize*8.0/outputTime(ctx)/1000, ctx->bitrate/1000, ctx->abrChanges, ctx->abrMin/1000, ctx->abrMax/1000);
+   if (ctx->latencyFrames > 0)
+      fprintf(stderr, "Glass to output latency: %.1fms average, %.1fms max (target %dms); %llu video packets dropped to keep up\n",
+         ctx->latencySum/1000.0/ctx->latencyFrames, ctx->latencyMax/1000.0, ctx->liveLatency, ctx->liveDropped);
+   if (ctx->userFlags & UFLAGS_VERBOSE)
+      fprintf(stderr, "Time waiting for encoder to finish: %.2lfs\n",(double)ctx->encWaitTime*1E-6);
+
+   closeOutput(ctx);
+   if (ctx->targetSize > 0 && stat(ctx->oname, &st) == 0)
+      fprintf(stderr, "Target size: %.1fMB; output %.1fMB (%+.1f%%)\n", ctx->targetSize/1048576.0, st.st_size/1048576.0,
+         100.0*(st.st_size - ctx->targetSize)/ctx->targetSize);
+   if (ctx->qualityGops > 0 && !interrupted) {
+      if (ctx->userFlags & UFLAGS_RAW)
+         fprintf(stderr, "WARNING: Quality can't be measured on raw output: it has no timestamps\n");
+      else if (!regularFile(ctx->iname) || !regularFile(ctx->oname))   /* A job from -j */
+         fprintf(stderr, "WARNING: Quality can't be measured: '%s' and '%s' must be regular files to be read again\n", ctx->iname, ctx->oname);
+      else
+         measureQuality(ctx);
+   }
+   return 0;   /* After ctrl-c the output is complete up to that point; the batch workers check interrupted */
+}
+
+/* Make a pipeline with the command line options in opts. It has no OMX components
+ * until its first job. Returns NULL on failure.
+ */
+static struct context *newPipeline(const struct context *opts) {
+   struct context *ctx;
+   pthread_condattr_t condAttr;
+   int i, j;
+
+   ctx = malloc(sizeof(struct context));
+   if (ctx == NULL) {
+      fprintf(stderr,"ERROR: Can't allocate memory for a pipeline\n");
+      return NULL;
+   }
+   memcpy(ctx, opts, sizeof(struct context));   /* Options; everything else is zero */
+
+   pthread_condattr_init(&condAttr);
+   pthread_condattr_setclock(&condAttr, CLOCK_MONOTONIC);   /* Completion waits use getDeadline() */
+   for (i = 0, j = 0; j < NCOMPONENTS; j++) {
+      i+=pthread_mutex_init(&ctx->completion[j].lock, NULL);
+      i+=pthread_cond_init(&ctx->completion[j].cond, &condAttr);
+   }
+   pthread_condattr_destroy(&condAttr);
+   i+=pthread_mutex_init(&ctx->bufLock, NULL);
+   i+=pthread_cond_init(&ctx->bufCond, NULL);
+   i+=pthread_mutex_init(&ctx->encLock, NULL);
+   i+=pthread_cond_init(&ctx->encCond, NULL);
+   i+=pthread_mutex_init(&ctx->muxLock, NULL);
+   i+=pthread_mutex_init(&ctx->filterLock, NULL);
+   i+=pthread_cond_init(&ctx->filterCond, NULL);
+   if (i!=0) {
+      fprintf(stderr,"ERROR: mutex init failed.\n");
+      free(ctx);
+      return NULL;
+   }
+
+   ctx->omxtimebase.num=1;
+   ctx->omxtimebase.den=1000000; /* OMX timebase is in micro seconds */
+   ctx->nalEntry.nalBufSize=NAL_BUF_SIZE;
+   ctx->nalEntry.nalPool=av_buffer_pool_init(ctx->nalEntry.nalBufSize, NULL);
+   if (ctx->nalEntry.nalPool==NULL) {
+      fprintf(stderr,"ERROR: Can't allocate memory for NAL buffers\n");
+      free(ctx);
+      return NULL;
+   }
+   ctx->nalEntry.nalBuf=NULL;
+   ctx->baseFlags=ctx->userFlags;
+   ctx->raw_fd=-1;
+   TAILQ_INIT(&ctx->packetq);
+
+   pthread_mutex_lock(&metrics.lock);
+   ctx->nextPipeline = metrics.pipelines;
+   metrics.pipelines = ctx;
+   pthread_mutex_unlock(&metrics.lock);
+
+   for (i = 0; i < opts->nRenditions; i++)
+      if ((ctx->renditions[i] = newRendition(opts, ctx, i)) == NULL) {
+         freePipeline(ctx);
+         return NULL;
+      }
+   if (opts->thumbs.enabled && opts->parent == NULL && opts->backend == &omxBackend
+         && (ctx->thumbnailer = newThumbnailer(opts, ctx)) == NULL) {
+      freePipeline(ctx);
+      return NULL;
+   }
+   return ctx;
+}
+
+/* Rendition n (-l) of parent: a pipeline of its own for the resizer and encoder it adds,
+ * with the options in opts but the size, bitrate and output of the rendition. The crop
+ * is applied by its resizer too; the deinterlacer and monitor are the parent's.
+ */
+static struct context *newRendition(const struct context *opts, struct context *parent, int n) {
+   struct context *ropts;
+   struct context *r;
+
+   ropts = malloc(sizeof(struct context));
+   if (ropts == NULL) {
+      fprintf(stderr,"ERROR: Can't allocate memory for a rendition\n");
+      return NULL;
+   }
+   memcpy(ropts, opts, sizeof(struct context));
+   ropts->nRenditions = 0;
+   ropts->outputWidth = opts->renditionOpts[n].width;
+   ropts->outputHeight = opts->renditionOpts[n].height;
+   ropts->bitrate = opts->renditionOpts[n].bitrate;
+   ropts->oname = opts->renditionOpts[n].oname;
+   ropts->userFlags = (opts->userFlags | UFLAGS_RESIZE) & ~(UFLAGS_DEINTERLACE | UFLAGS_MONITOR | UFLAGS_AUTO_SCALE_X | UFLAGS_AUTO_SCALE_Y);
+   ropts->qualityGops = 0;
+   ropts->thumbs.enabled = 0;
+   ropts->autoCrop = 0;   /* The parent's crop: see startRenditions() */
+   ropts->parent = parent;
+   ropts->splPort = PORT_SPL + 2 + n + ((opts->userFlags & UFLAGS_MONITOR) ? 1 : 0);
+   r = newPipeline(ropts);
+   free(ropts);
+   return r;
+}
+
+/* Thumbnailer (-k) of parent, on the OMX backend: a pipeline of its own for the resizer on
+ * a splitter output that scales the frames to the thumbnail size. The crop is applied by
+ * its resizer too.
+ */
+static struct context *newThumbnailer(const struct context *opts, struct context *parent) {
+   struct context *topts;
+   struct context *t;
+
+   topts = malloc(sizeof(struct context));
+   if (topts == NULL) {
+      fprintf(stderr,"ERROR: Can't allocate memory for the thumbnailer\n");
+      return NULL;
+   }
+   memcpy(topts, opts, sizeof(struct context));
+   topts->nRenditions = 0;
+   topts->outputWidth = opts->thumbs.width;
+   topts->outputHeight = opts->thumbs.height;   /* 0: set by configure() from the picture */
+   topts->userFlags = (opts->userFlags | UFLAGS_RESIZE) & ~(UFLAGS_DEINTERLACE | UFLAGS_MONITOR | UFLAGS_AUTO_SCALE_X | UFLAGS_AUTO_SCALE_Y);
+   topts->qualityGops = 0;
+   topts->autoCrop = 0;
+   topts->parent = parent;
+   topts->splPort = PORT_SPL + 2 + opts->nRenditions + ((opts->userFlags & UFLAGS_MONITOR) ? 1 : 0);
+   t = newPipeline(topts);
+   free(topts);
+   return t;
+}
+
+/* Release the components, buffers and locks of a pipeline made by newPipeline() */
+static void freePipeline(struct context *ctx) {
+   enum OMX_STATETYPE state;
+   struct context **p;
+   int i;
+
+   pthread_mutex_lock(&metrics.lock);
+   for (p = &metrics.pipelines; *p != NULL && *p != ctx; p = &(*p)->nextPipeline);
+   if (*p != NULL)
+      *p = ctx->nextPipeline;
+   pthread_mutex_unlock(&metrics.lock);
+
+   if ((ctx->userFlags & UFLAGS_VERBOSE) && ctx->dec != NULL) {
+      fprintf(stderr, "Pipeline teardown, after %lli frames:\n", ctx->framesOut);
+      dumpport(ctx, ctx->dec, PORT_DEC);
+      dumpport(ctx, ctx->dec, PORT_DEC+1);
+      dumpport(ctx, ctx->enc, PORT_ENC+1);
+
+      OMX_GetState(ctx->dec, &state);
+      fprintf(stderr, "Decoder state: %d\n", state);
+      OMX_GetState(ctx->enc, &state);
+      fprintf(stderr, "Encoder state: %d\n", state);
+      fprintf(stderr, "********** Starting teardown **********\n");
+   }
+   ctx->backend->release(ctx);   /* The renditions' and thumbnailer's components too */
+   for (i = 0; i < MAX_RENDITIONS; i++)
+      if (ctx->renditions[i] != NULL)
+         freePipeline(ctx->renditions[i]);
+   if (ctx->thumbnailer != NULL)
+      freePipeline(ctx->thumbnailer);
+   if (ctx->autoCrop)
+      free(ctx->cropRect);
+   freeSavedPackets(ctx);
+   free(ctx->decFree.bufs);
+   free(ctx->encFilled.bufs);
+   free(ctx->decFree.pushed);
+   free(ctx->encFilled.pushed);
+   free(ctx->filter.filled.bufs);
+   free(ctx->filter.free.bufs);
+   free(ctx->filter.filled.pushed);
+   free(ctx->filter.free.pushed);
+   av_buffer_unref(&ctx->nalEntry.nalBuf);
+   av_buffer_pool_uninit(&ctx->nalEntry.nalPool);
+   for (i = 0; i < NCOMPONENTS; i++) {
+      pthread_cond_destroy(&ctx->completion[i].cond);
+      pthread_mutex_destroy(&ctx->completion[i].lock);
+   }
+   pthread_cond_destroy(&ctx->bufCond);
+   pthread_mutex_destroy(&ctx->bufLock);
+   pthread_cond_destroy(&ctx->encCond);
+   pthread_mutex_destroy(&ctx->encLock);
+   pthread_mutex_destroy(&ctx->muxLock);
+   pthread_cond_destroy(&ctx->filterCond);
+   pthread_mutex_destroy(&ctx->filterLock);
+   free(ctx);
+}
+
+/* Batch mode: SIGUSR1 is sent by sigHandler_thread() to interrupt a worker blocked reading the job file */
+static void wakeReader(int sig) {
+}
+
+/* Read the next line of the job file into batch.line; a FIFO is opened again at end of file.
+ * Returns 1 at the end of the jobs, or after ctrl-c. reading is set before interrupted is
+ * looked at, so that sigHandler_thread() either sees it, or this sees interrupted.
+ */
+static int readJobLine(const struct context *opts) {
+   int r = 1;
+
+   batch.reader = pthread_self();
+   batch.reading = 1;
+   while (!interrupted && batch.fp != NULL) {
+      if (getline(&batch.line, &batch.len, batch.fp) >= 0) {
+         r = 0;
+         break;
+      }
+      if (!batch.fifo || interrupted)
+         break;
+      fclose(batch.fp);       /* Writer closed the FIFO: wait for the next one */
+      batch.fp=fopen(opts->jobFile, "r");
+   }
+   batch.reading = 0;
+   return r;
+}
+
+/* Read the next job from the job file, or the next segment, with batch.lock held. Returns 0
+ * with the job in *job, its names to be freed by the caller, or 1 if there are no more jobs.
+ */
+static int nextJob(const struct context *opts, OMXTX_JOB *job) {
+   char *name, *sep;
+
+   if (batch.segs != NULL) {
+      if (interrupted || batch.nextSeg == batch.nSegs)
+         return 1;
+      *job = batch.segs[batch.nextSeg++];
+      job->iname = strdup(job->iname);
+      job->oname = strdup(job->oname);
+      if (job->iname==NULL || job->oname==NULL) {
+         fprintf(stderr, "ERROR: Can't allocate memory for segment %d\n", batch.nextSeg);
+         free(job->iname);
+         free(job->oname);
+         return 1;
+      }
+      return 0;
+   }
+
+   job->segStart = opts->segStart;   /* -s applies to every job */
+   job->segEnd = opts->segEnd;
+   while (readJobLine(opts) == 0) {
+      batch.line[strcspn(batch.line, "\r\n")]='\0';
+      for (name=batch.line; *name==' ' || *name=='\t'; name++);
+      if (*name=='\0' || *name=='#')
+         continue;
+      sep=strrchr(name, '\t');
+      if (sep==NULL)
+         sep=strrchr(name, ' ');
+      if (sep==NULL || sep[1]=='\0') {
+         fprintf(stderr, "WARNING: Ignoring job '%s': expected <infile> <outfile>\n", name);
+         continue;
+      }
+      job->oname=strdup(sep+1);
+      while (sep>name && (sep[-1]==' ' || sep[-1]=='\t'))
+         sep--;
+      *sep='\0';
+      job->iname=strdup(name);
+      if (job->iname==NULL || job->oname==NULL) {
+         fprintf(stderr, "ERROR: Can't allocate memory for job '%s'\n", name);
+         free(job->iname);
+         free(job->oname);
+         return 1;
+      }
+      return 0;
+   }
+   return 1;
+}
+
+/* Batch mode worker thread: run jobs from the job file, or segments, on a pipeline of its own until
+ * there are no more. A pipeline left in an unknown state by a failed job is freed, and a
+ * new one is made for the next job; the other workers carry on regardless.
+ */
+static void *batchWorker(void *arg) {
+   const struct context *opts = arg;
+   struct context *ctx = NULL;
+   OMXTX_JOB next;
+   int r, job, first=0;
+   int64_t overhead;
+
+   traceThread("worker");
+   while (!interrupted) {
+      pthread_mutex_lock(&batch.lock);
+      r = nextJob(opts, &next);
+      if (r == 0)
+         job = ++batch.jobs;
+      pthread_mutex_unlock(&batch.lock);
+      if (r != 0)
+         break;
+
+      overhead = -1;   /* Only reported for jobs that leave the pipeline usable */
+      if (ctx == NULL)
+         ctx = newPipeline(opts);
+      if (ctx == NULL)
+         r = -1;
+      else {
+         ctx->iname = next.iname;
+         ctx->oname = next.oname;
+         ctx->segStart = next.segStart;
+         ctx->segEnd = next.segEnd;
+         first = ctx->jobs == 0;
+         fprintf(stderr, "\nINFO: Job %d: %s -> %s\n", job, next.iname, next.oname);
+         r = runJob(ctx);
+         if (r>=0 && ctx->backend->park!=NULL && ctx->backend->park(ctx)!=OMX_ErrorNone)
+            r = -1;
+         if (r>=0) {
+            overhead = ctx->setupTime;
+            if (first)
+               overhead += ctx->initTime;
+            fprintf(stderr, "INFO: Job %d %s; OMX set up and park: %.1fms\n", job, r==0 ? "done" : "failed", overhead/1000.0);
+         }
+         else {
+            if (!interrupted)
+               fprintf(stderr, "ERROR: Job %d failed; OMX components in an unknown state: setting up new ones.\n", job);
+            freePipeline(ctx);
+            ctx = NULL;
+         }
+      }
+      free(next.iname);
+      free(next.oname);
+
+      pthread_mutex_lock(&batch.lock);
+      if (r != 0)
+         batch.failed++;
+      if (overhead >= 0 && first) {
+         batch.firsts++;
+         batch.firstOverhead += overhead;
+      }
+      else if (overhead >= 0) {
+         batch.later++;
+         batch.laterOverhead += overhead;
+      }
+      pthread_mutex_unlock(&batch.lock);
+   }
+   if (ctx != NULL)
+      freePipeline(ctx);
+   return NULL;
+}
+
+/* Run opts->workers batch worker threads until there are no more jobs, and report on them.
+ * Returns 0 if every job was done.
+ */
+static int runWorkers(const struct context *opts) {
+   pthread_t *workers;
+   int i, n;
+
+   workers = calloc(opts->workers, sizeof(pthread_t));
+   if (workers==NULL || pthread_mutex_init(&batch.lock, NULL)!=0) {
+      fprintf(stderr, "ERROR: Failed to set up the batch workers\n");
+      free(workers);
+      return 1;
+   }
+
+   batch.workers = opts->workers;
+   for (i = 0, n = 0; i < opts->workers; i++) {
+      if (pthread_create(&workers[n], NULL, batchWorker, (void *)opts) == 0)
+         n++;
+      else {
+         fprintf(stderr, "WARNING: Failed to start batch worker %d\n", i+1);
+         pthread_mutex_lock(&batch.lock);
+         batch.workers--;
+         pthread_mutex_unlock(&batch.lock);
+      }
+   }
+   for (i = 0; i < n; i++)
+      pthread_join(workers[i], NULL);
+
+   fprintf(stderr, "\nINFO: %d jobs, %d failed.", batch.jobs, batch.failed);
+   if (batch.firsts>0 && batch.later>0)
+      fprintf(stderr, " OMX set up: %.1fms for the first job on a pipeline (%.1fms with OMX_Init(), as for one process per file), %.1fms per job after that.",
+         batch.firstOverhead/1000.0/batch.firsts, (batch.firstOverhead/batch.firsts + omxInitTime)/1000.0, batch.laterOverhead/1000.0/batch.later);
+   fprintf(stderr, "\n");
+   free(workers);
+   pthread_mutex_destroy(&batch.lock);
+   return batch.failed>0 || n==0;
+}
+
+/* Batch mode: run the jobs in opts->jobFile, one "<infile> <outfile>" per line. The names
+ * are separated by a tab if they contain spaces; blank lines and lines starting with '#'
+ * are skipped. If the job file is a FIFO it is opened again at end of file, to wait for
+ * more jobs. opts->workers threads take jobs from the file, each with a pipeline of its
+ * own, so that many jobs run at once on the one OMX core. A pipeline's components are set
+ * up by its first job, and parked in Idle between jobs.
+ * The OMX set up and park time of each job is reported: the first job on a pipeline includes
+ * getting the component handles, as every job would if run as a separate process.
+ */
+static int runBatch(const struct context *opts) {
+   struct stat st;
+   struct sigaction sa;
+   int r;
+
+   memset(&sa, 0, sizeof(sa));   /* No SA_RESTART: the read is interrupted */
+   sa.sa_handler = wakeReader;
+   sigemptyset(&sa.sa_mask);
+   sigaction(SIGUSR1, &sa, NULL);
+
+   if (strcmp(opts->jobFile, "-")==0)
+      batch.fp=stdin;
+   else {
+      batch.fifo = stat(opts->jobFile, &st)==0 && S_ISFIFO(st.st_mode);
+      batch.fp=fopen(opts->jobFile, "r");
+   }
+   if (batch.fp==NULL) {
+      fprintf(stderr, "ERROR: Failed to open job file '%s': %s\n", opts->jobFile, strerror(errno));
+      return 1;
+   }
+   r = runWorkers(opts);
+   free(batch.line);
+   if (batch.fp!=NULL && batch.fp!=stdin)
+      fclose(batch.fp);
+   return r;
+}
+
+/* -S: find the keyframes that split the input (the -s part of it, if given) into n
+ * segments of about the same length. Each is the first keyframe at or after its share of
+ * the duration, found as segmentFilter() will find it. points[0..k] are set to the segment
+ * boundaries, in us from the start of the input as for -s. Returns the number of segments
+ * k, which is less than n if the keyframes are far apart, or 0 on failure.
+ */
+static int findSplitPoints(const struct context *opts, int n, int64_t *points) {
+   AVFormatContext *ic=NULL;
+   AVPacket *pkt;
+   int64_t first, last, target, ts;
+   int i, k, vid;
+
+   if (avformat_open_input(&ic, opts->iname, NULL, NULL) != 0 || avformat_find_stream_info(ic, NULL) < 0) {
+      fprintf(stderr, "ERROR: Failed to open '%s'\n", opts->iname);
+      avformat_close_input(&ic);
+      return 0;
+   }
+   vid = av_find_best_stream(ic, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+   pkt = av_packet_alloc();
+   if (vid < 0 || ic->duration <= 0 || pkt == NULL) {
+      fprintf(stderr, "ERROR: Can't split '%s': %s\n", opts->iname, vid < 0 ? "no video stream" : "unknown duration");
+      av_packet_free(&pkt);
+      avformat_close_input(&ic);
+      return 0;
+   }
+
+   first = opts->segStart != AV_NOPTS_VALUE ? opts->segStart : 0;
+   last = (opts->segEnd != AV_NOPTS_VALUE && opts->segEnd < ic->duration) ? opts->segEnd : ic->duration;
+   points[0] = opts->segStart;
+   /* AV_NOPTS_VALUE is INT64_MIN, so points[0] compares as before any time */
+   for (i = 1, k = 1; i < n && !interrupted; i++) {
+      target = first + (last - first) * i / n;
+      if (target <= points[k-1])
+         continue;   /* The keyframe found for the last target is past this one */
+      if (av_seek_frame(ic, -1, inputStart(ic) + target - SEGMENT_MARGIN, AVSEEK_FLAG_BACKWARD) < 0 && i == 1)
+         fprintf(stderr, "WARNING: Can't seek in '%s': reading through it for keyframes\n", opts->iname);
+      ts = AV_NOPTS_VALUE;
+      while (av_read_frame(ic, pkt) >= 0) {
+         if (pkt->stream_index == vid && (pkt->flags & AV_PKT_FLAG_KEY))
+            ts = packetTime(ic, pkt);
+         av_packet_unref(pkt);
+         if (ts != AV_NOPTS_VALUE && ts >= target)
+            break;
+         ts = AV_NOPTS_VALUE;
+      }
+      if (ts == AV_NOPTS_VALUE || ts >= last)
+         break;      /* No keyframe left in the part to split */
+      if (ts > points[k-1])
+         points[k++] = ts;
+   }
+   points[k] = opts->segEnd;
+   if (opts->userFlags & UFLAGS_VERBOSE)
+      for (i = 1; i < k; i++)
+         fprintf(stderr, "Split point %d: keyframe at %.3fs\n", i, points[i]/1E6);
+
+   av_packet_free(&pkt);
+   avformat_close_input(&ic);
+   return interrupted ? 0 : k;
+}
+
+/* Check that segment ic can follow the segments already in oc: the same streams, and the
+ * same video SPS / PPS, as they are only written once in the output file header
+ */
+static int sameStreams(AVFormatContext *oc, AVFormatContext *ic) {
+   AVCodecParameters *a, *b;
+   unsigned int i;
+
+   if (ic->nb_streams != oc->nb_streams)
+      return 0;
+   for (i = 0; i < ic->nb_streams; i++) {
+      a = oc->streams[i]->codecpar;
+      b = ic->streams[i]->codecpar;
+      if (a->codec_type != b->codec_type || a->codec_id != b->codec_id)
+         return 0;
+      if (a->codec_type == AVMEDIA_TYPE_VIDEO && (a->width != b->width || a->height != b->height
+            || a->extradata_size != b->extradata_size || memcmp(a->extradata, b->extradata, a->extradata_size) != 0))
+         return 0;
+   }
+   return 1;
+}
+
+/* Join segments made with -s or -S into oname, without re-encoding. The streams come from
+ * the first segment, and the other segments must match them: segments encoded with the same
+ * options do. Each segment's timestamps are moved on to where the video of the one before
+ * ended, so the output timestamps run on without a gap whichever machine made a segment;
+ * packets that overlap the segment before (audio read past the split) are dropped.
+ * Returns 0 on success.
+ */
+static int joinSegments(char **names, int n, const char *oname, const char *formatName, int verbose) {
+   AVFormatContext *ic=NULL, *oc=NULL;
+   AVPacket *pkt;
+   AVStream *ist;
+   int64_t *lastDts=NULL;
+   int64_t offset, start, end, videoEnd=AV_NOPTS_VALUE, segEnd;
+   int i, s, vid, header=0, dropped=0, ret=1;
+
+   avformat_alloc_output_context2(&oc, NULL, formatName, oname);
+   pkt = av_packet_alloc();
+   if (oc == NULL || pkt == NULL) {
+      fprintf(stderr, "ERROR: Can't set up the output '%s'\n", oname);
+      goto done;
+   }
+
+   for (i = 0; i < n && !interrupted; i++) {
+      if (avformat_open_input(&ic, names[i], NULL, NULL) != 0 || avformat_find_stream_info(ic, NULL) < 0) {
+         fprintf(stderr, "ERROR: Failed to open segment '%s'\n", names[i]);
+         goto done;
+      }
+      vid = av_find_best_stream(ic, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+      if (vid < 0) {
+         fprintf(stderr, "ERROR: No video stream in segment '%s'\n", names[i]);
+         goto done;
+      }
+      if (i == 0) {
+         for (s = 0; s < ic->nb_streams; s++) {
+            AVStream *ost = avformat_new_stream(oc, NULL);
+            if (ost == NULL || avcodec_parameters_copy(ost->codecpar, ic->streams[s]->codecpar) < 0) {
+               fprintf(stderr, "ERROR: Can't add stream %d to '%s'\n", s, oname);
+               goto done;
+            }
+            ost->codecpar->codec_tag = 0;
+            ost->time_base = ic->streams[s]->time_base;
+            ost->avg_frame_rate = ic->streams[s]->avg_frame_rate;
+            ost->sample_aspect_ratio = ic->streams[s]->sample_aspect_ratio;
+         }
+         lastDts = malloc(ic->nb_streams * sizeof(int64_t));
+         if (lastDts == NULL) {
+            fprintf(stderr, "ERROR: Can't allocate memory to join segments\n");
+            goto done;
+         }
+         for (s = 0; s < ic->nb_streams; s++)
+            lastDts[s] = AV_NOPTS_VALUE;
+         if (!(oc->oformat->flags & AVFMT_NOFILE) && avio_open(&oc->pb, oname, AVIO_FLAG_WRITE) < 0) {
+            fprintf(stderr, "ERROR: Failed to open the output file '%s' for writing\n", oname);
+            goto done;
+         }
+         if (avformat_write_header(oc, NULL) < 0) {
+            fprintf(stderr, "ERROR: Failed to write the header of '%s'\n", oname);
+            goto done;
+         }
+         header = 1;
+      }
+      else if (!sameStreams(oc, ic)) {
+         fprintf(stderr, "ERROR: Segment '%s' doesn't match the first: the segments must be encoded with the same options\n", names[i]);
+         goto done;
+      }
+
+      ist = ic->streams[vid];
+      start = ist->start_time != AV_NOPTS_VALUE ? av_rescale_q(ist->start_time, ist->time_base, AV_TIME_BASE_Q) : 0;
+      offset = videoEnd != AV_NOPTS_VALUE ? videoEnd - start : 0;
+      if (verbose)
+         fprintf(stderr, "Segment %d: '%s', timestamps moved by %.3fs\n", i+1, names[i], offset/1E6);
+      segEnd = videoEnd;
+      while (!interrupted && av_read_frame(ic, pkt) >= 0) {
+         s = pkt->stream_index;
+         ist = ic->streams[s];
+         if (pkt->pts != AV_NOPTS_VALUE)
+            pkt->pts += av_rescale_q(offset, AV_TIME_BASE_Q, ist->time_base);
+         if (pkt->dts != AV_NOPTS_VALUE)
+            pkt->dts += av_rescale_q(offset, AV_TIME_BASE_Q, ist->time_base);
+         if (s == vid && pkt->pts != AV_NOPTS_VALUE) {
+            if (pkt->duration <= 0 && ist->avg_frame_rate.num > 0)
+               pkt->duration = av_rescale_q(1, av_inv_q(ist->avg_frame_rate), ist->time_base);
+            end = av_rescale_q(pkt->pts + pkt->duration, ist->time_base, AV_TIME_BASE_Q);
+            if (segEnd == AV_NOPTS_VALUE || end > segEnd)
+               segEnd = end;
+         }
+         av_packet_rescale_ts(pkt, ist->time_base, oc->streams[s]->time_base);
+         if (pkt->dts != AV_NOPTS_VALUE && lastDts[s] != AV_NOPTS_VALUE && pkt->dts <= lastDts[s]) {
+            dropped++;   /* Overlaps the segment before */
+            av_packet_unref(pkt);
+            continue;
+         }
+         if (pkt->dts != AV_NOPTS_VALUE)
+            lastDts[s] = pkt->dts;
+         if (av_interleaved_write_frame(oc, pkt) < 0) {
+            fprintf(stderr, "ERROR: Failed to write to '%s'\n", oname);
+            goto done;
+         }
+      }
+      videoEnd = segEnd;
+      avformat_close_input(&ic);
+   }
+   if (verbose || dropped > 0)
+      fprintf(stderr, "INFO: Joined %d segments into '%s'; %d overlapping packets dropped\n", i, oname, dropped);
+   ret = interrupted;
+
+done:
+   if (header)
+      av_write_trailer(oc);
+   if (oc != NULL && !(oc->oformat->flags & AVFMT_NOFILE))
+      avio_closep(&oc->pb);
+   avformat_free_context(oc);
+   avformat_close_input(&ic);
+   av_packet_free(&pkt);
+   free(lastDts);
+   return ret;
+}
+
+/* -C: join the segments listed in opts->iname, one file name per line, into opts->oname.
+ * Blank lines and lines starting with '#' are skipped.
+ */
+static int runJoin(const struct context *opts) {
+   FILE *fp;
+   char *line=NULL, *name, **names=NULL, **more;
+   size_t len=0;
+   int i, n=0, r=1;
+
+   fp = strcmp(opts->iname, "-")==0 ? stdin : fopen(opts->iname, "r");
+   if (fp == NULL) {
+      fprintf(stderr, "ERROR: Failed to open segment list '%s': %s\n", opts->iname, strerror(errno));
+      return 1;
+   }
+   while (getline(&line, &len, fp) >= 0) {
+      line[strcspn(line, "\r\n")]='\0';
+      for (name=line; *name==' ' || *name=='\t'; name++);
+      if (*name=='\0' || *name=='#')
+         continue;
+      more = realloc(names, (n+1) * sizeof(char *));
+      if (more == NULL || (more[n] = strdup(name)) == NULL) {
+         fprintf(stderr, "ERROR: Can't allocate memory for the segment list\n");
+         names = more != NULL ? more : names;
+         goto done;
+      }
+      names = more;
+      n++;
+   }
+   if (n == 0)
+      fprintf(stderr, "ERROR: No segments in '%s'\n", opts->iname);
+   else
+      r = joinSegments(names, n, opts->oname, opts->formatName, opts->userFlags & UFLAGS_VERBOSE);
+
+done:
+   for (i = 0; i < n; i++)
+      free(names[i]);
+   free(names);
+   free(line);
+   if (fp != stdin)
+      fclose(fp);
+   return r;
+}
+
+/* Target file size (-F): sample the input for the complexity of each part and the audio
+ * rate. complexity[] gets the video bytes per second of the input in each of PLAN_SLOTS
+ * parts; *audioBytes the audio that will be copied. Returns the input duration in us, or 0.
+ */
+static int64_t scanInput(const struct context *opts, double *complexity, double *audioBytes) {
+   AVFormatContext *ic=NULL;
+   AVPacket *pkt;
+   int64_t duration, slot, from, ts;
+   double window, vBytes, aBytes=0, aTime=0;
+   int i, vid, aud=-1, stream;
+
+   if (avformat_open_input(&ic, opts->iname, NULL, NULL) != 0 || avformat_find_stream_info(ic, NULL) < 0) {
+      fprintf(stderr, "ERROR: Failed to open '%s'\n", opts->iname);
+      avformat_close_input(&ic);
+      return 0;
+   }
+   vid = av_find_best_stream(ic, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+   if (!(opts->userFlags & UFLAGS_RAW))
+      aud = av_find_best_stream(ic, AVMEDIA_TYPE_AUDIO, opts->userAudioStreamIdx, -1, NULL, 0);
+   pkt = av_packet_alloc();
+   duration = ic->duration;
+   if (vid < 0 || duration <= 0 || pkt == NULL) {
+      fprintf(stderr, "ERROR: Can't plan a file size for '%s': %s\n", opts->iname, vid < 0 ? "no video stream" : "unknown duration");
+      av_packet_free(&pkt);
+      avformat_close_input(&ic);
+      return 0;
+   }
+
+   slot = duration / PLAN_SLOTS;
+   window = FFMIN(SCAN_SECONDS, (double)slot / AV_TIME_BASE);
+   for (i = 0; i < PLAN_SLOTS && !interrupted; i++) {
+      from = slot*i + (slot - (int64_t)(window*AV_TIME_BASE))/2;
+      if (av_seek_frame(ic, -1, inputStart(ic) + from, AVSEEK_FLAG_BACKWARD) < 0) {
+         fprintf(stderr, "ERROR: Option F needs a seekable input\n");
+         duration = 0;
+         break;
+      }
+      vBytes = 0;
+      while (av_read_frame(ic, pkt) >= 0) {
+         ts = packetTime(ic, pkt);
+         stream = pkt->stream_index;
+         if (ts != AV_NOPTS_VALUE && ts >= from && ts < from + window*AV_TIME_BASE) {
+            if (stream == vid)
+               vBytes += pkt->size;
+            else if (stream == aud)
+               aBytes += pkt->size;
+         }
+         av_packet_unref(pkt);
+         if (stream == vid && ts != AV_NOPTS_VALUE && ts >= from + window*AV_TIME_BASE)
+            break;
+      }
+      complexity[i] = vBytes / window;
+      aTime += window;
+   }
+   if (aud >= 0)   /* The stream's own bitrate if it has one: the samples miss any variation */
+      *audioBytes = ic->streams[aud]->codecpar->bit_rate > 0 ? ic->streams[aud]->codecpar->bit_rate / 8.0 * duration / AV_TIME_BASE
+         : (aTime > 0 ? aBytes / aTime * duration / AV_TIME_BASE : 0);
+   else
+      *audioBytes = 0;
+
+   av_packet_free(&pkt);
+   avformat_close_input(&ic);
+   return interrupted ? 0 : duration;
+}
+
+/* Target file size (-F): plan the video bitrate over the input so that the output, with the
+ * copied audio and the container overhead, comes to opts->targetSize. Each part gets a share
+ * in proportion to the square root of its complexity (within a third to three times the
+ * average), and the plan is followed by the adaptive bitrate controller. A short trial
+ * encode of a part of median complexity measures how far the encoder misses its target.
+ * Returns 0 on success.
+ */
+static int planTargetSize(struct context *opts) {
+   double complexity[PLAN_SLOTS], weight[PLAN_SLOTS], audioBytes, videoBytes, mean, sum, achieved;
+   struct context trial = *opts;
+   struct context *ctx;
+   int64_t duration;
+   char *name;
+   int i, j, m, r, lo, hi;
+
+   duration = scanInput(opts, complexity, &audioBytes);
+   if (duration == 0)
+      return 1;
+   videoBytes = opts->targetSize * ((opts->userFlags & UFLAGS_RAW) ? 1.0 : 1.0 - MUX_OVERHEAD) - audioBytes;
+   if (videoBytes < opts->targetSize * 0.05) {
+      fprintf(stderr, "ERROR: A %.1fMB output has no room for the video: the audio alone is %.1fMB\n",
+         opts->targetSize/1048576.0, audioBytes/1048576.0);
+      return 1;
+   }
+   mean = videoBytes * 8.0 * AV_TIME_BASE / duration;
+
+   for (i = 0, sum = 0; i < PLAN_SLOTS; i++)
+      sum += weight[i] = sqrt(FFMAX(complexity[i], 1.0));
+   for (i = 0; i < PLAN_SLOTS; i++)
+      weight[i] = FFMAX(FFMIN(weight[i] * PLAN_SLOTS / sum, 3.0), 1.0/3);
+   for (i = 0, sum = 0; i < PLAN_SLOTS; i++)
+      sum += weight[i];
+   for (i = 0, lo = INT_MAX, hi = 0; i < PLAN_SLOTS; i++) {
+      opts->planRate[i] = mean * weight[i] * PLAN_SLOTS / sum;
+      lo = FFMIN(lo, opts->planRate[i]);
+      hi = FFMAX(hi, opts->planRate[i]);
+   }
+   opts->planSlot = duration / PLAN_SLOTS;
+   opts->bitrate = mean;
+   fprintf(stderr, "INFO: %.1fMB in %.0fs: audio %.1fMB, video %.0fkbps on average (%d - %dkbps)\n",
+      opts->targetSize/1048576.0, (double)duration/AV_TIME_BASE, audioBytes/1048576.0, mean/1000, lo/1000, hi/1000);
+
+   /* Trial encode of the part of median complexity: it is a segment, so needs the input timestamps */
+   if (duration < 3*TRIAL_SECONDS*AV_TIME_BASE || (opts->userFlags & UFLAGS_MAKE_UP_PTS))
+      return 0;
+   for (m = 0; m < PLAN_SLOTS; m++) {
+      for (i = j = 0; i < PLAN_SLOTS; i++)
+         j += complexity[i] < complexity[m];
+      if (j == PLAN_SLOTS/2)
+         break;
+   }
+   if (m == PLAN_SLOTS)
+      m = PLAN_SLOTS/2;
+   name = malloc(strlen(opts->oname) + 16);
+   if (name == NULL)
+      return 0;
+   sprintf(name, "%s.trial.mkv", opts->oname);
+   trial.oname = name;
+   trial.formatName = "matroska";
+   trial.segStart = opts->planSlot * m;
+   trial.segEnd = trial.segStart + (int64_t)(TRIAL_SECONDS*AV_TIME_BASE);
+   trial.bitrate = opts->planRate[m];
+   trial.planSlot = 0;
+   trial.targetSize = 0;
+   trial.adaptive = 0;
+   trial.qualityGops = 0;
+   trial.thumbs.enabled = 0;
+   fprintf(stderr, "INFO: Trial encode of %.0fs at %.0fs, %dkbps\n", TRIAL_SECONDS, (double)trial.segStart/AV_TIME_BASE, trial.bitrate/1000);
+   ctx = newPipeline(&trial);
+   r = ctx != NULL ? runJob(ctx) : 1;
+   if (r == 0 && outputTime(ctx) > 0) {
+      achieved = ctx->curSize * 8.0 / outputTime(ctx);
+      opts->trialGain = FFMAX(FFMIN(achieved / trial.bitrate, 4.0), 0.25);
+      fprintf(stderr, "INFO: Trial encode: %.0fkbps for %dkbps\n", achieved/1000, trial.bitrate/1000);
+   }
+   else if (!interrupted)
+      fprintf(stderr, "WARNING: The trial encode failed: starting from the planned bitrate\n");
+   if (ctx != NULL)
+      freePipeline(ctx);
+   unlink(name);
+   free(name);
+   return interrupted;
+}
+
+/* -S: split the input at keyframes into opts->segments parts, encode them at once on
+ * opts->workers pipelines as batch jobs, and join them into opts->oname. The segments
+ * are written to <outfile>.partN.mkv, and removed once they have been joined.
+ */
+static int runSplit(const struct context *opts) {
+   struct context segOpts = *opts;
+   int64_t *points;
+   char **names;
+   int i, n, r=1;
+
+   points = malloc((opts->segments+1) * sizeof(int64_t));
+   names = calloc(opts->segments, sizeof(char *));
+   batch.segs = calloc(opts->segments, sizeof(OMXTX_JOB));
+   if (points == NULL || names == NULL || batch.segs == NULL) {
+      fprintf(stderr, "ERROR: Can't allocate memory for %d segments\n", opts->segments);
+      n = 0;
+      goto done;
+   }
+   n = findSplitPoints(opts, opts->segments, points);
+   if (n == 0)
+      goto done;
+   if (n < opts->segments)
+      fprintf(stderr, "INFO: Keyframes too far apart for %d segments: splitting into %d\n", opts->segments, n);
+
+   for (i = 0; i < n; i++) {
+      names[i] = malloc(strlen(opts->oname) + 20);
+      if (names[i] == NULL) {
+         fprintf(stderr, "ERROR: Can't allocate memory for %d segments\n", n);
+         goto done;
+      }
+      sprintf(names[i], "%s.part%d.mkv", opts->oname, i+1);
+      batch.segs[i].iname = opts->iname;
+      batch.segs[i].oname = names[i];
+      batch.segs[i].segStart = points[i];
+      batch.segs[i].segEnd = points[i+1];
+   }
+   batch.nSegs = n;
+   segOpts.formatName = "matroska";   /* Segments are joined into the output format */
+   if (segOpts.workers > n)
+      segOpts.workers = n;
+   if (runWorkers(&segOpts) != 0 || interrupted) {
+      fprintf(stderr, "ERROR: Not every segment was encoded: the segments are left in %s.part*.mkv\n", opts->oname);
+      goto done;
+   }
+   r = joinSegments(names, n, opts->oname, opts->formatName, opts->userFlags & UFLAGS_VERBOSE);
+   for (i = 0; r == 0 && i < n; i++)
+      unlink(names[i]);
+
+done:
+   for (i = 0; names != NULL && i < n; i++)
+      free(names[i]);
+   free(names);
+   free(points);
+   free(batch.segs);
+   batch.segs = NULL;
+   return r;
+}
+
+int main(int argc, char *argv[]) {
+   static struct context opts;   /* Command line options: copied to each pipeline */
+   struct context *ctx;
+   int i;
+   sigset_t set;
+   pthread_t sigThread;
+
+   trace.start = timeUs();
+   if (setupUserOpts(&opts, argc, argv)==1)
+      return 1;
+   traceThread("main");
+   if (opts.join)   /* Segments are copied: no OMX */
+      return runJoin(&opts);
+
+   /* Default backend: OMX if there is an IL core, software otherwise */
+   if (opts.backend == NULL) {
+      opts.backend = loadILCore(opts.userFlags & UFLAGS_VERBOSE) == 0 ? &omxBackend : &swBackend;
+      if (opts.backend == &swBackend)
+         fprintf(stderr, "INFO: No OMX IL core: using the software backend\n");
+   }
+   else if (opts.backend == &omxBackend && loadILCore(1) != 0) {
+      fprintf(stderr, "ERROR: Can't load the OMX IL core\n");
+      return 1;
+   }
+   if (opts.backend == &swBackend && opts.nRenditions > 0) {
+      fprintf(stderr, "ERROR: Renditions (-l) are made with the OMX splitter: they can't be used with the software backend\n");
+      return 1;
+   }
+   if (opts.backend == &swBackend)
+      for (i=0; i<NXOPTS; i++)
+         if (opts.encOpt[i] >= 0 && !encoderOptions[i].sw)
+            fprintf(stderr, "WARNING: Encoder option %s is for the OMX encoder: ignored\n", encoderOptions[i].name);
+
+   /* Block SIGINT and SIGQUIT; other threads created by main()
+    * will inherit a copy of the signal mask. */
+
+   sigemptyset(&set);
+   sigaddset(&set, SIGINT);
+   sigaddset(&set, SIGQUIT);
+   i=pthread_sigmask(SIG_BLOCK, &set, NULL);
+   i+=pthread_create(&sigThread, NULL, &sigHandler_thread, (void *) &set);
+   if (i!=0) {
+      fprintf(stderr,"ERROR: signal handling init failed.\n");
+      return 1;
+   }
+
+   if (metrics.enabled && pthread_create(&metrics.thread, NULL, metricsThread, NULL) != 0) {
+      fprintf(stderr, "ERROR: Failed to start the metrics thread\n");
+      return 1;
+   }
+
+   if (opts.jobFile!=NULL)
+      i=runBatch(&opts);
+   else if (opts.segments>0)
+      i=runSplit(&opts);
+   else {
+      if (opts.targetSize>0 && planTargetSize(&opts)!=0)
+         return 1;
+      ctx=newPipeline(&opts);
+      if (ctx==NULL)
+         return 1;
+      i=runJob(ctx)!=0;
+      if ((opts.userFlags & UFLAGS_VERBOSE) && opts.backend == &omxBackend)
+         fprintf(stderr, "OMX set up: %.1fms; OMX_Init: %.1fms; component handles: %.1fms\n", ctx->setupTime/1000.0, omxInitTime/1000.0, ctx->initTime/1000.0);
+      freePipeline(ctx);
+   }
+
+   if (metrics.enabled) {
+      metrics.stop = 1;
+      pthread_join(metrics.thread, NULL);
+      writeMetrics();
+   }
+   if (omxInitError == OMX_ErrorNone)
+      ilCore.deinit();
+   if (trace.enabled)
+      writeTrace();
+   return i;
+}